@@ -1,12 +1,49 @@
 #include "AttributeSet.hpp"
 #include "DisplayDevice.hpp"
 #include "LayerBlitInfo.hpp"
+#include "unit_test.hpp"
+
+namespace
+{
+	//index of the chunk holding v, rounding towards negative infinity
+	//so that chunks left of or above the origin are the same size.
+	int chunk_index(int v)
+	{
+		return v >= 0 ? v/LayerBlitInfo::ChunkSize : -((-v - 1)/LayerBlitInfo::ChunkSize) - 1;
+	}
+
+	void add_draw_ranges(KRE::AttributeSet& as, const std::vector<std::pair<size_t, size_t>>& ranges)
+	{
+		as.clearMultiDrawData();
+		for(const auto& r : ranges) {
+			as.addMultiDrawData(r.first, r.second);
+		}
+	}
+
+	//adds a range of vertices, merging it into the previous range if
+	//the two are next to each other in the buffer.
+	void add_range(std::vector<std::pair<size_t, size_t>>& ranges, size_t offset, size_t count)
+	{
+		if(count == 0) {
+			return;
+		}
+
+		if(!ranges.empty() && ranges.back().first + ranges.back().second == offset) {
+			ranges.back().second += count;
+		} else {
+			ranges.emplace_back(offset, count);
+		}
+	}
+}
 
 LayerBlitInfo::LayerBlitInfo()
 	: KRE::SceneObject("layer_blit_info"),
 	  xbase_(0),
 	  ybase_(0),
-	  initialised_(false)
+	  initialised_(false),
+	  chunks_changed_(false),
+	  visible_area_valid_(false),
+	  nvisible_chunks_(0)
 {
 	using namespace KRE;
 
@@ -16,6 +53,7 @@ LayerBlitInfo::LayerBlitInfo()
 	opaques_->addAttributeDesc(AttributeDesc(AttrType::TEXTURE, 2, AttrFormat::FLOAT, false, sizeof(tile_corner), offsetof(tile_corner, uv)));
 	ab->addAttribute(opaques_);
 	ab->setDrawMode(DrawMode::TRIANGLES);
+	ab->enableMultiDraw();
 	addAttributeSet(ab);
 
 	auto tab = DisplayDevice::createAttributeSet(true, false, false);
@@ -25,19 +63,183 @@ LayerBlitInfo::LayerBlitInfo()
 	tab->addAttribute(transparent_);
 
 	tab->setDrawMode(DrawMode::TRIANGLES);
+	tab->enableMultiDraw();
 	addAttributeSet(tab);
 }
 
-void LayerBlitInfo::setVertices(std::vector<tile_corner>* op, std::vector<tile_corner>* tr)
+rect LayerBlitInfo::getChunkArea(const rect& r)
+{
+	const int x1 = chunk_index(r.x());
+	const int y1 = chunk_index(r.y());
+	const int x2 = chunk_index(r.x2()) + 1;
+	const int y2 = chunk_index(r.y2()) + 1;
+	return rect(x1*ChunkSize, y1*ChunkSize, (x2 - x1)*ChunkSize, (y2 - y1)*ChunkSize);
+}
+
+void LayerBlitInfo::clearChunks(const rect& area)
+{
+	const int x1 = chunk_index(area.x());
+	const int x2 = chunk_index(area.x2() - 1);
+	for(int y = chunk_index(area.y()); y <= chunk_index(area.y2() - 1); ++y) {
+		auto i1 = chunks_.lower_bound(std::make_pair(y, x1));
+		auto i2 = chunks_.upper_bound(std::make_pair(y, x2));
+		if(i1 != i2) {
+			chunks_.erase(i1, i2);
+			chunks_changed_ = true;
+		}
+	}
+}
+
+std::vector<tile_corner>* LayerBlitInfo::getChunkVertices(int x, int y, bool opaque)
 {
-	//LOG_DEBUG("Adding " << op->size() << " opaque vertices");
-	if(op != nullptr) {
-		getAttributeSet()[0]->setCount(op->size());
-		opaques_->update(op);
+	chunks_changed_ = true;
+	Chunk& chunk = chunks_[std::make_pair(chunk_index(y), chunk_index(x))];
+	return opaque ? &chunk.opaque : &chunk.transparent;
+}
+
+void LayerBlitInfo::updateBuffers()
+{
+	if(!chunks_changed_) {
+		return;
+	}
+
+	chunks_changed_ = false;
+	visible_area_valid_ = false;
+
+	size_t nopaque = 0, ntransparent = 0;
+	for(const auto& c : chunks_) {
+		nopaque += c.second.opaque.size();
+		ntransparent += c.second.transparent.size();
+	}
+
+	std::vector<tile_corner> op, tr;
+	op.reserve(nopaque);
+	tr.reserve(ntransparent);
+	for(auto& c : chunks_) {
+		c.second.opaque_offset = op.size();
+		c.second.transparent_offset = tr.size();
+		op.insert(op.end(), c.second.opaque.begin(), c.second.opaque.end());
+		tr.insert(tr.end(), c.second.transparent.begin(), c.second.transparent.end());
 	}
-	//LOG_DEBUG("Adding " << tr->size() << " transparent vertices");
-	if(tr != nullptr) {
-		getAttributeSet()[1]->setCount(tr->size());
-		transparent_->update(tr);
+
+	getAttributeSet()[0]->setCount(op.size());
+	opaques_->update(&op);
+	getAttributeSet()[1]->setCount(tr.size());
+	transparent_->update(&tr);
+}
+
+void LayerBlitInfo::setVisibleArea(const rect& area)
+{
+	if(visible_area_valid_ && area == visible_area_) {
+		return;
 	}
+
+	visible_area_ = area;
+	visible_area_valid_ = true;
+	nvisible_chunks_ = 0;
+
+	std::vector<std::pair<size_t, size_t>> op, tr;
+
+	const int x1 = chunk_index(area.x());
+	const int x2 = chunk_index(area.x2() - 1);
+	for(int y = chunk_index(area.y()); y <= chunk_index(area.y2() - 1); ++y) {
+		auto i2 = chunks_.upper_bound(std::make_pair(y, x2));
+		for(auto i = chunks_.lower_bound(std::make_pair(y, x1)); i != i2; ++i) {
+			add_range(op, i->second.opaque_offset, i->second.opaque.size());
+			add_range(tr, i->second.transparent_offset, i->second.transparent.size());
+			++nvisible_chunks_;
+		}
+	}
+
+	add_draw_ranges(*getAttributeSet()[0], op);
+	add_draw_ranges(*getAttributeSet()[1], tr);
+}
+
+namespace
+{
+	void add_test_vertices(LayerBlitInfo& info, int x, int y, int count)
+	{
+		auto v = info.getChunkVertices(x, y, true);
+		for(int n = 0; n != count; ++n) {
+			v->emplace_back(glm::u16vec2(0, 0), glm::vec2(0.0f, 0.0f));
+		}
+	}
+
+	void check_draw_ranges(const KRE::AttributeSet& as, const std::vector<std::pair<int, int>>& expected)
+	{
+		CHECK_EQ(as.getMultiDrawCount(), static_cast<int>(expected.size()));
+		for(int n = 0; n != static_cast<int>(expected.size()); ++n) {
+			CHECK_EQ(as.getMultiOffsetArray()[n], expected[n].first);
+			CHECK_EQ(as.getMultiCountArray()[n], expected[n].second);
+		}
+	}
+}
+
+UNIT_TEST(layer_blit_info_chunks)
+{
+	KRE::DisplayDevice::factory("null", KRE::WindowPtr());
+
+	//chunks left of and above the origin are as big as the others.
+	CHECK_EQ(LayerBlitInfo::getChunkArea(rect(-1, -1, 2, 2)).toString(), rect(-512, -512, 1024, 1024).toString());
+	CHECK_EQ(LayerBlitInfo::getChunkArea(rect(-512, -512, 1, 1)).toString(), rect(-512, -512, 512, 512).toString());
+	CHECK_EQ(LayerBlitInfo::getChunkArea(rect(-513, 0, 1, 1)).toString(), rect(-1024, 0, 1024, 512).toString());
+
+	//the right and bottom edges of the area are included.
+	CHECK_EQ(LayerBlitInfo::getChunkArea(rect(0, 0, 511, 511)).toString(), rect(0, 0, 512, 512).toString());
+	CHECK_EQ(LayerBlitInfo::getChunkArea(rect(0, 0, 512, 512)).toString(), rect(0, 0, 1024, 1024).toString());
+
+	{
+		LayerBlitInfo info;
+		add_test_vertices(info, -1, -1, 6);
+		add_test_vertices(info, -512, -512, 6);
+		CHECK_EQ(info.numChunks(), 1);
+		add_test_vertices(info, -513, 0, 6);
+		add_test_vertices(info, 0, 0, 6);
+		CHECK_EQ(info.numChunks(), 3);
+
+		info.updateBuffers();
+		info.setVisibleArea(rect(-1, -1, 1, 1));
+		CHECK_EQ(info.numVisibleChunks(), 1);
+		check_draw_ranges(*info.getAttributeSet()[0], {{0, 12}});
+	}
+
+	//a 3x2 grid of chunks, missing the bottom right one, with 6 opaque
+	//vertices in each, stored at 0, 6, 12 in the top row and 18, 24 below.
+	LayerBlitInfo info;
+	for(int y = 0; y != 2; ++y) {
+		for(int x = 0; x != 3 - y; ++x) {
+			add_test_vertices(info, x*LayerBlitInfo::ChunkSize + 10, y*LayerBlitInfo::ChunkSize + 10, 6);
+		}
+	}
+	CHECK_EQ(info.numChunks(), 5);
+	info.updateBuffers();
+
+	info.setVisibleArea(rect(0, 0, 1536, 1024));
+	CHECK_EQ(info.numVisibleChunks(), 5);
+	check_draw_ranges(*info.getAttributeSet()[0], {{0, 30}});
+	check_draw_ranges(*info.getAttributeSet()[1], {});
+
+	info.setVisibleArea(rect(512, 0, 1024, 1024));
+	CHECK_EQ(info.numVisibleChunks(), 3);
+	check_draw_ranges(*info.getAttributeSet()[0], {{6, 12}, {24, 6}});
+
+	info.setVisibleArea(rect(0, 0, 512, 1024));
+	CHECK_EQ(info.numVisibleChunks(), 2);
+	check_draw_ranges(*info.getAttributeSet()[0], {{0, 6}, {18, 6}});
+
+	//clearing the middle top chunk leaves its neighbours, even the one
+	//touching the cleared area's right edge, and rebuilding it with fewer
+	//tiles moves the chunks after it down the buffer.
+	info.clearChunks(rect(512, 0, 512, 512));
+	CHECK_EQ(info.numChunks(), 4);
+	add_test_vertices(info, 600, 100, 3);
+	info.updateBuffers();
+	CHECK_EQ(info.getAttributeSet()[0]->getCount(), 27);
+
+	info.setVisibleArea(rect(0, 0, 1536, 1024));
+	CHECK_EQ(info.numVisibleChunks(), 5);
+	check_draw_ranges(*info.getAttributeSet()[0], {{0, 27}});
+
+	info.setVisibleArea(rect(512, 0, 1024, 1024));
+	check_draw_ranges(*info.getAttributeSet()[0], {{6, 9}, {21, 6}});
 }
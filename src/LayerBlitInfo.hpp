@@ -23,15 +23,28 @@
 
 #pragma once
 
+#include <map>
+#include <vector>
+
 #include "AttributeSet.hpp"
 #include "SceneObject.hpp"
 #include "Texture.hpp"
 
 #include "draw_tile.hpp"
+#include "geometry.hpp"
 
+//The vertices of all the tiles in one layer of a level.
+//
+//Tiles are grouped into square chunks by the position of their top-left
+//corner. Each chunk's vertices take up a contiguous range of the layer's
+//vertex buffers, so that only the chunks in view need to be drawn and
+//only the chunks whose tiles changed need to be rebuilt.
 class LayerBlitInfo : public KRE::SceneObject
 {
 public:
+	//Length of the side of a chunk, in pixels.
+	static const int ChunkSize = 512;
+
 	LayerBlitInfo();
 	bool isInitialised() const { return initialised_; }
 	int xbase() const { return xbase_; }
@@ -40,12 +53,47 @@ public:
 	void setYbase(int yb) { ybase_ = yb; }
 	void setBase(int xb, int yb) { xbase_ = xb; ybase_ = yb; initialised_ = true; }
 
-	void setVertices(std::vector<tile_corner>* op, std::vector<tile_corner>* tr);
+	//The area covered by the chunks which overlap r, including its right
+	//and bottom edges.
+	static rect getChunkArea(const rect& r);
+
+	//Empties the chunks which overlap area.
+	void clearChunks(const rect& area);
+
+	//The vertex list the tile at (x, y) should be added to.
+	std::vector<tile_corner>* getChunkVertices(int x, int y, bool opaque);
+
+	//Sends the vertices of all chunks to the vertex buffers, if any chunk
+	//has changed since the last call.
+	void updateBuffers();
+
+	//Restricts drawing to the chunks which overlap area. A tile may reach
+	//past its chunk, so area should be grown by a tile's size.
+	void setVisibleArea(const rect& area);
+
+	int numChunks() const { return static_cast<int>(chunks_.size()); }
+	int numVisibleChunks() const { return nvisible_chunks_; }
 private:
 	int xbase_;
 	int ybase_;
 	bool initialised_;
 
+	struct Chunk {
+		Chunk() : opaque_offset(0), transparent_offset(0) {}
+		std::vector<tile_corner> opaque, transparent;
+		size_t opaque_offset, transparent_offset;
+	};
+
+	//Chunks keyed by (row, column), so that a row of chunks is stored
+	//left to right and neighbouring chunks are next to each other in the
+	//vertex buffers.
+	std::map<std::pair<int, int>, Chunk> chunks_;
+	bool chunks_changed_;
+
+	rect visible_area_;
+	bool visible_area_valid_;
+	int nvisible_chunks_;
+
 	std::shared_ptr<KRE::Attribute<tile_corner>> opaques_;
 	std::shared_ptr<KRE::Attribute<tile_corner>> transparent_;
-};
\ No newline at end of file
+};
@@ -0,0 +1,144 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <algorithm>
+#include <atomic>
+
+#include "async_io.hpp"
+#include "concurrent_cache.hpp"
+#include "filesystem.hpp"
+#include "preferences.hpp"
+
+PREF_INT(file_cache_max_mb, 64, "Memory budget for cached file contents in megabytes. The least recently used files are dropped when it is exceeded. 0 means unlimited.");
+
+namespace async_io
+{
+	namespace
+	{
+		//Number of files read by a single prefetch job.
+		const int PrefetchBatchSize = 8;
+
+		struct CacheEntry
+		{
+			file_data data;
+			long long mod_time;
+		};
+
+		size_t entry_bytes(const CacheEntry& entry)
+		{
+			return entry.data ? entry.data->size() : 0;
+		}
+
+		typedef ConcurrentCache<std::string, CacheEntry> FileCache;
+		FileCache& cache()
+		{
+			static FileCache res(static_cast<size_t>(g_file_cache_max_mb) * 1024 * 1024, entry_bytes);
+			return res;
+		}
+
+		std::atomic<long long> g_prefetched(0);
+
+		CacheEntry load_entry(const std::string& fname)
+		{
+			CacheEntry entry;
+			entry.mod_time = sys::file_mod_time(fname);
+			entry.data = std::make_shared<const std::string>(sys::read_file(fname));
+			return entry;
+		}
+
+		background_task_pool::PRIORITY pool_priority(PRIORITY priority)
+		{
+			return priority == PRIORITY::BLOCKING ? background_task_pool::PRIORITY::HIGH : background_task_pool::PRIORITY::LOW;
+		}
+	}
+
+	file_data read_file(const std::string& fname)
+	{
+		bool loaded = false;
+		CacheEntry entry = cache().getOrCompute(fname, [&fname, &loaded]() {
+			loaded = true;
+			return load_entry(fname);
+		});
+
+		//The file may have been edited since it was cached.
+		if(!loaded && entry.mod_time != sys::file_mod_time(fname)) {
+			cache().erase(fname);
+			entry = cache().getOrCompute(fname, [&fname]() { return load_entry(fname); });
+		}
+
+		return entry.data;
+	}
+
+	background_task_pool::future<file_data> read_file_async(const std::string& fname, PRIORITY priority)
+	{
+		return background_task_pool::async<file_data>([fname]() { return read_file(fname); }, pool_priority(priority));
+	}
+
+	void prefetch(const std::vector<std::string>& fnames)
+	{
+		std::vector<std::string> needed;
+		for(const std::string& fname : fnames) {
+			if(!fname.empty() && cache().count(fname) == 0) {
+				needed.push_back(fname);
+			}
+		}
+
+		std::sort(needed.begin(), needed.end());
+		needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
+
+		g_prefetched += needed.size();
+
+		for(size_t n = 0; n < needed.size(); n += PrefetchBatchSize) {
+			const size_t end = std::min(needed.size(), n + PrefetchBatchSize);
+			std::shared_ptr<std::vector<std::string>> batch(new std::vector<std::string>(needed.begin() + n, needed.begin() + end));
+			background_task_pool::submit([batch]() {
+				for(const std::string& fname : *batch) {
+					read_file(fname);
+				}
+			}, std::function<void()>(), pool_priority(PRIORITY::PREFETCH));
+		}
+	}
+
+	void invalidate(const std::string& fname)
+	{
+		cache().erase(fname);
+	}
+
+	void clear_cache()
+	{
+		cache().clear();
+	}
+
+	cache_stats get_cache_stats()
+	{
+		const FileCache::Stats stats = cache().getStats();
+		cache_stats result;
+		result.hits = stats.hits;
+		result.misses = stats.misses;
+		result.evictions = stats.evictions;
+		result.entries = stats.entries;
+		result.bytes = stats.bytes;
+		result.prefetched = g_prefetched;
+		return result;
+	}
+}
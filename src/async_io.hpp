@@ -0,0 +1,76 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "background_task_pool.hpp"
+
+// Whole-file reads serviced by the background task pool, with a bounded
+// in-memory cache of file contents.
+//
+// Files the engine knows it will need soon can be prefetched; a later read
+// of the same file then comes from memory, or waits for the read already in
+// flight rather than reading the file a second time.
+namespace async_io
+{
+	enum class PRIORITY {
+		// Someone is (or soon will be) blocked waiting for the data.
+		BLOCKING,
+
+		// Read-ahead. Only run when there is no more urgent work.
+		PREFETCH
+	};
+
+	typedef std::shared_ptr<const std::string> file_data;
+
+	// Returns the contents of the file, which is empty if it could not be
+	// read. Safe to call from any thread.
+	file_data read_file(const std::string& fname);
+
+	background_task_pool::future<file_data> read_file_async(const std::string& fname, PRIORITY priority=PRIORITY::BLOCKING);
+
+	// Queues files to be read into the cache in the background. Files which
+	// are already cached are skipped. The rest are read in batches, in path
+	// order, so each job touches neighbouring files.
+	void prefetch(const std::vector<std::string>& fnames);
+
+	void invalidate(const std::string& fname);
+	void clear_cache();
+
+	struct cache_stats
+	{
+		cache_stats() : hits(0), misses(0), evictions(0), entries(0), bytes(0), prefetched(0)
+		{}
+		long long hits, misses, evictions;
+		size_t entries, bytes;
+
+		// Files queued for read-ahead since startup.
+		long long prefetched;
+	};
+
+	cache_stats get_cache_stats();
+}
@@ -21,81 +21,536 @@
 	   distribution.
 */
 
+#include <atomic>
+#include <deque>
 #include <functional>
-#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "background_task_pool.hpp"
+#include "formatter.hpp"
+#include "formula_garbage_collector.hpp"
+#include "logger.hpp"
+#include "preferences.hpp"
+#include "profile_timer.hpp"
 #include "thread.hpp"
+#include "unit_test.hpp"
+#include "variant.hpp"
+
+PREF_INT(background_task_threads, 0, "Number of worker threads in the background task pool. 0 uses the number of hardware threads.");
 
 namespace background_task_pool
 {
-	namespace
+	namespace detail
 	{
-		int next_task_id = 0;
+		enum TASK_STATE { TASK_QUEUED, TASK_RUNNING, TASK_FINISHED, TASK_CANCELLED };
 
 		struct task
 		{
+			task(std::function<void()> j, std::function<void()> c, int f) : job(j), on_complete(c), flags(f), state(TASK_QUEUED)
+			{}
 			std::function<void()> job, on_complete;
-			std::shared_ptr<threading::thread> thread;
+			int flags;
+			std::atomic<int> state;
+		};
+	}
+
+	namespace
+	{
+		using detail::task;
+		using detail::task_ptr;
+
+		const int NumPriorities = static_cast<int>(PRIORITY::NUM_PRIORITIES);
+
+		//Blocking jobs such as waiting on child processes go through the
+		//pool, so always have at least two workers.
+		const int MinWorkers = 2;
+
+		struct work_queue
+		{
+			threading::mutex mutex;
+			std::deque<task_ptr> tasks[NumPriorities];
+			queue_stats stats;
+		};
+
+		class pool
+		{
+		public:
+			pool();
+			~pool();
+
+			void push(task_ptr t, PRIORITY priority);
+
+			//Tries to find a queued task, starting with the given worker's
+			//own queue and stealing from the others if it has none.
+			task_ptr take(int worker, bool& stolen);
+
+			bool run_one(int worker);
+
+			int size() const { return static_cast<int>(queues_.size()); }
+
+			std::vector<queue_stats> stats();
+
+			//Called by any thread waiting on a task to be woken when a task
+			//finishes.
+			void wait_for_completion(const task& t);
+			void notify_completion();
+
+			void task_completed(task_ptr t) {
+				threading::lock lck(completed_mutex_);
+				completed_.push_back(t);
+			}
+
+			void swap_completed(std::vector<task_ptr>& v) {
+				threading::lock lck(completed_mutex_);
+				completed_.swap(v);
+			}
+
+			bool has_outstanding() const { return outstanding_ > 0; }
+			void task_submitted() { ++outstanding_; }
+			void task_done() { --outstanding_; }
+		private:
+			void worker_main(int worker);
+
+			std::vector<std::unique_ptr<work_queue>> queues_;
+			std::vector<std::unique_ptr<threading::thread>> threads_;
+
+			//Count of tasks in the queues that no worker has yet claimed.
+			//Guarded by sleep_mutex_. Workers sleep on sleep_cond_ while
+			//it is zero.
+			threading::mutex sleep_mutex_;
+			threading::condition sleep_cond_;
+			int pending_;
+			bool quit_;
+
+			threading::mutex completion_mutex_;
+			threading::condition completion_cond_;
+
+			threading::mutex completed_mutex_;
+			std::vector<task_ptr> completed_;
+
+			//Tasks which have been submitted but whose completion handler
+			//has not yet been run.
+			std::atomic<int> outstanding_;
+
+			std::atomic<unsigned> next_queue_;
 		};
 
-		const threading::mutex& get_completed_tasks_mutex()
+		//Index of the worker the current thread is, or -1 if the current
+		//thread is not a worker in the pool.
+		THREAD_LOCAL int g_worker_index = -1;
+
+		std::unique_ptr<pool> g_pool;
+
+		pool& get_pool()
 		{
-			static std::shared_ptr<threading::mutex> res = std::make_shared<threading::mutex>();
-			return *res;
+			if(!g_pool) {
+				g_pool.reset(new pool);
+			}
+
+			return *g_pool;
+		}
+
+		pool::pool() : pending_(0), quit_(false), outstanding_(0), next_queue_(0)
+		{
+			int nthreads = g_background_task_threads;
+			if(nthreads <= 0) {
+				nthreads = static_cast<int>(std::thread::hardware_concurrency());
+			}
+
+			if(nthreads < MinWorkers) {
+				nthreads = MinWorkers;
+			}
+
+			for(int n = 0; n != nthreads; ++n) {
+				queues_.emplace_back(new work_queue);
+			}
+
+			for(int n = 0; n != nthreads; ++n) {
+				threads_.emplace_back(new threading::thread(formatter() << "background_task_" << n, std::bind(&pool::worker_main, this, n)));
+			}
+
+			LOG_DEBUG("Started background task pool with " << nthreads << " workers");
+		}
+
+		pool::~pool()
+		{
+			{
+				threading::lock lck(sleep_mutex_);
+				quit_ = true;
+				sleep_cond_.notify_all();
+			}
+
+			//joins all the workers.
+			threads_.clear();
+		}
+
+		void pool::push(task_ptr t, PRIORITY priority)
+		{
+			//Jobs submitted from a worker go to that worker's own queue,
+			//so they are likely to run while the data they use is warm.
+			int index = g_worker_index;
+			if(index < 0) {
+				index = static_cast<int>(next_queue_++ % queues_.size());
+			}
+
+			work_queue& q = *queues_[index];
+			{
+				threading::lock lck(q.mutex);
+				q.tasks[static_cast<int>(priority)].push_back(t);
+				++q.stats.submitted;
+			}
+
+			threading::lock lck(sleep_mutex_);
+			++pending_;
+			sleep_cond_.notify_one();
+		}
+
+		task_ptr pool::take(int worker, bool& stolen)
+		{
+			stolen = false;
+			const int nqueues = size();
+			for(int p = 0; p != NumPriorities; ++p) {
+				for(int n = 0; n != nqueues; ++n) {
+					const int index = worker < 0 ? n : (worker + n)%nqueues;
+					work_queue& q = *queues_[index];
+					threading::lock lck(q.mutex);
+					std::deque<task_ptr>& tasks = q.tasks[p];
+					if(tasks.empty()) {
+						continue;
+					}
+
+					//Owners take from the front of their own queue; thieves
+					//take from the back so they contend with the owner less.
+					task_ptr result;
+					if(index == worker) {
+						result = tasks.front();
+						tasks.pop_front();
+						return result;
+					}
+
+					result = tasks.back();
+					tasks.pop_back();
+					stolen = true;
+					return result;
+				}
+			}
+
+			return task_ptr();
+		}
+
+		bool pool::run_one(int worker)
+		{
+			{
+				threading::lock lck(sleep_mutex_);
+				if(pending_ == 0) {
+					return false;
+				}
+
+				--pending_;
+			}
+
+			//Each unit of pending_ we claim guarantees there is a task in
+			//some queue for us, though another worker may beat us to the
+			//queue we look in first.
+			task_ptr t;
+			bool stolen = false;
+			while(!t) {
+				t = take(worker, stolen);
+			}
+
+			if(stolen && worker >= 0) {
+				work_queue& q = *queues_[worker];
+				threading::lock lck(q.mutex);
+				++q.stats.stolen;
+			}
+
+			int expected = detail::TASK_QUEUED;
+			if(!t->state.compare_exchange_strong(expected, detail::TASK_RUNNING)) {
+				//the task was cancelled before it started.
+				if(worker >= 0) {
+					work_queue& q = *queues_[worker];
+					threading::lock lck(q.mutex);
+					++q.stats.cancelled;
+				}
+				return true;
+			}
+
+			profile::timer timer;
+			//the job is destroyed here rather than wherever the last
+			//reference to the task happens to be dropped, so anything it
+			//captured is released while the garbage collector is held off.
+			if(t->flags&TASK_ALLOCATES_COLLECTIBLE_OBJECTS) {
+				std::lock_guard<std::mutex> lock(GarbageCollector::getGlobalMutex());
+				t->job();
+				t->job = std::function<void()>();
+			} else {
+				t->job();
+				t->job = std::function<void()>();
+			}
+
+			if(worker >= 0) {
+				//stats are only updated while holding the queue's lock so
+				//that get_stats() sees consistent values.
+				work_queue& q = *queues_[worker];
+				threading::lock lck(q.mutex);
+				++q.stats.executed;
+				q.stats.busy_us += timer.get_time();
+			}
+
+			t->state = detail::TASK_FINISHED;
+			task_completed(t);
+			notify_completion();
+			return true;
+		}
+
+		void pool::worker_main(int worker)
+		{
+			g_worker_index = worker;
+			variant::registerThread();
+
+			for(;;) {
+				{
+					threading::lock lck(sleep_mutex_);
+					while(pending_ == 0 && !quit_) {
+						sleep_cond_.wait(sleep_mutex_);
+					}
+
+					if(pending_ == 0 && quit_) {
+						break;
+					}
+				}
+
+				run_one(worker);
+			}
+
+			variant::unregisterThread();
+			g_worker_index = -1;
 		}
 
-		std::vector<int> completed_tasks;
+		void pool::wait_for_completion(const task& t)
+		{
+			threading::lock lck(completion_mutex_);
+			while(t.state == detail::TASK_QUEUED || t.state == detail::TASK_RUNNING) {
+				completion_cond_.wait_timeout(completion_mutex_, 10);
+			}
+		}
 
-		std::map<int, task> task_map;
+		void pool::notify_completion()
+		{
+			threading::lock lck(completion_mutex_);
+			completion_cond_.notify_all();
+		}
 
-		void run_task(std::function<void()> job, int task_id)
+		std::vector<queue_stats> pool::stats()
 		{
-			job();
-			threading::lock lck(get_completed_tasks_mutex());
-			completed_tasks.push_back(task_id);
+			std::vector<queue_stats> result;
+			for(auto& q : queues_) {
+				threading::lock lck(q->mutex);
+				result.push_back(q->stats);
+				result.back().queued = 0;
+				for(const auto& tasks : q->tasks) {
+					result.back().queued += static_cast<int>(tasks.size());
+				}
+			}
+
+			return result;
+		}
+	}
+
+	bool task_handle::cancel()
+	{
+		if(!task_) {
+			return false;
+		}
+
+		int expected = detail::TASK_QUEUED;
+		if(!task_->state.compare_exchange_strong(expected, detail::TASK_CANCELLED)) {
+			return false;
+		}
+
+		task_->job = std::function<void()>();
+
+		//The task stays in its queue until a worker pops and discards it;
+		//hand the completion to pump() now so outstanding work is balanced.
+		get_pool().task_completed(task_);
+		get_pool().notify_completion();
+		return true;
+	}
+
+	bool task_handle::cancelled() const
+	{
+		return task_ && task_->state == detail::TASK_CANCELLED;
+	}
+
+	bool task_handle::finished() const
+	{
+		return task_ && task_->state == detail::TASK_FINISHED;
+	}
+
+	void task_handle::wait() const
+	{
+		if(!task_) {
+			return;
 		}
+
+		pool& p = get_pool();
+
+		if(g_worker_index >= 0) {
+			//A worker blocking on another task could deadlock the pool if
+			//every worker did it, so help out with queued work instead.
+			while(task_->state == detail::TASK_QUEUED || task_->state == detail::TASK_RUNNING) {
+				if(!p.run_one(g_worker_index)) {
+					p.wait_for_completion(*task_);
+				}
+			}
+			return;
+		}
+
+		p.wait_for_completion(*task_);
 	}
 
 	manager::manager()
 	{
-		get_completed_tasks_mutex();
+		get_pool();
 	}
 
 	manager::~manager()
 	{
-		while(task_map.empty() == false) {
+		while(g_pool && g_pool->has_outstanding()) {
 			pump();
+			profile::delay(1);
 		}
+
+		if(g_pool) {
+			for(const queue_stats& s : g_pool->stats()) {
+				LOG_DEBUG("background task queue: submitted " << s.submitted << ", executed " << s.executed << ", stolen " << s.stolen << ", cancelled " << s.cancelled << ", busy " << static_cast<int>(s.busy_us/1000.0) << "ms");
+			}
+		}
+
+		g_pool.reset();
 	}
 
-	void submit(std::function<void()> job, std::function<void()> on_complete)
+	task_handle submit(std::function<void()> job, std::function<void()> on_complete, PRIORITY priority, int flags)
 	{
-        std::string task_name = "background_task";
-        std::function<void()> f = std::bind(run_task, job, next_task_id);
-        task t = {
-            job,
-            on_complete,
-            std::make_shared<threading::thread>(task_name, f) };
-		task_map[next_task_id] = t;
-		++next_task_id;
+		ASSERT_LOG(priority != PRIORITY::NUM_PRIORITIES, "Illegal background task priority");
+		pool& p = get_pool();
+		task_ptr t = std::make_shared<task>(job, on_complete, flags);
+
+		if(flags&TASK_ALLOCATES_COLLECTIBLE_OBJECTS) {
+			//the count of threads allocating collectible objects is only
+			//changed from the main thread; it's decremented again in pump().
+			ASSERT_LOG(g_worker_index < 0, "Background tasks allocating collectible objects must be submitted from the main thread");
+			GarbageCollectible::incrementWorkerThreads();
+		}
+
+		p.task_submitted();
+		p.push(t, priority);
+		return task_handle(t);
 	}
 
 	void pump()
 	{
-		std::vector<int> completed;
-		{
-			threading::lock lck(get_completed_tasks_mutex());
-			completed.swap(completed_tasks);
+		if(!g_pool) {
+			return;
 		}
 
-		for(int t : completed) {
-			task_map[t].on_complete();
-			task_map.erase(t);
+		std::vector<task_ptr> completed;
+		g_pool->swap_completed(completed);
+
+		for(const task_ptr& t : completed) {
+			if(t->flags&TASK_ALLOCATES_COLLECTIBLE_OBJECTS) {
+				GarbageCollectible::decrementWorkerThreads();
+			}
+
+			if(t->state == detail::TASK_FINISHED && t->on_complete) {
+				t->on_complete();
+			}
+
+			g_pool->task_done();
 		}
 	}
 
+	int num_workers()
+	{
+		return get_pool().size();
+	}
+
+	bool is_worker_thread()
+	{
+		return g_worker_index >= 0;
+	}
+
+	std::vector<queue_stats> get_stats()
+	{
+		return get_pool().stats();
+	}
+}
+
+UNIT_TEST(background_task_pool_futures)
+{
+	std::vector<background_task_pool::future<int>> futures;
+	for(int n = 0; n != 100; ++n) {
+		futures.push_back(background_task_pool::async<int>([n]() { return n*n; }));
+	}
+
+	int continuations_run = 0;
+	for(auto& f : futures) {
+		f.then([&continuations_run](const int&) { ++continuations_run; });
+	}
+
+	for(int n = 0; n != 100; ++n) {
+		CHECK_EQ(futures[n].get(), n*n);
+	}
+
+	while(continuations_run != 100) {
+		background_task_pool::pump();
+	}
+}
+
+UNIT_TEST(background_task_pool_cancel)
+{
+	//occupy every worker so that the tasks after them stay queued.
+	std::atomic<bool> release(false);
+	std::vector<background_task_pool::task_handle> blockers;
+	for(int n = 0; n != background_task_pool::num_workers(); ++n) {
+		blockers.push_back(background_task_pool::submit([&release]() {
+			while(!release) {
+				profile::delay(1);
+			}
+		}, std::function<void()>(), background_task_pool::PRIORITY::HIGH));
+	}
+
+	bool ran = false, completed = false;
+	background_task_pool::task_handle h = background_task_pool::submit([&ran]() { ran = true; }, [&completed]() { completed = true; }, background_task_pool::PRIORITY::LOW);
+	CHECK(h.cancel(), "could not cancel queued task");
+	CHECK(h.cancelled(), "task not marked as cancelled");
+	release = true;
+
+	for(auto& b : blockers) {
+		b.wait();
+	}
+
+	background_task_pool::pump();
+	CHECK(!ran, "cancelled task was run");
+	CHECK(!completed, "cancelled task's completion handler was run");
+}
+
+BENCHMARK(background_task_pool_submit)
+{
+	BENCHMARK_LOOP {
+		std::atomic<int> count(0);
+		for(int n = 0; n != 500; ++n) {
+			background_task_pool::submit([&count]() { ++count; }, std::function<void()>());
+		}
+
+		while(count != 500) {
+			background_task_pool::pump();
+		}
+
+		background_task_pool::pump();
+	}
 }
@@ -24,7 +24,16 @@
 #pragma once
 
 #include <functional>
+#include <memory>
+#include <vector>
 
+#include "asserts.hpp"
+
+// A fixed-size pool of worker threads which run jobs in the background.
+//
+// Each worker owns a queue of pending jobs; idle workers steal jobs from
+// the queues of busy workers. Completion handlers, and continuations
+// attached to futures, are always run on the main thread from inside pump().
 namespace background_task_pool
 {
 	struct manager
@@ -33,7 +42,140 @@ namespace background_task_pool
 		~manager();
 	};
 
+	enum class PRIORITY { HIGH, NORMAL, LOW, NUM_PRIORITIES };
+
+	// Jobs which create FFL objects must be submitted from the main thread
+	// with this flag. The garbage collector is held off while they run.
+	enum { TASK_ALLOCATES_COLLECTIBLE_OBJECTS = 1 };
+
+	namespace detail
+	{
+		struct task;
+		typedef std::shared_ptr<task> task_ptr;
+	}
+
+	// Handle to a submitted job. Handles are cheap to copy and may be
+	// discarded if the caller has no need to track the job.
+	class task_handle
+	{
+	public:
+		task_handle() {}
+		explicit task_handle(detail::task_ptr t) : task_(t) {}
+
+		// Cancels the job if it has not started running yet. Returns true
+		// if the job was cancelled, in which case neither the job nor its
+		// completion handler will ever be run.
+		bool cancel();
+
+		bool valid() const { return task_.get() != nullptr; }
+		bool cancelled() const;
+
+		// True once the job has finished running on its worker. The
+		// completion handler may not have been run yet.
+		bool finished() const;
+
+		// Blocks until the job has finished or been cancelled. If called
+		// from a worker thread, runs other pending jobs while waiting.
+		void wait() const;
+	private:
+		detail::task_ptr task_;
+	};
+
+	// Runs completion handlers for all jobs that have finished. Must be
+	// called regularly from the main thread.
 	void pump();
 
-	void submit(std::function<void()> job, std::function<void()> on_complete);
+	task_handle submit(std::function<void()> job, std::function<void()> on_complete, PRIORITY priority=PRIORITY::NORMAL, int flags=0);
+
+	// Number of worker threads in the pool.
+	int num_workers();
+
+	// True if the calling thread is one of the pool's workers.
+	bool is_worker_thread();
+
+	struct queue_stats
+	{
+		queue_stats() : submitted(0), executed(0), stolen(0), cancelled(0), busy_us(0), queued(0)
+		{}
+
+		// Jobs pushed onto this queue, jobs run by this queue's worker,
+		// jobs this worker took from other queues and jobs that were
+		// cancelled before they started.
+		int submitted, executed, stolen, cancelled;
+
+		// Total time this worker spent running jobs, in microseconds.
+		double busy_us;
+
+		// Jobs currently waiting in this queue.
+		int queued;
+	};
+
+	std::vector<queue_stats> get_stats();
+
+	// The result of a job submitted through async(). Continuations attached
+	// with then() run on the main thread once the result is available.
+	template<typename T>
+	class future
+	{
+		struct state
+		{
+			state() : has_value(false), completed(false) {}
+			T value;
+			bool has_value, completed;
+			std::vector<std::function<void(const T&)>> continuations;
+		};
+	public:
+		future() {}
+
+		bool valid() const { return state_.get() != nullptr; }
+		bool ready() const { return handle_.finished(); }
+		bool cancel() { return handle_.cancel(); }
+		bool cancelled() const { return handle_.cancelled(); }
+
+		void wait() const { handle_.wait(); }
+
+		const T& get() const {
+			handle_.wait();
+			ASSERT_LOG(state_->has_value, "Getting the value of a cancelled background task");
+			return state_->value;
+		}
+
+		// Must be called from the main thread. If the result is already
+		// available the continuation runs immediately.
+		const future& then(std::function<void(const T&)> fn) const {
+			if(state_->completed) {
+				fn(state_->value);
+			} else {
+				state_->continuations.push_back(fn);
+			}
+			return *this;
+		}
+
+		template<typename U>
+		friend future<U> async(std::function<U()> fn, PRIORITY priority, int flags);
+	private:
+		std::shared_ptr<state> state_;
+		task_handle handle_;
+	};
+
+	template<typename T>
+	future<T> async(std::function<T()> fn, PRIORITY priority=PRIORITY::NORMAL, int flags=0)
+	{
+		future<T> result;
+		auto st = std::make_shared<typename future<T>::state>();
+		result.state_ = st;
+		result.handle_ = submit([st, fn]() {
+			st->value = fn();
+			st->has_value = true;
+		},
+		[st]() {
+			st->completed = true;
+			std::vector<std::function<void(const T&)>> continuations;
+			continuations.swap(st->continuations);
+			for(auto& c : continuations) {
+				c(st->value);
+			}
+		}, priority, flags);
+		return result;
+	}
 }
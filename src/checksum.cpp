@@ -22,19 +22,26 @@
 */
 
 #include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include <stdio.h>
 
 #include "asserts.hpp"
+#include "background_task_pool.hpp"
 #include "checksum.hpp"
 #include "filesystem.hpp"
 #include "md5.hpp"
 #include "module.hpp"
+#include "module_pack.hpp"
 #include "json_parser.hpp"
+#include "thread.hpp"
 #include "unit_test.hpp"
 #include "variant.hpp"
 
@@ -43,10 +50,112 @@ namespace checksum
 
 	namespace
 	{
-		bool verified = false;
+		//Cleared as soon as any file fails to verify. Files are verified
+		//on worker threads, so readers must wait for them to finish first.
+		std::atomic<bool> verified(false);
+
+		//Not modified after the manager is constructed.
 		std::map<std::string, std::string> hashes;
 		std::string whole_game_signature;
 		std::string	g_build_description;
+
+		//Files are hashed a block at a time as they're read, rather than
+		//being read into memory whole.
+		const size_t ReadBlockSize = 256*1024;
+
+		//Number of files checked by each verification job.
+		const int FilesPerJob = 16;
+
+		threading::mutex pending_mutex;
+		threading::condition pending_cond;
+		int pending_jobs = 0;
+
+		//Returns an empty string if the file can't be read.
+		std::string hash_file(const std::string& path)
+		{
+			//packed files aren't files of their own on disk.
+			if(module_pack::file_exists(path)) {
+				return md5::sum(sys::read_file(path));
+			}
+
+			std::ifstream file(path.c_str(), std::ios_base::binary);
+			if(!file) {
+				return "";
+			}
+
+			md5::hasher h;
+			std::vector<char> buf(ReadBlockSize);
+			while(file) {
+				file.read(&buf[0], buf.size());
+				const size_t nread = static_cast<size_t>(file.gcount());
+				if(nread == 0) {
+					break;
+				}
+
+				h.update(&buf[0], nread);
+			}
+
+			return h.hexdigest();
+		}
+
+		void submit_verification_job(std::function<void()> job)
+		{
+			{
+				threading::lock l(pending_mutex);
+				++pending_jobs;
+			}
+
+			background_task_pool::submit([job]() {
+				job();
+
+				threading::lock l(pending_mutex);
+				--pending_jobs;
+				pending_cond.notify_all();
+			}, std::function<void()>(), background_task_pool::PRIORITY::LOW);
+		}
+
+		struct SignedFile
+		{
+			std::string name, path, md5;
+		};
+
+		//Checks every signed file on the background task pool. Module
+		//paths are resolved here, since module lookups aren't safe to do
+		//on the workers.
+		void start_verification()
+		{
+			std::vector<SignedFile> files;
+			for(const auto& h : hashes) {
+				SignedFile f = { h.first, module::map_file(h.first), h.second };
+				files.push_back(f);
+			}
+
+			for(size_t begin = 0; begin < files.size(); begin += FilesPerJob) {
+				const size_t end = std::min(files.size(), begin + FilesPerJob);
+				auto batch = std::make_shared<std::vector<SignedFile>>(files.begin() + begin, files.begin() + end);
+
+				submit_verification_job([batch]() {
+					for(const SignedFile& f : *batch) {
+						if(!verified) {
+							break;
+						}
+
+						if(hash_file(f.path) != f.md5) {
+							LOG_INFO("UNVERIFIED FILE: " << f.name);
+							verified = false;
+						}
+					}
+				});
+			}
+		}
+
+		void wait_for_verification()
+		{
+			threading::lock l(pending_mutex);
+			while(pending_jobs > 0) {
+				pending_cond.wait(pending_mutex);
+			}
+		}
 	}
 
 	manager::manager()
@@ -82,11 +191,21 @@ namespace checksum
 		} catch(...) {
 			verified = false;
 		}
+
+		if(verified) {
+			start_verification();
+		}
 	}
 
 	manager::~manager()
 	{
-		LOG_INFO("EXITING WITH " << (verified ? "VERIFIED" : "UNVERIFIED") << " SESSION");
+		bool finished;
+		{
+			threading::lock l(pending_mutex);
+			finished = pending_jobs == 0;
+		}
+
+		LOG_INFO("EXITING WITH " << (verified ? (finished ? "VERIFIED" : "PARTLY VERIFIED") : "UNVERIFIED") << " SESSION");
 	}
 
 	const std::string& build_description()
@@ -101,6 +220,10 @@ namespace checksum
 
 	bool is_verified()
 	{
+		if(verified) {
+			wait_for_verification();
+		}
+
 		return verified;
 	}
 
@@ -124,38 +247,27 @@ namespace checksum
 			return;
 		}
 
-		const std::map<std::string,std::string>::const_iterator itor = hashes.find(fname);
-		if(itor == hashes.end()) {
-			if(!contents.empty()) {
-				LOG_INFO("UNVERIFIED NEW FILE: " << fname);
-				verified = false;
-			}
-			return;
-		}
-
-		verified = md5::sum(contents) == itor->second;
-		if(!verified) {
-			LOG_INFO("UNVERIFIED FILE: " << fname << " (((" << contents << ")))");
+		//Signed files are all hashed once by start_verification(), so only
+		//files missing from the signature need to be caught here.
+		if(hashes.count(fname) == 0 && !contents.empty()) {
+			LOG_INFO("UNVERIFIED NEW FILE: " << fname);
+			verified = false;
 		}
 	}
 
 	}
 
 	namespace {
-	void get_signatures(const std::string& dir, std::map<std::string, std::string>* results)
+	void get_signed_files(const std::string& dir, std::vector<std::string>* results)
 	{
 		std::vector<std::string> files, dirs;
 		module::get_files_in_dir(dir, &files, &dirs);
 		for(const std::string& d : dirs) {
-			get_signatures(dir + "/" + d, results);
+			get_signed_files(dir + "/" + d, results);
 		}
 
 		for(const std::string& fname : files) {
-			const std::string path = dir + "/" + fname;
-			const std::string contents = sys::read_file(module::map_file(path));
-			ASSERT_LOG(contents != "", "COULD NOT READ " << path);
-			const std::string md5sum = md5::sum(contents);
-			(*results)[path] = md5sum;
+			results->push_back(dir + "/" + fname);
 		}
 	}
 }
@@ -167,12 +279,24 @@ COMMAND_LINE_UTILITY(sign_game_data)
 		return;
 	}
 
-	std::map<std::string,std::string> signatures;
-	get_signatures("data", &signatures);
+	std::vector<std::string> files;
+	get_signed_files("data", &files);
+
+	//hash the files in parallel on the task pool. Module paths are
+	//resolved here rather than on the workers.
+	std::vector<background_task_pool::future<std::string>> sums;
+	for(const std::string& fname : files) {
+		const std::string path = module::map_file(fname);
+		sums.push_back(background_task_pool::async<std::string>([path]() {
+			return checksum::hash_file(path);
+		}));
+	}
 
 	std::map<variant,variant> output;
-	for(std::map<std::string,std::string>::const_iterator i = signatures.begin(); i != signatures.end(); ++i) {
-		output[variant(i->first)] = variant(i->second);
+	for(int n = 0; n != files.size(); ++n) {
+		const std::string& sum = sums[n].get();
+		ASSERT_LOG(sum != "", "COULD NOT READ " << files[n]);
+		output[variant(files[n])] = variant(sum);
 	}
 
 	std::map<variant,variant> info;
@@ -21,6 +21,9 @@
 	   distribution.
 */
 
+#include <algorithm>
+#include <unordered_map>
+
 #include "asserts.hpp"
 #include "collision_utils.hpp"
 #include "frame.hpp"
@@ -29,6 +32,7 @@
 #include "object_events.hpp"
 #include "rectangle_rotator.hpp"
 #include "solid_map.hpp"
+#include "unit_test.hpp"
 
 namespace
 {
@@ -43,6 +47,56 @@ namespace
 
 		return ypos + delta_y;
 	}
+
+	//64 pixels of row y of the mask, starting at column x. Pixels outside
+	//the mask are clear.
+	uint64_t alpha_mask_bits(const Frame::AlphaMask& mask, int x, int y)
+	{
+		if(y < 0 || y >= mask.height || x >= mask.width || x <= -64) {
+			return 0;
+		}
+
+		const uint64_t* row = mask.row(y);
+		if(x < 0) {
+			return row[0] << -x;
+		}
+
+		const int word = x >> 6;
+		const int shift = x & 63;
+		uint64_t result = row[word] >> shift;
+		if(shift != 0 && word + 1 < mask.words_per_row) {
+			result |= row[word + 1] << (64 - shift);
+		}
+
+		return result;
+	}
+
+	//Tells if an opaque pixel of mask a lies on an opaque pixel of mask b
+	//anywhere from (x1, y1) to (x2, y2) inclusive. The masks are placed
+	//with their top left corners at (ax, ay) and (bx, by). A null mask
+	//counts every pixel as opaque.
+	bool alpha_masks_overlap(const Frame::AlphaMask* a, int ax, int ay, const Frame::AlphaMask* b, int bx, int by, int x1, int y1, int x2, int y2)
+	{
+		for(int y = y1; y <= y2; ++y) {
+			for(int x = x1; x <= x2; x += 64) {
+				const int npixels = x2 - x + 1;
+				uint64_t bits = npixels < 64 ? (uint64_t(1) << npixels) - 1 : ~uint64_t(0);
+				if(a) {
+					bits &= alpha_mask_bits(*a, x - ax, y - ay);
+				}
+
+				if(b) {
+					bits &= alpha_mask_bits(*b, x - bx, y - by);
+				}
+
+				if(bits) {
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
 }
 
 void CollisionInfo::readSurfInfo()
@@ -81,7 +135,7 @@ std::vector<EntityPtr> get_potentially_standable_objects_in_area(const Level& lv
 {
 	std::vector<EntityPtr> result;
 
-	const std::vector<EntityPtr>& chars = lvl.get_solid_chars();
+	const std::vector<EntityPtr>& chars = lvl.get_solid_chars_near(e, area);
 
 	for(const EntityPtr& obj : chars) {
 		if(obj.get() == &e) {
@@ -110,7 +164,7 @@ std::vector<EntityPtr> get_potentially_standable_objects_in_area(const Level& lv
 
 bool point_standable(const Level& lvl, const Entity& e, int x, int y, CollisionInfo* info, ALLOW_PLATFORM allow_platform)
 {
-	return point_standable(lvl, e, lvl.get_solid_chars(), x, y, info, allow_platform);
+	return point_standable(lvl, e, lvl.get_solid_chars_near(e, rect(x, y, 1, 1)), x, y, info, allow_platform);
 }
 
 bool point_standable(const Level& lvl, const Entity& e, const std::vector<EntityPtr>& chars, int x, int y, CollisionInfo* info, ALLOW_PLATFORM allow_platform)
@@ -196,7 +250,7 @@ bool entity_collides(Level& lvl, const Entity& e, MOVE_DIRECTION dir, CollisionI
 		return true;
 	}
 
-	for(const EntityPtr& obj : lvl.get_solid_chars()) {
+	for(const EntityPtr& obj : lvl.get_solid_chars_near(e, e.solidRect())) {
 		if(obj.get() != &e && entity_collides_with_entity(e, *obj, info)) {
 			if(info) {
 				info->collide_with = obj;
@@ -361,7 +415,7 @@ bool entity_collides_with_level(const Level& lvl, const Entity& e, MOVE_DIRECTIO
 	}
 
 	for(const ConstSolidMapPtr& m : s->solid()) {
-		if(lvl.solid(e, m->dir(dir), info ? &info->surf_info : nullptr)) {
+		if(lvl.solid(e, m->spans(dir), info ? &info->surf_info : nullptr)) {
 			if(info) {
 				info->readSurfInfo();
 			}
@@ -530,6 +584,9 @@ int entity_user_collision(const Entity& a, const Entity& b, CollisionPair* areas
 	const int time_a = a.getTimeInFrame();
 	const int time_b = b.getTimeInFrame();
 
+	const Frame::AlphaMask* mask_a = nullptr;
+	const Frame::AlphaMask* mask_b = nullptr;
+
 	int result = 0;
 
 	for(const auto& area_a : fa.getCollisionAreas()) {
@@ -615,22 +672,18 @@ int entity_user_collision(const Entity& a, const Entity& b, CollisionPair* areas
 				}
 			}
 
-			//simple case of axis-aligned rectangles
+			//simple case of axis-aligned rectangles: compare the opaque
+			//pixels of the two objects a row of 64 pixels at a time.
 			else if(rects_intersect(rect_a, rect_b)) {
+				if(!mask_a) {
+					mask_a = &fa.getAlphaMask(time_a, a.isFacingRight());
+					mask_b = &fb.getAlphaMask(time_b, b.isFacingRight());
+				}
 
-				//we only check every other pixel, since this gives us
-				//enough accuracy and is 4x faster.
-				const int Stride = 2;
 				const rect intersection = intersection_rect(rect_a, rect_b);
-				for(int y = intersection.y(); y <= intersection.y2() && !found; y += Stride) {
-					for(int x = intersection.x(); x <= intersection.x2(); x += Stride) {
-						if((area_a.no_alpha_check || !fa.isAlpha(x - a.x(), y - a.y(), time_a, a.isFacingRight())) &&
-						   (area_b.no_alpha_check || !fb.isAlpha(x - b.x(), y - b.y(), time_b, b.isFacingRight()))) {
-							found = true;
-							break;
-						}
-					}
-				}
+				found = alpha_masks_overlap(area_a.no_alpha_check ? nullptr : mask_a, a.x(), a.y(),
+				                            area_b.no_alpha_check ? nullptr : mask_b, b.x(), b.y(),
+				                            intersection.x(), intersection.y(), intersection.x2(), intersection.y2());
 			}
 
 			if(found) {
@@ -704,16 +757,9 @@ bool entity_user_collision_specific_areas(const Entity& a, const std::string& ar
 	const int time_b = b.getTimeInFrame();
 
 	const rect intersection = intersection_rect(rect_a, rect_b);
-	for(int y = intersection.y(); y <= intersection.y2(); ++y) {
-		for(int x = intersection.x(); x <= intersection.x2(); ++x) {
-			if(!fa.isAlpha(x - a.x(), y - a.y(), time_a, a.isFacingRight()) &&
-			   !fb.isAlpha(x - b.x(), y - b.y(), time_b, b.isFacingRight())) {
-				return true;
-			}
-		}
-	}
-
-	return false;
+	return alpha_masks_overlap(&fa.getAlphaMask(time_a, a.isFacingRight()), a.x(), a.y(),
+	                           &fb.getAlphaMask(time_b, b.isFacingRight()), b.x(), b.y(),
+	                           intersection.x(), intersection.y(), intersection.x2(), intersection.y2());
 }
 
 namespace {
@@ -760,6 +806,126 @@ int get_collision_event_id(const std::string& area)
 	return cache[area];
 }
 
+//A rect containing every collision area of the object, as
+//entity_user_collision() sees them, so that objects whose rects don't
+//touch can't collide.
+rect user_collision_bounds(const Entity& e)
+{
+	const Frame& f = e.getCurrentFrame();
+	const bool rotated = e.currentRotation() != 0;
+
+	rect result;
+	bool first = true;
+	for(const auto& area : f.getCollisionAreas()) {
+		rect r = e.calculateCollisionRect(f, area);
+		if(rotated) {
+			const int center_x = r.x() + r.w()/2;
+			const int center_y = r.y() + r.h()/2;
+			const int dim = std::max(r.w(), r.h());
+			r = rect(center_x - dim/2 - 1, center_y - dim/2 - 1, dim+2, dim+2);
+		}
+
+		result = first ? r : geometry::rect_union(result, r);
+		first = false;
+	}
+
+	return result;
+}
+
+//Sweep and prune over the collision bounds of objects along the x axis.
+//Objects move little between frames, so the order they were sorted into
+//last frame is kept and the new order found with an insertion sort,
+//which takes close to linear time on nearly sorted input.
+class UserCollisionBroadphase
+{
+public:
+	//Finds the pairs (i, j), i < j, of objects whose bounds touch, in
+	//increasing order.
+	void findPairs(const std::vector<EntityPtr>& chars, std::vector<std::pair<int, int>>* pairs) {
+		const int nchars = static_cast<int>(chars.size());
+
+		index_.clear();
+		for(int n = 0; n != nchars; ++n) {
+			index_[chars[n].get()] = n;
+		}
+
+		std::vector<bool> placed(nchars, false);
+		entries_.clear();
+		for(const Entity* e : order_) {
+			auto itor = index_.find(e);
+			if(itor != index_.end() && !placed[itor->second]) {
+				placed[itor->second] = true;
+				entries_.push_back(makeEntry(*chars[itor->second], itor->second));
+			}
+		}
+
+		for(int n = 0; n != nchars; ++n) {
+			if(!placed[n]) {
+				entries_.push_back(makeEntry(*chars[n], n));
+			}
+		}
+
+		for(size_t n = 1; n < entries_.size(); ++n) {
+			const Entry entry = entries_[n];
+			size_t m = n;
+			while(m > 0 && entries_[m-1].x1 > entry.x1) {
+				entries_[m] = entries_[m-1];
+				--m;
+			}
+			entries_[m] = entry;
+		}
+
+		order_.clear();
+		for(const Entry& entry : entries_) {
+			order_.push_back(chars[entry.index].get());
+		}
+
+		for(size_t n = 0; n < entries_.size(); ++n) {
+			const Entry& a = entries_[n];
+			for(size_t m = n + 1; m < entries_.size() && entries_[m].x1 <= a.x2; ++m) {
+				const Entry& b = entries_[m];
+				if(a.y1 <= b.y2 && b.y1 <= a.y2) {
+					pairs->push_back(std::make_pair(std::min(a.index, b.index), std::max(a.index, b.index)));
+				}
+			}
+		}
+
+		std::sort(pairs->begin(), pairs->end());
+	}
+
+private:
+	struct Entry
+	{
+		int index;
+		int x1, y1, x2, y2;
+	};
+
+	static Entry makeEntry(const Entity& e, int index) {
+		const rect r = user_collision_bounds(e);
+		Entry entry = { index, r.x(), r.y(), r.x2(), r.y2() };
+		return entry;
+	}
+
+	//Only used to order this frame's objects; the objects may have gone.
+	std::vector<const Entity*> order_;
+
+	std::unordered_map<const Entity*, int> index_;
+	std::vector<Entry> entries_;
+};
+
+struct UserCollision
+{
+	Entity* obj;
+	const std::string* area;
+	Entity* other;
+	const std::string* other_area;
+};
+
+bool compare_user_collision_keys(const UserCollision& a, const UserCollision& b)
+{
+	return a.obj < b.obj || (a.obj == b.obj && a.area < b.area);
+}
+
 }
 
 void detect_user_collisions(Level& lvl)
@@ -772,66 +938,77 @@ void detect_user_collisions(Level& lvl)
 		}
 	}
 
-	typedef std::pair<EntityPtr, const std::string*> collision_key;
-	std::map<collision_key, std::vector<collision_key> > collision_info;
+	static UserCollisionBroadphase broadphase;
+	std::vector<std::pair<int, int>> pairs;
+	broadphase.findPairs(chars, &pairs);
 
 	static const int CollideObjectID = get_object_event_id("collide_object");
 
+	//Collisions are gathered in the order the pairs are tested, and then
+	//grouped by object and area, ordered by address as they always have
+	//been. A stable sort keeps each group in the order found.
+	std::vector<UserCollision> collisions;
+
 	const int MaxCollisions = 16;
 	CollisionPair collision_buf[MaxCollisions];
-	for(std::vector<EntityPtr>::const_iterator i = chars.begin(); i != chars.end(); ++i) {
-		for(std::vector<EntityPtr>::const_iterator j = i + 1; j != chars.end(); ++j) {
-			const EntityPtr& a = *i;
-			const EntityPtr& b = *j;
-			if(a == b ||
-			   ((a->getWeakCollideDimensions()&b->getCollideDimensions()) == 0 &&
-			   (a->getCollideDimensions()&b->getWeakCollideDimensions()) == 0)) {
-				//the objects do not share a dimension, and so can't collide.
-				continue;
-			}
-
-			int ncollisions = entity_user_collision(*a, *b, collision_buf, MaxCollisions);
-			if(ncollisions > MaxCollisions) {
-				ncollisions = MaxCollisions;
-			}
+	for(const std::pair<int, int>& p : pairs) {
+		Entity* a = chars[p.first].get();
+		Entity* b = chars[p.second].get();
+		if(a == b ||
+		   ((a->getWeakCollideDimensions()&b->getCollideDimensions()) == 0 &&
+		   (a->getCollideDimensions()&b->getWeakCollideDimensions()) == 0)) {
+			//the objects do not share a dimension, and so can't collide.
+			continue;
+		}
 
-			for(int n = 0; n != ncollisions; ++n) {
-				{
-					collision_info[collision_key(a, collision_buf[n].first)].emplace_back(b, collision_buf[n].second);
-				}
+		int ncollisions = entity_user_collision(*a, *b, collision_buf, MaxCollisions);
+		if(ncollisions > MaxCollisions) {
+			ncollisions = MaxCollisions;
+		}
 
-				{
-					collision_info[collision_key(b, collision_buf[n].second)].emplace_back(a, collision_buf[n].first);
-				}
-			}
+		for(int n = 0; n != ncollisions; ++n) {
+			const UserCollision ab = { a, collision_buf[n].first, b, collision_buf[n].second };
+			const UserCollision ba = { b, collision_buf[n].second, a, collision_buf[n].first };
+			collisions.push_back(ab);
+			collisions.push_back(ba);
 		}
 	}
 
-	for(std::map<collision_key, std::vector<collision_key> >::iterator i = collision_info.begin(); i != collision_info.end(); ++i) {
+	std::stable_sort(collisions.begin(), collisions.end(), compare_user_collision_keys);
+
+	for(auto i = collisions.begin(); i != collisions.end(); ) {
+		auto group_end = i + 1;
+		while(group_end != collisions.end() && !compare_user_collision_keys(*i, *group_end)) {
+			++group_end;
+		}
+
+		const EntityPtr obj(i->obj);
+		const std::string& area = *i->area;
+
 		std::vector<ffl::IntrusivePtr<UserCollisionCallable> > v;
 		std::vector<variant> all_callables;
-		v.reserve(i->second.size());
+		v.reserve(group_end - i);
 		int index = 0;
-		for(const collision_key& k : i->second) {
-			v.push_back(ffl::IntrusivePtr<UserCollisionCallable>(new UserCollisionCallable(i->first.first, k.first, *i->first.second, *k.second, index)));
+		for(auto k = i; k != group_end; ++k) {
+			v.push_back(ffl::IntrusivePtr<UserCollisionCallable>(new UserCollisionCallable(obj, EntityPtr(k->other), area, *k->other_area, index)));
 			all_callables.emplace_back(v.back().get());
 			++index;
 		}
 
 		variant all_callables_variant(&all_callables);
 
-		collision_key key = i->first;
-
 		for(const ffl::IntrusivePtr<UserCollisionCallable>& p : v) {
 			p->setAllCollisions(all_callables_variant);
-			key.first->handleEventDelay(CollideObjectID, p.get());
-			key.first->handleEventDelay(get_collision_event_id(*i->first.second), p.get());
+			obj->handleEventDelay(CollideObjectID, p.get());
+			obj->handleEventDelay(get_collision_event_id(area), p.get());
 		}
 
 		for(const ffl::IntrusivePtr<UserCollisionCallable>& p : v) {
 			//make sure we don't retain circular references.
 			p->setAllCollisions(variant());
 		}
+
+		i = group_end;
 	}
 
 	for(const EntityPtr& a : chars) {
@@ -845,7 +1022,7 @@ bool is_flightpath_clear(const Level& lvl, const Entity& e, const rect& area)
 		return false;
 	}
 
-	for(const EntityPtr& obj : lvl.get_solid_chars()) {
+	for(const EntityPtr& obj : lvl.get_solid_chars_near(e, area)) {
 		if(obj.get() == &e) {
 			continue;
 		}
@@ -857,3 +1034,75 @@ bool is_flightpath_clear(const Level& lvl, const Entity& e, const rect& area)
 
 	return true;
 }
+
+namespace
+{
+	Frame::AlphaMask make_test_alpha_mask(int width, int height, const std::vector<bool>& opaque)
+	{
+		Frame::AlphaMask mask;
+		mask.width = width;
+		mask.height = height;
+		mask.words_per_row = (width + 63)/64;
+		mask.bits.resize(mask.words_per_row*height);
+		for(int y = 0; y != height; ++y) {
+			for(int x = 0; x != width; ++x) {
+				if(opaque[y*width + x]) {
+					mask.bits[y*mask.words_per_row + (x >> 6)] |= uint64_t(1) << (x & 63);
+				}
+			}
+		}
+
+		return mask;
+	}
+}
+
+UNIT_TEST(alpha_masks_overlap)
+{
+	//compare against looking at each pixel for sprites of awkward sizes
+	//placed all around each other.
+	const int wa = 70, ha = 9, wb = 5, hb = 67;
+	std::vector<bool> pa(wa*ha), pb(wb*hb);
+	for(int n = 0; n != wa*ha; ++n) {
+		pa[n] = (n*7)%13 == 0;
+	}
+	for(int n = 0; n != wb*hb; ++n) {
+		pb[n] = (n*5)%11 == 0;
+	}
+
+	const Frame::AlphaMask ma = make_test_alpha_mask(wa, ha, pa);
+	const Frame::AlphaMask mb = make_test_alpha_mask(wb, hb, pb);
+
+	for(int by = -70; by <= 12; by += 3) {
+		for(int bx = -8; bx <= 72; ++bx) {
+			const rect intersection = intersection_rect(rect(0, 0, wa, ha), rect(bx, by, wb, hb));
+			bool expected = false;
+			for(int y = intersection.y(); y <= intersection.y2(); ++y) {
+				for(int x = intersection.x(); x <= intersection.x2(); ++x) {
+					const bool opaque_a = x >= 0 && y >= 0 && x < wa && y < ha && pa[y*wa + x];
+					const bool opaque_b = x >= bx && y >= by && x < bx + wb && y < by + hb && pb[(y - by)*wb + x - bx];
+					expected = expected || (opaque_a && opaque_b);
+				}
+			}
+
+			CHECK_EQ(alpha_masks_overlap(&ma, 0, 0, &mb, bx, by, intersection.x(), intersection.y(), intersection.x2(), intersection.y2()), expected);
+		}
+	}
+}
+
+BENCHMARK(alpha_masks_overlap_sprites)
+{
+	//two 64x64 sprites with a sparse pattern, overlapping by half in
+	//each direction, as with objects brushing past each other.
+	const int size = 64;
+	std::vector<bool> pa(size*size), pb(size*size);
+	for(int n = 0; n != size*size; ++n) {
+		pa[n] = (n%size) < size/4;
+		pb[n] = (n%size) >= size - size/4;
+	}
+
+	const Frame::AlphaMask ma = make_test_alpha_mask(size, size, pa);
+	const Frame::AlphaMask mb = make_test_alpha_mask(size, size, pb);
+	BENCHMARK_LOOP {
+		alpha_masks_overlap(&ma, 0, 0, &mb, size/2, size/2, size/2, size/2, size, size);
+	}
+}
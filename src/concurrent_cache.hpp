@@ -23,71 +23,304 @@
 
 #pragma once
 
-#include <map>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include "thread.hpp"
 
-template<typename Key, typename Value>
+// A thread-safe key/value cache.
+//
+// Entries are spread over a number of shards, each with its own lock, so
+// that threads looking up different keys rarely contend. Lookups return
+// values by copy so that nothing refers into the cache after the lock is
+// released.
+//
+// If given a byte budget and a function to measure the size of values, the
+// cache evicts the least recently used entries once the budget is exceeded.
+template<typename Key, typename Value, typename Hash=std::hash<Key>>
 class ConcurrentCache
 {
 public:
-	typedef std::map<Key, Value> map_type;
+	typedef std::function<size_t (const Value&)> SizeFn;
 
-	size_t size() const { threading::lock l(mutex_); return map_.size(); }
+	struct Stats
+	{
+		Stats() : hits(0), misses(0), evictions(0), entries(0), bytes(0)
+		{}
+		int64_t hits, misses, evictions;
+		size_t entries, bytes;
+	};
 
-	const Value& get(const Key& key) {
-		threading::lock l(mutex_);
-		typename map_type::const_iterator itor = map_.find(key);
-		if(itor != map_.end()) {
-			return itor->second;
-		} else {
-			static const Value empty_result = Value();
-			return empty_result;
+	explicit ConcurrentCache(size_t max_bytes=0, SizeFn size_fn=SizeFn(), int num_shards=16)
+	  : shards_(num_shards), size_fn_(size_fn), max_bytes_(max_bytes), bytes_(0), next_evict_shard_(0)
+	{
+		for(auto& s : shards_) {
+			s.reset(new Shard);
+		}
+	}
+
+	size_t size() const {
+		size_t result = 0;
+		for(const auto& s : shards_) {
+			threading::lock l(s->mutex);
+			result += s->map.size();
 		}
+		return result;
+	}
+
+	//Returns the cached value, or a default-constructed value if the key
+	//isn't in the cache.
+	Value get(const Key& key) {
+		Value result;
+		tryGet(key, &result);
+		return result;
+	}
+
+	bool tryGet(const Key& key, Value* result) {
+		Shard& s = getShard(key);
+		threading::lock l(s.mutex);
+		return findLocked(s, key, result);
 	}
 
 	void put(const Key& key, const Value& value) {
-		threading::lock l(mutex_);
-		map_[key] = value;
+		Shard& s = getShard(key);
+		{
+			threading::lock l(s.mutex);
+			insertLocked(s, key, value);
+		}
+		evictIfNeeded();
+	}
+
+	//Looks up key, and if it isn't present calls fn() to create the value
+	//and stores it. If several threads ask for the same missing key at the
+	//same time only one of them calls fn(); the others wait for its result.
+	//If fn() throws, the exception propagates to the caller that ran it and
+	//one of the waiting threads will try computing the value itself.
+	template<typename Fn>
+	Value getOrCompute(const Key& key, Fn fn) {
+		Shard& s = getShard(key);
+		std::shared_ptr<InFlight> flight;
+		{
+			threading::lock l(s.mutex);
+			for(;;) {
+				Value result;
+				if(findLocked(s, key, &result)) {
+					return result;
+				}
+
+				auto itor = s.loading.find(key);
+				if(itor == s.loading.end()) {
+					break;
+				}
+
+				std::shared_ptr<InFlight> other = itor->second;
+				while(!other->done) {
+					s.cond.wait(s.mutex);
+				}
+			}
+
+			flight = std::make_shared<InFlight>();
+			s.loading[key] = flight;
+		}
+
+		Value value;
+		try {
+			value = fn();
+		} catch(...) {
+			threading::lock l(s.mutex);
+			flight->done = true;
+			s.loading.erase(key);
+			s.cond.notify_all();
+			throw;
+		}
+
+		{
+			threading::lock l(s.mutex);
+			insertLocked(s, key, value);
+			flight->done = true;
+			s.loading.erase(key);
+			s.cond.notify_all();
+		}
+
+		evictIfNeeded();
+		return value;
 	}
 
 	void erase(const Key& key) {
-		threading::lock l(mutex_);
-		map_.erase(key);
+		Shard& s = getShard(key);
+		threading::lock l(s.mutex);
+		auto itor = s.map.find(key);
+		if(itor != s.map.end()) {
+			eraseLocked(s, itor);
+		}
 	}
 
 	int count(const Key& key) const {
-		threading::lock l(mutex_);
-		return map_.count(key);
+		const Shard& s = getShard(key);
+		threading::lock l(s.mutex);
+		return static_cast<int>(s.map.count(key));
 	}
 
 	void clear() {
-		threading::lock l(mutex_);
-		map_.clear();
+		for(auto& s : shards_) {
+			threading::lock l(s->mutex);
+			for(const Entry& e : s->lru) {
+				bytes_ -= e.bytes;
+			}
+			s->map.clear();
+			s->lru.clear();
+		}
 	}
 
 	std::vector<Key> getKeys() {
 		std::vector<Key> result;
-		threading::lock l(mutex_);
-		for(const auto& i : map_) {
-			result.push_back(i.first);
+		for(auto& s : shards_) {
+			threading::lock l(s->mutex);
+			for(const Entry& e : s->lru) {
+				result.push_back(e.key);
+			}
 		}
 
 		return result;
 	}
 
-	struct lock : public threading::lock {
-		explicit lock(ConcurrentCache& cache) : threading::lock(cache.mutex_), cache_(cache) {
+	//Sets the byte budget. 0 means the cache is unbounded.
+	void setMaxBytes(size_t max_bytes) {
+		max_bytes_ = max_bytes;
+		evictIfNeeded();
+	}
+
+	size_t getMaxBytes() const { return max_bytes_; }
+
+	Stats getStats() const {
+		Stats result;
+		for(const auto& s : shards_) {
+			threading::lock l(s->mutex);
+			result.hits += s->hits;
+			result.misses += s->misses;
+			result.evictions += s->evictions;
+			result.entries += s->map.size();
 		}
 
-		map_type& map() const { return cache_.map_; }
+		result.bytes = bytes_;
+		return result;
+	}
 
-	private:
-		ConcurrentCache& cache_;
-	};
+	void resetStats() {
+		for(auto& s : shards_) {
+			threading::lock l(s->mutex);
+			s->hits = s->misses = s->evictions = 0;
+		}
+	}
 
 private:
-	map_type map_;
-	mutable threading::mutex mutex_;
+	ConcurrentCache(const ConcurrentCache&);
+	void operator=(const ConcurrentCache&);
+
+	struct Entry
+	{
+		Key key;
+		Value value;
+		size_t bytes;
+	};
+
+	typedef std::list<Entry> EntryList;
+
+	struct InFlight
+	{
+		InFlight() : done(false) {}
+		bool done;
+	};
+
+	struct Shard
+	{
+		Shard() : hits(0), misses(0), evictions(0) {}
+		mutable threading::mutex mutex;
+		threading::condition cond;
+
+		//Entries, most recently used first.
+		EntryList lru;
+		std::unordered_map<Key, typename EntryList::iterator, Hash> map;
+
+		std::unordered_map<Key, std::shared_ptr<InFlight>, Hash> loading;
+
+		int64_t hits, misses, evictions;
+	};
+
+	Shard& getShard(const Key& key) {
+		return *shards_[Hash()(key)%shards_.size()];
+	}
+
+	const Shard& getShard(const Key& key) const {
+		return *shards_[Hash()(key)%shards_.size()];
+	}
+
+	bool findLocked(Shard& s, const Key& key, Value* result) {
+		auto itor = s.map.find(key);
+		if(itor == s.map.end()) {
+			++s.misses;
+			return false;
+		}
+
+		++s.hits;
+		s.lru.splice(s.lru.begin(), s.lru, itor->second);
+		*result = itor->second->value;
+		return true;
+	}
+
+	void insertLocked(Shard& s, const Key& key, const Value& value) {
+		const size_t nbytes = size_fn_ ? size_fn_(value) : 0;
+		auto itor = s.map.find(key);
+		if(itor != s.map.end()) {
+			bytes_ -= itor->second->bytes;
+			itor->second->value = value;
+			itor->second->bytes = nbytes;
+			s.lru.splice(s.lru.begin(), s.lru, itor->second);
+		} else {
+			Entry e = { key, value, nbytes };
+			s.lru.push_front(e);
+			s.map[key] = s.lru.begin();
+		}
+
+		bytes_ += nbytes;
+	}
+
+	void eraseLocked(Shard& s, typename std::unordered_map<Key, typename EntryList::iterator, Hash>::iterator itor) {
+		bytes_ -= itor->second->bytes;
+		s.lru.erase(itor->second);
+		s.map.erase(itor);
+	}
+
+	//Evicts the least recently used entries of each shard in turn until the
+	//cache is within budget. Only one shard is locked at a time. The most
+	//recently used entry of a shard is never evicted so that a value that
+	//was just inserted survives until the caller has it.
+	void evictIfNeeded() {
+		if(max_bytes_ == 0 || bytes_ <= max_bytes_) {
+			return;
+		}
+
+		size_t shards_without_victims = 0;
+		while(bytes_ > max_bytes_ && shards_without_victims < shards_.size()) {
+			Shard& s = *shards_[next_evict_shard_++ % shards_.size()];
+			threading::lock l(s.mutex);
+			if(s.lru.size() > 1) {
+				eraseLocked(s, s.map.find(s.lru.back().key));
+				++s.evictions;
+				shards_without_victims = 0;
+			} else {
+				++shards_without_victims;
+			}
+		}
+	}
+
+	std::vector<std::unique_ptr<Shard>> shards_;
+	SizeFn size_fn_;
+	std::atomic<size_t> max_bytes_, bytes_;
+	std::atomic<unsigned> next_evict_shard_;
 };
@@ -58,6 +58,7 @@ namespace controls
 
 	int npackets_received;
 	int ngood_packets;
+	int nchecksum_mismatches;
 	int last_packet_size_;
 
 	const int MAX_PLAYERS = 8;
@@ -210,6 +211,8 @@ namespace controls
 		for(int32_t& highest : remote_highest_confirmed) {
 			highest = 0;
 		}
+
+		nchecksum_mismatches = 0;
 	}
 
 
@@ -465,6 +468,7 @@ namespace controls
 				LOG_DEBUG("CHECKSUM MATCH FOR " << current_cycle << ": " << checksum);
 			} else {
 				LOG_ERROR("CHECKSUM DID NOT MATCH FOR " << current_cycle << ": " << checksum << " VS " << our_checksums[current_cycle-1]);
+				++nchecksum_mismatches;
 			}
 
 		}
@@ -646,6 +650,11 @@ namespace controls
 		return npackets_received - ngood_packets;
 	}
 
+	int num_checksum_mismatches()
+	{
+		return nchecksum_mismatches;
+	}
+
 	int packets_received()
 	{
 		return npackets_received;
@@ -100,6 +100,9 @@ namespace controls
 
 	unsigned num_players();
 	int num_errors();
+
+	//Number of control packets whose game state checksum didn't match ours.
+	int num_checksum_mismatches();
 	int packets_received();
 	int cycles_behind();
 
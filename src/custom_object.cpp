@@ -70,6 +70,7 @@
 #include "profile_timer.hpp"
 #include "rectangle_rotator.hpp"
 #include "screen_handling.hpp"
+#include "sprite_batch.hpp"
 #include "string_utils.hpp"
 #include "variant.hpp"
 #include "variant_utils.hpp"
@@ -1628,6 +1629,47 @@ void CustomObject::draw(int xx, int yy) const
 	}
 }
 
+bool CustomObject::drawBatched(SpriteBatch& batch, int dx, int dy) const
+{
+	//Only objects whose draw() amounts to a single frame quad may be
+	//batched; anything else they draw would end up out of order.
+	if(frame_ == nullptr || shader_ || driver_ || clip_area_ || draw_area_ || custom_draw_ || particles_ || document_ || text_ ||
+	   use_absolute_screen_coordinates_ || type_->isShadow() || type_->isHiddenInGame() ||
+	   type_->drawBatchID().empty() == false ||
+	   custom_draw_xy_.empty() == false || blur_objects_.empty() == false || effects_shaders_.empty() == false ||
+	   draw_primitives_.empty() == false || widgets_.empty() == false || particle_systems_.empty() == false ||
+	   attachedObjects().empty() == false) {
+		return false;
+	}
+
+	if(draw_color_ && !draw_color_->fits_in_color()) {
+		return false;
+	}
+
+	if(preferences::show_debug_hitboxes() || (solid() && g_debug_object_solid) ||
+	   (platform_area_ && !platform_offsets_.empty() && Level::current().in_editor()) ||
+	   Level::current().debug_properties().empty() == false) {
+		return false;
+	}
+
+	//draw() would drop any clip left over from an earlier object.
+	g_clip_stencil_scope.reset();
+	g_clip_stencil_rect.reset();
+
+	int draw_x = x();
+	int draw_y = y();
+
+	if(g_draw_objects_on_even_pixel_boundaries) {
+		draw_x -= draw_x%2;
+		draw_y -= draw_y%2;
+	}
+
+	batch.add(*frame_, draw_color_ ? draw_color_->toColor() : KRE::ColorScope::getCurrentColor(),
+	          draw_x + dx, draw_y + dy, isFacingRight(), isUpsideDown(), time_in_frame_,
+	          getRotateZ().as_float32(), draw_scale_ ? draw_scale_->as_float32() : 1.0f);
+	return true;
+}
+
 void CustomObject::drawGroup() const
 {
 	auto wnd = KRE::WindowManager::getMainWindow();
@@ -1701,6 +1743,8 @@ void CustomObject::process(Level& lvl)
 		}
 	}
 
+	stateChanged();
+
 	CollisionInfo debug_collide_info;
 	ASSERT_LOG(type_->isStaticObject() || lvl.in_editor() || !entity_collides(Level::current(), *this, MOVE_DIRECTION::NONE, &debug_collide_info), "ENTITY " << getDebugDescription() << " COLLIDES WITH " << (debug_collide_info.collide_with ? debug_collide_info.collide_with->getDebugDescription() : "THE LEVEL") << " AT START OF PROCESS, WITH ITS SOLID RECT BEING [x,y,x2,y2]: " << solidRect());
 
@@ -1725,6 +1769,8 @@ void CustomObject::process(Level& lvl)
 
 	last_cycle_active_ = lvl.cycle();
 
+	const Level::MoverScope mover_scope(lvl, *this);
+
 	Entity::process(lvl);
 
 	//the object should never be colliding with the level at the start of processing.
@@ -3745,6 +3791,11 @@ void CustomObject::getInputs(std::vector<game_logic::FormulaInput>* inputs) cons
 
 void CustomObject::setValue(const std::string& key, const variant& value)
 {
+	stateChanged();
+
+	//Many properties change where the object is active.
+	activationBoundsChanged();
+
 	const int slot = CustomObjectCallable::getKeySlot(key);
 	if(slot != -1) {
 		setValueBySlot(slot, value);
@@ -4033,6 +4084,9 @@ void CustomObject::setValue(const std::string& key, const variant& value)
 
 void CustomObject::setValueBySlot(int slot, const variant& value)
 {
+	stateChanged();
+	activationBoundsChanged();
+
 	switch(slot) {
 	case CUSTOM_OBJECT_DATA: {
 		ASSERT_LOG(active_property_ >= 0, "Illegal access of 'data' in object when not in writable property");
@@ -5261,6 +5315,40 @@ bool CustomObject::isActive(const rect& screen_area) const
 	return false || activation_area_intersects_screen;
 }
 
+bool CustomObject::getActivationBounds(rect* bounds) const
+{
+	//Anything that makes isActive() look past the frame and activation
+	//border leaves the object without bounds.
+	if(isAlwaysActive() || useAbsoluteScreenCoordinates() || type_->goesInactiveOnlyWhenStanding() || activation_area_ || text_ || draw_area_) {
+		return false;
+	}
+
+	if(parallax_scale_millis_.get() != nullptr && (parallax_scale_millis_->first != 1000 || parallax_scale_millis_->second != 1000)) {
+		return false;
+	}
+
+	//The body is included since queries for objects at a point or in a
+	//rect look at the frame and at the midpoint of the body.
+	rect area = frameRect();
+	if(solid()) {
+		area = geometry::rect_union(area, solidRect());
+	}
+
+	const int border = std::max(0, activation_border_);
+	*bounds = rect(area.x() - border, area.y() - border, area.w() + border*2, area.h() + border*2);
+	return true;
+}
+
+bool CustomObject::getCollisionBounds(rect* bounds) const
+{
+	//platformRectAt() moves the platform by the offsets.
+	if(!platform_offsets_.empty()) {
+		return false;
+	}
+
+	return Entity::getCollisionBounds(bounds);
+}
+
 bool CustomObject::moveToStanding(Level& lvl, int max_displace)
 {
 	int start_y = y();
@@ -5357,6 +5445,13 @@ EntityPtr CustomObject::backup() const
 	return res;
 }
 
+unsigned int CustomObject::stateGeneration() const
+{
+	//Variable storages draw their generations from a shared clock, so the
+	//sum still changes if a storage is replaced.
+	return Entity::stateGeneration() + vars_->generation() + tmp_vars_->generation();
+}
+
 bool CustomObject::handleEvent(const std::string& event, const FormulaCallable* context)
 {
 	return handleEvent(get_object_event_id(event), context);
@@ -5425,6 +5520,8 @@ namespace
 
 bool CustomObject::handleEventInternal(int event, const FormulaCallable* context, bool executeCommands_now)
 {
+	stateChanged();
+
 	if(paused_ && event != OBJECT_EVENT_BEING_REMOVED) {
 		static const int MouseLeaveID = get_object_event_id("mouse_leave");
 		if(event != MouseLeaveID) {
@@ -5728,6 +5825,8 @@ namespace
 
 void CustomObject::mapEntities(const std::map<EntityPtr, EntityPtr>& m)
 {
+	stateChanged();
+
 	do_map_entity(last_hit_by_, m);
 	do_map_entity(standing_on_, m);
 	do_map_entity(parent_, m);
@@ -5747,6 +5846,8 @@ void CustomObject::mapEntities(const std::map<EntityPtr, EntityPtr>& m)
 
 void CustomObject::cleanup_references()
 {
+	stateChanged();
+
 	last_hit_by_.reset();
 	standing_on_.reset();
 	parent_.reset();
@@ -5916,6 +6017,7 @@ void CustomObject::removeParticleSystem(const std::string& key)
 
 void CustomObject::setText(const std::string& text, const std::string& font, int size, int align)
 {
+	activationBoundsChanged();
 	text_.reset(new CustomObjectText);
 	text_->text = text;
 	text_->font = GraphicalFont::get(font);
@@ -94,6 +94,7 @@ public:
 	virtual void draw(int xx, int yy) const override;
 	virtual void drawLater(int x, int y) const override;
 	virtual void drawGroup() const override;
+	virtual bool drawBatched(SpriteBatch& batch, int dx, int dy) const override;
 	virtual void process(Level& lvl) override;
 	virtual void construct();
 	virtual bool createObject() override;
@@ -147,6 +148,8 @@ public:
 	void die();
 	void dieWithNoEvent() override;
 	virtual bool isActive(const rect& screen_area) const override;
+	virtual bool getActivationBounds(rect* bounds) const override;
+	virtual bool getCollisionBounds(rect* bounds) const override;
 	bool diesOnInactive() const override;
 	bool isAlwaysActive() const override;
 	bool moveToStanding(Level& lvl, int max_displace=10000) override;
@@ -172,6 +175,7 @@ public:
 
 	virtual EntityPtr clone() const override;
 	virtual EntityPtr backup() const override;
+	unsigned int stateGeneration() const override;
 
 	game_logic::ConstFormulaPtr getEventHandler(int key) const override;
 	void setEventHandler(int, game_logic::ConstFormulaPtr f) override;
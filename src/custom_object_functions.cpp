@@ -78,6 +78,7 @@
 #include "speech_dialog.hpp"
 #include "stats.hpp"
 #include "string_utils.hpp"
+#include "surface_palette.hpp"
 #include "tbs_internal_server.hpp"
 #include "thread.hpp"
 #include "unit_test.hpp"
@@ -2274,6 +2275,21 @@ namespace
 	RETURN_TYPE("[object]")
 	END_FUNCTION_DEF(debug_all_custom_objects)
 
+	FUNCTION_DEF(palette_cache_stats, 0, 0, "palette_cache_stats(): gets the memory used by and the hit rate of the cache of palette-swapped images")
+		const graphics::palette_cache_stats stats = graphics::get_palette_cache_stats();
+		variant_builder b;
+		b.add("hits", static_cast<int>(stats.hits));
+		b.add("misses", static_cast<int>(stats.misses));
+		b.add("evictions", static_cast<int>(stats.evictions));
+		b.add("entries", static_cast<int>(stats.entries));
+		b.add("kb", static_cast<int>(stats.bytes/1024));
+		b.add("tables_built", static_cast<int>(stats.tables_built));
+		b.add("kpixels_mapped", static_cast<int>(stats.pixels_mapped/1000));
+		b.add("map_ms", static_cast<int>(stats.map_us/1000));
+		return b.build();
+	RETURN_TYPE("map")
+	END_FUNCTION_DEF(palette_cache_stats)
+
 
 	class add_debug_chart_command : public game_logic::CommandCallable {
 		std::string id_;
@@ -2841,6 +2857,25 @@ RETURN_TYPE("bool")
 	RETURN_TYPE("[object]")
 	END_FUNCTION_DEF(get_objects_at_point)
 
+	FUNCTION_DEF(get_objects_in_rect, 4, 4, "get_objects_in_rect(x, y, w, h): Returns all objects whose midpoint is within the specified rect, in absolute Level-coordinates.")
+		Level* lvl = &Level::current();
+		const std::vector<EntityPtr> v = lvl->get_characters_in_rect(rect(EVAL_ARG(0).as_int(), EVAL_ARG(1).as_int(), EVAL_ARG(2).as_int(), EVAL_ARG(3).as_int()),
+														 static_cast<int>(last_draw_position().x / 100 * lvl->zoom_level()),
+														 static_cast<int>(last_draw_position().y / 100 * lvl->zoom_level()));
+		std::vector<variant> res;
+		res.reserve(v.size());
+		for(const EntityPtr& e : v) {
+			res.emplace_back(e.get());
+		}
+		return variant(&res);
+	FUNCTION_ARGS_DEF
+		ARG_TYPE("int")
+		ARG_TYPE("int")
+		ARG_TYPE("int")
+		ARG_TYPE("int")
+	RETURN_TYPE("[object]")
+	END_FUNCTION_DEF(get_objects_in_rect)
+
 	FUNCTION_DEF(toggle_pause, 0, 0, "toggle_pause()")
 		Formula::failIfStaticContext();
 		return variant(new FnCommandCallable("toggle_pause", [=]() {
@@ -25,6 +25,7 @@
 #include <iostream>
 
 #include "asserts.hpp"
+#include "async_io.hpp"
 #include "code_editor_dialog.hpp"
 #include "collision_utils.hpp"
 #include "custom_object.hpp"
@@ -932,6 +933,24 @@ const std::string* CustomObjectType::getObjectPath(const std::string& id)
 	return &itor->second;
 }
 
+void CustomObjectType::prefetchFiles(const std::vector<std::string>& ids)
+{
+	std::vector<std::string> paths;
+	for(const std::string& id : ids) {
+		const std::string base_id(id.begin(), std::find(id.begin(), id.end(), '.'));
+		if(cache().count(module::get_id(base_id))) {
+			continue;
+		}
+
+		const std::string* path = getObjectPath(base_id + ".cfg");
+		if(path) {
+			paths.push_back(*path);
+		}
+	}
+
+	async_io::prefetch(paths);
+}
+
 ConstCustomObjectTypePtr CustomObjectType::get(const std::string& id)
 {
 	std::string::const_iterator dot_itor = std::find(id.begin(), id.end(), '.');
@@ -70,6 +70,10 @@ public:
 	static variant mergePrototype(variant node, std::vector<std::string>* proto_paths=nullptr);
 	static const std::string* getObjectPath(const std::string& id);
 	static ConstCustomObjectTypePtr get(const std::string& id);
+
+	//Starts reading the files of any of these object types which aren't
+	//loaded yet in the background, so that a later get() doesn't wait on disk.
+	static void prefetchFiles(const std::vector<std::string>& ids);
 	static ConstCustomObjectTypePtr getOrDie(const std::string& id);
 	static CustomObjectTypePtr create(const std::string& id);
 	static void invalidateObject(const std::string& id);
@@ -0,0 +1,570 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <memory>
+
+#include <boost/filesystem.hpp>
+
+#include "Surface.hpp"
+
+#include "asserts.hpp"
+#include "background_task_pool.hpp"
+#include "decoded_image_cache.hpp"
+#include "filesystem.hpp"
+#include "logger.hpp"
+#include "mapped_file.hpp"
+#include "module.hpp"
+#include "preferences.hpp"
+#include "profile_timer.hpp"
+#include "reference_counted_object.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+#include "xxhash.hpp"
+
+PREF_BOOL(decoded_image_cache, true, "Keep decoded images on disk so that they load without being decompressed again.");
+PREF_INT(decoded_image_cache_mb, 512, "Disk budget for decoded images in megabytes. The least recently used images are removed when it is exceeded. 0 means unlimited.");
+
+namespace decoded_image_cache
+{
+	namespace
+	{
+		const char Magic[4] = { 'F', 'F', 'D', 'I' };
+		const uint32_t Version = 1;
+
+		//magic, version, width, height, bpp, row pitch, four masks, four
+		//alpha borders, pixel bytes and alpha map bytes. 64 bytes keeps the
+		//pixels that follow aligned.
+		const size_t HeaderSize = 64;
+		const int NumHeaderFields = 15;
+
+		uint64_t g_salt = 0;
+
+		std::atomic<int> g_hits(0), g_misses(0), g_writes(0), g_hashed(0);
+
+		threading::mutex g_pending_mutex;
+		threading::condition g_pending_cond;
+		int g_pending_writes = 0;
+
+		//Total size of the files in the cache directory. Worked out when the
+		//cache is first written to; -1 until then.
+		threading::mutex g_size_mutex;
+		int64_t g_cache_bytes = -1;
+
+		//The key worked out for the last image this thread failed to find,
+		//so the saver, which is called for the same image straight after,
+		//doesn't need to hash the file again.
+		struct LastMiss
+		{
+			std::string fname, key;
+		};
+
+		THREAD_LOCAL LastMiss* g_last_miss;
+
+		LastMiss& last_miss()
+		{
+			if(g_last_miss == nullptr) {
+				g_last_miss = new LastMiss;
+			}
+
+			return *g_last_miss;
+		}
+
+		std::string cache_fname(const std::string& key)
+		{
+			return cache_dir() + key + ".img";
+		}
+
+		std::string ref_fname(const std::string& ref)
+		{
+			return cache_dir() + ref + ".ref";
+		}
+
+		void hash_params(xxhash::hasher* h, KRE::PixelFormat::PF fmt, KRE::SurfaceFlags flags)
+		{
+			const int relevant_flags = static_cast<int>(flags) & static_cast<int>(KRE::SurfaceFlags::NO_ALPHA_FILTER | KRE::SurfaceFlags::STRIP_ALPHA_BORDERS);
+			const int32_t params[] = {
+				static_cast<int32_t>(Version),
+				static_cast<int32_t>(fmt),
+				relevant_flags,
+				KRE::Surface::getAlphaFilter() ? 1 : 0,
+				KRE::Surface::getAlphaStripThreshold(),
+			};
+
+			h->update(params, sizeof(params));
+		}
+
+		bool read_ref(const std::string& ref, std::string* key)
+		{
+			std::ifstream in(ref_fname(ref).c_str(), std::ios_base::binary);
+			std::string contents;
+			if(!in || !std::getline(in, contents) || contents.size() != 16) {
+				return false;
+			}
+
+			if(std::find_if(contents.begin(), contents.end(), [](char c) { return !isxdigit(static_cast<unsigned char>(c)); }) != contents.end()) {
+				return false;
+			}
+
+			key->swap(contents);
+			return true;
+		}
+
+		//Works out the key of an image's cache file. The key is a hash of
+		//the source file's contents, so a file that is touched or copied
+		//without changing still finds its image. Hashing the contents means
+		//reading the whole file though, so the key is also kept in a small
+		//.ref file named after the file's path, size and modification time,
+		//and read back from there while none of those change. If the key
+		//had to be worked out from the contents, *new_ref is set to the
+		//name of the .ref file to record it in, and is cleared otherwise.
+		bool make_key(const std::string& fname, KRE::PixelFormat::PF fmt, KRE::SurfaceFlags flags, std::string* key, std::string* new_ref)
+		{
+			new_ref->clear();
+
+			const std::string path = KRE::Surface::getFileFilter(KRE::FileFilterType::LOAD)(fname);
+			const int64_t stat[] = { sys::file_size(path), sys::file_mod_time(path) };
+			if(stat[0] <= 0) {
+				return false;
+			}
+
+			xxhash::hasher ref_hash(g_salt);
+			ref_hash.update(path.data(), path.size());
+			ref_hash.update(stat, sizeof(stat));
+			hash_params(&ref_hash, fmt, flags);
+			const std::string ref = ref_hash.hexdigest();
+			if(read_ref(ref, key)) {
+				return true;
+			}
+
+			const std::string contents = sys::read_file(path);
+			if(contents.empty()) {
+				return false;
+			}
+
+			++g_hashed;
+			xxhash::hasher h(g_salt);
+			h.update(contents.data(), contents.size());
+			hash_params(&h, fmt, flags);
+			*key = h.hexdigest();
+			*new_ref = ref;
+			return true;
+		}
+
+		void queue_write(const std::string& fname, const std::string& contents, bool image);
+
+		struct Mapping
+		{
+			MappedFile file;
+		};
+
+		bool load(const std::string& fname, KRE::PixelFormat::PF fmt, KRE::SurfaceFlags flags, KRE::DecodedImage* img)
+		{
+			std::string key, new_ref;
+			if(!make_key(fname, fmt, flags, &key, &new_ref)) {
+				return false;
+			}
+
+			if(!new_ref.empty()) {
+				queue_write(ref_fname(new_ref), key + "\n", false);
+			}
+
+			auto mapping = std::make_shared<Mapping>();
+			if(!mapping->file.open(cache_fname(key))) {
+				++g_misses;
+				last_miss().fname = fname;
+				last_miss().key = key;
+				return false;
+			}
+
+			const char* data = mapping->file.data();
+			const size_t size = mapping->file.size();
+
+			uint32_t header[NumHeaderFields];
+			if(size < HeaderSize || memcmp(data, Magic, sizeof(Magic)) != 0) {
+				LOG_ERROR("Ignoring corrupt decoded image cache file for " << fname);
+				++g_misses;
+				last_miss().fname = fname;
+				last_miss().key = key;
+				return false;
+			}
+
+			memcpy(header, data + sizeof(Magic), sizeof(header));
+
+			const uint32_t width = header[1], height = header[2], row_pitch = header[4];
+			const uint32_t pixel_bytes = header[13], alpha_bytes = header[14];
+			if(header[0] != Version || static_cast<uint64_t>(row_pitch) * height != pixel_bytes || alpha_bytes != (static_cast<uint64_t>(width) * height + 7) / 8 || HeaderSize + pixel_bytes + alpha_bytes != size) {
+				LOG_ERROR("Ignoring corrupt decoded image cache file for " << fname);
+				++g_misses;
+				last_miss().fname = fname;
+				last_miss().key = key;
+				return false;
+			}
+
+			img->width = static_cast<int>(width);
+			img->height = static_cast<int>(height);
+			img->bpp = static_cast<int>(header[3]);
+			img->row_pitch = static_cast<int>(row_pitch);
+			img->rmask = header[5];
+			img->gmask = header[6];
+			img->bmask = header[7];
+			img->amask = header[8];
+			for(int n = 0; n != 4; ++n) {
+				img->alpha_borders[n] = static_cast<int32_t>(header[9 + n]);
+			}
+
+			img->pixels = data + HeaderSize;
+			img->alpha_map = reinterpret_cast<const unsigned char*>(data + HeaderSize + pixel_bytes);
+			img->owner = mapping;
+
+			//The modification time of a cache file is when it was last used,
+			//which is what the cache is pruned by.
+			boost::system::error_code ec;
+			boost::filesystem::last_write_time(boost::filesystem::path(cache_fname(key)), std::time(nullptr), ec);
+
+			++g_hits;
+			return true;
+		}
+
+		struct CacheFile
+		{
+			boost::filesystem::path path;
+			std::time_t last_used;
+			int64_t size;
+		};
+
+		//Returns the total size of the finished images in the cache, adding
+		//them to files if it's given, and adding the .ref files to refs.
+		int64_t scan_cache(std::vector<CacheFile>* files, std::vector<CacheFile>* refs=nullptr)
+		{
+			int64_t total = 0;
+			boost::system::error_code ec;
+			for(boost::filesystem::directory_iterator i(boost::filesystem::path(cache_dir()), ec), end; !ec && i != end; i.increment(ec)) {
+				CacheFile f;
+				f.path = i->path();
+				if(f.path.extension() == ".ref" && refs) {
+					boost::system::error_code file_ec;
+					f.size = 0;
+					f.last_used = boost::filesystem::last_write_time(f.path, file_ec);
+					if(!file_ec) {
+						refs->push_back(f);
+					}
+					continue;
+				}
+
+				if(f.path.extension() != ".img") {
+					continue;
+				}
+
+				boost::system::error_code file_ec;
+				f.size = static_cast<int64_t>(boost::filesystem::file_size(f.path, file_ec));
+				f.last_used = boost::filesystem::last_write_time(f.path, file_ec);
+				if(file_ec) {
+					continue;
+				}
+
+				total += f.size;
+				if(files) {
+					files->push_back(f);
+				}
+			}
+
+			return total;
+		}
+
+		//Removes the least recently used images until the cache is down to
+		//three quarters of the budget, so that it isn't pruned again on the
+		//very next write. Called with g_size_mutex held.
+		void prune_cache(int64_t budget)
+		{
+			std::vector<CacheFile> files, refs;
+			g_cache_bytes = scan_cache(&files, &refs);
+
+			std::sort(files.begin(), files.end(), [](const CacheFile& a, const CacheFile& b) { return a.last_used < b.last_used; });
+
+			int nremoved = 0;
+			for(const CacheFile& f : files) {
+				if(g_cache_bytes <= budget - budget/4) {
+					break;
+				}
+
+				//Images mapped by a running game may not be removable on
+				//some platforms; those are left for next time.
+				boost::system::error_code ec;
+				if(boost::filesystem::remove(f.path, ec) && !ec) {
+					g_cache_bytes -= f.size;
+					++nremoved;
+				}
+			}
+
+			//.ref files are only touched when written, so any older than the
+			//least recently used image left go too. An image whose .ref is
+			//removed has its source file hashed once more the next time.
+			std::time_t oldest = std::time(nullptr);
+			for(const CacheFile& f : files) {
+				if(boost::filesystem::exists(f.path)) {
+					oldest = f.last_used;
+					break;
+				}
+			}
+
+			for(const CacheFile& f : refs) {
+				if(f.last_used < oldest) {
+					boost::system::error_code ec;
+					boost::filesystem::remove(f.path, ec);
+				}
+			}
+
+			LOG_INFO("Pruned " << nremoved << " images from the decoded image cache, leaving " << (g_cache_bytes/(1024*1024)) << "MB");
+		}
+
+		void note_written(size_t nbytes)
+		{
+			threading::lock l(g_size_mutex);
+			if(g_cache_bytes < 0) {
+				g_cache_bytes = scan_cache(nullptr);
+			} else {
+				g_cache_bytes += nbytes;
+			}
+
+			const int64_t budget = static_cast<int64_t>(g_decoded_image_cache_mb) * 1024 * 1024;
+			if(budget > 0 && g_cache_bytes > budget) {
+				prune_cache(budget);
+			}
+		}
+
+		bool write_file(const std::string& fname, const std::string& contents)
+		{
+			sys::get_dir(cache_dir());
+
+			//Written under a temporary name and renamed into place, so that
+			//another instance of the game never reads a half-written file.
+			const std::string tmp_fname = fname + ".tmp";
+			{
+				std::ofstream out(tmp_fname.c_str(), std::ios_base::binary | std::ios_base::trunc);
+				out.write(contents.data(), contents.size());
+				if(!out) {
+					LOG_ERROR("Could not write decoded image cache file " << tmp_fname);
+					return false;
+				}
+			}
+
+			try {
+				sys::move_file(tmp_fname, fname);
+				return true;
+			} catch(...) {
+				LOG_ERROR("Could not write decoded image cache file " << fname);
+				sys::remove_file(tmp_fname);
+				return false;
+			}
+		}
+
+		//Writing files can wait; the image is needed now.
+		void queue_write(const std::string& fname, const std::string& contents, bool image)
+		{
+			{
+				threading::lock l(g_pending_mutex);
+				++g_pending_writes;
+			}
+
+			background_task_pool::submit([fname, contents, image]() {
+				if(write_file(fname, contents) && image) {
+					++g_writes;
+					note_written(contents.size());
+				}
+
+				threading::lock l(g_pending_mutex);
+				--g_pending_writes;
+				g_pending_cond.notify_all();
+			}, std::function<void()>(), background_task_pool::PRIORITY::LOW);
+		}
+
+		void save(const std::string& fname, KRE::PixelFormat::PF fmt, KRE::SurfaceFlags flags, KRE::SurfacePtr surf)
+		{
+			std::string key;
+			LastMiss& miss = last_miss();
+			if(miss.fname == fname) {
+				key.swap(miss.key);
+				miss.fname.clear();
+			} else {
+				std::string new_ref;
+				if(!make_key(fname, fmt, flags, &key, &new_ref)) {
+					return;
+				}
+
+				if(!new_ref.empty()) {
+					queue_write(ref_fname(new_ref), key + "\n", false);
+				}
+			}
+
+			//Only plain 32-bit images are cached. They're the great majority,
+			//and can be restored with a copy.
+			auto pf = surf->getPixelFormat();
+			if(surf->bytesPerPixel() != 4 || pf->hasPalette()) {
+				return;
+			}
+
+			auto am = surf->getAlphaMap();
+			const uint32_t width = surf->width(), height = surf->height();
+			const uint32_t row_bytes = width * 4;
+			const uint32_t pixel_bytes = row_bytes * height;
+			const uint32_t alpha_bytes = (width * height + 7) / 8;
+			if(!am || am->size() != width * height) {
+				return;
+			}
+
+			const auto& borders = surf->getAlphaBorders();
+			const uint32_t header[NumHeaderFields] = {
+				Version, width, height, static_cast<uint32_t>(surf->bitsPerPixel()), row_bytes,
+				pf->getRedMask(), pf->getGreenMask(), pf->getBlueMask(), pf->getAlphaMask(),
+				static_cast<uint32_t>(borders[0]), static_cast<uint32_t>(borders[1]), static_cast<uint32_t>(borders[2]), static_cast<uint32_t>(borders[3]),
+				pixel_bytes, alpha_bytes,
+			};
+
+			std::string contents(HeaderSize + pixel_bytes + alpha_bytes, '\0');
+			memcpy(&contents[0], Magic, sizeof(Magic));
+			memcpy(&contents[sizeof(Magic)], header, sizeof(header));
+
+			{
+				KRE::SurfaceLock lck(surf);
+				const char* src = static_cast<const char*>(surf->pixels());
+				for(uint32_t y = 0; y != height; ++y) {
+					memcpy(&contents[HeaderSize + y * row_bytes], src + y * surf->rowPitch(), row_bytes);
+				}
+			}
+
+			unsigned char* bits = reinterpret_cast<unsigned char*>(&contents[HeaderSize + pixel_bytes]);
+			const std::vector<bool>& alpha = *am;
+			for(uint32_t n = 0; n != width * height; ++n) {
+				if(alpha[n]) {
+					bits[n >> 3] |= 1 << (n & 7);
+				}
+			}
+
+			queue_write(cache_fname(key), contents, true);
+		}
+	}
+
+	void install(const std::string& salt)
+	{
+		if(!g_decoded_image_cache) {
+			return;
+		}
+
+		g_salt = xxhash::hash64(salt.data(), salt.size());
+		set_enabled(true);
+	}
+
+	void set_enabled(bool enabled)
+	{
+		if(enabled) {
+			KRE::Surface::setDecodedImageCache(load, save);
+		} else {
+			KRE::Surface::setDecodedImageCache(nullptr, nullptr);
+		}
+	}
+
+	void clear()
+	{
+		flush();
+
+		std::vector<std::string> files;
+		sys::get_files_in_dir(cache_dir(), &files);
+		for(const std::string& f : files) {
+			sys::remove_file(cache_dir() + f);
+		}
+
+		threading::lock l(g_size_mutex);
+		g_cache_bytes = 0;
+	}
+
+	std::string cache_dir()
+	{
+		return std::string(preferences::user_data_path()) + "/decoded_images/";
+	}
+
+	stats get_stats()
+	{
+		stats result;
+		result.hits = g_hits;
+		result.misses = g_misses;
+		result.writes = g_writes;
+		result.hashed = g_hashed;
+
+		threading::lock l(g_pending_mutex);
+		result.pending_writes = g_pending_writes;
+		return result;
+	}
+
+	void flush()
+	{
+		threading::lock l(g_pending_mutex);
+		while(g_pending_writes > 0) {
+			g_pending_cond.wait(g_pending_mutex);
+		}
+	}
+}
+
+UTILITY(benchmark_image_loading)
+{
+	std::map<std::string, std::string> files;
+	module::get_unique_filenames_under_dir("images/", &files, module::MODULE_NO_PREFIX);
+
+	std::vector<std::string> images;
+	for(const auto& f : files) {
+		if(f.first.size() > 4 && std::equal(f.first.end() - 4, f.first.end(), ".png")) {
+			images.push_back(f.first);
+		}
+	}
+
+	auto load_all = [&images](const char* description) {
+		const int hashed = decoded_image_cache::get_stats().hashed;
+		profile::timer timer;
+		for(const std::string& img : images) {
+			KRE::Surface::create(img, KRE::SurfaceFlags::NO_CACHE);
+		}
+		const double ms = timer.get_time() / 1000.0;
+		LOG_INFO(description << ": loaded " << images.size() << " images in " << ms << "ms, hashing " << (decoded_image_cache::get_stats().hashed - hashed) << " source files");
+		return ms;
+	};
+
+	decoded_image_cache::set_enabled(false);
+	load_all("No cache");
+
+	decoded_image_cache::set_enabled(true);
+	decoded_image_cache::clear();
+	load_all("Cold cache");
+	decoded_image_cache::flush();
+
+	load_all("Warm cache");
+
+	const auto s = decoded_image_cache::get_stats();
+	LOG_INFO("Cache hits: " << s.hits << " misses: " << s.misses << " files written: " << s.writes << " source files hashed: " << s.hashed);
+}
@@ -0,0 +1,67 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <string>
+
+// An on-disk cache of images as they are after loading: decoded, put
+// through the alpha filter and with their alpha map and borders worked out.
+// Each image is stored in a file named after a hash of its source file, laid
+// out so that it can be mapped into memory and copied straight into a
+// surface, which is much quicker than decompressing the PNG again. The hash
+// is remembered by the source file's path, size and modification time, so
+// the source is only read again when one of those changes.
+// The directory is kept within the decoded_image_cache_mb preference by
+// removing the least recently used images whenever it grows past it.
+namespace decoded_image_cache
+{
+	// Hooks the cache into surface loading. salt is mixed into the key of
+	// every image, and should change whenever anything that affects how
+	// images are processed does, e.g. the colors used by the alpha filter.
+	void install(const std::string& salt);
+
+	// Turns the cache off, or back on after install().
+	void set_enabled(bool enabled);
+
+	// Deletes every cached image.
+	void clear();
+
+	std::string cache_dir();
+
+	struct stats
+	{
+		stats() : hits(0), misses(0), writes(0), pending_writes(0), hashed(0)
+		{}
+		int hits, misses, writes, pending_writes;
+
+		// Source files read whole to work out their key, because their
+		// path, size or modification time hadn't been seen before.
+		int hashed;
+	};
+
+	stats get_stats();
+
+	// Blocks until images queued to be written to the cache are written.
+	void flush();
+}
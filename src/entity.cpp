@@ -29,6 +29,7 @@
 #include "custom_object.hpp"
 #include "debug_console.hpp"
 #include "entity.hpp"
+#include "entity_grid.hpp"
 #include "level.hpp"
 #include "playable_custom_object.hpp"
 #include "preferences.hpp"
@@ -55,7 +56,8 @@ Entity::Entity(variant node)
 	platform_motion_x_(node["platform_motion_x"].as_int()),
 	mouse_over_entity_(false), being_dragged_(false), mouse_button_state_(0),
 	mouseover_delay_(0), mouseover_trigger_cycle_(std::numeric_limits<int>::max()),
-	true_z_(false), tx_(node["x"].as_decimal().as_float()), ty_(node["y"].as_decimal().as_float()), tz_(0.0f)
+	true_z_(false), tx_(node["x"].as_decimal().as_float()), ty_(node["y"].as_decimal().as_float()), tz_(0.0f),
+	state_generation_(0)
 {
 	if(node.has_key("anchorx")) {
 		setAnchorX(node["anchorx"].as_decimal());
@@ -79,13 +81,23 @@ Entity::Entity(int x, int y, bool face_right)
 	weak_solid_dimensions_(0), weak_collide_dimensions_(0),	platform_motion_x_(0),
 	mouse_over_entity_(false), being_dragged_(false), mouse_button_state_(0),
 	mouseover_delay_(0), mouseover_trigger_cycle_(std::numeric_limits<int>::max()),
-	true_z_(false), tx_(double(x)), ty_(double(y)), tz_(0.0f)
+	true_z_(false), tx_(double(x)), ty_(double(y)), tz_(0.0f),
+	state_generation_(0)
 {
 	for(bool& b : controls_) {
 		b = false;
 	}
 }
 
+Entity::~Entity()
+{
+	for(EntityGridLink& link : grid_links_) {
+		if(link.grid) {
+			link.grid->erase(this);
+		}
+	}
+}
+
 void Entity::setAnchorX(decimal value)
 {
 	if(value < 0) {
@@ -184,6 +196,7 @@ int Entity::getLastMoveY() const
 void Entity::setPlatformMotionX(int value)
 {
 	platform_motion_x_ = value;
+	stateChanged();
 }
 
 int Entity::mapPlatformPos(int xpos) const
@@ -211,6 +224,8 @@ int Entity::getPlatformMotionX() const
 
 void Entity::process(Level& lvl)
 {
+	stateChanged();
+
 	if(prev_feet_x_ != std::numeric_limits<int>::min()) {
 		last_move_x_ = getFeetX() - prev_feet_x_;
 		last_move_y_ = getFeetY() - prev_feet_y_;
@@ -227,6 +242,7 @@ void Entity::setFacingRight(bool facing)
 	}
 	const int start_x = getFeetX();
 	face_right_ = facing;
+	stateChanged();
 	const int delta_x = getFeetX() - start_x;
 	x_ -= delta_x*100;
 	assert(getFeetX() == start_x);
@@ -250,6 +266,7 @@ void Entity::setUpsideDown(bool facing)
 void Entity::setRotateZ(float new_rotate_z)
 {
 	rotate_z_ = variant(new_rotate_z).as_decimal();
+	stateChanged();
 }
 
 void Entity::setDrawScale(float new_scale)
@@ -259,6 +276,8 @@ void Entity::setDrawScale(float new_scale)
 
 void Entity::calculateSolidRect()
 {
+	stateChanged();
+
 	const Frame& f = getCurrentFrame();
 
 	frame_rect_ = rect(x(), y(), f.width(), f.height());
@@ -303,6 +322,30 @@ void Entity::calculateSolidRect()
 	} else {
 		platform_rect_ = rect();
 	}
+
+	activationBoundsChanged();
+}
+
+void Entity::activationBoundsChanged()
+{
+	for(EntityGridLink& link : grid_links_) {
+		if(link.grid && !link.dirty) {
+			link.grid->markMoved(this);
+		}
+	}
+}
+
+bool Entity::getCollisionBounds(rect* bounds) const
+{
+	if(!platform_) {
+		*bounds = solid_rect_;
+	} else if(!solid_) {
+		*bounds = platform_rect_;
+	} else {
+		*bounds = geometry::rect_union(solid_rect_, platform_rect_);
+	}
+
+	return true;
 }
 
 rect Entity::getBodyRect() const
@@ -34,6 +34,7 @@
 #include "current_generator.hpp"
 #include "editor_variable_info.hpp"
 #include "entity_fwd.hpp"
+#include "entity_grid.hpp"
 #include "formula_callable.hpp"
 #include "formula_callable_definition_fwd.hpp"
 #include "formula_fwd.hpp"
@@ -48,6 +49,7 @@ class Frame;
 class Level;
 class pc_character;
 class PlayerInfo;
+class SpriteBatch;
 
 typedef ffl::IntrusivePtr<character> CharacterPtr;
 
@@ -57,7 +59,7 @@ public:
 	static EntityPtr build(variant node);
 	explicit Entity(variant node);
 	Entity(int x, int y, bool face_right);
-	virtual ~Entity() {}
+	virtual ~Entity();
 
 	virtual void validate_properties() {}
 	virtual void addToLevel();
@@ -68,6 +70,11 @@ public:
 	virtual void draw(int x, int y) const = 0;
 	virtual void drawLater(int x, int y) const = 0;
 	virtual void drawGroup() const = 0;
+
+	//Draws the entity by adding it to a sprite batch, moved by (dx, dy).
+	//Returns false without adding anything if drawing the entity takes more
+	//than a plain sprite, in which case it must be drawn with draw().
+	virtual bool drawBatched(SpriteBatch& batch, int dx, int dy) const { return false; }
 	PlayerInfo* getPlayerInfo() { return isHuman(); }
 	const PlayerInfo* getPlayerInfo() const { return isHuman(); }
 	virtual const PlayerInfo* isHuman() const { return nullptr; }
@@ -76,7 +83,7 @@ public:
 	virtual bool executeCommand(const variant& var) override = 0;
 
 	const std::string& label() const { return label_; }
-	void setLabel(const std::string& lb) { label_ = lb; }
+	void setLabel(const std::string& lb) { label_ = lb; stateChanged(); }
 	void setDistinctLabel();
 
 	virtual void shiftPosition(int x, int y) { x_ += x*100; y_ += y*100; prev_feet_x_ += x; prev_feet_y_ += y; calculateSolidRect(); }
@@ -98,8 +105,8 @@ public:
 	int zorder() const { return zorder_; }
 	int zSubOrder() const { return zsub_order_; }
 
-	void setZOrder(int z) { zorder_ = z; }
-	void setZSubOrder(int z) { zsub_order_ = z; }
+	void setZOrder(int z) { zorder_ = z; stateChanged(); }
+	void setZSubOrder(int z) { zsub_order_ = z; stateChanged(); }
 
 	public:
 
@@ -112,7 +119,7 @@ public:
 	virtual int velocityY() const { return 0; }
 
 	int group() const { return group_; }
-	void setGroup(int group) { group_ = group; }
+	void setGroup(int group) { group_ = group; stateChanged(); }
 
 	virtual bool isStandable(int x, int y, int* friction=nullptr, int* traction=nullptr, int* adjust_y=nullptr) const { return false; }
 
@@ -161,7 +168,7 @@ public:
 
 	decimal rotate_z_;
 	decimal getRotateZ() const { return rotate_z_; }
-	void setRotateZ(decimal new_rotate_z) { rotate_z_ = new_rotate_z; }
+	void setRotateZ(decimal new_rotate_z) { rotate_z_ = new_rotate_z; stateChanged(); }
 	void setRotateZ(float new_rotate_z);
 
 	virtual decimal getDrawScale() const { return decimal(1.0); };
@@ -182,6 +189,16 @@ public:
 
 	virtual void dieWithNoEvent() = 0;
 	virtual bool isActive(const rect& screen_area) const = 0;
+
+	//Gets an area outside of which the entity is never active or drawn,
+	//whatever the screen area. Returns false if there is no such area,
+	//for instance because the entity is always active.
+	virtual bool getActivationBounds(rect* bounds) const { return false; }
+
+	//Gets the area in which other objects can collide with or stand on
+	//the entity: its solid and platform rects. Returns false if the area
+	//can't be known ahead of time.
+	virtual bool getCollisionBounds(rect* bounds) const;
 	virtual bool diesOnInactive() const { return false; }
 	virtual bool isAlwaysActive() const { return false; }
 
@@ -194,7 +211,7 @@ public:
 	//object is focused.
 	virtual int verticalLook() const { return 0; }
 
-	void setId(int id) { id_ = id; }
+	void setId(int id) { id_ = id; stateChanged(); }
 	int getId() const { return id_; }
 
 	bool respawn() const { return respawn_; }
@@ -220,6 +237,14 @@ public:
 	virtual EntityPtr clone() const { return EntityPtr(); }
 	virtual EntityPtr backup() const = 0;
 
+	//Changes whenever the entity is processed, moved, handles an event or
+	//has a value set, so that Level::backup() can keep using the copy it
+	//made in an earlier snapshot while this stays the same. Anything that
+	//changes state backup() copies must call stateChanged(), or reversing
+	//the level may bring back a stale copy.
+	virtual unsigned int stateGeneration() const { return state_generation_; }
+	void stateChanged() { ++state_generation_; }
+
 	virtual void generateCurrent(const Entity& target, int* velocity_x, int* velocity_y) const;
 
 	virtual game_logic::ConstFormulaPtr getEventHandler(int key) const { return game_logic::ConstFormulaPtr(); }
@@ -345,13 +370,18 @@ protected:
 	virtual ConstSolidInfoPtr calculatePlatform() const = 0;
 	void calculateSolidRect();
 
+	//Tells the level's EntityGrids that getActivationBounds() or
+	//getCollisionBounds() may give a different result. Moving the entity
+	//does this already.
+	void activationBoundsChanged();
+
 	bool controlStatus(controls::CONTROL_ITEM ctrl) const { return controls_[ctrl]; }
 	variant controlStatusUser() const { return controls_user_; }
 	void readControls(int cycle);
 
 	void setCurrentGenerator(CurrentGenerator* generator);
 
-	void setRespawn(bool value) { respawn_ = value; }
+	void setRespawn(bool value) { respawn_ = value; stateChanged(); }
 
 	//move the entity by a number of centi pixels. Returns true if its
 	//position is changed.
@@ -375,6 +405,11 @@ protected:
 	void surrenderReferences(GarbageCollector* collector) override;
 
 private:
+	friend class EntityGrid;
+
+	//Where the entity is filed in a level's EntityGrids, one for each kind
+	//of bounds.
+	EntityGridLink grid_links_[EntityGrid::NUM_BOUNDS];
 
 	std::string label_;
 
@@ -441,6 +476,8 @@ private:
 
 	bool true_z_;
 	double tx_, ty_, tz_;
+
+	unsigned int state_generation_;
 };
 
 bool zorder_compare(const EntityPtr& e1, const EntityPtr& e2);
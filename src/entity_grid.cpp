@@ -0,0 +1,293 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <algorithm>
+
+#include "asserts.hpp"
+#include "entity.hpp"
+#include "entity_grid.hpp"
+
+namespace
+{
+	//Entities that cover more cells than this are cheaper to keep on the
+	//unbounded list than to file in every cell they touch.
+	const int MaxCellsPerEntity = 64;
+
+	uint64_t cell_key(int x, int y)
+	{
+		return (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) | static_cast<uint32_t>(y);
+	}
+
+	bool bounds_touch(const rect& a, const rect& b)
+	{
+		return a.x() <= b.x2() && a.x2() >= b.x() && a.y() <= b.y2() && a.y2() >= b.y();
+	}
+}
+
+EntityGrid::EntityGrid(BOUNDS bounds, int cell_size)
+  : bounds_(bounds), cell_size_(cell_size), next_seq_(0), stamp_(0), generation_(0), size_(0), ignored_mover_(nullptr)
+{
+	ASSERT_LOG(cell_size_ > 0, "Bad entity grid cell size: " << cell_size_);
+}
+
+EntityGrid::EntityGrid(const EntityGrid& o)
+  : bounds_(o.bounds_), cell_size_(o.cell_size_), next_seq_(0), stamp_(0), generation_(0), size_(0), ignored_mover_(nullptr)
+{
+}
+
+EntityGrid::~EntityGrid()
+{
+	clear();
+}
+
+void EntityGrid::insert(Entity* e)
+{
+	EntityGridLink& link = linkOf(e);
+	if(link.grid == this) {
+		return;
+	}
+
+	if(link.grid != nullptr) {
+		link.grid->erase(e);
+	}
+
+	link.grid = this;
+	link.dirty = false;
+	link.seq = next_seq_++;
+	link.stamp = 0;
+	++size_;
+	++generation_;
+	place(e);
+}
+
+void EntityGrid::erase(Entity* e)
+{
+	EntityGridLink& link = linkOf(e);
+	if(link.grid != this) {
+		return;
+	}
+
+	if(link.dirty) {
+		Entity* last = dirty_.back();
+		dirty_[link.dirty_index] = last;
+		linkOf(last).dirty_index = link.dirty_index;
+		dirty_.pop_back();
+	}
+
+	unplace(e);
+	link.grid = nullptr;
+	link.dirty = false;
+	--size_;
+	++generation_;
+}
+
+void EntityGrid::rebuild(const std::vector<EntityPtr>& chars)
+{
+	clear();
+	for(const EntityPtr& e : chars) {
+		insert(e.get());
+	}
+}
+
+void EntityGrid::clear()
+{
+	for(auto& cell : cells_) {
+		for(Entity* e : cell.second) {
+			linkOf(e).grid = nullptr;
+			linkOf(e).dirty = false;
+		}
+	}
+
+	for(Entity* e : unbounded_) {
+		linkOf(e).grid = nullptr;
+		linkOf(e).dirty = false;
+	}
+
+	for(Entity* e : hidden_) {
+		linkOf(e).grid = nullptr;
+		linkOf(e).dirty = false;
+	}
+
+	cells_.clear();
+	unbounded_.clear();
+	hidden_.clear();
+	dirty_.clear();
+	next_seq_ = 0;
+	size_ = 0;
+	++generation_;
+}
+
+void EntityGrid::markMoved(Entity* e)
+{
+	EntityGridLink& link = linkOf(e);
+	ASSERT_LOG(link.grid == this, "Entity moved in a grid it isn't in");
+	link.dirty = true;
+	link.dirty_index = dirty_.size();
+	dirty_.push_back(e);
+
+	if(e != ignored_mover_) {
+		++generation_;
+	}
+}
+
+void EntityGrid::query(const rect& area, std::vector<EntityPtr>* result)
+{
+	update();
+
+	++stamp_;
+	const size_t first = result->size();
+
+	const int x1 = cellOf(area.x()), y1 = cellOf(area.y());
+	const int x2 = cellOf(area.x2()), y2 = cellOf(area.y2());
+
+	auto visit = [this, &area, result](const Cell& cell) {
+		for(Entity* e : cell) {
+			EntityGridLink& link = linkOf(e);
+			if(link.stamp != stamp_) {
+				link.stamp = stamp_;
+				if(bounds_touch(link.bounds, area)) {
+					result->emplace_back(e);
+				}
+			}
+		}
+	};
+
+	//Very large areas, such as a selection covering the whole level, are
+	//quicker to answer by walking the cells that exist.
+	if(static_cast<int64_t>(x2 - x1 + 1) * (y2 - y1 + 1) > static_cast<int64_t>(cells_.size())) {
+		for(const auto& cell : cells_) {
+			visit(cell.second);
+		}
+	} else {
+		for(int y = y1; y <= y2; ++y) {
+			for(int x = x1; x <= x2; ++x) {
+				auto itor = cells_.find(cell_key(x, y));
+				if(itor != cells_.end()) {
+					visit(itor->second);
+				}
+			}
+		}
+	}
+
+	for(Entity* e : unbounded_) {
+		result->emplace_back(e);
+	}
+
+	std::sort(result->begin() + first, result->end(), [this](const EntityPtr& a, const EntityPtr& b) {
+		return linkOf(a.get()).seq < linkOf(b.get()).seq;
+	});
+}
+
+void EntityGrid::place(Entity* e)
+{
+	EntityGridLink& link = linkOf(e);
+
+	link.hidden = bounds_ == COLLISION_BOUNDS && !e->solid() && !e->platform();
+	if(link.hidden) {
+		link.index = hidden_.size();
+		hidden_.push_back(e);
+		return;
+	}
+
+	rect bounds;
+	link.bounded = getBounds(e, &bounds);
+	if(link.bounded) {
+		link.x1 = cellOf(bounds.x());
+		link.y1 = cellOf(bounds.y());
+		link.x2 = cellOf(bounds.x2());
+		link.y2 = cellOf(bounds.y2());
+		link.bounded = static_cast<int64_t>(link.x2 - link.x1 + 1) * (link.y2 - link.y1 + 1) <= MaxCellsPerEntity;
+	}
+
+	if(!link.bounded) {
+		link.index = unbounded_.size();
+		unbounded_.push_back(e);
+		return;
+	}
+
+	link.bounds = bounds;
+	for(int y = link.y1; y <= link.y2; ++y) {
+		for(int x = link.x1; x <= link.x2; ++x) {
+			cells_[cell_key(x, y)].push_back(e);
+		}
+	}
+}
+
+void EntityGrid::unplace(Entity* e)
+{
+	EntityGridLink& link = linkOf(e);
+
+	if(link.hidden || !link.bounded) {
+		std::vector<Entity*>& list = link.hidden ? hidden_ : unbounded_;
+		Entity* last = list.back();
+		list[link.index] = last;
+		linkOf(last).index = link.index;
+		list.pop_back();
+		return;
+	}
+
+	for(int y = link.y1; y <= link.y2; ++y) {
+		for(int x = link.x1; x <= link.x2; ++x) {
+			auto itor = cells_.find(cell_key(x, y));
+			ASSERT_LOG(itor != cells_.end(), "Entity missing from its grid cell");
+			Cell& cell = itor->second;
+			auto pos = std::find(cell.begin(), cell.end(), e);
+			ASSERT_LOG(pos != cell.end(), "Entity missing from its grid cell");
+			*pos = cell.back();
+			cell.pop_back();
+			if(cell.empty()) {
+				cells_.erase(itor);
+			}
+		}
+	}
+}
+
+void EntityGrid::update()
+{
+	for(Entity* e : dirty_) {
+		linkOf(e).dirty = false;
+		unplace(e);
+		place(e);
+	}
+
+	dirty_.clear();
+}
+
+int EntityGrid::cellOf(int pos) const
+{
+	return pos >= 0 ? pos/cell_size_ : -((-pos - 1)/cell_size_) - 1;
+}
+
+bool EntityGrid::getBounds(const Entity* e, rect* bounds) const
+{
+	if(bounds_ == COLLISION_BOUNDS) {
+		return e->getCollisionBounds(bounds);
+	}
+
+	return !e->diesOnInactive() && e->getActivationBounds(bounds);
+}
+
+EntityGridLink& EntityGrid::linkOf(Entity* e) const
+{
+	return e->grid_links_[bounds_];
+}
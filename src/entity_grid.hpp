@@ -0,0 +1,132 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "entity_fwd.hpp"
+#include "geometry.hpp"
+
+class Entity;
+class EntityGrid;
+
+// Where an entity is filed in an EntityGrid. A copy of an entity starts
+// out in no grid.
+struct EntityGridLink
+{
+	EntityGridLink() : grid(nullptr), dirty(false), bounded(false), hidden(false), index(0), dirty_index(0), seq(0), stamp(0), x1(0), y1(0), x2(0), y2(0)
+	{}
+	EntityGridLink(const EntityGridLink&) : EntityGridLink()
+	{}
+	EntityGridLink& operator=(const EntityGridLink&) { return *this; }
+
+	EntityGrid* grid;
+	bool dirty, bounded, hidden;
+	rect bounds;
+	size_t index, dirty_index;
+	unsigned seq, stamp;
+	int x1, y1, x2, y2;
+};
+
+// A uniform grid over the bounds of a level's entities, used to find the
+// entities near an area without looking at every entity. A grid either
+// files entities by their activation bounds, or by their collision bounds
+// to find the solid objects and platforms near a moving object.
+//
+// Entities tell the grid when they move, and are re-filed the next time
+// the grid is queried. Entities with no bounds -- for activation, those
+// which are always active, die when inactive, have parallax and so forth
+// -- are kept on a separate list and returned by every query. A grid of
+// collision bounds never returns entities which are neither solid nor a
+// platform.
+//
+// The grid doesn't own its entities. The level must erase an entity from
+// the grid when removing it; entities also erase themselves when destroyed.
+class EntityGrid
+{
+public:
+	enum { DefaultCellSize = 512 };
+
+	enum BOUNDS { ACTIVATION_BOUNDS, COLLISION_BOUNDS, NUM_BOUNDS };
+
+	explicit EntityGrid(BOUNDS bounds=ACTIVATION_BOUNDS, int cell_size=DefaultCellSize);
+
+	//An entity can only be filed in one grid, so copies start out empty.
+	EntityGrid(const EntityGrid& o);
+	~EntityGrid();
+
+	void insert(Entity* e);
+	void erase(Entity* e);
+
+	// Replaces the contents of the grid. Queries give entities in the
+	// order they are in here, and after that in the order inserted.
+	void rebuild(const std::vector<EntityPtr>& chars);
+	void clear();
+
+	void markMoved(Entity* e);
+
+	// Appends to result every entity whose bounds intersect area, and
+	// every entity without bounds, in insertion order.
+	void query(const rect& area, std::vector<EntityPtr>* result);
+
+	// Changes whenever the result of a query might change, so that callers
+	// can keep query results while it stays the same. Moves of the entity
+	// given to setIgnoredMover() are not counted; that entity's own query
+	// results may be kept while it moves around.
+	unsigned generation() const { return generation_; }
+	void setIgnoredMover(const Entity* e) { ignored_mover_ = e; }
+
+	size_t size() const { return size_; }
+	size_t numUnbounded() const { return unbounded_.size(); }
+	size_t numCells() const { return cells_.size(); }
+
+private:
+	void operator=(const EntityGrid&);
+
+	void place(Entity* e);
+	void unplace(Entity* e);
+	void update();
+
+	int cellOf(int pos) const;
+
+	bool getBounds(const Entity* e, rect* bounds) const;
+	EntityGridLink& linkOf(Entity* e) const;
+
+	typedef std::vector<Entity*> Cell;
+	std::unordered_map<uint64_t, Cell> cells_;
+	std::vector<Entity*> unbounded_;
+
+	//Entities which are neither solid nor a platform, in a grid of
+	//collision bounds. No query finds them.
+	std::vector<Entity*> hidden_;
+	std::vector<Entity*> dirty_;
+
+	BOUNDS bounds_;
+	int cell_size_;
+	unsigned next_seq_, stamp_, generation_;
+	size_t size_;
+	const Entity* ignored_mover_;
+};
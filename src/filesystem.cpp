@@ -47,7 +47,10 @@
 #include <boost/filesystem.hpp>
 
 #include "asserts.hpp"
+#include "async_io.hpp"
 #include "filesystem.hpp"
+#include "json_parser.hpp"
+#include "module_pack.hpp"
 #include "preferences.hpp"
 #include "profile_timer.hpp"
 #include "thread.hpp"
@@ -75,7 +78,7 @@ namespace sys
 
 	bool is_directory(const std::string& dname)
 	{
-		return is_directory(path(dname));
+		return module_pack::dir_exists(dname) || is_directory(path(dname));
 	}
 
 
@@ -83,26 +86,33 @@ namespace sys
 		std::vector<std::string>* files,
 		std::vector<std::string>* dirs)
 	{
+		module_pack::get_files_in_dir(dir, files, dirs);
+
 		path p(dir);
-		if(!is_directory(p) && !is_other(p)) {
-			return;
-		}
-		for(directory_iterator it = directory_iterator(p); it != directory_iterator(); ++it) {
-			if(is_directory(it->path()) || is_other(it->path())) {
-				if(dirs != nullptr) {
-					dirs->push_back(it->path().filename().generic_string());
-				}
-			} else {
-				if(files != nullptr) {
-					files->push_back(it->path().filename().generic_string());
+		if(is_directory(p) || is_other(p)) {
+			for(directory_iterator it = directory_iterator(p); it != directory_iterator(); ++it) {
+				if(is_directory(it->path()) || is_other(it->path())) {
+					if(dirs != nullptr) {
+						dirs->push_back(it->path().filename().generic_string());
+					}
+				} else {
+					if(files != nullptr) {
+						files->push_back(it->path().filename().generic_string());
+					}
 				}
 			}
 		}
-		if(files != nullptr)
+
+		//A pack and the directory it's mounted over may both have the file.
+		if(files != nullptr) {
 			std::sort(files->begin(), files->end());
+			files->erase(std::unique(files->begin(), files->end()), files->end());
+		}
 
-		if (dirs != nullptr)
+		if (dirs != nullptr) {
 			std::sort(dirs->begin(), dirs->end());
+			dirs->erase(std::unique(dirs->begin(), dirs->end()), dirs->end());
+		}
 	}
 
 
@@ -111,6 +121,12 @@ namespace sys
 									const std::string& prefix)
 	{
 		ASSERT_LOG(file_map != nullptr, "get_unique_filenames_under_dir() passed a nullptr file_map");
+		std::vector<std::string> packed;
+		module_pack::get_files_under_dir(dir, &packed);
+		for(const std::string& fname : packed) {
+			(*file_map)[prefix + path(fname).filename().generic_string()] = fname;
+		}
+
 		path p(dir);
 		if(!is_directory(p)) {
 			return;
@@ -127,6 +143,12 @@ namespace sys
 									const std::string& prefix)
 	{
 		ASSERT_LOG(file_map != nullptr, "get_unique_filenames_under_dir() passed a nullptr file_map");
+		std::vector<std::string> packed;
+		module_pack::get_files_under_dir(dir, &packed);
+		for(const std::string& fname : packed) {
+			file_map->emplace(prefix + path(fname).filename().generic_string(), fname);
+		}
+
 		path p(dir);
 		if(!is_directory(p)) {
 			return;
@@ -150,6 +172,11 @@ namespace sys
 
 	std::string read_file(const std::string& fname)
 	{
+		std::string packed;
+		if(module_pack::read_file(fname, &packed)) {
+			return packed;
+		}
+
 		std::ifstream file(fname.c_str(), std::ios_base::binary);
 		std::stringstream ss;
 		ss << file.rdbuf();
@@ -166,18 +193,34 @@ namespace sys
 		create_directories(p.parent_path(), ec);
 
 		// Write the file.
-		std::ofstream file(fname.c_str(), std::ios_base::binary);
-		file << data;
+		{
+			std::ofstream file(fname.c_str(), std::ios_base::binary);
+			file << data;
+		}
+
+		//Modification times only have a resolution of a second, so don't
+		//rely on them to notice this write.
+		async_io::invalidate(fname);
+		json::file_written(fname);
+		module_pack::shadow_file(fname);
 	}
 
 	bool dir_exists(const std::string& fname)
 	{
+		if(module_pack::dir_exists(fname)) {
+			return true;
+		}
+
 		path p(fname);
 		return exists(p) && is_directory(p);
 	}
 
 	bool file_exists(const std::string& fname)
 	{
+		if(module_pack::file_exists(fname)) {
+			return true;
+		}
+
 		path p(fname);
 		return exists(p) && is_regular_file(p);
 	}
@@ -198,6 +241,10 @@ namespace sys
 
 	long long file_mod_time(const std::string& fname)
 	{
+		if(const long long packed = module_pack::file_mod_time(fname)) {
+			return packed;
+		}
+
 		path p(fname);
 		if(is_regular_file(p)) {
 			return static_cast<int64_t>(last_write_time(p));
@@ -206,6 +253,18 @@ namespace sys
 		}
 	}
 
+	long long file_size(const std::string& fname)
+	{
+		const long long packed = module_pack::file_size(fname);
+		if(packed >= 0) {
+			return packed;
+		}
+
+		boost::system::error_code ec;
+		const boost::uintmax_t size = boost::filesystem::file_size(path(fname), ec);
+		return ec ? -1 : static_cast<long long>(size);
+	}
+
 	void move_file(const std::string& from, const std::string& to)
 	{
 		return rename(path(from), path(to));
@@ -67,6 +67,9 @@ namespace sys
 
 	long long file_mod_time(const std::string& fname);
 
+	//returns -1 if the file doesn't exist.
+	long long file_size(const std::string& fname);
+
 	void move_file(const std::string& from, const std::string& to);
 	void remove_file(const std::string& fname);
 	void copy_file(const std::string& from, const std::string& to);
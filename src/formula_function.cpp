@@ -94,6 +94,7 @@
 #include "json_parser.hpp"
 #include "utf8_to_codepoint.hpp"
 #include "uuid.hpp"
+#include "variant_binary.hpp"
 #include "variant_type_check.hpp"
 #include "variant_utils.hpp"
 #include "voxel_model.hpp"
@@ -5113,9 +5114,10 @@ std::map<std::string, variant>& get_doc_cache(bool prefs_dir) {
 		END_FUNCTION_DEF(remove_document)
 
 
-		FUNCTION_DEF(write_document, 2, 3, "write_document(string filename, doc, [enum{game_dir}]): writes 'doc' to the given filename")
+		FUNCTION_DEF(write_document, 2, 3, "write_document(string filename, doc, [enum{game_dir,binary}]): writes 'doc' to the given filename. With the binary flag the document is written in the compact binary format, which get_document() reads transparently.")
 
 			bool prefs_directory = true;
+			bool binary = false;
 
 			if(NUM_ARGS > 2) {
 				const variant flags = EVAL_ARG(2);
@@ -5124,6 +5126,8 @@ std::map<std::string, variant>& get_doc_cache(bool prefs_dir) {
 					const std::string& flag = f.is_enum() ? f.as_enum() : f.as_string();
 					if(flag == "game_dir") {
 						prefs_directory = false;
+					} else if(flag == "binary") {
+						binary = true;
 					} else {
 						ASSERT_LOG(false, "Illegal flag to write_document: " << flag);
 					}
@@ -5158,12 +5162,13 @@ std::map<std::string, variant>& get_doc_cache(bool prefs_dir) {
 					real_docname = module::map_write_path(docname);
 				}
 
-				sys::write_file(real_docname, game_logic::serialize_doc_with_objects(doc).write_json());
+				const variant serialized = game_logic::serialize_doc_with_objects(doc);
+				sys::write_file(real_docname, binary ? variant_binary::write_binary(serialized) : serialized.write_json());
 			}));
 		FUNCTION_ARGS_DEF
 			ARG_TYPE("string");
 			ARG_TYPE("any");
-			ARG_TYPE("[enum{game_dir}]|[string]");
+			ARG_TYPE("[enum{game_dir,binary}]|[string]");
 			RETURN_TYPE("commands")
 		END_FUNCTION_DEF(write_document)
 
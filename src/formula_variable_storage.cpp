@@ -21,18 +21,25 @@
 	   distribution.
 */
 
+#include <atomic>
+
 #include "asserts.hpp"
 #include "formula_variable_storage.hpp"
 #include "variant_utils.hpp"
 
 namespace game_logic
 {
+	namespace
+	{
+		std::atomic<unsigned int> generation_clock(0);
+	}
+
 	FormulaVariableStorage::FormulaVariableStorage()
-		: disallow_new_keys_(false)
+		: disallow_new_keys_(false), generation_(++generation_clock)
 	{}
 
 	FormulaVariableStorage::FormulaVariableStorage(const std::map<std::string, variant>& m)
-		: disallow_new_keys_(false)
+		: disallow_new_keys_(false), generation_(++generation_clock)
 	{
 		for(std::map<std::string, variant>::const_iterator i = m.begin(); i != m.end(); ++i) {
 			add(i->first, i->second);
@@ -86,8 +93,14 @@ namespace game_logic
 		return node.build();
 	}
 
+	void FormulaVariableStorage::changed()
+	{
+		generation_ = ++generation_clock;
+	}
+
 	void FormulaVariableStorage::add(const std::string& key, const variant& value)
 	{
+		changed();
 		std::map<std::string,int>::const_iterator i = strings_to_values_.find(key);
 		if(i != strings_to_values_.end()) {
 			values_[i->second] = value;
@@ -128,6 +141,7 @@ namespace game_logic
 
 	void FormulaVariableStorage::setValueBySlot(int slot, const variant& value)
 	{
+		changed();
 		values_[slot] = value;
 	}
 
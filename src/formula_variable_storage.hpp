@@ -52,6 +52,11 @@ namespace game_logic
 
 		void disallowNewKeys(bool value=true) { disallow_new_keys_ = value; }
 
+		//Changes whenever a value is set. Generations are drawn from a clock
+		//shared by all storages, so a storage never has the generation of
+		//one that was created or changed before it.
+		unsigned int generation() const { return generation_; }
+
 		void surrenderReferences(GarbageCollector* collector) override;
 
 	private:
@@ -62,12 +67,16 @@ namespace game_logic
 
 		void getInputs(std::vector<FormulaInput>* inputs) const override;
 
+		void changed();
+
 		std::string debug_object_name_;
 
 		std::vector<variant> values_;
 		std::map<std::string, int> strings_to_values_;
 
 		bool disallow_new_keys_;
+
+		unsigned int generation_;
 	};
 
 	typedef ffl::IntrusivePtr<FormulaVariableStorage> FormulaVariableStoragePtr;
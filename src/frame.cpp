@@ -24,10 +24,12 @@
 
 #include <algorithm>
 #include <array>
+#include <cmath>
 #include <iostream>
 
 #include <boost/lexical_cast.hpp>
 
+#include "AttributeSet.hpp"
 #include "DisplayDevice.hpp"
 #include "TextureUtils.hpp"
 #include "WindowManager.hpp"
@@ -45,6 +47,7 @@
 #include "surface_cache.hpp"
 #include "surface_palette.hpp"
 #include "TextureObject.hpp"
+#include "unit_test.hpp"
 #include "variant_utils.hpp"
 
 PREF_FLOAT(global_frame_scale, 2.0, "Sets the global frame scales for all frames in all animations");
@@ -58,6 +61,42 @@ namespace
 
     uint64_t current_palette_mask = 0L;
 	const glm::vec3 z_axis(0, 0, 1.0f);
+
+	//This is the same geometry draw() gets from the blit target for the
+	//area (x, y, w, h): a quad centred on the middle of the area, mirrored,
+	//scaled and then rotated about its centre. Quads after the first are
+	//joined to the strip with two degenerate vertices.
+	void append_sprite_quad(std::vector<KRE::vertex_texcoord>* queue, int x, int y, int w, int h, const rectf& uv, bool face_right, bool upside_down, float rotate, float scale)
+	{
+		const float hw = w/2.0f;
+		const float hh = h/2.0f;
+		const float x1 = (face_right ? -hw : hw) * scale;
+		const float x2 = -x1;
+		const float y1 = (upside_down ? hh : -hh) * scale;
+		const float y2 = -y1;
+		const float cx = static_cast<float>(x + w/2);
+		const float cy = static_cast<float>(y + h/2);
+
+		std::array<glm::vec2, 4> corners = {{ glm::vec2(x1, y1), glm::vec2(x2, y1), glm::vec2(x1, y2), glm::vec2(x2, y2) }};
+		if(rotate != 0.0f) {
+			const float radians = glm::radians(rotate);
+			const float c = std::cos(radians);
+			const float s = std::sin(radians);
+			for(auto& p : corners) {
+				p = glm::vec2(p.x*c - p.y*s, p.x*s + p.y*c);
+			}
+		}
+
+		if(queue->empty() == false) {
+			queue->emplace_back(queue->back());
+			queue->emplace_back(glm::vec2(cx + corners[0].x, cy + corners[0].y), glm::vec2(uv.x1(), uv.y1()));
+		}
+
+		queue->emplace_back(glm::vec2(cx + corners[0].x, cy + corners[0].y), glm::vec2(uv.x1(), uv.y1()));
+		queue->emplace_back(glm::vec2(cx + corners[1].x, cy + corners[1].y), glm::vec2(uv.x2(), uv.y1()));
+		queue->emplace_back(glm::vec2(cx + corners[2].x, cy + corners[2].y), glm::vec2(uv.x1(), uv.y2()));
+		queue->emplace_back(glm::vec2(cx + corners[3].x, cy + corners[3].y), glm::vec2(uv.x2(), uv.y2()));
+	}
 }
 
 void Frame::buildPatterns(variant obj_variant)
@@ -710,6 +749,54 @@ std::vector<bool>::const_iterator Frame::getAlphaItor(int x, int y, int time, bo
 	return alpha_.begin() + index;
 }
 
+const Frame::AlphaMask& Frame::getAlphaMask(int time, bool face_right) const
+{
+	const int nframe = frameNumber(time);
+	ASSERT_LOG(nframe >= 0 && nframe < nframes_, "Bad frame number " << nframe << " in animation " << id_);
+
+	if(alpha_masks_.empty()) {
+		alpha_masks_.resize(nframes_*2);
+	}
+
+	std::shared_ptr<const AlphaMask>& mask = alpha_masks_[nframe*2 + (face_right ? 0 : 1)];
+	if(!mask) {
+		mask = buildAlphaMask(nframe, face_right);
+	}
+
+	return *mask;
+}
+
+std::shared_ptr<const Frame::AlphaMask> Frame::buildAlphaMask(int nframe, bool face_right) const
+{
+	auto mask = std::make_shared<AlphaMask>();
+	mask->width = width();
+	mask->height = height();
+	mask->words_per_row = (mask->width + 63)/64;
+	mask->bits.resize(mask->words_per_row*mask->height);
+
+	//Without alpha information every pixel is treated as transparent,
+	//as isAlpha() does.
+	if(alpha_.empty()) {
+		return mask;
+	}
+
+	//This mirrors the mapping from frame to image pixels in getAlphaItor().
+	const int stride = img_rect_.w()*nframes_;
+	for(int y = 0; y != mask->height; ++y) {
+		const int img_y = static_cast<int>(y / scale_);
+		uint64_t* row = &mask->bits[y*mask->words_per_row];
+		for(int x = 0; x != mask->width; ++x) {
+			const int frame_x = face_right ? x : mask->width - x - 1;
+			const int img_x = static_cast<int>(frame_x / scale_) + nframe*img_rect_.w();
+			if(!alpha_[img_y*stride + img_x]) {
+				row[x >> 6] |= uint64_t(1) << (x & 63);
+			}
+		}
+	}
+
+	return mask;
+}
+
 void Frame::draw(graphics::AnuraShaderPtr shader, int x, int y, bool face_right, bool upside_down, int time, float rotate) const
 {
 	rect old_src_rect = blit_target_.getTexture()->getSourceRect();
@@ -740,6 +827,7 @@ void Frame::draw(graphics::AnuraShaderPtr shader, int x, int y, bool face_right,
 	blit_target_.setCentre(KRE::Blittable::Centre::MIDDLE);
 	blit_target_.setPosition(x + w/2, y + h/2);
 	blit_target_.setRotation(rotate, z_axis);
+	blit_target_.setScale(1.0f, 1.0f);
 	blit_target_.setDrawRect(rect(0, 0, w, h));
 	blit_target_.setMirrorHoriz(upside_down);
 	blit_target_.setMirrorVert(!face_right);
@@ -817,6 +905,7 @@ void Frame::draw(graphics::AnuraShaderPtr shader, int x, int y, const rect& area
 	blit_target_.setCentre(KRE::Blittable::Centre::MIDDLE);
 	blit_target_.setPosition(x + w/2, y + h/2);
 	blit_target_.setRotation(rotate, z_axis);
+	blit_target_.setScale(1.0f, 1.0f);
 	blit_target_.setDrawRect(rect(0, 0, w, h));
 	blit_target_.getTexture()->setSourceRect(0, rect(src_rect.x() + x_adjust, src_rect.y() + y_adjust, src_rect.w() + w_adjust, src_rect.h() + h_adjust));
 	blit_target_.setMirrorHoriz(upside_down);
@@ -890,6 +979,19 @@ void Frame::drawBatch(graphics::AnuraShaderPtr shader, const BatchDrawItem* i1,
 	wnd->render(&frame->blit_target_);
 }
 
+void Frame::appendQuad(std::vector<KRE::vertex_texcoord>* queue, int x, int y, bool face_right, bool upside_down, int time, float rotate, float scale) const
+{
+	const FrameInfo* info = nullptr;
+	getRectInTexture(time, info);
+
+	x += static_cast<int>((face_right ? info->x_adjust : info->x2_adjust) * scale_);
+	y += static_cast<int>(info->y_adjust * scale_);
+	const int w = static_cast<int>(info->area.w() * scale_);
+	const int h = static_cast<int>(info->area.h() * scale_);
+
+	append_sprite_quad(queue, x, y, w, h, info->draw_rect, face_right, upside_down, rotate, scale);
+}
+
 void Frame::drawCustom(graphics::AnuraShaderPtr shader, int x, int y, const std::vector<CustomPoint>& points, const rect* area, bool face_right, bool upside_down, int time, float rotation) const
 {
 	KRE::Blittable blit;
@@ -1214,3 +1316,45 @@ BEGIN_DEFINE_CALLABLE_NOBASE(Frame)
     DEFINE_FIELD(play_backwards, "bool")
         return variant::from_bool(obj.play_backwards_);
 END_DEFINE_CALLABLE(Frame)
+
+UNIT_TEST(frame_batched_quad_matches_blit)
+{
+	//The quads sprite batches draw must land where draw() puts the frame
+	//with its blit target, for each way of mirroring it, scaled or not.
+	KRE::DisplayDevice::factory("null", KRE::WindowPtr());
+	KRE::Blittable blit(KRE::Texture::createTexture2D(64, 64, KRE::PixelFormat::PF::PIXELFORMAT_RGBA8888));
+	const rectf uv = blit.getTexture()->getSourceRectNormalised();
+
+	const int x = 100, y = 50, w = 31, h = 20;
+	for(int n = 0; n != 8; ++n) {
+		const bool face_right = (n&1) != 0;
+		const bool upside_down = (n&2) != 0;
+		const float scale = (n&4) ? 2.5f : 1.0f;
+
+		blit.setCentre(KRE::Blittable::Centre::MIDDLE);
+		blit.setPosition(x + w/2, y + h/2);
+		blit.setScale(scale, scale);
+		blit.setDrawRect(rect(0, 0, w, h));
+		blit.setMirrorHoriz(upside_down);
+		blit.setMirrorVert(!face_right);
+		blit.preRender(KRE::WindowPtr());
+
+		auto attr = std::dynamic_pointer_cast<KRE::Attribute<KRE::vertex_texcoord>>(blit.getAttributeSet().back()->getAttributes().front());
+		ASSERT_LOG(attr && attr->size() == 4, "Blit target has no quad");
+
+		std::vector<KRE::vertex_texcoord> quad;
+		append_sprite_quad(&quad, x, y, w, h, uv, face_right, upside_down, 0.0f, scale);
+		CHECK_EQ(quad.size(), 4);
+
+		const glm::mat4 model = blit.getModelMatrix();
+		int i = 0;
+		for(const KRE::vertex_texcoord& v : *attr) {
+			const glm::vec4 pos = model * glm::vec4(v.vtx, 0.0f, 1.0f);
+			CHECK_LE(std::abs(pos.x - quad[i].vtx.x), 0.001f);
+			CHECK_LE(std::abs(pos.y - quad[i].vtx.y), 0.001f);
+			CHECK_EQ(v.tc.x, quad[i].tc.x);
+			CHECK_EQ(v.tc.y, quad[i].tc.y);
+			++i;
+		}
+	}
+}
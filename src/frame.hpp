@@ -23,6 +23,8 @@
 
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -73,6 +75,23 @@ public:
 	std::vector<bool>::const_iterator getAlphaItor(int x, int y, int time, bool face_right) const;
 	const std::vector<bool>& getAlphaBuf() const { return alpha_; }
 
+	//The opaque pixels of one image of the animation as drawn facing the
+	//given way, one bit per pixel, with the leftmost pixel of a row in the
+	//lowest bit of its first word.
+	struct AlphaMask
+	{
+		AlphaMask() : width(0), height(0), words_per_row(0)
+		{}
+		int width, height, words_per_row;
+		std::vector<uint64_t> bits;
+
+		const uint64_t* row(int y) const { return &bits[y*words_per_row]; }
+	};
+
+	//Gets the mask of the image shown at the given time. Masks are built
+	//the first time they're needed.
+	const AlphaMask& getAlphaMask(int time, bool face_right) const;
+
 	void draw(graphics::AnuraShaderPtr shader, int x, int y, bool face_right=true, bool upside_down=false, int time=0, float rotate=0) const;
 	void draw(graphics::AnuraShaderPtr shader, int x, int y, bool face_right, bool upside_down, int time, float rotate, float scale) const;
 	void draw(graphics::AnuraShaderPtr shader, int x, int y, const rect& area, bool face_right=true, bool upside_down=false, int time=0, float rotate=0) const;
@@ -98,6 +117,16 @@ public:
 
 	static void drawBatch(graphics::AnuraShaderPtr shader, const BatchDrawItem* i1, const BatchDrawItem* i2);
 
+	//Appends the quad that draw() would render to a triangle strip, joined
+	//to any quads already there with degenerate triangles. The position,
+	//rotation and scale are applied to the vertices so that the quad can be
+	//drawn in a single call together with other frames using the same texture.
+	void appendQuad(std::vector<KRE::vertex_texcoord>* queue, int x, int y, bool face_right, bool upside_down, int time, float rotate, float scale) const;
+
+	//The renderable draw() uses. Quads from appendQuad() need to be drawn
+	//with its texture, shader and blend state.
+	const KRE::Blittable& getBlitTarget() const { return blit_target_; }
+
 	void setImageAsSolid();
 	ConstSolidInfoPtr solid() const { return solid_; }
 	ConstSolidInfoPtr platform() const { return platform_; }
@@ -216,6 +245,11 @@ private:
 	void buildAlphaFromFrameInfo();
 	void buildAlpha();
 	std::vector<bool> alpha_;
+
+	std::shared_ptr<const AlphaMask> buildAlphaMask(int nframe, bool face_right) const;
+
+	//Two masks for each image, facing right then left.
+	mutable std::vector<std::shared_ptr<const AlphaMask>> alpha_masks_;
 	bool allow_wrapping_;
 	bool force_no_alpha_;
 
@@ -22,8 +22,11 @@
 */
 
 #include <algorithm>
+#include <list>
 
 #include "asserts.hpp"
+#include "async_io.hpp"
+#include "background_task_pool.hpp"
 #include "code_editor_dialog.hpp"
 #include "checksum.hpp"
 #include "filesystem.hpp"
@@ -39,7 +42,9 @@
 #include "preferences.hpp"
 #include "preprocessor.hpp"
 #include "string_utils.hpp"
+#include "thread.hpp"
 #include "unit_test.hpp"
+#include "variant_binary.hpp"
 #include "variant_utils.hpp"
 #include "wml_formula_callable.hpp"
 
@@ -48,17 +53,118 @@ namespace game_logic
 	void remove_formula_function_cached_doc(const std::string& name);
 }
 
+PREF_INT(json_doc_cache_kb, 8192, "Size, in kilobytes of source file, of the parsed JSON documents kept in memory so that files which are requested again are not re-read.");
+PREF_BOOL(json_doc_cache_verify_contents, false, "Compare the contents of cached JSON files against what is on disk, instead of trusting their modification time and size.");
+
 namespace json
 {
 	namespace
 	{
 		std::map<std::string, std::string> pseudo_file_contents;
+
+		//Parsed documents, keyed by file path and parse options. An entry is
+		//valid while the file's modification time and size are unchanged,
+		//and until the file is written through sys::write_file.
+		//Only used from the main thread since variant reference counts
+		//aren't thread safe.
+		typedef std::pair<std::string, JSON_PARSE_OPTIONS> DocCacheKey;
+
+		struct DocCacheEntry
+		{
+			DocCacheKey key;
+
+			//the file the document was read from.
+			std::string path;
+			long long mod_time, size;
+
+			//Only computed when json_doc_cache_verify_contents is set.
+			std::string md5;
+
+			variant doc;
+		};
+
+		typedef std::list<DocCacheEntry> DocCacheList;
+
+		//Entries, most recently used first.
+		DocCacheList doc_cache_lru;
+		std::map<DocCacheKey, DocCacheList::iterator> doc_cache;
+
+		//Sum of the file sizes of the cached documents.
+		long long doc_cache_bytes = 0;
+
+		void erase_doc_from_cache(std::map<DocCacheKey, DocCacheList::iterator>::iterator itor)
+		{
+			doc_cache_bytes -= itor->second->size;
+			doc_cache_lru.erase(itor->second);
+			doc_cache.erase(itor);
+		}
+
+		void add_doc_to_cache(const DocCacheEntry& entry)
+		{
+			auto itor = doc_cache.find(entry.key);
+			if(itor != doc_cache.end()) {
+				erase_doc_from_cache(itor);
+			}
+
+			doc_cache_lru.push_front(entry);
+			doc_cache[entry.key] = doc_cache_lru.begin();
+			doc_cache_bytes += entry.size;
+
+			//the document just added is always kept, however big it is.
+			while(doc_cache_lru.size() > 1 && doc_cache_bytes > static_cast<long long>(g_json_doc_cache_kb)*1024) {
+				erase_doc_from_cache(doc_cache.find(doc_cache_lru.back().key));
+			}
+		}
+
+		//Paths written since the cache was last checked. Files may be
+		//written from any thread, so they are only noted here and the
+		//cache entries are dropped on the main thread.
+		threading::mutex written_paths_mutex;
+		std::set<std::string> written_paths;
+		bool have_written_paths = false;
+
+		void drop_written_docs_from_cache()
+		{
+			std::set<std::string> paths;
+			{
+				threading::lock lck(written_paths_mutex);
+				if(!have_written_paths) {
+					return;
+				}
+
+				paths.swap(written_paths);
+				have_written_paths = false;
+			}
+
+			for(auto itor = doc_cache.begin(); itor != doc_cache.end(); ) {
+				if(paths.count(itor->second->path) || paths.count(itor->first.first)) {
+					erase_doc_from_cache(itor++);
+				} else {
+					++itor;
+				}
+			}
+		}
+	}
+
+	void file_written(const std::string& path)
+	{
+		threading::lock lck(written_paths_mutex);
+		written_paths.insert(path);
+		have_written_paths = true;
 	}
 
 	void set_file_contents(const std::string& path, const std::string& contents)
 	{
 		game_logic::remove_formula_function_cached_doc(contents);
 		pseudo_file_contents[path] = contents;
+
+		for(auto itor = doc_cache.begin(); itor != doc_cache.end(); ) {
+			if(itor->first.first == path) {
+				erase_doc_from_cache(itor++);
+			} else {
+				++itor;
+			}
+		}
 	}
 
 	std::string get_file_contents(const std::string& path)
@@ -67,7 +173,7 @@ namespace json
 		if(i != pseudo_file_contents.end()) {
 			return i->second;
 		} else {
-			return sys::read_file(module::map_file(path));
+			return *async_io::read_file(module::map_file(path));
 		}
 	}
 
@@ -262,7 +368,17 @@ namespace json
 			}
 		};
 
+		//documents may be parsed on background workers, so registering a
+		//file name is done under a lock. Entries are never removed, so the
+		//names handed out stay valid.
 		std::set<std::string> filename_registry;
+		threading::mutex filename_registry_mutex;
+
+		const std::string* register_filename(const std::string& fname)
+		{
+			threading::lock lck(filename_registry_mutex);
+			return &*filename_registry.insert(fname).first;
+		}
 
 		variant parse_internal(const std::string& doc, const std::string& fname,
 							   JSON_PARSE_OPTIONS options,
@@ -276,10 +392,8 @@ namespace json
 
 			bool use_preprocessor = options == JSON_PARSE_OPTIONS::USE_PREPROCESSOR;
 
-			std::set<std::string>::const_iterator filename_itor = filename_registry.insert(fname).first;
-
 			variant::debug_info debug_info;
-			debug_info.filename = &*filename_itor;
+			debug_info.filename = register_filename(fname);
 			debug_info.line = 1;
 			debug_info.column = 1;
 
@@ -575,18 +689,51 @@ namespace json
 		return parse_internal(doc, "", options, nullptr, nullptr);
 	}
 
+	variant parse(const std::string& doc, const std::string& fname, JSON_PARSE_OPTIONS options)
+	{
+		if(variant_binary::is_binary(doc)) {
+			return variant_binary::parse_binary(doc, options);
+		}
+
+		return parse_internal(doc, fname, options, nullptr, nullptr);
+	}
+
 	variant parse_from_file(const std::string& fname, JSON_PARSE_OPTIONS options)
 	{
 		try {
-			std::string data = get_file_contents(fname);
+			//variant reference counts aren't thread safe, so documents
+			//parsed on background workers bypass the cache entirely, as do
+			//files whose contents have been overridden in memory.
+			const bool use_cache = !background_task_pool::is_worker_thread() && pseudo_file_contents.count(fname) == 0;
+
+			DocCacheEntry entry;
+			std::string data;
+			bool have_data = false;
+
+			if(use_cache) {
+				drop_written_docs_from_cache();
+
+				entry.key = DocCacheKey(fname, options);
+				entry.path = module::map_file(fname);
+				entry.mod_time = sys::file_mod_time(entry.path);
+				entry.size = sys::file_size(entry.path);
+
+				auto itor = doc_cache.find(entry.key);
+				if(itor != doc_cache.end() && itor->second->mod_time == entry.mod_time && itor->second->size == entry.size) {
+					if(g_json_doc_cache_verify_contents) {
+						data = get_file_contents(fname);
+						have_data = true;
+					}
 
-			typedef std::pair<std::string, JSON_PARSE_OPTIONS> CacheKey;
-			static std::map<CacheKey, variant> cache;
+					if(!have_data || itor->second->md5 == md5::sum(data)) {
+						doc_cache_lru.splice(doc_cache_lru.begin(), doc_cache_lru, itor->second);
+						return itor->second->doc;
+					}
+				}
+			}
 
-			CacheKey key(md5::sum(data), options);
-			std::map<CacheKey, variant>::iterator cache_itor = cache.find(key);
-			if(cache_itor != cache.end()) {
-				return cache_itor->second;
+			if(!have_data) {
+				data = get_file_contents(fname);
 			}
 
 			checksum::verify_file(fname, data);
@@ -598,9 +745,13 @@ namespace json
 			variant result;
 
 			try {
-				result = parse_internal(data, fname, options, nullptr, nullptr);
+				if(variant_binary::is_binary(data)) {
+					result = variant_binary::parse_binary(data, options);
+				} else {
+					result = parse_internal(data, fname, options, nullptr, nullptr);
+				}
 			} catch(const ParseError& e) {
-				if(!preferences::edit_and_continue()) {
+				if(!preferences::edit_and_continue() || background_task_pool::is_worker_thread()) {
 					throw e;
 				}
 
@@ -617,15 +768,15 @@ namespace json
 				return parse_from_file(fname, options);
 			}
 
-			for(std::map<CacheKey, variant>::iterator i = cache.begin(); i != cache.end(); ) {
-				if(i->second.refcount() == 1) {
-					cache.erase(i++);
-				} else {
-					++i;
+			if(use_cache) {
+				if(g_json_doc_cache_verify_contents) {
+					entry.md5 = md5::sum(data);
 				}
+
+				entry.doc = result;
+				add_doc_to_cache(entry);
 			}
 
-			cache[key] = result;
 			return result;
 		} catch(ParseError& e) {
 			// Removed the completely asinine practice of emitting they parser error message.
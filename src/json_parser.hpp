@@ -31,8 +31,18 @@ namespace json
 	void set_file_contents(const std::string& path, const std::string& contents);
 	std::string get_file_contents(const std::string& path);
 
+	//Tells the parser that the file at path (a path on disk, not a module
+	//path) has been written, so any parsed copy of it is out of date. May be
+	//called from any thread.
+	void file_written(const std::string& path);
+
 	enum class JSON_PARSE_OPTIONS { NO_PREPROCESSOR, USE_PREPROCESSOR };
 	variant parse(const std::string& doc, JSON_PARSE_OPTIONS options=JSON_PARSE_OPTIONS::USE_PREPROCESSOR);
+	//Parses a document already read from fname, which may be text or binary.
+	//Unlike parse_from_file() this doesn't touch the document cache or the
+	//module paths, so it may be used on background workers together with
+	//NO_PREPROCESSOR.
+	variant parse(const std::string& doc, const std::string& fname, JSON_PARSE_OPTIONS options=JSON_PARSE_OPTIONS::USE_PREPROCESSOR);
 	variant parse_from_file(const std::string& fname, JSON_PARSE_OPTIONS options=JSON_PARSE_OPTIONS::USE_PREPROCESSOR);
 	variant parse_from_file_or_die(const std::string& fname, JSON_PARSE_OPTIONS options=JSON_PARSE_OPTIONS::USE_PREPROCESSOR);
 	bool file_exists_and_is_valid(const std::string& fname);
@@ -22,17 +22,159 @@
 */
 
 #include <algorithm>
+#include <cstdint>
 #include <cstring>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define JSON_TOKENIZER_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "asserts.hpp"
+#include "filesystem.hpp"
+#include "json_parser.hpp"
 #include "json_tokenizer.hpp"
+#include "profile_timer.hpp"
 #include "unit_test.hpp"
 #include "string_utils.hpp"
 
 namespace json
 {
+	namespace
+	{
+		//Cleared to compare against scanning a byte at a time.
+		bool g_vectorized_scanning = true;
+
+		//Long runs of string contents and whitespace are scanned a block of
+		//64 bytes at a time. For each block we build a bitmap with one bit
+		//per byte marking the bytes of interest, then jump straight to the
+		//first marked byte. Anything shorter than a block is scanned a byte
+		//at a time.
+
+		const int BlockSize = 64;
+
+		int count_trailing_zeros(uint64_t mask)
+		{
+#if defined(_MSC_VER) && defined(_M_X64)
+			unsigned long index;
+			_BitScanForward64(&index, mask);
+			return static_cast<int>(index);
+#elif defined(_MSC_VER)
+			unsigned long index;
+			if(_BitScanForward(&index, static_cast<unsigned long>(mask))) {
+				return static_cast<int>(index);
+			}
+			_BitScanForward(&index, static_cast<unsigned long>(mask >> 32));
+			return static_cast<int>(index) + 32;
+#else
+			return __builtin_ctzll(mask);
+#endif
+		}
+
+#ifdef JSON_TOKENIZER_SSE2
+		struct Block
+		{
+			explicit Block(const char* p) {
+				for(int n = 0; n != 4; ++n) {
+					chunk[n] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + n*16));
+				}
+			}
+
+			//Bitmap of the bytes in the block equal to c.
+			uint64_t eq(char c) const {
+				const __m128i needle = _mm_set1_epi8(c);
+				uint64_t result = 0;
+				for(int n = 0; n != 4; ++n) {
+					const uint64_t bits = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk[n], needle)));
+					result |= bits << (n*16);
+				}
+				return result;
+			}
+
+			//Bitmap of the bytes in the block which are whitespace
+			//according to isspace(): ' ' and '\t' through '\r'.
+			uint64_t whitespace() const {
+				const __m128i space = _mm_set1_epi8(' ');
+				const __m128i low = _mm_set1_epi8('\t' - 1);
+				const __m128i high = _mm_set1_epi8('\r' + 1);
+				uint64_t result = 0;
+				for(int n = 0; n != 4; ++n) {
+					const __m128i control = _mm_and_si128(_mm_cmpgt_epi8(chunk[n], low), _mm_cmplt_epi8(chunk[n], high));
+					const __m128i ws = _mm_or_si128(control, _mm_cmpeq_epi8(chunk[n], space));
+					const uint64_t bits = static_cast<uint32_t>(_mm_movemask_epi8(ws));
+					result |= bits << (n*16);
+				}
+				return result;
+			}
+
+			__m128i chunk[4];
+		};
+#endif
+
+		//Returns the first quote or backslash at or after p, or end.
+		const char* find_quote_or_escape(const char* p, const char* end, char quote)
+		{
+#ifdef JSON_TOKENIZER_SSE2
+			if(g_vectorized_scanning) {
+				while(end - p >= BlockSize) {
+					const Block block(p);
+					const uint64_t mask = block.eq(quote) | block.eq('\\');
+					if(mask) {
+						return p + count_trailing_zeros(mask);
+					}
+
+					p += BlockSize;
+				}
+			}
+#endif
+			while(p != end && *p != quote && *p != '\\') {
+				++p;
+			}
+
+			return p;
+		}
+
+		const char* skip_whitespace(const char* p, const char* end)
+		{
+#ifdef JSON_TOKENIZER_SSE2
+			//Most whitespace runs are a few bytes of indentation, so only
+			//switch to whole blocks once the run turns out to be long.
+			const char* scalar_end = std::min(end, p + 16);
+			while(p != scalar_end && util::c_isspace(*p)) {
+				++p;
+			}
+
+			if(g_vectorized_scanning && p == scalar_end) {
+				while(end - p >= BlockSize) {
+					const uint64_t mask = ~Block(p).whitespace();
+					if(mask) {
+						return p + count_trailing_zeros(mask);
+					}
+
+					p += BlockSize;
+				}
+			}
+#endif
+			while(p != end && util::c_isspace(*p)) {
+				++p;
+			}
+
+			return p;
+		}
+	}
+
 	Token get_token(const char*& i1, const char* i2)
 	{
-		while((i1 != i2 && util::c_isspace(*i1)) || *i1 == '#' || (*i1 == '/' && i1+1 != i2 && (*(i1 + 1) == '/' || *(i1 + 1) == '*'))) {
+		for(;;) {
+			i1 = skip_whitespace(i1, i2);
+			if(i1 == i2 || !(*i1 == '#' || (*i1 == '/' && i1+1 != i2 && (*(i1 + 1) == '/' || *(i1 + 1) == '*')))) {
+				break;
+			}
+
 			if(*i1 == '/' && *(i1 + 1) == '*') {
 				const char* begin = i1;
 				i1 += 2;
@@ -59,11 +201,12 @@ namespace json
 				}
 
 				++i1;
-			} else if(*i1 == '#' || *i1 == '/') {
-				//ignore comments.
-				i1 = std::find(i1, i2, '\n');
 			} else {
-				++i1;
+				//ignore comments.
+				i1 = static_cast<const char*>(memchr(i1, '\n', i2 - i1));
+				if(i1 == nullptr) {
+					i1 = i2;
+				}
 			}
 		}
 
@@ -99,7 +242,13 @@ namespace json
 			i1 += 3;
 			result.begin = i1;
 
-			while(i1+2 != i2) {
+			while(i2 - i1 > 2) {
+				i1 = static_cast<const char*>(memchr(i1, '"', i2 - i1 - 2));
+				if(i1 == nullptr) {
+					i1 = i2 - 2;
+					break;
+				}
+
 				if(std::equal(i1, i1+3, "\"\"\"")) {
 					break;
 				}
@@ -107,7 +256,7 @@ namespace json
 				++i1;
 			}
 
-			if(i1+2 == i2) {
+			if(i2 - i1 <= 2) {
 				TokenizerError error = { "Unexpected end of file while parsing string", result.begin };
 				throw error;
 			}
@@ -121,17 +270,18 @@ namespace json
 			result.translate = quote_type == '~';
 			result.type = Token::TYPE::STRING;
 			result.begin = ++i1;
-			while(i1 != i2) {
-				if(*i1 == quote_type) {
+			for(;;) {
+				i1 = find_quote_or_escape(i1, i2, quote_type);
+				if(i1 == i2 || *i1 == quote_type) {
 					break;
-				} else if(*i1 == '\\') {
-					++i1;
-					if(i1 == i2) {
-						break;
-					}
 				}
 
-				++i1;
+				//skip the escaped character.
+				i1 += 2;
+				if(i1 >= i2) {
+					i1 = i2;
+					break;
+				}
 			}
 
 			if(i1 == i2) {
@@ -208,3 +358,115 @@ namespace json
 		return res;
 	}
 }
+
+namespace
+{
+	struct TokenInfo
+	{
+		json::Token::TYPE type;
+		ptrdiff_t begin, end;
+		bool operator==(const TokenInfo& o) const { return type == o.type && begin == o.begin && end == o.end; }
+	};
+
+	std::vector<TokenInfo> tokenize_all(const std::string& doc)
+	{
+		std::vector<TokenInfo> result;
+		const char* i1 = doc.c_str();
+		const char* i2 = i1 + doc.size();
+		for(;;) {
+			const json::Token t = json::get_token(i1, i2);
+			if(t.type == json::Token::TYPE::NUM_TYPES) {
+				break;
+			}
+
+			TokenInfo info = { t.type, t.begin - doc.c_str(), t.end - doc.c_str() };
+			result.push_back(info);
+		}
+
+		return result;
+	}
+}
+
+UNIT_TEST(json_tokenizer_vectorized_matches_scalar)
+{
+	std::string doc = "{\n\t# comment\n\tkey: \"";
+	doc += std::string(61, 'a') + "\\\"" + std::string(70, 'b') + "\\\\\",";
+	doc += std::string(150, ' ') + "// another comment\n";
+	doc += "other: 'single', text: ~" + std::string(100, 'c') + "~, /* nested /* comment */ */";
+	doc += "formula: \"\"\"" + std::string(90, 'd') + "\"\" \"\"\", num: -12.5, flag: true\n}";
+
+	const bool old_value = json::g_vectorized_scanning;
+	json::g_vectorized_scanning = false;
+	const std::vector<TokenInfo> scalar = tokenize_all(doc);
+	json::g_vectorized_scanning = true;
+	const std::vector<TokenInfo> vectorized = tokenize_all(doc);
+	json::g_vectorized_scanning = old_value;
+
+	CHECK_EQ(scalar.size(), vectorized.size());
+	CHECK_EQ(scalar == vectorized, true);
+	CHECK_EQ(scalar.size() > 20, true);
+}
+
+// Compares tokenizing and parsing every .cfg file under the given
+// directories (data/ by default) with and without vectorized scanning.
+// e.g. --utility=benchmark_json_tokenizer data modules/frogatto/data
+COMMAND_LINE_UTILITY(benchmark_json_tokenizer)
+{
+	std::vector<std::string> dirs = args;
+	if(dirs.empty()) {
+		dirs.push_back("data");
+	}
+
+	std::vector<std::string> docs;
+	size_t total_bytes = 0;
+	for(const std::string& dir : dirs) {
+		std::multimap<std::string, std::string> files;
+		sys::get_all_filenames_under_dir(dir, &files, "");
+		for(const auto& f : files) {
+			if(f.second.size() > 4 && std::equal(f.second.end()-4, f.second.end(), ".cfg")) {
+				docs.push_back(sys::read_file(f.second));
+				total_bytes += docs.back().size();
+			}
+		}
+	}
+
+	LOG_INFO("Benchmarking " << docs.size() << " files, " << (total_bytes/1024) << "KB");
+
+	const int Iterations = 5;
+	for(bool vectorized : { false, true }) {
+		json::g_vectorized_scanning = vectorized;
+
+		int ntokens = 0, nerrors = 0;
+		profile::timer tokenize_timer;
+		for(int n = 0; n != Iterations; ++n) {
+			for(const std::string& doc : docs) {
+				const char* i1 = doc.c_str();
+				const char* i2 = i1 + doc.size();
+				try {
+					while(json::get_token(i1, i2).type != json::Token::TYPE::NUM_TYPES) {
+						++ntokens;
+					}
+				} catch(const json::TokenizerError&) {
+					++nerrors;
+				}
+			}
+		}
+		const double tokenize_us = tokenize_timer.get_time() / Iterations;
+
+		profile::timer parse_timer;
+		for(int n = 0; n != Iterations; ++n) {
+			for(const std::string& doc : docs) {
+				try {
+					json::parse(doc, json::JSON_PARSE_OPTIONS::NO_PREPROCESSOR);
+				} catch(const json::ParseError&) {
+				}
+			}
+		}
+		const double parse_us = parse_timer.get_time() / Iterations;
+
+		LOG_INFO((vectorized ? "vectorized" : "scalar    ") << ": tokenize " << (tokenize_us/1000.0) << "ms (" << (total_bytes/tokenize_us) << "MB/s, "
+		         << (ntokens/Iterations) << " tokens, " << (nerrors/Iterations) << " errors); parse " << (parse_us/1000.0) << "ms (" << (total_bytes/parse_us) << "MB/s)");
+	}
+
+	json::g_vectorized_scanning = true;
+}
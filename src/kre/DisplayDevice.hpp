@@ -104,6 +104,8 @@ namespace KRE
 			DISPLAY_DEVICE_SDL,
 			// Display device is Direct3D
 			DISPLAY_DEVICE_D3D,
+			// Display device draws nothing, it only counts what it is given.
+			DISPLAY_DEVICE_NULL,
 		};
 
 		explicit DisplayDevice(WindowPtr wnd);
@@ -0,0 +1,910 @@
+/*
+	Copyright (C) 2013-2014 by Kristina Simpson <sweet.kristas@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <map>
+#include <sstream>
+
+#include "asserts.hpp"
+#include "AttributeSet.hpp"
+#include "Blend.hpp"
+#include "Blittable.hpp"
+#include "Canvas.hpp"
+#include "ClipScope.hpp"
+#include "DisplayDeviceNull.hpp"
+#include "Effects.hpp"
+#include "RenderTarget.hpp"
+#include "Scissor.hpp"
+#include "StencilScope.hpp"
+#include "Surface.hpp"
+#include "Texture.hpp"
+#include "unit_test.hpp"
+
+namespace KRE
+{
+	namespace
+	{
+		static DisplayDeviceRegistrar<DisplayDeviceNull> null_register("null");
+
+		RenderStats& get_stats()
+		{
+			static RenderStats res;
+			return res;
+		}
+
+		unsigned& get_current_bound_texture()
+		{
+			static unsigned res = 0;
+			return res;
+		}
+
+		const ShaderProgram*& get_active_shader()
+		{
+			static const ShaderProgram* res = nullptr;
+			return res;
+		}
+
+		unsigned next_texture_id()
+		{
+			static unsigned res = 0;
+			return ++res;
+		}
+
+		void record_draw(int64_t vertices)
+		{
+			++get_stats().draw_calls;
+			get_stats().vertices += vertices;
+		}
+
+		void record_upload(int64_t bytes)
+		{
+			get_stats().uploaded_bytes += bytes;
+		}
+
+		int bytes_per_texel(PixelFormat::PF fmt)
+		{
+			switch(fmt) {
+			case PixelFormat::PF::PIXELFORMAT_INDEX8:
+			case PixelFormat::PF::PIXELFORMAT_RGB332:
+			case PixelFormat::PF::PIXELFORMAT_R8:
+			case PixelFormat::PF::PIXELFORMAT_YV12:
+			case PixelFormat::PF::PIXELFORMAT_IYUV:
+				return 1;
+			case PixelFormat::PF::PIXELFORMAT_RGB444:
+			case PixelFormat::PF::PIXELFORMAT_RGB555:
+			case PixelFormat::PF::PIXELFORMAT_BGR555:
+			case PixelFormat::PF::PIXELFORMAT_ARGB4444:
+			case PixelFormat::PF::PIXELFORMAT_RGBA4444:
+			case PixelFormat::PF::PIXELFORMAT_ABGR4444:
+			case PixelFormat::PF::PIXELFORMAT_BGRA4444:
+			case PixelFormat::PF::PIXELFORMAT_ARGB1555:
+			case PixelFormat::PF::PIXELFORMAT_RGBA5551:
+			case PixelFormat::PF::PIXELFORMAT_ABGR1555:
+			case PixelFormat::PF::PIXELFORMAT_BGRA5551:
+			case PixelFormat::PF::PIXELFORMAT_RGB565:
+			case PixelFormat::PF::PIXELFORMAT_BGR565:
+			case PixelFormat::PF::PIXELFORMAT_YUY2:
+			case PixelFormat::PF::PIXELFORMAT_UYVY:
+			case PixelFormat::PF::PIXELFORMAT_YVYU:
+				return 2;
+			case PixelFormat::PF::PIXELFORMAT_RGB24:
+			case PixelFormat::PF::PIXELFORMAT_BGR24:
+				return 3;
+			default: break;
+			}
+			return 4;
+		}
+
+		class TextureNull : public Texture
+		{
+		public:
+			explicit TextureNull(const variant& node, const std::vector<SurfacePtr>& surfaces)
+				: Texture(node, surfaces)
+			{
+				createFromSurfaces();
+			}
+			explicit TextureNull(const std::vector<SurfacePtr>& surfaces, TextureType type, int mipmap_levels)
+				: Texture(surfaces, type, mipmap_levels)
+			{
+				createFromSurfaces();
+			}
+			explicit TextureNull(int count, int width, int height, int depth, PixelFormat::PF fmt, TextureType type)
+				: Texture(count, width, height, depth, fmt, type)
+			{
+				for(int n = 0; n != count; ++n) {
+					ids_.emplace_back(next_texture_id());
+					texel_bytes_.emplace_back(bytes_per_texel(fmt));
+				}
+			}
+
+			void init(int n) override {}
+
+			void bind(int binding_point) override {
+				if(get_current_bound_texture() == ids_[0]) {
+					return;
+				}
+				++get_stats().texture_switches;
+				if(binding_point == 0) {
+					get_current_bound_texture() = ids_[0];
+				}
+			}
+
+			unsigned id(int n) const override {
+				ASSERT_LOG(n < static_cast<int>(ids_.size()), "Requested texture id outside bounds.");
+				return ids_[n];
+			}
+
+			void update(int n, int x, int width, void* pixels) override {
+				record_upload(static_cast<int64_t>(width) * texel_bytes_[n]);
+			}
+			void update(int n, int x, int y, int width, int height, const void* pixels) override {
+				record_upload(static_cast<int64_t>(width) * height * texel_bytes_[n]);
+			}
+			void update2D(int n, int x, int y, int width, int height, int stride, const void* pixels) override {
+				record_upload(static_cast<int64_t>(width) * height * texel_bytes_[n]);
+			}
+			void updateYUV(int x, int y, int width, int height, const std::vector<int>& stride, const std::vector<void*>& pixels) override {
+				// The chroma planes are half the height of the luma plane.
+				for(int n = 0; n != static_cast<int>(stride.size()); ++n) {
+					record_upload(static_cast<int64_t>(stride[n]) * (n == 0 ? height : height / 2));
+				}
+			}
+			void update(int n, int x, int y, int z, int width, int height, int depth, void* pixels) override {
+				record_upload(static_cast<int64_t>(width) * height * depth * texel_bytes_[n]);
+			}
+
+			SurfacePtr extractTextureToSurface(int n) const override {
+				if(getSurface(n) != nullptr) {
+					return getSurface(n);
+				}
+				return Surface::create(actualWidth(n), actualHeight(n), PixelFormat::PF::PIXELFORMAT_ABGR8888);
+			}
+
+			const unsigned char* colorAt(int x, int y) const override {
+				if(getFrontSurface() == nullptr) {
+					return nullptr;
+				}
+				auto s = getFrontSurface();
+				const unsigned char* pixels = reinterpret_cast<const unsigned char*>(s->pixels());
+				return (pixels + (y*s->width() + x)*s->getPixelFormat()->bytesPerPixel());
+			}
+
+			TexturePtr clone() override {
+				return TexturePtr(new TextureNull(*this));
+			}
+		private:
+			void createFromSurfaces() {
+				for(auto& surf : getSurfaces()) {
+					ids_.emplace_back(next_texture_id());
+					texel_bytes_.emplace_back(surf->getPixelFormat()->bytesPerPixel());
+					record_upload(static_cast<int64_t>(surf->width()) * surf->height() * texel_bytes_.back());
+				}
+			}
+
+			void rebuild() override {
+				for(int n = 0; n != static_cast<int>(ids_.size()); ++n) {
+					ids_[n] = next_texture_id();
+					record_upload(static_cast<int64_t>(actualWidth(n)) * actualHeight(n) * texel_bytes_[n]);
+				}
+			}
+
+			void handleAddPalette(int index, const SurfacePtr& palette) override {
+				record_upload(static_cast<int64_t>(palette->width()) * palette->height() * palette->getPixelFormat()->bytesPerPixel());
+			}
+
+			std::vector<unsigned> ids_;
+			std::vector<int> texel_bytes_;
+		};
+
+		std::map<std::string, ShaderProgramPtr>& get_shader_factory()
+		{
+			static std::map<std::string, ShaderProgramPtr> res;
+			return res;
+		}
+
+		// Hands out a location for any uniform or attribute name it is asked
+		// about, so that code which looks them up always finds them.
+		class ShaderProgramNull : public ShaderProgram
+		{
+		public:
+			explicit ShaderProgramNull(const std::string& name, const variant& node)
+				: ShaderProgram(name, node),
+				  uniforms_(),
+				  attributes_()
+			{
+			}
+
+			void makeActive() override {
+				if(get_active_shader() != this) {
+					++get_stats().shader_switches;
+					get_active_shader() = this;
+				}
+			}
+			void applyAttribute(AttributeBasePtr attr) override {}
+			void cleanUpAfterDraw() override {}
+
+			int getAttributeOrDie(const std::string& attr) const override { return getAttribute(attr); }
+			int getUniformOrDie(const std::string& attr) const override { return getUniform(attr); }
+
+			int getAttribute(const std::string& attr) const override { return lookup(attributes_, attr); }
+			int getUniform(const std::string& attr) const override { return lookup(uniforms_, attr); }
+
+			std::vector<std::string> getAllUniforms() const override { return names(uniforms_); }
+			std::vector<std::string> getAllAttributes() const override { return names(attributes_); }
+
+			void setUniformMapping(const std::vector<std::pair<std::string, std::string>>& mapping) override {
+				for(auto& m : mapping) {
+					uniforms_[m.first] = getUniform(m.second);
+				}
+			}
+			void setAttributeMapping(const std::vector<std::pair<std::string, std::string>>& mapping) override {
+				for(auto& m : mapping) {
+					attributes_[m.first] = getAttribute(m.second);
+				}
+			}
+
+			void setUniformValue(int uid, const int) const override {}
+			void setUniformValue(int uid, const float) const override {}
+			void setUniformValue(int uid, const float*) const override {}
+			void setUniformValue(int uid, const int*) const override {}
+			void setUniformValue(int uid, const void*) const override {}
+			void setUniformFromVariant(int uid, const variant& value) const override {}
+
+			void setAttributeValue(int aid, const int) const override {}
+			void setAttributeValue(int aid, const float) const override {}
+			void setAttributeValue(int aid, const float*) const override {}
+			void setAttributeValue(int aid, const int*) const override {}
+			void setAttributeValue(int aid, const void*) const override {}
+			void setAttributeValue(int aid, const unsigned char*) const override {}
+			void setAttributeFromVariant(int uid, const variant& value) const override {}
+
+			void configureActives(AttributeSetPtr attrset) override {
+				for(auto& attr : attrset->getAttributes()) {
+					configureAttribute(attr);
+				}
+			}
+			void configureAttribute(AttributeBasePtr attr) override {
+				for(auto& desc : attr->getAttrDesc()) {
+					desc.setLocation(getAttribute(desc.getAttrName()));
+				}
+			}
+			void configureUniforms(UniformBufferBase& uniforms) override {}
+
+			int getColorUniform() const override { return getUniform("color"); }
+			int getLineWidthUniform() const override { return getUniform("line_width"); }
+			int getMvUniform() const override { return getUniform("mv_matrix"); }
+			int getPUniform() const override { return getUniform("p_matrix"); }
+			int getPVUniform() const override { return getUniform("pv_matrix"); }
+			int getMvpUniform() const override { return getUniform("mvp_matrix"); }
+			int getTexMapUniform() const override { return getUniform("tex_map"); }
+			int getDiscardUniform() const override { return getUniform("discard"); }
+
+			int getColorAttribute() const override { return getAttribute("color"); }
+			int getVertexAttribute() const override { return getAttribute("position"); }
+			int getTexcoordAttribute() const override { return getAttribute("texcoord"); }
+			int getNormalAttribute() const override { return getAttribute("normal"); }
+
+			void setUniformsForTexture(const TexturePtr& tex) const override {
+				if(tex) {
+					tex->bind();
+				}
+			}
+
+			ShaderProgramPtr clone() override {
+				return std::make_shared<ShaderProgramNull>(*this);
+			}
+		private:
+			typedef std::map<std::string, int> location_map;
+
+			static int lookup(location_map& m, const std::string& name) {
+				auto it = m.find(name);
+				if(it == m.end()) {
+					it = m.emplace(name, static_cast<int>(m.size())).first;
+				}
+				return it->second;
+			}
+
+			static std::vector<std::string> names(const location_map& m) {
+				std::vector<std::string> res;
+				for(auto& p : m) {
+					res.emplace_back(p.first);
+				}
+				return res;
+			}
+
+			mutable location_map uniforms_;
+			mutable location_map attributes_;
+		};
+
+		ShaderProgramPtr get_program(const std::string& name, const variant& node)
+		{
+			auto& sf = get_shader_factory();
+			auto it = sf.find(name);
+			if(it != sf.end()) {
+				return it->second;
+			}
+			auto spp = std::make_shared<ShaderProgramNull>(name, node);
+			sf[name] = spp;
+			return spp;
+		}
+
+		ShaderProgramPtr get_program_from_variant(const variant& node)
+		{
+			if(node.is_map() && node.has_key("name")) {
+				return get_program(node["name"].as_string(), node);
+			}
+			std::stringstream ss;
+			ss << "null_shader" << get_shader_factory().size();
+			return get_program(ss.str(), node);
+		}
+
+		class HardwareAttributeNull : public HardwareAttributeImpl
+		{
+		public:
+			explicit HardwareAttributeNull(AttributeBase* parent) : HardwareAttributeImpl(parent) {}
+			void update(const void* value, ptrdiff_t offset, size_t size) override {
+				record_upload(static_cast<int64_t>(size));
+				HardwareAttributeImpl::update(value, offset, size);
+			}
+			HardwareAttributePtr create(AttributeBase* parent) override {
+				return std::make_shared<HardwareAttributeNull>(parent);
+			}
+		};
+
+		// Claims to be hardware backed so that attribute buffers are created
+		// by the device and their uploads can be counted.
+		class AttributeSetNull : public AttributeSet
+		{
+		public:
+			explicit AttributeSetNull(bool indexed, bool instanced) : AttributeSet(indexed, instanced) {}
+			bool isHardwareBacked() const override { return true; }
+			AttributeSetPtr clone() override {
+				return std::make_shared<AttributeSetNull>(*this);
+			}
+		private:
+			void handleIndexUpdate() override {
+				record_upload(getTotalArraySize());
+			}
+		};
+
+		class RenderTargetNull : public RenderTarget
+		{
+		public:
+			explicit RenderTargetNull(int width, int height,
+				int color_plane_count,
+				bool depth,
+				bool stencil,
+				bool use_multi_sampling,
+				int multi_samples)
+				: RenderTarget(width, height, color_plane_count, depth, stencil, use_multi_sampling, multi_samples)
+			{
+				on_create();
+			}
+			explicit RenderTargetNull(const variant& node)
+				: RenderTarget(node)
+			{
+				on_create();
+			}
+			RenderTargetNull(const RenderTargetNull& rt)
+				: RenderTarget(rt)
+			{
+				on_create();
+			}
+		private:
+			void handleCreate() override {
+				auto tex = Texture::createTextureArray(getColorPlanes(), width(), height(), PixelFormat::PF::PIXELFORMAT_RGBA8888, TextureType::TEXTURE_2D);
+				tex->setSourceRect(-1, rect(0, 0, width(), height()));
+				setTexture(tex);
+				setDrawRect(rect(0, 0, width(), height()));
+			}
+			void handleApply(const rect& r) const override {}
+			void handleUnapply() const override {}
+			void handleClear() const override {}
+			void handleSizeChange(int width, int height) override {
+				handleCreate();
+			}
+			RenderTargetPtr handleClone() override {
+				return std::make_shared<RenderTargetNull>(*this);
+			}
+			std::vector<uint8_t> handleReadPixels() const override {
+				return std::vector<uint8_t>(width() * height() * 4);
+			}
+			SurfacePtr handleReadToSurface(SurfacePtr s) const override {
+				return Surface::create(width(), height(), PixelFormat::PF::PIXELFORMAT_ABGR8888);
+			}
+		};
+
+		// Each call counts as one draw of the vertices the OpenGL canvas
+		// would have sent.
+		class CanvasNull : public Canvas
+		{
+		public:
+			CanvasNull() {}
+
+			void blitTexture(const TexturePtr& tex, const rect& src, float rotation, const rect& dst, const Color& color, CanvasBlitFlags flags) const override {
+				draw(tex, 4);
+			}
+			void blitTexture(const TexturePtr& tex, const std::vector<vertex_texcoord>& vtc, float rotation, const Color& color) override {
+				draw(tex, vtc.size());
+			}
+
+			void drawSolidRect(const rect& r, const Color& fill_color, const Color& stroke_color, float rotate) const override {
+				draw("simple", 4);
+				draw("simple", 5);
+			}
+			void drawSolidRect(const rect& r, const Color& fill_color, float rotate) const override {
+				draw("simple", 4);
+			}
+			void drawHollowRect(const rect& r, const Color& stroke_color, float rotate) const override {
+				draw("simple", 5);
+			}
+			void drawLine(const point& p1, const point& p2, const Color& color) const override {
+				draw("simple", 2);
+			}
+			void drawLines(const std::vector<glm::vec2>& varray, float line_width, const Color& color) const override {
+				draw("simple", varray.size());
+			}
+			void drawLines(const std::vector<glm::vec2>& varray, float line_width, const std::vector<glm::u8vec4>& carray) const override {
+				draw("attr_color_shader", varray.size());
+			}
+			void drawLineStrip(const std::vector<glm::vec2>& points, float line_width, const Color& color) const override {
+				draw("simple", points.size());
+			}
+			void drawLineLoop(const std::vector<glm::vec2>& varray, float line_width, const Color& color) const override {
+				draw("simple", varray.size());
+			}
+			void drawLine(const pointf& p1, const pointf& p2, const Color& color) const override {
+				draw("simple", 2);
+			}
+			void drawPolygon(const std::vector<glm::vec2>& points, const Color& color) const override {
+				draw("simple", points.size());
+			}
+
+			void drawSolidCircle(const point& centre, float radius, const Color& color) const override {
+				drawSolidCircle(pointf(static_cast<float>(centre.x), static_cast<float>(centre.y)), radius, color);
+			}
+			void drawSolidCircle(const point& centre, float radius, const std::vector<glm::u8vec4>& color) const override {
+				drawSolidCircle(pointf(static_cast<float>(centre.x), static_cast<float>(centre.y)), radius, color);
+			}
+			void drawSolidCircle(const pointf& centre, float radius, const Color& color) const override {
+				draw("circle", 4);
+			}
+			void drawSolidCircle(const pointf& centre, float radius, const std::vector<glm::u8vec4>& color) const override {
+				draw("attr_color_shader", color.size());
+			}
+
+			void drawHollowCircle(const point& centre, float outer_radius, float inner_radius, const Color& color) const override {
+				drawHollowCircle(pointf(static_cast<float>(centre.x), static_cast<float>(centre.y)), outer_radius, inner_radius, color);
+			}
+			void drawHollowCircle(const pointf& centre, float outer_radius, float inner_radius, const Color& color) const override {
+				draw("circle", 4);
+			}
+
+			void drawPoints(const std::vector<glm::vec2>& points, float radius, const Color& color) const override {
+				draw("simple", points.size());
+			}
+		private:
+			DISALLOW_COPY_AND_ASSIGN(CanvasNull);
+			void handleDimensionsChanged() override {}
+
+			void draw(const TexturePtr& tex, size_t vertices) const {
+				auto shader = getCurrentShader();
+				shader->makeActive();
+				shader->setUniformsForTexture(tex);
+				record_draw(vertices);
+			}
+
+			void draw(const std::string& shader_name, size_t vertices) const {
+				ShaderProgram::getProgram(shader_name)->makeActive();
+				record_draw(vertices);
+			}
+		};
+
+		CanvasPtr& get_canvas_instance()
+		{
+			static CanvasPtr res = CanvasPtr(new CanvasNull());
+			return res;
+		}
+
+		class ClipScopeNull : public ClipScope
+		{
+		public:
+			explicit ClipScopeNull(const rect& r) : ClipScope(r) {}
+			void apply(const CameraPtr& cam) const override {}
+			void clear() const override {}
+		};
+
+		class ClipShapeScopeNull : public ClipShapeScope
+		{
+		public:
+			explicit ClipShapeScopeNull(const RenderablePtr& r) : ClipShapeScope(r) {}
+			void apply(const CameraPtr& cam) const override {
+				// The clip shape is drawn into the stencil buffer.
+				DisplayDevice::getCurrent()->render(getRenderable().get());
+			}
+			void clear() const override {}
+		};
+
+		class StencilScopeNull : public StencilScope
+		{
+		public:
+			explicit StencilScopeNull(const StencilSettings& settings) : StencilScope(settings) {}
+		private:
+			void handleUpdatedMask() override {}
+			void handleUpdatedSettings() override {}
+		};
+
+		class ScissorNull : public Scissor
+		{
+		public:
+			explicit ScissorNull(const rect& area) : Scissor(area) {}
+			void apply() override {}
+			void clear() override {}
+		};
+
+		class BlendEquationImplNull : public BlendEquationImplBase
+		{
+		public:
+			void apply(const BlendEquation& eqn) const override {}
+			void clear(const BlendEquation& eqn) const override {}
+		};
+	}
+
+	DisplayDeviceNull::DisplayDeviceNull(WindowPtr wnd)
+		: DisplayDevice(wnd),
+		  default_camera_(),
+		  viewport_()
+	{
+	}
+
+	DisplayDeviceNull::~DisplayDeviceNull()
+	{
+	}
+
+	void DisplayDeviceNull::init(int width, int height)
+	{
+		viewport_ = rect(0, 0, width, height);
+	}
+
+	void DisplayDeviceNull::printDeviceInfo()
+	{
+		LOG_INFO("Null display device: nothing will be drawn.");
+	}
+
+	int DisplayDeviceNull::queryParameteri(DisplayDeviceParameters param)
+	{
+		switch (param)
+		{
+		case DisplayDeviceParameters::MAX_TEXTURE_UNITS:	return 16;
+		default: break;
+		}
+		ASSERT_LOG(false, "Invalid Parameter requested: " << static_cast<int>(param));
+		return -1;
+	}
+
+	void DisplayDeviceNull::clearTextures()
+	{
+	}
+
+	void DisplayDeviceNull::clear(ClearFlags clr)
+	{
+	}
+
+	void DisplayDeviceNull::setClearColor(float r, float g, float b, float a) const
+	{
+	}
+
+	void DisplayDeviceNull::setClearColor(const Color& color) const
+	{
+	}
+
+	void DisplayDeviceNull::swap()
+	{
+		++get_stats().frames;
+	}
+
+	ShaderProgramPtr DisplayDeviceNull::getDefaultShader()
+	{
+		return get_program("default", variant());
+	}
+
+	CameraPtr DisplayDeviceNull::setDefaultCamera(const CameraPtr& cam)
+	{
+		auto old_cam = default_camera_;
+		default_camera_ = cam;
+		return old_cam;
+	}
+
+	CameraPtr DisplayDeviceNull::getDefaultCamera() const
+	{
+		return default_camera_;
+	}
+
+	void DisplayDeviceNull::render(const Renderable* r) const
+	{
+		if(!r->isEnabled()) {
+			return;
+		}
+
+		if(r->hasClipSettings()) {
+			render(r->getStencilMask().get());
+		}
+
+		auto shader = r->getShader();
+		shader->makeActive();
+
+		if(r->getRenderTarget()) {
+			r->getRenderTarget()->apply();
+		}
+
+		shader->setUniformsForTexture(r->getTexture());
+
+		auto uniform_draw_fn = shader->getUniformDrawFunction();
+		if(uniform_draw_fn) {
+			uniform_draw_fn(shader);
+		}
+
+		for(auto as : r->getAttributeSet()) {
+			if(!as->isEnabled()) {
+				continue;
+			}
+			if((!as->isMultiDrawEnabled() && as->getCount() <= 0) || (as->isMultiDrawEnabled() && as->getMultiDrawCount() <= 0)) {
+				continue;
+			}
+
+			int64_t vertices = 0;
+			if(as->isMultiDrawEnabled()) {
+				for(int n = 0; n != as->getMultiDrawCount(); ++n) {
+					vertices += as->getMultiCountArray()[n];
+				}
+			} else {
+				vertices = as->getCount();
+			}
+			if(as->isInstanced()) {
+				vertices *= as->getInstanceCount();
+			}
+			record_draw(vertices);
+
+			shader->cleanUpAfterDraw();
+		}
+
+		if(r->getRenderTarget()) {
+			r->getRenderTarget()->unapply();
+		}
+	}
+
+	ScissorPtr DisplayDeviceNull::getScissor(const rect& r)
+	{
+		return ScissorPtr(new ScissorNull(r));
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTexture(const SurfacePtr& surface, const variant& node)
+	{
+		std::vector<SurfacePtr> surfaces;
+		if(surface != nullptr) {
+			surfaces.emplace_back(surface);
+		}
+		return std::make_shared<TextureNull>(node, surfaces);
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTexture(const SurfacePtr& surface, TextureType type, int mipmap_levels)
+	{
+		std::vector<SurfacePtr> surfaces(1, surface);
+		return std::make_shared<TextureNull>(surfaces, type, mipmap_levels);
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTexture1D(int width, PixelFormat::PF fmt)
+	{
+		return std::make_shared<TextureNull>(1, width, 0, 0, fmt, TextureType::TEXTURE_1D);
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTexture2D(int width, int height, PixelFormat::PF fmt)
+	{
+		const int count = fmt == PixelFormat::PF::PIXELFORMAT_YV12 ? 3 : 1;
+		return std::make_shared<TextureNull>(count, width, height, 0, fmt, TextureType::TEXTURE_2D);
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTexture3D(int width, int height, int depth, PixelFormat::PF fmt)
+	{
+		return std::make_shared<TextureNull>(1, width, height, depth, fmt, TextureType::TEXTURE_3D);
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTextureArray(int count, int width, int height, PixelFormat::PF fmt, TextureType type)
+	{
+		return std::make_shared<TextureNull>(count, width, height, 0, fmt, type);
+	}
+
+	TexturePtr DisplayDeviceNull::handleCreateTextureArray(const std::vector<SurfacePtr>& surfaces, const variant& node)
+	{
+		return std::make_shared<TextureNull>(node, surfaces);
+	}
+
+	RenderTargetPtr DisplayDeviceNull::handleCreateRenderTarget(int width, int height,
+			int color_plane_count,
+			bool depth,
+			bool stencil,
+			bool use_multi_sampling,
+			int multi_samples)
+	{
+		return std::make_shared<RenderTargetNull>(width, height, color_plane_count, depth, stencil, use_multi_sampling, multi_samples);
+	}
+
+	RenderTargetPtr DisplayDeviceNull::handleCreateRenderTarget(const variant& node)
+	{
+		return std::make_shared<RenderTargetNull>(node);
+	}
+
+	AttributeSetPtr DisplayDeviceNull::handleCreateAttributeSet(bool indexed, bool instanced)
+	{
+		return std::make_shared<AttributeSetNull>(indexed, instanced);
+	}
+
+	HardwareAttributePtr DisplayDeviceNull::handleCreateAttribute(AttributeBase* parent)
+	{
+		return std::make_shared<HardwareAttributeNull>(parent);
+	}
+
+	CanvasPtr DisplayDeviceNull::getCanvas()
+	{
+		return get_canvas_instance();
+	}
+
+	ClipScopePtr DisplayDeviceNull::createClipScope(const rect& r)
+	{
+		return ClipScopePtr(new ClipScopeNull(r));
+	}
+
+	ClipShapeScopePtr DisplayDeviceNull::createClipShapeScope(const RenderablePtr& r)
+	{
+		return ClipShapeScopePtr(new ClipShapeScopeNull(r));
+	}
+
+	StencilScopePtr DisplayDeviceNull::createStencilScope(const StencilSettings& settings)
+	{
+		return StencilScopePtr(new StencilScopeNull(settings));
+	}
+
+	BlendEquationImplBasePtr DisplayDeviceNull::getBlendEquationImpl()
+	{
+		return BlendEquationImplBasePtr(new BlendEquationImplNull());
+	}
+
+	void DisplayDeviceNull::setViewPort(int x, int y, int width, int height)
+	{
+		setViewPort(rect(x, y, width, height));
+	}
+
+	void DisplayDeviceNull::setViewPort(const rect& vp)
+	{
+		if(vp.w() != 0 && vp.h() != 0) {
+			viewport_ = vp;
+		}
+	}
+
+	const rect& DisplayDeviceNull::getViewPort() const
+	{
+		return viewport_;
+	}
+
+	bool DisplayDeviceNull::doCheckForFeature(DisplayDeviceCapabilities cap)
+	{
+		switch(cap) {
+		case DisplayDeviceCapabilities::NPOT_TEXTURES:
+		case DisplayDeviceCapabilities::BLEND_EQUATION_SEPERATE:
+		case DisplayDeviceCapabilities::RENDER_TO_TEXTURE:
+		case DisplayDeviceCapabilities::SHADERS:
+			return true;
+		case DisplayDeviceCapabilities::UNIFORM_BUFFERS:
+			return false;
+		default:
+			ASSERT_LOG(false, "Unknown value for DisplayDeviceCapabilities given.");
+		}
+		return false;
+	}
+
+	void DisplayDeviceNull::loadShadersFromVariant(const variant& node)
+	{
+		if(node.is_map() && node.has_key("instances") && node["instances"].is_list()) {
+			for(auto instance : node["instances"].as_list()) {
+				get_program_from_variant(instance);
+			}
+		} else {
+			get_program_from_variant(node);
+		}
+	}
+
+	ShaderProgramPtr DisplayDeviceNull::getShaderProgram(const std::string& name)
+	{
+		return get_program(name, variant());
+	}
+
+	ShaderProgramPtr DisplayDeviceNull::getShaderProgram(const variant& node)
+	{
+		return get_program_from_variant(node);
+	}
+
+	ShaderProgramPtr DisplayDeviceNull::createShader(const std::string& name,
+		const std::vector<ShaderData>& shader_data,
+		const std::vector<ActiveMapping>& uniform_map,
+		const std::vector<ActiveMapping>& attribute_map)
+	{
+		return std::make_shared<ShaderProgramNull>(name, variant());
+	}
+
+	ShaderProgramPtr DisplayDeviceNull::createGaussianShader(int radius)
+	{
+		std::stringstream ss;
+		ss << "blur" << radius;
+		return get_program(ss.str(), variant());
+	}
+
+	void DisplayDeviceNull::doBlitTexture(const TexturePtr& tex, int dstx, int dsty, int dstw, int dsth, float rotation, int srcx, int srcy, int srcw, int srch)
+	{
+		ASSERT_LOG(false, "DisplayDevice::doBlitTexture deprecated");
+	}
+
+	bool DisplayDeviceNull::handleReadPixels(int x, int y, unsigned width, unsigned height, ReadFormat fmt, AttrFormat type, void* data, int stride)
+	{
+		ASSERT_LOG(width > 0 && height > 0, "Width or height was negative: " << width << " x " << height);
+		std::fill(static_cast<uint8_t*>(data), static_cast<uint8_t*>(data) + height * stride, 0);
+		return true;
+	}
+
+	EffectPtr DisplayDeviceNull::createEffect(const variant& node)
+	{
+		return EffectPtr();
+	}
+
+	const RenderStats& DisplayDeviceNull::getStats()
+	{
+		return get_stats();
+	}
+
+	void DisplayDeviceNull::resetStats()
+	{
+		get_stats() = RenderStats();
+	}
+}
+
+UNIT_TEST(null_display_device_counts_blits)
+{
+	using namespace KRE;
+	DisplayDevicePtr device = DisplayDevice::factory("null", WindowPtr());
+	CHECK_EQ(device->ID(), DisplayDevice::DISPLAY_DEVICE_NULL);
+	device->init(800, 600);
+
+	DisplayDeviceNull::resetStats();
+
+	Blittable blit(Texture::createTexture2D(32, 16, PixelFormat::PF::PIXELFORMAT_RGBA8888));
+	blit.setDrawRect(rect(10, 20, 32, 16));
+	blit.preRender(WindowPtr());
+	device->render(&blit);
+	device->render(&blit);
+	device->swap();
+
+	const RenderStats& stats = DisplayDeviceNull::getStats();
+	CHECK_EQ(stats.frames, 1);
+	CHECK_EQ(stats.draw_calls, 2);
+	CHECK_EQ(stats.vertices, 8);
+
+	DisplayDeviceNull::resetStats();
+}
@@ -264,22 +264,24 @@ namespace KRE
 
 			auto& td = texture_data_[0];
 			td.palette.clear();
-			getSurface(0)->iterateOverSurface([&new_pixels, rp, &td](int x, int y, int r, int g, int b, int a){
-				color_histogram_type::key_type color = (static_cast<uint32_t>(r) << 24)
-					| (static_cast<uint32_t>(g) << 16)
-					| (static_cast<uint32_t>(b) << 8)
-					| (static_cast<uint32_t>(a));
-
-				auto it = td.color_index_map.find(color);
-				if(it == td.color_index_map.end()) {
-					const auto index = td.palette.size();
-					td.color_index_map[color] = static_cast<uint8_t>(index);
-					new_pixels[x + y * rp] = static_cast<uint8_t>(index);
-					td.palette.emplace_back(color);
-				} else {
-					new_pixels[x + y * rp] = static_cast<uint8_t>(it->second);
+			getSurface(0)->iterateOverRows([&new_pixels, rp, &td](int y, const uint8_t* rgba, int w){
+				for(int x = 0; x != w; ++x, rgba += 4) {
+					color_histogram_type::key_type color = (static_cast<uint32_t>(rgba[0]) << 24)
+						| (static_cast<uint32_t>(rgba[1]) << 16)
+						| (static_cast<uint32_t>(rgba[2]) << 8)
+						| (static_cast<uint32_t>(rgba[3]));
+
+					auto it = td.color_index_map.find(color);
+					if(it == td.color_index_map.end()) {
+						const auto index = td.palette.size();
+						td.color_index_map[color] = static_cast<uint8_t>(index);
+						new_pixels[x + y * rp] = static_cast<uint8_t>(index);
+						td.palette.emplace_back(color);
+					} else {
+						new_pixels[x + y * rp] = static_cast<uint8_t>(it->second);
+					}
+					ASSERT_LOG(td.palette.size() < 256, "Can't convert surface to palettized version. Too many colors in source image > 256");
 				}
-				ASSERT_LOG(td.palette.size() < 256, "Can't convert surface to palettized version. Too many colors in source image > 256");
 			});
 			surf->writePixels(&new_pixels[0], static_cast<int>(new_pixels.size()));
 			surf->setAlphaMap(getSurface(0)->getAlphaMap());
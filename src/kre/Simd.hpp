@@ -0,0 +1,175 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KRE_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define KRE_SIMD_AVX2
+#include <immintrin.h>
+#endif
+
+// Helpers for the vectorized paths of the CPU image filters. Vector code is
+// chosen when the compiler targets SSE2 or AVX2, and falls back to scalar
+// code otherwise. Every path performs the same arithmetic in the same order
+// as the scalar code, so the output doesn't depend on which one ran.
+namespace KRE
+{
+	namespace simd
+	{
+		// The vector paths can be turned off at run time, to check them
+		// against the scalar code or to compare their speed.
+		inline bool& enabled_flag()
+		{
+			static bool enabled = true;
+			return enabled;
+		}
+
+		inline bool enabled() { return enabled_flag(); }
+		inline void set_enabled(bool en) { enabled_flag() = en; }
+
+		// Four doubles, used to work on the four channels of a pixel at once.
+		struct dvec4
+		{
+#if defined(KRE_SIMD_AVX2)
+			__m256d v;
+
+			dvec4() {}
+			explicit dvec4(double d) : v(_mm256_set1_pd(d)) {}
+			explicit dvec4(__m256d d) : v(d) {}
+
+			// Lane n is byte n of px.
+			static dvec4 fromBytes(uint32_t px) {
+				const __m128i zero = _mm_setzero_si128();
+				const __m128i b = _mm_cvtsi32_si128(static_cast<int>(px));
+				return dvec4(_mm256_cvtepi32_pd(_mm_unpacklo_epi16(_mm_unpacklo_epi8(b, zero), zero)));
+			}
+
+			// Truncates each lane towards zero, as static_cast<int> does.
+			void toInts(int* out) const {
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_cvttpd_epi32(v));
+			}
+
+			// Clamps each lane to [0, 255], then truncates it.
+			uint32_t toClampedBytes() const {
+				const __m256d c = _mm256_min_pd(_mm256_max_pd(v, _mm256_setzero_pd()), _mm256_set1_pd(255.0));
+				const __m128i i = _mm256_cvttpd_epi32(c);
+				const __m128i b = _mm_packus_epi16(_mm_packs_epi32(i, i), _mm_setzero_si128());
+				return static_cast<uint32_t>(_mm_cvtsi128_si32(b));
+			}
+
+			dvec4 operator-() const { return dvec4(_mm256_xor_pd(v, _mm256_set1_pd(-0.0))); }
+			dvec4 operator+(const dvec4& o) const { return dvec4(_mm256_add_pd(v, o.v)); }
+			dvec4 operator-(const dvec4& o) const { return dvec4(_mm256_sub_pd(v, o.v)); }
+			dvec4 operator*(const dvec4& o) const { return dvec4(_mm256_mul_pd(v, o.v)); }
+			dvec4 operator/(const dvec4& o) const { return dvec4(_mm256_div_pd(v, o.v)); }
+#elif defined(KRE_SIMD_SSE2)
+			__m128d lo, hi;
+
+			dvec4() {}
+			explicit dvec4(double d) : lo(_mm_set1_pd(d)), hi(_mm_set1_pd(d)) {}
+			dvec4(__m128d l, __m128d h) : lo(l), hi(h) {}
+
+			static dvec4 fromBytes(uint32_t px) {
+				const __m128i zero = _mm_setzero_si128();
+				const __m128i b = _mm_cvtsi32_si128(static_cast<int>(px));
+				const __m128i i = _mm_unpacklo_epi16(_mm_unpacklo_epi8(b, zero), zero);
+				return dvec4(_mm_cvtepi32_pd(i), _mm_cvtepi32_pd(_mm_shuffle_epi32(i, _MM_SHUFFLE(1, 0, 3, 2))));
+			}
+
+			void toInts(int* out) const {
+				const __m128i i = _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(out), i);
+			}
+
+			uint32_t toClampedBytes() const {
+				const __m128d zero = _mm_setzero_pd(), max = _mm_set1_pd(255.0);
+				const __m128i i = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(lo, zero), max)),
+					_mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(hi, zero), max)));
+				const __m128i b = _mm_packus_epi16(_mm_packs_epi32(i, i), _mm_setzero_si128());
+				return static_cast<uint32_t>(_mm_cvtsi128_si32(b));
+			}
+
+			dvec4 operator-() const {
+				const __m128d sign = _mm_set1_pd(-0.0);
+				return dvec4(_mm_xor_pd(lo, sign), _mm_xor_pd(hi, sign));
+			}
+			dvec4 operator+(const dvec4& o) const { return dvec4(_mm_add_pd(lo, o.lo), _mm_add_pd(hi, o.hi)); }
+			dvec4 operator-(const dvec4& o) const { return dvec4(_mm_sub_pd(lo, o.lo), _mm_sub_pd(hi, o.hi)); }
+			dvec4 operator*(const dvec4& o) const { return dvec4(_mm_mul_pd(lo, o.lo), _mm_mul_pd(hi, o.hi)); }
+			dvec4 operator/(const dvec4& o) const { return dvec4(_mm_div_pd(lo, o.lo), _mm_div_pd(hi, o.hi)); }
+#else
+			double v[4];
+
+			dvec4() {}
+			explicit dvec4(double d) { v[0] = v[1] = v[2] = v[3] = d; }
+
+			static dvec4 fromBytes(uint32_t px) {
+				dvec4 r;
+				for(int n = 0; n != 4; ++n) {
+					r.v[n] = static_cast<double>((px >> (n * 8)) & 0xff);
+				}
+				return r;
+			}
+
+			void toInts(int* out) const {
+				for(int n = 0; n != 4; ++n) {
+					out[n] = static_cast<int>(v[n]);
+				}
+			}
+
+			uint32_t toClampedBytes() const {
+				uint32_t r = 0;
+				for(int n = 0; n != 4; ++n) {
+					const double d = v[n];
+					r |= static_cast<uint32_t>(d < 0 ? 0 : d > 255 ? 255 : static_cast<uint8_t>(d)) << (n * 8);
+				}
+				return r;
+			}
+
+			dvec4 operator-() const { dvec4 r; for(int n = 0; n != 4; ++n) { r.v[n] = -v[n]; } return r; }
+			dvec4 operator+(const dvec4& o) const { dvec4 r; for(int n = 0; n != 4; ++n) { r.v[n] = v[n] + o.v[n]; } return r; }
+			dvec4 operator-(const dvec4& o) const { dvec4 r; for(int n = 0; n != 4; ++n) { r.v[n] = v[n] - o.v[n]; } return r; }
+			dvec4 operator*(const dvec4& o) const { dvec4 r; for(int n = 0; n != 4; ++n) { r.v[n] = v[n] * o.v[n]; } return r; }
+			dvec4 operator/(const dvec4& o) const { dvec4 r; for(int n = 0; n != 4; ++n) { r.v[n] = v[n] / o.v[n]; } return r; }
+#endif
+		};
+
+#if defined(KRE_SIMD_SSE2)
+		// The low 32 bits of the products of each lane. SSE2 has no 32-bit
+		// multiply, so it's built from two 32x32->64 bit multiplies.
+		inline __m128i mullo_epi32(__m128i a, __m128i b)
+		{
+			const __m128i even = _mm_mul_epu32(a, b);
+			const __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+			return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+		}
+#endif
+	}
+}
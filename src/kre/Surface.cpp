@@ -21,7 +21,10 @@
 	   distribution.
 */
 
+#include <atomic>
+#include <cstring>
 #include <future>
+#include <mutex>
 #include <thread>
 #include <tuple>
 
@@ -39,6 +42,8 @@ namespace KRE
 			return res;
 		}
 
+		// Surfaces may be loaded from several threads at once, so the
+		// cache is guarded by get_surface_cache_mutex().
 		typedef std::map<std::string, SurfacePtr> SurfaceCacheType;
 		SurfaceCacheType& get_surface_cache()
 		{
@@ -46,18 +51,76 @@ namespace KRE
 			return res;
 		}
 
+		std::mutex& get_surface_cache_mutex()
+		{
+			static std::mutex res;
+			return res;
+		}
+
 		unsigned get_next_id()
 		{
-			static unsigned id = 1;
+			static std::atomic<unsigned> id(1);
 			return id++;
 		}
 
 		int alpha_strip_threshold = 20;	// 20/255 ~ 7.8%
 
+		decoded_image_loader decoded_image_loader_fn = nullptr;
+		decoded_image_saver decoded_image_saver_fn = nullptr;
+
 		const int max_surface_width = 4096;
 		const int max_surface_height = 4096;
 	}
 
+	namespace
+	{
+		bool is_little_endian()
+		{
+			const uint32_t one = 1;
+			uint8_t first_byte;
+			memcpy(&first_byte, &one, 1);
+			return first_byte == 1;
+		}
+
+		// Works out how many rows and columns on each side of the surface
+		// have no pixels more opaque than threshold, in the order left, top,
+		// right, bottom. If no pixel is above the threshold borders is
+		// returned unchanged.
+		std::array<int, 4> find_alpha_borders(Surface& surf, int threshold, std::array<int, 4> borders)
+		{
+			int top = -1, bottom = -1, left = surf.width(), right = -1;
+			surf.iterateOverRows([&](int y, const uint8_t* rgba, int w) {
+				int first = 0;
+				while(first != w && rgba[first * 4 + 3] <= threshold) {
+					++first;
+				}
+				if(first == w) {
+					return;
+				}
+
+				int last = w - 1;
+				while(rgba[last * 4 + 3] <= threshold) {
+					--last;
+				}
+
+				if(top < 0) {
+					top = y;
+				}
+				bottom = y;
+				left = std::min(left, first);
+				right = std::max(right, last);
+			});
+
+			if(top >= 0) {
+				borders[0] = left;
+				borders[1] = top;
+				borders[2] = surf.width() - 1 - right;
+				borders[3] = surf.height() - 1 - bottom;
+			}
+			return borders;
+		}
+	}
+
 	namespace {
 		std::set<const Surface*>& getAllSurfacesMutable() {
 			static std::set<const Surface*>* all_surfaces = new std::set<const Surface*>;
@@ -134,21 +197,70 @@ namespace KRE
 	SurfacePtr Surface::create(const std::string& filename, SurfaceFlags flags, PixelFormat::PF fmt, SurfaceConvertFn convert)
 	{
 		ASSERT_LOG(get_surface_creator().empty() == false, "No resources registered to surfaces images from files.");
-		auto create_fn_tuple = get_surface_creator().begin()->second;
 		if(!(flags & SurfaceFlags::NO_CACHE)) {
-			auto it = get_surface_cache().find(filename);
-			if(it != get_surface_cache().end()) {
-				return it->second;
+			{
+				std::lock_guard<std::mutex> lock(get_surface_cache_mutex());
+				auto it = get_surface_cache().find(filename);
+				if(it != get_surface_cache().end()) {
+					return it->second;
+				}
 			}
-			auto surface = std::get<0>(create_fn_tuple)(filename, fmt, flags, convert);
-			surface->name_ = filename;
-			get_surface_cache()[filename] = surface;
-			surface->init();
-			return surface;
+			auto surface = loadFromFile(filename, flags, fmt, convert);
+
+			// Another thread may have loaded the same file meanwhile; keep
+			// whichever surface made it into the cache first.
+			std::lock_guard<std::mutex> lock(get_surface_cache_mutex());
+			auto res = get_surface_cache().insert(std::make_pair(filename, surface));
+			return res.first->second;
 		}
+		return loadFromFile(filename, flags, fmt, convert);
+	}
+
+	SurfacePtr Surface::loadFromFile(const std::string& filename, SurfaceFlags flags, PixelFormat::PF fmt, SurfaceConvertFn convert)
+	{
+		auto create_fn_tuple = get_surface_creator().begin()->second;
+
+		// Images made with a conversion function can't be matched up with a
+		// decoded copy, since there's no telling what the function does.
+		const bool use_decoded_cache = decoded_image_loader_fn && convert == nullptr && !(flags & SurfaceFlags::FROM_DATA);
+		if(use_decoded_cache) {
+			DecodedImage img;
+			if(decoded_image_loader_fn(filename, fmt, flags, &img)) {
+				// The cached pixels have already been through the alpha
+				// filter, so they're copied into a blank surface rather than
+				// created from pixels, which would filter them again.
+				auto surf = std::get<2>(create_fn_tuple)(img.width, img.height, img.bpp, img.rmask, img.gmask, img.bmask, img.amask);
+				surf->name_ = filename;
+				surf->setFlags(flags);
+				{
+					SurfaceLock lck(surf);
+					const int row_bytes = img.width * surf->bytesPerPixel();
+					const char* src = static_cast<const char*>(img.pixels);
+					char* dst = static_cast<char*>(surf->pixelsWriteable());
+					for(int y = 0; y != img.height; ++y) {
+						memcpy(dst + y * surf->rowPitch(), src + y * img.row_pitch, row_bytes);
+					}
+				}
+
+				const int npixels = img.width * img.height;
+				surf->alpha_map_ = std::make_shared<std::vector<bool>>(npixels);
+				auto& am = *surf->alpha_map_;
+				for(int n = 0; n != npixels; ++n) {
+					am[n] = ((img.alpha_map[n >> 3] >> (n & 7)) & 1) != 0;
+				}
+
+				surf->setAlphaBorders(img.alpha_borders);
+				return surf;
+			}
+		}
+
 		auto surf = std::get<0>(create_fn_tuple)(filename, fmt, flags, convert);
 		surf->name_ = filename;
 		surf->init();
+
+		if(use_decoded_cache && decoded_image_saver_fn) {
+			decoded_image_saver_fn(filename, fmt, flags, surf);
+		}
 		return surf;
 	}
 
@@ -212,96 +324,24 @@ namespace KRE
 
 	void Surface::createAlphaMap()
 	{
-		const int npixels = width() * height();
 		alpha_map_ = std::make_shared<std::vector<bool>>();
-		alpha_map_->resize(npixels);
+		alpha_map_->resize(width() * height());
 
 		if(getPixelFormat()->hasAlphaChannel()) {
-			SurfaceLock lck(shared_from_this());
-			auto pf = getPixelFormat();
-			uint32_t alpha_mask = pf->getAlphaMask();
-			if(bytesPerPixel() == 4 && rowPitch() % 4 == 0) {
-				// Optimization for a common case. Operates ~25 faster than default case.
-				const uint32_t* px = reinterpret_cast<const uint32_t*>(pixels());
-				auto it = alpha_map_->begin();
-				for(int n = 0; n != npixels; ++n) {
-					*it++ = (*px++ & alpha_mask) ? false : true;
+			auto& am = *alpha_map_;
+			iterateOverRows([&am](int y, const uint8_t* rgba, int w) {
+				auto it = am.begin() + y * w;
+				for(int x = 0; x != w; ++x) {
+					*it++ = rgba[x * 4 + 3] == 0;
 				}
-			} else {
-				std::fill(alpha_map_->begin(), alpha_map_->end(), false);
-				int w = width();
-				auto& am = *alpha_map_;
-				iterateOverSurface([&am, w](int x, int y, int r, int g, int b, int a) {
-					if(a == 0) {
-						am[x + y * w] = true;
-					}
-				});
-			}
+			});
 		}
-
-		//if(getPixelFormat()->hasAlphaChannel()) {
-			//int w = width();
-			//auto& am = alpha_map_;
-			//iterateOverSurface([&am, w](int x, int y, int r, int g, int b, int a) {
-			//	am[x + y * w] = a == 0 ? true : false;
-			//});
-		//}
 	}
 
 	void Surface::stripAlphaBorders(int threshold)
 	{
 		if(getPixelFormat()->hasAlphaChannel()) {
-			const int w = width();
-			const int h = height();
-			SurfaceLock lck(shared_from_this());
-			auto pf = getPixelFormat();
-			uint32_t alpha_mask = pf->getAlphaMask();
-			int alpha_shift = pf->getAlphaShift();
-			threshold <<= alpha_shift;
-			if(bytesPerPixel() == 4 && rowPitch() % 4 == 0) {
-				// Optimization for a common case. Operates ~25 faster than default case.
-				const int num_pixels = w * h;
-				// top border
-				uint32_t const* pxt = reinterpret_cast<const uint32_t*>(pixels());
-				for(int ndx = 0; ndx < num_pixels; ++ndx) {
-					if((*pxt++ & alpha_mask) > static_cast<uint32_t>(threshold)) {
-						alpha_borders_[1] = ndx / w;
-						break;
-					}
-				}
-				const uint32_t* pxb = &reinterpret_cast<const uint32_t*>(pixels())[w * h];
-				// bottom border
-				for(int ndx = num_pixels - 1; ndx >= 0; --ndx) {
-					if((*(--pxb) & alpha_mask) > static_cast<uint32_t>(threshold)) {
-						alpha_borders_[3] = h - 1 - ndx / w;
-						break;
-					}
-				}
-				// left border
-				const uint32_t* pxl = reinterpret_cast<const uint32_t*>(pixels());
-				bool finished = false;
-				for(int x = 0; x < w && !finished; ++x) {
-					for(int y = 0; y < h && !finished; ++y) {
-						if((pxl[x + y*w] & alpha_mask) > static_cast<uint32_t>(threshold)) {
-							alpha_borders_[0] = x;
-							finished = true;
-						}
-					}
-				}
-				// right border
-				const uint32_t* pxr = reinterpret_cast<const uint32_t*>(pixels());
-				finished = false;
-				for(int x = w - 1; x >= 0 && !finished; --x) {
-					for(int y = 0; y < h && !finished; ++y) {
-						if((pxr[x + y*w] & alpha_mask) > static_cast<uint32_t>(threshold)) {
-							alpha_borders_[2] = w - 1 - x;
-							finished = true;
-						}
-					}
-				}
-			} else {
-				ASSERT_LOG(false, "won't apply stripAlphaBorders to non 32-bit RGBA image");
-			}
+			alpha_borders_ = find_alpha_borders(*this, threshold, alpha_borders_);
 		}
 	}
 
@@ -312,6 +352,7 @@ namespace KRE
 
 	void Surface::resetSurfaceCache()
 	{
+		std::lock_guard<std::mutex> lock(get_surface_cache_mutex());
 		get_surface_cache().clear();
 	}
 
@@ -399,6 +440,8 @@ namespace KRE
 		}
 
 		alpha_filter alpha_filter_fn = nullptr;
+
+		file_reader file_reader_fn = nullptr;
 	}
 
 	void Surface::setFileFilter(FileFilterType type, file_filter fn)
@@ -416,6 +459,22 @@ namespace KRE
 		return it->second;
 	}
 
+	void Surface::setFileReader(file_reader fn)
+	{
+		file_reader_fn = fn;
+	}
+
+	file_reader Surface::getFileReader()
+	{
+		return file_reader_fn;
+	}
+
+	void Surface::setDecodedImageCache(decoded_image_loader loader, decoded_image_saver saver)
+	{
+		decoded_image_loader_fn = loader;
+		decoded_image_saver_fn = saver;
+	}
+
 	void Surface::setAlphaFilter(alpha_filter fn)
 	{
 		alpha_filter_fn = fn;
@@ -472,6 +531,77 @@ namespace KRE
 		return alpha_map_->end();
 	}
 
+	const uint8_t* Surface::getRowRGBA(int y, uint8_t* scratch) const
+	{
+		const int w = width();
+		const uint8_t* src = static_cast<const uint8_t*>(pixels()) + y * rowPitch();
+		PixelFormat& pf = *pf_;
+
+		const bool has_alpha = pf.hasAlphaChannel();
+		if(bytesPerPixel() == 4 && pf.isRGB() && !pf.hasPalette()
+			&& (!pf.hasRedChannel() || pf.getRedBits() == 8)
+			&& (!pf.hasGreenChannel() || pf.getGreenBits() == 8)
+			&& (!pf.hasBlueChannel() || pf.getBlueBits() == 8)
+			&& (!has_alpha || pf.getAlphaBits() == 8)) {
+			const uint32_t rshift = pf.hasRedChannel() ? pf.getRedShift() : 0;
+			const uint32_t gshift = pf.hasGreenChannel() ? pf.getGreenShift() : 0;
+			const uint32_t bshift = pf.hasBlueChannel() ? pf.getBlueShift() : 0;
+			const uint32_t ashift = has_alpha ? pf.getAlphaShift() : 0;
+			const uint32_t rmask = pf.hasRedChannel() ? 0xff : 0;
+			const uint32_t gmask = pf.hasGreenChannel() ? 0xff : 0;
+			const uint32_t bmask = pf.hasBlueChannel() ? 0xff : 0;
+
+			static const bool little_endian = is_little_endian();
+			if(little_endian && has_alpha && rmask && gmask && bmask && rshift == 0 && gshift == 8 && bshift == 16 && ashift == 24) {
+				return src;
+			}
+
+			for(int x = 0; x != w; ++x) {
+				uint32_t px;
+				memcpy(&px, src + x * 4, 4);
+				uint8_t* out = scratch + x * 4;
+				out[0] = static_cast<uint8_t>((px >> rshift) & rmask);
+				out[1] = static_cast<uint8_t>((px >> gshift) & gmask);
+				out[2] = static_cast<uint8_t>((px >> bshift) & bmask);
+				out[3] = has_alpha ? static_cast<uint8_t>(px >> ashift) : 255;
+			}
+			return scratch;
+		}
+
+		// Formats with several pixels to a byte are given the position of
+		// the pixel within its byte as a bit offset.
+		int pixels_per_byte = 1, bits_per_index = 0;
+		switch(pf.getFormat()) {
+			case PixelFormat::PF::PIXELFORMAT_INDEX1LSB:
+			case PixelFormat::PF::PIXELFORMAT_INDEX1MSB:
+				pixels_per_byte = 8;
+				bits_per_index = 1;
+				break;
+			case PixelFormat::PF::PIXELFORMAT_INDEX4LSB:
+			case PixelFormat::PF::PIXELFORMAT_INDEX4MSB:
+				pixels_per_byte = 2;
+				bits_per_index = 4;
+				break;
+			default: break;
+		}
+
+		const int bpp = bytesPerPixel();
+		for(int x = 0; x != w; ++x) {
+			int red = 0, green = 0, blue = 0, alpha = 0;
+			if(pixels_per_byte > 1) {
+				pf.extractRGBA(src + x / pixels_per_byte, (x % pixels_per_byte) * bits_per_index, red, green, blue, alpha);
+			} else {
+				pf.extractRGBA(src + x * bpp, 0, red, green, blue, alpha);
+			}
+			uint8_t* out = scratch + x * 4;
+			out[0] = static_cast<uint8_t>(red);
+			out[1] = static_cast<uint8_t>(green);
+			out[2] = static_cast<uint8_t>(blue);
+			out[3] = static_cast<uint8_t>(alpha);
+		}
+		return scratch;
+	}
+
 	void Surface::iterateOverSurface(surface_iterator_fn fn)
 	{
 		iterateOverSurface(0, 0, width(), height(), fn);
@@ -502,12 +632,12 @@ namespace KRE
 				}
 			}
 		} else {
+			std::vector<uint8_t> scratch(width() * 4 + 1);
 			for(int y = sy; y != sh; ++y) {
+				const uint8_t* rgba = getRowRGBA(y, &scratch[0]);
 				for(int x = sx; x != sw; ++x) {
-					int red = 0, green = 0, blue = 0, alpha = 0;
-					const uint8_t* px = &reinterpret_cast<const uint8_t*>(pixels())[x * bytesPerPixel() + y * rowPitch()];
-					pf->extractRGBA(px, 0, red, green, blue, alpha);
-					iterator_fn(x, y, red, green, blue, alpha);
+					const uint8_t* px = rgba + x * 4;
+					iterator_fn(x, y, px[0], px[1], px[2], px[3]);
 				}
 			}
 		}
@@ -625,3 +755,76 @@ namespace KRE
 		return out;
 	}
 }
+
+#include "unit_test.hpp"
+
+namespace
+{
+	// A sprite sheet sized surface with a transparent border and a mix of
+	// opaque and transparent pixels inside it.
+	KRE::SurfacePtr make_benchmark_sheet(KRE::PixelFormat::PF fmt)
+	{
+		using namespace KRE;
+		const int size = 2048;
+		auto surf = Surface::create(size, size, fmt);
+		std::vector<uint8_t> px(surf->rowPitch() * size);
+		for(int y = 16; y < size - 16; ++y) {
+			for(int x = 16; x < size - 16; ++x) {
+				if((x ^ y) & 8) {
+					uint8_t* p = &px[y * surf->rowPitch() + x * 4];
+					p[0] = p[1] = p[2] = p[3] = static_cast<uint8_t>(x + y);
+				}
+			}
+		}
+		surf->writePixels(&px[0], static_cast<int>(px.size()));
+		return surf;
+	}
+}
+
+BENCHMARK(surface_alpha_map_2048)
+{
+	auto surf = make_benchmark_sheet(KRE::PixelFormat::PF::PIXELFORMAT_ABGR8888);
+	BENCHMARK_LOOP {
+		surf->createAlphaMap();
+	}
+}
+
+BENCHMARK(surface_alpha_map_converted_2048)
+{
+	auto surf = make_benchmark_sheet(KRE::PixelFormat::PF::PIXELFORMAT_ARGB8888);
+	BENCHMARK_LOOP {
+		surf->createAlphaMap();
+	}
+}
+
+BENCHMARK(surface_alpha_borders_2048)
+{
+	auto surf = make_benchmark_sheet(KRE::PixelFormat::PF::PIXELFORMAT_ABGR8888);
+	BENCHMARK_LOOP {
+		KRE::find_alpha_borders(*surf, KRE::Surface::getAlphaStripThreshold(), std::array<int, 4>());
+	}
+}
+
+BENCHMARK(surface_iterate_pixels_2048)
+{
+	auto surf = make_benchmark_sheet(KRE::PixelFormat::PF::PIXELFORMAT_ARGB8888);
+	uint64_t sum = 0;
+	BENCHMARK_LOOP {
+		surf->iterateOverSurface([&sum](int x, int y, int r, int g, int b, int a) {
+			sum += a;
+		});
+	}
+}
+
+BENCHMARK(surface_iterate_rows_2048)
+{
+	auto surf = make_benchmark_sheet(KRE::PixelFormat::PF::PIXELFORMAT_ARGB8888);
+	uint64_t sum = 0;
+	BENCHMARK_LOOP {
+		surf->iterateOverRows([&sum](int y, const uint8_t* rgba, int w) {
+			for(int x = 0; x != w; ++x) {
+				sum += rgba[x * 4 + 3];
+			}
+		});
+	}
+}
@@ -23,12 +23,14 @@
 
 #pragma once
 
+#include <array>
 #include <cstdint>
 #include <functional>
 #include <map>
 #include <memory>
 #include <tuple>
 #include <unordered_map>
+#include <vector>
 
 #include "geometry.hpp"
 #include "Cursor.hpp"
@@ -80,6 +82,36 @@ namespace KRE
 		SAVE,
 	};
 
+	// Supplies the contents of an image file that isn't stored as a file of
+	// its own. Returns false to have the file read from disk as usual.
+	typedef std::function<bool(const std::string& fname, std::string* data)> file_reader;
+
+	// An image decoded on an earlier run, together with the alpha map and
+	// borders that were worked out from it, so that loading the file again
+	// can skip decoding it.
+	struct DecodedImage
+	{
+		DecodedImage() : width(0), height(0), bpp(0), row_pitch(0), rmask(0), gmask(0), bmask(0), amask(0), pixels(nullptr), alpha_map(nullptr), alpha_borders()
+		{}
+		int width, height, bpp, row_pitch;
+		uint32_t rmask, gmask, bmask, amask;
+		const void* pixels;
+
+		// One bit per pixel, least significant first, set where the pixel
+		// is transparent.
+		const unsigned char* alpha_map;
+		std::array<int, 4> alpha_borders;
+
+		// Keeps pixels and alpha_map valid.
+		std::shared_ptr<void> owner;
+	};
+
+	// The loader fills in a DecodedImage if it has one for the file, and
+	// returns false otherwise. The saver is given each image decoded from a
+	// file, once its alpha map and borders have been made.
+	typedef std::function<bool(const std::string& fname, PixelFormat::PF fmt, SurfaceFlags flags, DecodedImage* img)> decoded_image_loader;
+	typedef std::function<void(const std::string& fname, PixelFormat::PF fmt, SurfaceFlags flags, SurfacePtr surf)> decoded_image_saver;
+
 	// When loading an image we can use this function to convert certain
 	// pixels to be alpha zero values.
 	typedef std::function<bool(int r, int g, int b)> alpha_filter;
@@ -133,6 +165,27 @@ namespace KRE
 		void iterateOverSurface(rect r, surface_iterator_fn fn);
 		void iterateOverSurface(int x, int y, int w, int h, surface_iterator_fn fn);
 
+		// Returns the pixels of row y with 8-bit channels stored in r, g, b,
+		// a order. If the surface is already laid out that way this points
+		// into the surface, otherwise the row is converted into scratch,
+		// which must have room for width()*4 bytes. The surface must be
+		// locked.
+		const uint8_t* getRowRGBA(int y, uint8_t* scratch) const;
+
+		// Calls fn(y, rgba, width) for each row in turn, with rgba as given
+		// by getRowRGBA(). Since fn is called once a row, and not through a
+		// std::function, it can be inlined and the loop over the row
+		// vectorized, which makes this much faster than iterateOverSurface().
+		template<typename Fn>
+		void iterateOverRows(Fn fn) {
+			SurfaceLock lck(shared_from_this());
+			const int w = width();
+			std::vector<uint8_t> scratch(w * 4 + 1);
+			for(int y = 0; y != height(); ++y) {
+				fn(y, getRowRGBA(y, &scratch[0]), w);
+			}
+		}
+
 		virtual void blit(SurfacePtr src, const rect& src_rect) = 0;
 		virtual void blitTo(SurfacePtr src, const rect& src_rect, const rect& dst_rect) = 0;
 		virtual void blitTo(SurfacePtr src, const rect& dst_rect) = 0;
@@ -210,6 +263,11 @@ namespace KRE
 		static void setFileFilter(FileFilterType type, file_filter fn);
 		static file_filter getFileFilter(FileFilterType type);
 
+		static void setFileReader(file_reader fn);
+		static file_reader getFileReader();
+
+		static void setDecodedImageCache(decoded_image_loader loader, decoded_image_saver saver);
+
 		static void setAlphaFilter(alpha_filter fn);
 		static alpha_filter getAlphaFilter();
 		static void clearAlphaFilter();
@@ -249,6 +307,8 @@ namespace KRE
 		void setAlphaBorders(const std::array<int, 4>& borders) { alpha_borders_ = borders; }
 		virtual void stripAlphaBorders(int threshold = 0);
 	private:
+		static SurfacePtr loadFromFile(const std::string& filename, SurfaceFlags flags, PixelFormat::PF fmt, SurfaceConvertFn convert);
+
 		virtual SurfacePtr handleConvert(PixelFormat::PF fmt, SurfaceConvertFn convert) = 0;
 		SurfaceFlags flags_;
 		PixelFormatPtr pf_;
@@ -99,6 +99,16 @@ namespace KRE
 			return SDL_PIXELFORMAT_ABGR8888;
 		}
 
+		SDL_Surface* load_image(const std::string& fname)
+		{
+			auto reader = Surface::getFileReader();
+			std::string contents;
+			if(reader && reader(fname, &contents)) {
+				return IMG_Load_RW(SDL_RWFromConstMem(contents.data(), static_cast<int>(contents.size())), 1);
+			}
+			return IMG_Load(fname.c_str());
+		}
+
 		class CursorSDL : public Cursor
 		{
 			public:
@@ -167,7 +177,7 @@ namespace KRE
 		  palette_()
 	{
 		auto filter = Surface::getFileFilter(FileFilterType::LOAD);
-		auto surf = IMG_Load(filter(filename).c_str());
+		auto surf = load_image(filter(filename));
 		if(surf == nullptr) {
 			LOG_ERROR("Failed to load image file: '" << filename << "' : " << IMG_GetError());
 			std::stringstream ss;
@@ -725,7 +735,7 @@ namespace KRE
 			s = IMG_Load_RW(SDL_RWFromConstMem(filename.c_str(), static_cast<int>(filename.size())), 0);
 		} else {
 			auto filter = Surface::getFileFilter(FileFilterType::LOAD);
-			s = IMG_Load(filter(filename).c_str());
+			s = load_image(filter(filename));
 		}
 		if(s == nullptr) {
 			std::stringstream ss;
@@ -973,11 +983,16 @@ namespace KRE
 		int dst_size = dst->rowPitch() * dst->height();
 		void* dst_pixels = new uint8_t[dst_size];
 
-		int dst_bpp = dst->getPixelFormat()->bytesPerPixel();
-		iterateOverSurface([&](int x, int y, int r, int g, int b, int a) {
-			uint8_t* dst_pixel_ptr = static_cast<uint8_t*>(dst_pixels) + y * dst->rowPitch() + x * dst_bpp;
-			convert(r, g, b, a);
-			dst->getPixelFormat()->encodeRGBA(dst_pixel_ptr, r, g, b, a);
+		const int dst_bpp = dst->getPixelFormat()->bytesPerPixel();
+		const int dst_pitch = dst->rowPitch();
+		auto dst_pf = dst->getPixelFormat();
+		iterateOverRows([&](int y, const uint8_t* rgba, int w) {
+			uint8_t* dst_pixel_ptr = static_cast<uint8_t*>(dst_pixels) + y * dst_pitch;
+			for(int x = 0; x != w; ++x, rgba += 4, dst_pixel_ptr += dst_bpp) {
+				int r = rgba[0], g = rgba[1], b = rgba[2], a = rgba[3];
+				convert(r, g, b, a);
+				dst_pf->encodeRGBA(dst_pixel_ptr, r, g, b, a);
+			}
 		});
 		dst->writePixels(dst_pixels, dst_size);
 		delete[] static_cast<uint8_t*>(dst_pixels);
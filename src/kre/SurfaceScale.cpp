@@ -21,7 +21,11 @@
 	   distribution.
 */
 
+#include <vector>
+
+#include "Simd.hpp"
 #include "SurfaceScale.hpp"
+#include "Util.hpp"
 
 namespace KRE
 {
@@ -44,6 +48,66 @@ namespace KRE
 				}
 				return inp;
 			}
+
+			// Output rows are shared out between threads in blocks of at
+			// least this many.
+			const int rows_per_task = 16;
+
+			// The source position, and fractional offset from it, that each
+			// output row or column samples from.
+			struct SampleTable
+			{
+				SampleTable(double ratio, int n) : pos(n), frac(n) {
+					for(int i = 0; i != n; ++i) {
+						pos[i] = static_cast<int>(ratio * i);
+						frac[i] = ratio * i - pos[i];
+					}
+				}
+				std::vector<int> pos;
+				std::vector<double> frac;
+			};
+
+			// The vector versions of the per-pixel arithmetic do exactly the
+			// same operations as the scalar code, one channel to a lane, so
+			// they give identical results.
+			uint32_t bilinear_pixel(uint32_t a, uint32_t b, uint32_t c, uint32_t d, double xd, double yd)
+			{
+				using simd::dvec4;
+				const dvec4 one(1.0), x(xd), y(yd);
+				int ia[4], ib[4], ic[4], id[4];
+				(dvec4::fromBytes(a) * (one - x) * (one - y)).toInts(ia);
+				(dvec4::fromBytes(b) * x * (one - y)).toInts(ib);
+				(dvec4::fromBytes(c) * (one - x) * y).toInts(ic);
+				(dvec4::fromBytes(d) * x * y).toInts(id);
+
+				uint32_t result = 0;
+				for(int n = 0; n != 4; ++n) {
+					result |= static_cast<uint32_t>(static_cast<uint8_t>(ia[n] + ib[n] + ic[n] + id[n])) << (n * 8);
+				}
+				return result;
+			}
+
+			simd::dvec4 cubic_hermite_lanes(const simd::dvec4& a, const simd::dvec4& b, const simd::dvec4& c, const simd::dvec4& d, double t)
+			{
+				using simd::dvec4;
+				const dvec4 two(2.0), three(3.0), five(5.0), tv(t);
+				const dvec4 a0 = -a / two + (three * b) / two - (three * c) / two + d / two;
+				const dvec4 b0 = a - (five * b) / two + two * c - d / two;
+				const dvec4 c0 = -a / two + c / two;
+				const dvec4 d0 = b;
+
+				return tv * ((a0 * tv + b0) * tv + c0) + d0;
+			}
+
+			uint32_t bicubic_pixel(const uint32_t (&pix)[4][4], double xd, double yd)
+			{
+				using simd::dvec4;
+				dvec4 cols[4];
+				for(int i = 0; i != 4; ++i) {
+					cols[i] = cubic_hermite_lanes(dvec4::fromBytes(pix[0][i]), dvec4::fromBytes(pix[1][i]), dvec4::fromBytes(pix[2][i]), dvec4::fromBytes(pix[3][i]), xd);
+				}
+				return cubic_hermite_lanes(cols[0], cols[1], cols[2], cols[3], yd).toClampedBytes();
+			}
 		}
 
 		// scale is a value from 1 to 10000, such that a value of 100 is a scale factor of 1 (i.e. not scaled).
@@ -67,14 +131,22 @@ namespace KRE
 			std::unique_ptr<uint32_t[]> new_pixels(new uint32_t[new_image_width * new_image_height]);
 			const uint32_t* old_pixels = static_cast<const uint32_t*>(inp->pixels());
 
-			for(int y = 0; y != new_image_height; ++y) {
-				for(int x = 0; x != new_image_width; ++x) {
-					const int px = static_cast<int>(ratio_x * x);
-					const int py = static_cast<int>(ratio_y * y);
-					new_pixels[y * new_image_width + x] = old_pixels[py * old_image_width + px];
-				}
+			std::vector<int> src_x(new_image_width);
+			for(int x = 0; x != new_image_width; ++x) {
+				src_x[x] = static_cast<int>(ratio_x * x);
 			}
 
+			uint32_t* out = new_pixels.get();
+			Util::parallel_for(new_image_height, rows_per_task, [&](int y0, int y1) {
+				for(int y = y0; y != y1; ++y) {
+					const uint32_t* src_row = old_pixels + static_cast<int>(ratio_y * y) * old_image_width;
+					uint32_t* dst_row = out + y * new_image_width;
+					for(int x = 0; x != new_image_width; ++x) {
+						dst_row[x] = src_row[src_x[x]];
+					}
+				}
+			});
+
 			return Surface::create(new_image_width, new_image_height, 32, 4*new_image_width, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, new_pixels.get());
 		}
 
@@ -122,30 +194,41 @@ namespace KRE
 			std::unique_ptr<uint32_t[]> new_pixels(new uint32_t[new_image_width * new_image_height]);
 			const uint32_t* old_pixels = static_cast<const uint32_t*>(inp->pixels());
 
-			for(int y = 0; y != new_image_height; ++y) {
-				for(int x = 0; x != new_image_width; ++x) {
-					const int px = static_cast<int>(ratio_x * x);
-					const int py = static_cast<int>(ratio_y * y);
-					const double xd = ratio_x * x - px;
-					const double yd = ratio_y * y - py;
-					const int pix_index = py * old_image_width + px;
-					const uint32_t a = old_pixels[pix_index];
-					const uint32_t b = old_pixels[pix_index+1];
-					const uint32_t c = old_pixels[pix_index+old_image_width];
-					const uint32_t d = old_pixels[pix_index+old_image_width+1];
-
-					const uint8_t alpha = BILINEAR_ALPHA(a, b, c, d, xd, yd);
-					const uint8_t red = BILINEAR_RED(a, b, c, d, xd, yd);
-					const uint8_t green = BILINEAR_GREEN(a, b, c, d, xd, yd);
-					const uint8_t blue = BILINEAR_BLUE(a, b, c, d, xd, yd);
-
-					new_pixels[y * new_image_width + x]
-						= (static_cast<uint32_t>(alpha) << 24)
-						+ (static_cast<uint32_t>(red) << 16)
-						+ (static_cast<uint32_t>(green) << 8)
-						+ static_cast<uint32_t>(blue);
+			const SampleTable xs(ratio_x, new_image_width), ys(ratio_y, new_image_height);
+			const bool use_simd = simd::enabled();
+
+			uint32_t* out = new_pixels.get();
+			Util::parallel_for(new_image_height, rows_per_task, [&](int y0, int y1) {
+				for(int y = y0; y != y1; ++y) {
+					const int py = ys.pos[y];
+					const double yd = ys.frac[y];
+					for(int x = 0; x != new_image_width; ++x) {
+						const int px = xs.pos[x];
+						const double xd = xs.frac[x];
+						const int pix_index = py * old_image_width + px;
+						const uint32_t a = old_pixels[pix_index];
+						const uint32_t b = old_pixels[pix_index+1];
+						const uint32_t c = old_pixels[pix_index+old_image_width];
+						const uint32_t d = old_pixels[pix_index+old_image_width+1];
+
+						if(use_simd) {
+							out[y * new_image_width + x] = bilinear_pixel(a, b, c, d, xd, yd);
+							continue;
+						}
+
+						const uint8_t alpha = BILINEAR_ALPHA(a, b, c, d, xd, yd);
+						const uint8_t red = BILINEAR_RED(a, b, c, d, xd, yd);
+						const uint8_t green = BILINEAR_GREEN(a, b, c, d, xd, yd);
+						const uint8_t blue = BILINEAR_BLUE(a, b, c, d, xd, yd);
+
+						out[y * new_image_width + x]
+							= (static_cast<uint32_t>(alpha) << 24)
+							+ (static_cast<uint32_t>(red) << 16)
+							+ (static_cast<uint32_t>(green) << 8)
+							+ static_cast<uint32_t>(blue);
+					}
 				}
-			}
+			});
 
 			return Surface::create(new_image_width, new_image_height, 32, 4*new_image_width, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, new_pixels.get());
 		}
@@ -212,36 +295,46 @@ namespace KRE
 			std::unique_ptr<uint32_t[]> new_pixels(new uint32_t[new_image_width * new_image_height]);
 			const uint32_t* old_pixels = static_cast<const uint32_t*>(inp->pixels());
 
-			for(int y = 0; y != new_image_height; ++y) {
-				for(int x = 0; x != new_image_width; ++x) {
-					const int px = static_cast<int>(ratio_x * x);
-					const int py = static_cast<int>(ratio_y * y);
-					const double xd = ratio_x * x - px;
-					const double yd = ratio_y * y - py;
-					const int pix_index = py * old_image_width + px;
+			const SampleTable xs(ratio_x, new_image_width), ys(ratio_y, new_image_height);
+			const bool use_simd = simd::enabled();
+
+			uint32_t* out = new_pixels.get();
+			Util::parallel_for(new_image_height, rows_per_task, [&](int y0, int y1) {
+				for(int y = y0; y != y1; ++y) {
+					const int py = ys.pos[y];
+					const double yd = ys.frac[y];
+					for(int x = 0; x != new_image_width; ++x) {
+						const int px = xs.pos[x];
+						const double xd = xs.frac[x];
 
-					uint32_t pix[4][4];
+						uint32_t pix[4][4];
 
-					for(int j = 0; j != 4; ++j) {
-						for(int i = 0; i != 4; ++i) {
-							pix[j][i] = old_pixels[CLAMP_XY(px+i-1, py+j-1, old_image_width, old_image_height)];
+						for(int j = 0; j != 4; ++j) {
+							for(int i = 0; i != 4; ++i) {
+								pix[j][i] = old_pixels[CLAMP_XY(px+i-1, py+j-1, old_image_width, old_image_height)];
+							}
 						}
-					}
 
-					const auto col0 = cubic_hermite4(pix[0][0], pix[1][0], pix[2][0], pix[3][0], xd);
-					const auto col1 = cubic_hermite4(pix[0][1], pix[1][1], pix[2][1], pix[3][1], xd);
-					const auto col2 = cubic_hermite4(pix[0][2], pix[1][2], pix[2][2], pix[3][2], xd);
-					const auto col3 = cubic_hermite4(pix[0][3], pix[1][3], pix[2][3], pix[3][3], xd);
-					uint32_t pix_value = 0;
-					for(int n = 0; n != 4; n++) {
-						const double value = cubic_hermite(col0[n], col1[n], col2[n], col3[n], yd);
-						pix_value >>= 8;
-						pix_value |= (value < 0 ? 0 : value > 255 ? 255 : static_cast<uint8_t>(value)) << 24;
-					}
+						if(use_simd) {
+							out[y * new_image_width + x] = bicubic_pixel(pix, xd, yd);
+							continue;
+						}
+
+						const auto col0 = cubic_hermite4(pix[0][0], pix[1][0], pix[2][0], pix[3][0], xd);
+						const auto col1 = cubic_hermite4(pix[0][1], pix[1][1], pix[2][1], pix[3][1], xd);
+						const auto col2 = cubic_hermite4(pix[0][2], pix[1][2], pix[2][2], pix[3][2], xd);
+						const auto col3 = cubic_hermite4(pix[0][3], pix[1][3], pix[2][3], pix[3][3], xd);
+						uint32_t pix_value = 0;
+						for(int n = 0; n != 4; n++) {
+							const double value = cubic_hermite(col0[n], col1[n], col2[n], col3[n], yd);
+							pix_value >>= 8;
+							pix_value |= (value < 0 ? 0 : value > 255 ? 255 : static_cast<uint8_t>(value)) << 24;
+						}
 
-					new_pixels[y * new_image_width + x] = pix_value;
+						out[y * new_image_width + x] = pix_value;
+					}
 				}
-			}
+			});
 
 			return Surface::create(new_image_width, new_image_height, 32, 4*new_image_width, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, new_pixels.get());
 		}
@@ -265,48 +358,50 @@ namespace KRE
 			std::unique_ptr<uint32_t[]> new_pixels(new uint32_t[new_image_width * new_image_height]);
 			const uint32_t* old_pixels = static_cast<const uint32_t*>(inp->pixels());
 
-			for(int y = 0; y != new_image_height; y += 2) {
-				for(int x = 0; x != new_image_width; x += 2) {
-					const int px = static_cast<int>(ratio_x * x);
-					const int py = static_cast<int>(ratio_y * y);
-					const int pix_index = py * old_image_width + px;
-
-					const uint32_t P = old_pixels[CLAMP_XY(px+1-1, py+1-1 ,old_image_width, old_image_height)];
-
-					const uint32_t A = old_pixels[CLAMP_XY(px+1-1, py+0-1 ,old_image_width, old_image_height)];
-					const uint32_t B = old_pixels[CLAMP_XY(px+2-1, py+1-1 ,old_image_width, old_image_height)];
-					const uint32_t C = old_pixels[CLAMP_XY(px+0-1, py+1-1 ,old_image_width, old_image_height)];
-					const uint32_t D = old_pixels[CLAMP_XY(px+1-1, py+2-1 ,old_image_width, old_image_height)];
-
-					/*
-						  A    --\ 1 2
-						C P B  --/ 3 4
-						  D
-						1=P; 2=P; 3=P; 4=P;
-						IF C==A AND C!=D AND A!=B => 1=A
-						IF A==B AND A!=C AND B!=D => 2=B
-						IF B==D AND B!=A AND D!=C => 4=D
-						IF D==C AND D!=B AND C!=A => 3=C
-					*/
-					uint32_t outp[4] = { P, P, P, P };
-					if(C == A && C != D && A != B) {
-						outp[0] = A;
-					}
-					if(A == B && A != C && B != D) {
-						outp[1] = B;
-					}
-					if(B == D && B != A && D != C) {
-						outp[3] = D;
-					}
-					if(D == C && D != B && C != A) {
-						outp[2] = C;
+			uint32_t* out = new_pixels.get();
+			Util::parallel_for(new_image_height / 2, rows_per_task, [&](int row0, int row1) {
+				for(int y = row0 * 2; y != row1 * 2; y += 2) {
+					for(int x = 0; x != new_image_width; x += 2) {
+						const int px = static_cast<int>(ratio_x * x);
+						const int py = static_cast<int>(ratio_y * y);
+
+						const uint32_t P = old_pixels[CLAMP_XY(px+1-1, py+1-1 ,old_image_width, old_image_height)];
+
+						const uint32_t A = old_pixels[CLAMP_XY(px+1-1, py+0-1 ,old_image_width, old_image_height)];
+						const uint32_t B = old_pixels[CLAMP_XY(px+2-1, py+1-1 ,old_image_width, old_image_height)];
+						const uint32_t C = old_pixels[CLAMP_XY(px+0-1, py+1-1 ,old_image_width, old_image_height)];
+						const uint32_t D = old_pixels[CLAMP_XY(px+1-1, py+2-1 ,old_image_width, old_image_height)];
+
+						/*
+							  A    --\ 1 2
+							C P B  --/ 3 4
+							  D
+							1=P; 2=P; 3=P; 4=P;
+							IF C==A AND C!=D AND A!=B => 1=A
+							IF A==B AND A!=C AND B!=D => 2=B
+							IF B==D AND B!=A AND D!=C => 4=D
+							IF D==C AND D!=B AND C!=A => 3=C
+						*/
+						uint32_t outp[4] = { P, P, P, P };
+						if(C == A && C != D && A != B) {
+							outp[0] = A;
+						}
+						if(A == B && A != C && B != D) {
+							outp[1] = B;
+						}
+						if(B == D && B != A && D != C) {
+							outp[3] = D;
+						}
+						if(D == C && D != B && C != A) {
+							outp[2] = C;
+						}
+						out[y * new_image_width + x]		 = outp[0];
+						out[y * new_image_width + x + 1]   = outp[1];
+						out[(y+1) * new_image_width + x]   = outp[2];
+						out[(y+1) * new_image_width + x+1] = outp[3];
 					}
-					new_pixels[y * new_image_width + x]		  = outp[0];
-					new_pixels[y * new_image_width + x + 1]   = outp[1];
-					new_pixels[(y+1) * new_image_width + x]   = outp[2];
-					new_pixels[(y+1) * new_image_width + x+1] = outp[3];
 				}
-			}
+			});
 
 			return Surface::create(new_image_width, new_image_height, 32, 4*new_image_width, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, new_pixels.get());
 		}
@@ -25,8 +25,9 @@
 
 #include "Surface.hpp"
 
-// Simple routines for doing scaling of surfaces. N.B. This is software scaling and not optimized for speed
-// i.e. only suitable for offline use.
+// Simple routines for doing scaling of surfaces in software. Output rows are split between threads
+// and the bilinear and bicubic filters use SSE2/AVX where available, but they're still best suited
+// to offline use.
 namespace KRE
 {
 	namespace scale
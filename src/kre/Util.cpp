@@ -21,9 +21,16 @@
 	   distribution.
 */
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <stdexcept>
+
 #include "Util.hpp"
 
 #include "asserts.hpp"
+#include "background_task_pool.hpp"
 #include "unit_test.hpp"
 
 namespace Util
@@ -45,6 +52,152 @@ namespace Util
 		}
 		return v;
 	}
+
+	namespace
+	{
+		std::atomic<int> max_parallel_threads(0);
+
+		// The chunks parallel_for() handed to the pool. They refer to the
+		// caller's fn, so however parallel_for() is left, none may still be
+		// queued or running once it returns.
+		class chunk_tasks
+		{
+		public:
+			~chunk_tasks() {
+				for(auto& t : tasks_) {
+					t.cancel();
+					t.wait();
+				}
+			}
+
+			std::vector<background_task_pool::task_handle> tasks_;
+		};
+	}
+
+	void set_max_parallel_threads(int n)
+	{
+		max_parallel_threads = n;
+	}
+
+	int get_max_parallel_threads()
+	{
+		const int n = max_parallel_threads;
+		if(n > 0) {
+			return n;
+		}
+		// The calling thread works alongside the pool's workers.
+		return background_task_pool::num_workers() + 1;
+	}
+
+	void parallel_for(int count, int min_chunk, const std::function<void(int, int)>& fn)
+	{
+		if(count <= 0) {
+			return;
+		}
+
+		const int nchunks = std::max(1, std::min(get_max_parallel_threads(), count / std::max(1, min_chunk)));
+		if(nchunks == 1) {
+			fn(0, count);
+			return;
+		}
+
+		auto chunk_begin = [count, nchunks](int n) {
+			return static_cast<int>(static_cast<int64_t>(count) * n / nchunks);
+		};
+
+		// An exception thrown by a chunk is kept until every chunk is done,
+		// then rethrown on the calling thread. The pool's workers don't
+		// expect jobs to throw.
+		std::vector<std::exception_ptr> errors(nchunks);
+		auto run_chunk = [&fn, &errors, chunk_begin](int n) {
+			try {
+				fn(chunk_begin(n), chunk_begin(n + 1));
+			} catch(...) {
+				errors[n] = std::current_exception();
+			}
+		};
+
+		// The calling thread does the first chunk itself, and then any chunk
+		// no worker has picked up yet rather than waiting for one to be free.
+		chunk_tasks tasks;
+		for(int n = 1; n < nchunks; ++n) {
+			tasks.tasks_.push_back(background_task_pool::submit([&run_chunk, n]() { run_chunk(n); }, std::function<void()>(), background_task_pool::PRIORITY::HIGH));
+		}
+
+		run_chunk(0);
+		while(tasks.tasks_.empty() == false) {
+			const int n = static_cast<int>(tasks.tasks_.size());
+			if(tasks.tasks_.back().cancel()) {
+				run_chunk(n);
+			} else {
+				tasks.tasks_.back().wait();
+			}
+			tasks.tasks_.pop_back();
+		}
+
+		for(const std::exception_ptr& e : errors) {
+			if(e) {
+				std::rethrow_exception(e);
+			}
+		}
+	}
+}
+
+UNIT_TEST(parallel_for_covers_range) {
+	std::vector<std::atomic<int>> hits(1000);
+	for(auto& h : hits) {
+		h = 0;
+	}
+
+	Util::parallel_for(static_cast<int>(hits.size()), 10, [&hits](int begin, int end) {
+		for(int n = begin; n != end; ++n) {
+			++hits[n];
+		}
+	});
+
+	for(auto& h : hits) {
+		CHECK_EQ(h.load(), 1);
+	}
+}
+
+UNIT_TEST(parallel_for_rethrows_chunk_errors) {
+	const int old_threads = Util::get_max_parallel_threads();
+	Util::set_max_parallel_threads(4);
+
+	// Throw from the chunk the calling thread runs, and from the last
+	// chunk, which a worker usually runs.
+	for(int bad_item : { 0, 999 }) {
+		std::vector<std::atomic<int>> hits(1000);
+		for(auto& h : hits) {
+			h = 0;
+		}
+
+		bool caught = false;
+		try {
+			Util::parallel_for(static_cast<int>(hits.size()), 10, [&hits, bad_item](int begin, int end) {
+				if(bad_item >= begin && bad_item < end) {
+					throw std::runtime_error("chunk failed");
+				}
+
+				for(int n = begin; n != end; ++n) {
+					++hits[n];
+				}
+			});
+		} catch(const std::runtime_error&) {
+			caught = true;
+		}
+
+		CHECK_EQ(caught, true);
+
+		// Every other chunk still ran to completion before the throw.
+		const int chunk = static_cast<int>(hits.size()) / 4;
+		const int bad_begin = bad_item / chunk * chunk;
+		for(int n = 0; n != static_cast<int>(hits.size()); ++n) {
+			CHECK_EQ(hits[n].load(), n >= bad_begin && n < bad_begin + chunk ? 0 : 1);
+		}
+	}
+
+	Util::set_max_parallel_threads(old_threads);
 }
 
 UNIT_TEST(split_test_0) {
@@ -23,6 +23,7 @@
 
 #pragma once
 
+#include <functional>
 #include <vector>
 #include <string>
 
@@ -61,4 +62,14 @@ namespace Util
 	};
 
 	std::vector<std::string> split(const std::string& s, const std::string& eol, SplitFlags flags=SplitFlags::NONE);
+
+	// Splits [0, count) into contiguous ranges of at least min_chunk items
+	// and calls fn(begin, end) for each, on the calling thread and the
+	// background task pool's workers. Returns once every range is done.
+	void parallel_for(int count, int min_chunk, const std::function<void(int, int)>& fn);
+
+	// Limits the number of threads parallel_for() uses. 0, the default,
+	// means the calling thread and every background task pool worker.
+	void set_max_parallel_threads(int n);
+	int get_max_parallel_threads();
 }
@@ -86,7 +86,8 @@ namespace KRE
 			  request_major_version_(2),
 			  request_minor_version_(1),
 			  profile_(ProfileValue::COMPAT),
-			  new_frame_(0)
+			  new_frame_(0),
+			  use_imgui_(false)
 		{
 			if(hints.has_key("renderer")) {
 				if(hints["renderer"].is_string()) {
@@ -253,7 +254,10 @@ namespace KRE
 			}
 			window_.reset(SDL_CreateWindow(getTitle().c_str(), x, y, w, h, wnd_flags), [&](SDL_Window* wnd){
 #ifdef USE_IMGUI
-				ImGui_ImplSdlGL3_Shutdown();
+				if(use_imgui_) {
+					ImGui_ImplSdlGL3_Shutdown();
+					use_imgui_ = false;
+				}
 #endif
 				getDisplayDevice().reset();
 				if(context_) {
@@ -264,7 +268,12 @@ namespace KRE
 			});
 
 #ifdef USE_IMGUI
-			ImGui_ImplSdlGL3_Init(window_.get());
+			// The ImGui back-end draws with OpenGL, so other devices, such as
+			// the null device, go without it.
+			use_imgui_ = getDisplayDevice()->ID() == DisplayDevice::DISPLAY_DEVICE_OPENGL || getDisplayDevice()->ID() == DisplayDevice::DISPLAY_DEVICE_OPENGLES;
+			if(use_imgui_) {
+				ImGui_ImplSdlGL3_Init(window_.get());
+			}
 #endif
 
 			ASSERT_LOG(window_.get() != nullptr, "Could not create window: " << x << ", " << y << ", " << w << ", " << h << " / wnd_flags = " << wnd_flags);
@@ -309,7 +318,7 @@ namespace KRE
 			getDisplayDevice()->setClearColor(clear_color_);
 			getDisplayDevice()->clear(f);
 #ifdef USE_IMGUI
-			if(new_frame_ == 0) {
+			if(use_imgui_ && new_frame_ == 0) {
 				ImGui_ImplSdlGL3_NewFrame(window_.get());
 				++new_frame_;
 			}
@@ -321,9 +330,11 @@ namespace KRE
 			// But SDL provides a device independent way of doing it which is really nice.
 			// So we use that.
 #ifdef USE_IMGUI
-			ImGui::Render();
-			if(--new_frame_ < 0) {
-				new_frame_ = 0;
+			if(use_imgui_) {
+				ImGui::Render();
+				if(--new_frame_ < 0) {
+					new_frame_ = 0;
+				}
 			}
 #endif
 			if(getDisplayDevice()->ID() == DisplayDevice::DISPLAY_DEVICE_OPENGL || getDisplayDevice()->ID() == DisplayDevice::DISPLAY_DEVICE_OPENGLES) {
@@ -497,6 +508,7 @@ namespace KRE
 		ProfileValue profile_;
 
 		int new_frame_;
+		bool use_imgui_;
 
 		SDLWindow(const SDLWindow&);
 	};
@@ -40,6 +40,7 @@
 #include "WindowManager.hpp"
 
 #include "asserts.hpp"
+#include "background_task_pool.hpp"
 #include "collision_utils.hpp"
 #include "controls.hpp"
 #include "draw_scene.hpp"
@@ -67,12 +68,14 @@
 #include "rect_renderable.hpp"
 #include "screen_handling.hpp"
 #include "sound.hpp"
+#include "sprite_batch.hpp"
 #include "stats.hpp"
 #include "string_utils.hpp"
 #include "surface_palette.hpp"
 #include "thread.hpp"
 #include "tile_map.hpp"
 #include "unit_test.hpp"
+#include "variant_binary.hpp"
 #include "variant_utils.hpp"
 #include "wml_formula_callable.hpp"
 
@@ -93,6 +96,7 @@ namespace
 	PREF_INT(debug_skip_draw_zorder_begin, INT_MIN, "Avoid drawing the given zorder");
 	PREF_INT(debug_skip_draw_zorder_end, INT_MIN, "Avoid drawing the given zorder");
 	PREF_BOOL(debug_shadows, false, "Show debug visualization of shadow drawing");
+	PREF_BOOL(batch_sprites, true, "Draw runs of objects that are plain sprites on the same texture with a single draw call");
 
 	LevelPtr& get_current_level()
 	{
@@ -117,6 +121,122 @@ namespace
 	{
 		return t.x < r.x() || t.y < r.y() || t.x >= r.x2() || t.y >= r.y2();
 	}
+
+	//If set, compiled levels store their tiles and the solid maps of their
+	//tiles as binary data. That can only be saved in binary level files.
+	bool g_compile_binary_levels = false;
+
+	//Binary compiled tiles are fixed size records: x and y as 32-bit
+	//little-endian integers, a flags byte and the 3 character compiled
+	//index of the tile's object.
+	const int CompiledTileRecordSize = 12;
+	enum { COMPILED_TILE_FACE_RIGHT = 1 };
+
+	void put_int32(std::string& out, int value)
+	{
+		const uint32_t v = static_cast<uint32_t>(value);
+		for(int n = 0; n != 4; ++n) {
+			out.push_back(static_cast<char>((v >> (n*8)) & 0xFF));
+		}
+	}
+
+	int get_int32(const char* p)
+	{
+		uint32_t v = 0;
+		for(int n = 0; n != 4; ++n) {
+			v |= static_cast<uint32_t>(static_cast<unsigned char>(p[n])) << (n*8);
+		}
+		return static_cast<int32_t>(v);
+	}
+
+	void read_compiled_tile_data(variant node, std::vector<LevelTile>::iterator& out, std::vector<LevelTile>::iterator end)
+	{
+		const int zorder = parse_zorder(node["zorder"]);
+		const std::string& data = node["tile_data"].as_string();
+		ASSERT_LOG(data.size()%CompiledTileRecordSize == 0, "ILLEGAL COMPILED TILE DATA");
+		ASSERT_LOG(static_cast<size_t>(end - out) >= data.size()/CompiledTileRecordSize, "NOT ENOUGH COMPILED TILES REPORTED");
+
+		for(const char* p = data.c_str(); p != data.c_str() + data.size(); p += CompiledTileRecordSize) {
+			out->x = get_int32(p);
+			out->y = get_int32(p + 4);
+			out->zorder = zorder;
+			out->face_right = (p[8] & COMPILED_TILE_FACE_RIGHT) != 0;
+			out->draw_disabled = false;
+			out->object = LevelObject::getCompiled(p + 9).get();
+			++out;
+		}
+	}
+
+	//Writes the compiled form of a layer of tiles, which must all have the
+	//same zorder and be sorted by position.
+	variant write_compiled_tiles_node(const std::vector<LevelTile>& tiles, bool binary)
+	{
+		int basex = std::numeric_limits<int>::max(), basey = std::numeric_limits<int>::max();
+		for(const LevelTile& t : tiles) {
+			basex = std::min(basex, t.x);
+			basey = std::min(basey, t.y);
+		}
+
+		variant_builder node;
+		node.add("zorder", write_zorder(tiles.front().zorder));
+		node.add("x", basex);
+		node.add("y", basey);
+
+		if(binary) {
+			std::string data;
+			data.reserve(tiles.size()*CompiledTileRecordSize);
+			for(const LevelTile& t : tiles) {
+				char buf[4];
+				t.object->writeCompiledIndex(buf);
+				put_int32(data, t.x);
+				put_int32(data, t.y);
+				data.push_back(t.face_right ? COMPILED_TILE_FACE_RIGHT : 0);
+				data.append(buf, 3);
+			}
+
+			node.add("tile_data", data);
+			return node.build();
+		}
+
+		int last_x = basex, last_y = basey;
+		std::string tiles_str;
+		for(std::vector<LevelTile>::size_type n = 0; n != tiles.size(); ) {
+			const LevelTile& t = tiles[n];
+			while(last_y < t.y) {
+				tiles_str += "\n";
+				last_y += TileSize;
+				last_x = basex;
+			}
+
+			while(last_x < t.x) {
+				tiles_str += ",";
+				last_x += TileSize;
+			}
+
+			ASSERT_EQ(last_x, t.x);
+			ASSERT_EQ(last_y, t.y);
+
+			if(t.face_right) {
+				tiles_str += "~";
+			}
+
+			for(const auto start_n = n; n != tiles.size() && tiles[n].x == t.x && tiles[n].y == t.y; ++n) {
+				char buf[4];
+				tiles[n].object->writeCompiledIndex(buf);
+				if(n != start_n) {
+					tiles_str += "|";
+				}
+				tiles_str += buf;
+			}
+
+			tiles_str += ",";
+
+			last_x += TileSize;
+		}
+
+		node.add("tiles", tiles_str);
+		return node.build();
+	}
 }
 
 void Level::clearCurrentLevel()
@@ -312,6 +432,7 @@ Level::Level(const std::string& level_cfg, variant node)
 	absolute_object_adjust_y_(0),
 	set_screen_resolution_on_entry_(false),
 	highlight_layer_(std::numeric_limits<int>::min()),
+	solid_grid_(EntityGrid::COLLISION_BOUNDS),
 	num_compiled_tiles_(0),
 	entered_portal_active_(false),
 	save_point_x_(-1),
@@ -324,6 +445,7 @@ Level::Level(const std::string& level_cfg, variant node)
 	air_resistance_(0),
 	water_resistance_(7),
 	end_game_(false),
+	backups_since_keyframe_(0),
 	editor_tile_updates_frozen_(0),
 	editor_dragging_objects_(false),
 	zoom_level_(1.0f),
@@ -563,8 +685,27 @@ Level::Level(const std::string& level_cfg, variant node)
 
 	ASSERT_LOG(compiled_itor == tiles_.end(), "INCORRECT NUMBER OF COMPILED TILES");
 
+	//Levels compiled in binary form carry the solid maps of their compiled
+	//tiles, which saves testing every pixel of every tile here.
+	bool have_compiled_solid = false;
+	if(node.has_key("compiled_solid") && node.has_key("compiled_standable")) {
+		have_compiled_solid = solid_.readBinary(node["compiled_solid"].as_string()) &&
+		                      standable_.readBinary(node["compiled_standable"].as_string());
+		if(!have_compiled_solid) {
+			LOG_INFO("Compiled solid map for " << id_ << " is out of date; rebuilding it");
+		}
+	}
+
+	const auto compiled_tile_index = tiles_.size() - num_compiled_tiles_;
 	for(std::vector<LevelTile>::size_type i = begin_tile_index; i != tiles_.size(); ++i) {
-		add_tile_solid(tiles_[i]);
+		if(have_compiled_solid && i >= compiled_tile_index) {
+			if(tiles_[i].zorder < 1000) {
+				widest_tile_ = std::max(widest_tile_, tiles_[i].object->width());
+				highest_tile_ = std::max(highest_tile_, tiles_[i].object->height());
+			}
+		} else {
+			add_tile_solid(tiles_[i]);
+		}
 		layers_.insert(tiles_[i].zorder);
 	}
 
@@ -594,15 +735,23 @@ Level::Level(const std::string& level_cfg, variant node)
 
 	prepare_tiles_for_drawing();
 
+	std::vector<std::string> char_types;
 	for(variant char_node : node["character"].as_list()) {
 		if(player_save_node.is_null() == false && char_node["is_human"].as_bool(false)) {
 			continue;
 		}
 
 		wml_chars_.push_back(char_node);
+		if(char_node["type"].is_string()) {
+			char_types.push_back(char_node["type"].as_string());
+		}
 		continue;
 	}
 
+	//The characters are only created once the level starts, so read the
+	//files for their types ahead of time.
+	CustomObjectType::prefetchFiles(char_types);
+
 	if(player_save_node.is_null() == false) {
 		wml_chars_.push_back(player_save_node);
 	}
@@ -741,6 +890,11 @@ void Level::set_level_transition_ratio(decimal d)
 
 void Level::read_compiled_tiles(variant node, std::vector<LevelTile>::iterator& out)
 {
+	if(node.has_key("tile_data")) {
+		read_compiled_tile_data(node, out, tiles_.end());
+		return;
+	}
+
 	const int xbase = node["x"].as_int();
 	const int ybase = node["y"].as_int();
 	const int zorder = parse_zorder(node["zorder"]);
@@ -785,6 +939,8 @@ void Level::read_compiled_tiles(variant node, std::vector<LevelTile>::iterator&
 void Level::load_character(variant c)
 {
 	chars_.push_back(Entity::build(c));
+	entity_grid_.insert(chars_.back().get());
+	solid_grid_.insert(chars_.back().get());
 	layers_.insert(chars_.back()->zorder());
 	if(!chars_.back()->isHuman()) {
 		chars_.back()->setId(static_cast<int>(chars_.size()));
@@ -1005,6 +1161,8 @@ void Level::finishLoading()
 		}
 
 		chars_.erase(std::remove(chars_.begin(), chars_.end(), EntityPtr()), chars_.end());
+		entity_grid_.rebuild(chars_);
+		solid_grid_.rebuild(chars_);
 	}
 
 	//iterate over all our objects and let them do any final loading actions.
@@ -1064,7 +1222,6 @@ namespace
 	{
 		level_tile_rebuild_info() : tile_rebuild_in_progress(false),
 									tile_rebuild_queued(false),
-									rebuild_tile_thread(nullptr),
 									tile_rebuild_complete(false)
 		{}
 
@@ -1073,7 +1230,7 @@ namespace
 		bool tile_rebuild_in_progress;
 		bool tile_rebuild_queued;
 
-		threading::thread* rebuild_tile_thread;
+		background_task_pool::task_handle rebuild_tile_task;
 
 		//an unsynchronized buffer only accessed by the main thread with layers
 		//that will be rebuilt.
@@ -1094,9 +1251,7 @@ namespace
 
 	std::map<const Level*, level_tile_rebuild_info> tile_rebuild_map;
 
-	void build_tiles_thread_function(level_tile_rebuild_info* info, std::map<int, TileMap> tile_maps, threading::mutex& sync) {
-		std::lock_guard<std::mutex> lock(GarbageCollector::getGlobalMutex());
-
+	void build_tiles_thread_function(level_tile_rebuild_info* info, std::map<int, TileMap> tile_maps) {
 		info->task_tiles.clear();
 
 		if(info->rebuild_tile_layers_worker_buffer.empty()) {
@@ -1148,9 +1303,7 @@ void Level::start_rebuild_tiles_in_background(const std::vector<int>& layers)
 		i.second.prepareForCopyToWorkerThread();
 	}
 
-	static threading::mutex* sync = new threading::mutex;
-
-	info.rebuild_tile_thread = new threading::thread("rebuild_tiles", std::bind(build_tiles_thread_function, &info, worker_tile_maps, *sync), threading::THREAD_ALLOCATES_COLLECTIBLE_OBJECTS);
+	info.rebuild_tile_task = background_task_pool::submit(std::bind(build_tiles_thread_function, &info, worker_tile_maps), std::function<void()>(), background_task_pool::PRIORITY::HIGH, background_task_pool::TASK_ALLOCATES_COLLECTIBLE_OBJECTS);
 }
 
 void Level::freeze_rebuild_tiles_in_background()
@@ -1162,7 +1315,7 @@ void Level::freeze_rebuild_tiles_in_background()
 void Level::unfreeze_rebuild_tiles_in_background()
 {
 	level_tile_rebuild_info& info = tile_rebuild_map[this];
-	if(info.rebuild_tile_thread != nullptr) {
+	if(info.rebuild_tile_task.valid()) {
 		//a thread is actually in flight calculating tiles, so any requests
 		//would have been queued up anyway.
 		return;
@@ -1242,9 +1395,7 @@ bool Level::complete_rebuild_tiles_in_background()
 
 	const int begin_time = profile::get_tick_time();
 
-//	ASSERT_LOG(rebuild_tile_thread, "REBUILD TILE THREAD IS nullptr");
-	delete info.rebuild_tile_thread;
-	info.rebuild_tile_thread = nullptr;
+	info.rebuild_tile_task = background_task_pool::task_handle();
 
 	TileBackupScope backup(tiles_);
 
@@ -1388,7 +1539,7 @@ void Level::rebuild_tiles_rect(const rect& r)
 	if(std::adjacent_find(tiles_.rbegin(), tiles_.rend(), level_tile_zorder_pos_comparer()) != tiles_.rend()) {
 		std::sort(tiles_.begin(), tiles_.end(), level_tile_zorder_pos_comparer());
 	}
-	prepare_tiles_for_drawing();
+	prepare_tiles_for_drawing(&r);
 }
 
 std::string Level::package() const
@@ -1502,91 +1653,37 @@ variant Level::write() const
 		LevelObject::setCurrentPalette(palettes_used_);
 
 		int num_tiles = 0;
-		int last_zorder = std::numeric_limits<int>::min();
-		int basex = 0, basey = 0;
-		int last_x = 0, last_y = 0;
-		std::string tiles_str;
-		for(unsigned n = 0; n <= tiles_.size(); ++n) {
-			if(n != tiles_.size() && tiles_[n].draw_disabled && tiles_[n].object->hasSolid() == false) {
-				continue;
-			}
-
-			if(n == tiles_.size() || tiles_[n].zorder != last_zorder) {
-				if(!tiles_str.empty()) {
-					variant_builder node;
-					node.add("zorder", write_zorder(last_zorder));
-					node.add("x", basex);
-					node.add("y", basey);
-					node.add("tiles", tiles_str);
-					res.add("compiled_tiles", node.build());
-				}
-
-				if(n == tiles_.size()) {
-					break;
+		for(auto begin = tiles_.begin(); begin != tiles_.end(); ) {
+			std::vector<LevelTile> layer;
+			auto end = begin;
+			for(; end != tiles_.end() && end->zorder == begin->zorder; ++end) {
+				if(end->draw_disabled == false || end->object->hasSolid()) {
+					layer.push_back(*end);
 				}
-
-				tiles_str.clear();
-
-				last_zorder = tiles_[n].zorder;
-
-				basex = basey = std::numeric_limits<int>::max();
-				for(int m = n; m != tiles_.size() && tiles_[m].zorder == tiles_[n].zorder; ++m) {
-					if(tiles_[m].x < basex) {
-						basex = tiles_[m].x;
-					}
-
-					if(tiles_[m].y < basey) {
-						basey = tiles_[m].y;
-					}
-				}
-
-				last_x = basex;
-				last_y = basey;
 			}
 
-			while(last_y < tiles_[n].y) {
-				tiles_str += "\n";
-				last_y += TileSize;
-				last_x = basex;
-			}
-
-			while(last_x < tiles_[n].x) {
-				tiles_str += ",";
-				last_x += TileSize;
-			}
-
-			ASSERT_EQ(last_x, tiles_[n].x);
-			ASSERT_EQ(last_y, tiles_[n].y);
-
-			if(tiles_[n].face_right) {
-				tiles_str += "~";
+			begin = end;
+			if(layer.empty() == false) {
+				num_tiles += static_cast<int>(layer.size());
+				res.add("compiled_tiles", write_compiled_tiles_node(layer, g_compile_binary_levels));
 			}
+		}
 
-			const int xpos = tiles_[n].x;
-			const int ypos = tiles_[n].y;
-			const int zpos = tiles_[n].zorder;
-			const int start_n = n;
+		res.add("num_compiled_tiles", num_tiles);
 
-			while(n != tiles_.size() && tiles_[n].x == xpos && tiles_[n].y == ypos && tiles_[n].zorder == zpos) {
-				char buf[4];
-				tiles_[n].object->writeCompiledIndex(buf);
-				if(n != start_n) {
-					tiles_str += "|";
-				}
-				tiles_str += buf;
-				++n;
-				++num_tiles;
+		if(g_compile_binary_levels) {
+			LevelSolidMap solid, standable;
+			for(const LevelTile& t : tiles_) {
+				add_tile_solid(t, solid, standable);
 			}
 
-			--n;
-
-			tiles_str += ",";
-
-			last_x += TileSize;
+			std::string solid_data, standable_data;
+			solid.writeBinary(&solid_data);
+			standable.writeBinary(&standable_data);
+			res.add("compiled_solid", solid_data);
+			res.add("compiled_standable", standable_data);
 		}
 
-		res.add("num_compiled_tiles", num_tiles);
-
 		//calculate rectangular opaque areas of tiles that allow us
 		//to avoid drawing the background. Start by calculating the set
 		//of tiles that are opaque.
@@ -1738,6 +1835,14 @@ variant Level::write() const
 	if(num_compiled_tiles_ > 0) {
 		res.add("num_compiled_tiles", num_compiled_tiles_);
 		for(variant compiled_node : wml_compiled_tiles_) {
+			if(compiled_node.has_key("tile_data")) {
+				//binary tile data can't go in a text level file, so convert
+				//it back to the text form.
+				std::vector<LevelTile> layer(compiled_node["tile_data"].as_string().size()/CompiledTileRecordSize);
+				auto itor = layer.begin();
+				read_compiled_tile_data(compiled_node, itor, layer.end());
+				compiled_node = write_compiled_tiles_node(layer, false);
+			}
 			res.add("compiled_tiles", compiled_node);
 		}
 	}
@@ -1872,7 +1977,10 @@ void Level::draw_layer(int layer, int x, int y, int w, int h) const
 
 	draw_layer_solid(layer, x, y, w, h);
 
+	//only draw the chunks of the layer that are on screen. Tiles are
+	//chunked by their top-left corner, so allow for one tile of overhang.
 	auto& blit_cache_info = *layer_itor->second;
+	blit_cache_info.setVisibleArea(rect(x - TileSize, y - TileSize, w + TileSize*2, h + TileSize*2));
 	KRE::ModelManager2D model_matrix_scope(position.x, position.y);
 	KRE::WindowManager::getMainWindow()->render(&blit_cache_info);
 }
@@ -1905,13 +2013,24 @@ void Level::draw_layer_solid(int layer, int x, int y, int w, int h) const
 	}
 }
 
-void Level::prepare_tiles_for_drawing()
+void Level::prepare_tiles_for_drawing(const rect* dirty)
 {
 	auto main_wnd = KRE::WindowManager::getMainWindow();
 	LevelObject::setCurrentPalette(palettes_used_);
 
 	solid_color_rects_.clear();
-	blit_cache_.clear();
+
+	//when only part of the level changed, keep the vertices of the chunks
+	//outside of it and rebuild the rest.
+	rect dirty_chunks;
+	if(dirty != nullptr) {
+		dirty_chunks = LayerBlitInfo::getChunkArea(*dirty);
+		for(auto& p : blit_cache_) {
+			p.second->clearChunks(dirty_chunks);
+		}
+	} else {
+		blit_cache_.clear();
+	}
 
 	for(int n = 0; n != tiles_.size(); ++n) {
 		if(!is_arcade_level() && tiles_[n].object->getSolidColor()) {
@@ -1943,8 +2062,6 @@ void Level::prepare_tiles_for_drawing()
 		}
 	}
 
-	std::map<int, std::pair<std::vector<tile_corner>, std::vector<tile_corner>>> vertices_ot;
-
 	for(int n = 0; n != tiles_.size(); ++n) {
 //		if(!editor_ && (tiles_[n].x <= boundaries().x() - TileSize || tiles_[n].y <= boundaries().y() - TileSize || tiles_[n].x >= boundaries().x2() || tiles_[n].y >= boundaries().y2())) {
 //			continue;
@@ -1972,7 +2089,12 @@ void Level::prepare_tiles_for_drawing()
 
 		tiles_[n].draw_disabled = false;
 
-		const int npoints = LevelObject::calculateTileCorners(tiles_[n].object->isOpaque() ? &vertices_ot[tiles_[n].zorder].first : &vertices_ot[tiles_[n].zorder].second, tiles_[n]);
+		if(dirty != nullptr && (tiles_[n].x < dirty_chunks.x() || tiles_[n].x >= dirty_chunks.x2() ||
+		                        tiles_[n].y < dirty_chunks.y() || tiles_[n].y >= dirty_chunks.y2())) {
+			continue;
+		}
+
+		const int npoints = LevelObject::calculateTileCorners(blit_cache_info_ptr->getChunkVertices(tiles_[n].x, tiles_[n].y, tiles_[n].object->isOpaque()), tiles_[n]);
 		if(npoints > 0) {
 			if(*tiles_[n].object->texture() != *blit_cache_info_ptr->getTexture()) {
 				ASSERT_LOG(false, "Multiple tile textures per level per zorder are unsupported. level: '"
@@ -1982,9 +2104,8 @@ void Level::prepare_tiles_for_drawing()
 		}
 	}
 
-	for(auto& v_ot : vertices_ot) {
-		auto blit_cache_info_ptr = blit_cache_[v_ot.first];
-		blit_cache_info_ptr->setVertices(&v_ot.second.first, &v_ot.second.second);
+	for(auto& p : blit_cache_) {
+		p.second->updateBuffers();
 	}
 
 	for(int n = 1; n < static_cast<int>(solid_color_rects_.size()); ++n) {
@@ -2032,7 +2153,7 @@ void Level::draw_status() const
 
 namespace
 {
-	void draw_entity(const Entity& obj, int x, int y, bool editor)
+	void draw_entity(const Entity& obj, int x, int y, bool editor, SpriteBatch* batch=nullptr)
 	{
 		const std::pair<int,int>* scroll_speed = obj.parallaxScaleMillis();
 
@@ -2046,6 +2167,14 @@ namespace
 			diffy = ((scrolly - 1000)*y)/1000;
 		}
 
+		if(batch != nullptr) {
+			if(!editor && obj.drawBatched(*batch, diffx, diffy)) {
+				return;
+			}
+
+			batch->flush();
+		}
+
 		KRE::ModelManager2D model_scope(diffx, diffy);
 		obj.draw(x, y);
 		if(editor) {
@@ -2218,12 +2347,15 @@ void Level::draw(int x, int y, int w, int h) const
 			{
 
 			CustomObjectDrawZOrderManager draw_manager;
+			SpriteBatch batch;
 
 			while(entity_itor != chars.end() && (*entity_itor)->zorder() <= *layer) {
-				draw_entity(**entity_itor, x, y, editor_);
+				draw_entity(**entity_itor, x, y, editor_, g_batch_sprites ? &batch : nullptr);
 				++entity_itor;
 			}
 
+			batch.flush();
+
 			}
 
 			draw_layer(*layer, x, y, w, h);
@@ -2236,8 +2368,10 @@ void Level::draw(int x, int y, int w, int h) const
 		}
 
 		int last_zorder = -1000000;
+		SpriteBatch batch;
 		while(entity_itor != chars.end()) {
 			if((*entity_itor)->zorder() != last_zorder) {
+				batch.flush();
 				last_zorder = (*entity_itor)->zorder();
 				frameBufferEnterZorder(last_zorder);
 				const bool alpha_test = last_zorder >= begin_alpha_test && last_zorder < end_alpha_test;
@@ -2245,10 +2379,12 @@ void Level::draw(int x, int y, int w, int h) const
 				stencil->updateMask(alpha_test ? 0x02 : 0x0);
 			}
 
-			draw_entity(**entity_itor, x, y, editor_);
+			draw_entity(**entity_itor, x, y, editor_, g_batch_sprites ? &batch : nullptr);
 			++entity_itor;
 		}
 
+		batch.flush();
+
 		graphics::set_alpha_test(false);
 		frameBufferEnterZorder(1000000);
 
@@ -2533,13 +2669,13 @@ void Level::draw_debug_solid(int x, int y, int w, int h) const
 						//The following if statement correctly loads a rectangle of
 						//coordinates into v. However, rr.update doesn't work. (I think.)
 
-						//if(info->bitmap.test(suby*TileSize + subx)) {
+						//if(solid_.isSolidAt(xpixel + subx, ypixel + suby)) {
 						//	v.emplace_back(xpixel + subx + 1, ypixel + suby + 1);
 						//}
 
 						//Because rr.update doesn't work, I've added this much less efficient
 						//code which just draws the rectangle once for each pixel. >_<
-						if(info->bitmap.test(suby*TileSize + subx)) {
+						if(solid_.isSolidAt(xpixel + subx, ypixel + suby)) {
 							rr.update(xpixel + subx, ypixel + suby, 1, 1,
 								info->info.damage ? KRE::Color(255, 0, 0, 196) : KRE::Color(255, 255, 255, 196));
 							KRE::WindowManager::getMainWindow()->render(&rr);
@@ -2734,8 +2870,17 @@ void Level::set_active_chars()
 
 	const rect screen_area(screen_left, screen_top, screen_right - screen_left, screen_bottom - screen_top);
 	active_chars_.clear();
+
+	//In multiplayer every object is active, so the grid can't rule any out.
+	std::vector<EntityPtr> candidates;
+	if(controls::num_players() > 1) {
+		candidates = chars_;
+	} else {
+		entity_grid_.query(screen_area, &candidates);
+	}
+
 	std::vector<EntityPtr> objects_to_remove;
-	for(EntityPtr& c : chars_) {
+	for(EntityPtr& c : candidates) {
 		const bool isActive = c->isActive(screen_area) || c->useAbsoluteScreenCoordinates();
 
 		if(isActive) {
@@ -2838,6 +2983,8 @@ void Level::erase_char(EntityPtr c)
 		chars_by_label_.erase(c->label());
 	}
 	chars_.erase(std::remove(chars_.begin(), chars_.end(), c), chars_.end());
+	entity_grid_.erase(c.get());
+	solid_grid_.erase(c.get());
 	if(c->group() >= 0) {
 		assert(c->group() < static_cast<int>(groups_.size()));
 		entity_group& group = groups_[c->group()];
@@ -2847,70 +2994,25 @@ void Level::erase_char(EntityPtr c)
 	solid_chars_.clear();
 }
 
-bool Level::isSolid(const LevelSolidMap& map, const Entity& e, const std::vector<point>& points, const SurfaceInfo** surf_info) const
+bool Level::isSolid(const LevelSolidMap& map, const Entity& e, const std::vector<SolidSpan>& spans, const SurfaceInfo** surf_info) const
 {
-	const TileSolidInfo* info = nullptr;
-	int prev_x = std::numeric_limits<int>::min(), prev_y = std::numeric_limits<int>::min();
-
-	const Frame& current_frame = e.getCurrentFrame();
-
-	for(std::vector<point>::const_iterator p = points.begin(); p != points.end(); ++p) {
-		int x = 0, y = 0;
-		if(prev_x != std::numeric_limits<int>::min()) {
-			const int diff_x = (p->x - (p-1)->x) * (e.isFacingRight() ? 1 : -1);
-			const int diff_y = p->y - (p-1)->y;
-
-			x = prev_x + diff_x;
-			y = prev_y + diff_y;
-
-			if(x < 0 || y < 0 || x >= TileSize || y >= TileSize) {
-				//we need to recalculate the info, since we've stepped into
-				//another tile.
-				prev_x = std::numeric_limits<int>::min();
-			}
+	const int width = e.getCurrentFrame().width();
+	for(const SolidSpan& span : spans) {
+		int x1 = e.x() + span.x1;
+		int x2 = e.x() + span.x2;
+		if(!e.isFacingRight()) {
+			x1 = e.x() + width - 1 - span.x2;
+			x2 = e.x() + width - 1 - span.x1;
 		}
 
-		if(prev_x == std::numeric_limits<int>::min()) {
-			x = e.x() + (e.isFacingRight() ? p->x : (current_frame.width() - 1 - p->x));
-			y = e.y() + p->y;
-
-			tile_pos pos(x/TileSize, y/TileSize);
-			x = x%TileSize;
-			y = y%TileSize;
-			if(x < 0) {
-				pos.first--;
-				x += TileSize;
-			}
-
-			if(y < 0) {
-				pos.second--;
-				y += TileSize;
-			}
-
-			info = map.find(pos);
-		}
-
-		if(info != nullptr) {
-			if(info->all_solid) {
-				if(surf_info) {
-					*surf_info = &info->info;
-				}
-
-				return true;
+		int x = 0;
+		if(map.findSolidInSpan(x1, x2 + 1, e.y() + span.y, &x)) {
+			if(surf_info) {
+				*surf_info = map.getSurfaceAt(x, e.y() + span.y);
 			}
 
-			const int index = y*TileSize + x;
-			if(info->bitmap.test(index)) {
-				if(surf_info) {
-					*surf_info = &info->info;
-				}
-
-				return true;
-			}
+			return true;
 		}
-
-		prev_x = x;
-		prev_y = y;
 	}
 
 	return false;
@@ -2918,56 +3020,30 @@ bool Level::isSolid(const LevelSolidMap& map, const Entity& e, const std::vector
 
 bool Level::isSolid(const LevelSolidMap& map, int x, int y, const SurfaceInfo** surf_info) const
 {
-	tile_pos pos(x/TileSize, y/TileSize);
-	x = x%TileSize;
-	y = y%TileSize;
-	if(x < 0) {
-		pos.first--;
-		x += TileSize;
+	if(!map.isSolidAt(x, y)) {
+		return false;
 	}
 
-	if(y < 0) {
-		pos.second--;
-		y += TileSize;
+	if(surf_info) {
+		*surf_info = map.getSurfaceAt(x, y);
 	}
 
-	const TileSolidInfo* info = map.find(pos);
-	if(info != nullptr) {
-		if(info->all_solid) {
-			if(surf_info) {
-				*surf_info = &info->info;
-			}
-
-			return true;
-		}
-
-		const int index = y*TileSize + x;
-		if(info->bitmap.test(index)) {
-			if(surf_info) {
-				*surf_info = &info->info;
-			}
-
-			return true;
-		} else {
-			return false;
-		}
-	}
-
-	return false;
+	return true;
 }
 
 bool Level::standable(const rect& r, const SurfaceInfo** info) const
 {
-	const int ybegin = r.y();
-	const int yend = r.y2();
-	const int xbegin = r.x();
-	const int xend = r.x2();
-
-	for(int y = ybegin; y != yend; ++y) {
-		for(int x = xbegin; x != xend; ++x) {
-			if(standable(x, y, info)) {
-				return true;
+	for(int y = r.y(); y < r.y2(); ++y) {
+		//report the leftmost pixel which is either solid or standable.
+		int solid_x = r.x2(), standable_x = r.x2();
+		solid_.findSolidInSpan(r.x(), r.x2(), y, &solid_x);
+		standable_.findSolidInSpan(r.x(), solid_x, y, &standable_x);
+		if(solid_x != r.x2() || standable_x != r.x2()) {
+			if(info) {
+				*info = standable_x < solid_x ? standable_.getSurfaceAt(standable_x, y) : solid_.getSurfaceAt(solid_x, y);
 			}
+
+			return true;
 		}
 	}
 
@@ -2998,21 +3074,21 @@ bool Level::solid(int x, int y, const SurfaceInfo** info) const
 	return isSolid(solid_, x, y, info);
 }
 
-bool Level::solid(const Entity& e, const std::vector<point>& points, const SurfaceInfo** info) const
+bool Level::solid(const Entity& e, const std::vector<SolidSpan>& spans, const SurfaceInfo** info) const
 {
-	return isSolid(solid_, e, points, info);
+	return isSolid(solid_, e, spans, info);
 }
 
 bool Level::solid(int xbegin, int ybegin, int w, int h, const SurfaceInfo** info) const
 {
-	const int xend = xbegin + w;
-	const int yend = ybegin + h;
-
-	for(int y = ybegin; y != yend; ++y) {
-		for(int x = xbegin; x != xend; ++x) {
-			if(solid(x, y, info)) {
-				return true;
+	for(int y = ybegin; y < ybegin + h; ++y) {
+		int x = 0;
+		if(solid_.findSolidInSpan(xbegin, xbegin + w, y, &x)) {
+			if(info) {
+				*info = solid_.getSurfaceAt(x, y);
 			}
+
+			return true;
 		}
 	}
 
@@ -3021,21 +3097,7 @@ bool Level::solid(int xbegin, int ybegin, int w, int h, const SurfaceInfo** info
 
 bool Level::solid(const rect& r, const SurfaceInfo** info) const
 {
-	//TODO: consider optimizing this function.
-	const int ybegin = r.y();
-	const int yend = r.y2();
-	const int xbegin = r.x();
-	const int xend = r.x2();
-
-	for(int y = ybegin; y != yend; ++y) {
-		for(int x = xbegin; x != xend; ++x) {
-			if(solid(x, y, info)) {
-				return true;
-			}
-		}
-	}
-
-	return false;
+	return solid(r.x(), r.y(), r.w(), r.h(), info);
 }
 
 bool Level::may_be_solid_in_rect(const rect& r) const
@@ -3265,9 +3327,18 @@ void Level::add_tile_solid(const LevelTile& t)
 		highest_tile_ = t.object->height();
 	}
 
+	add_tile_solid(t, solid_, standable_);
+}
+
+void Level::add_tile_solid(const LevelTile& t, LevelSolidMap& solid, LevelSolidMap& standable)
+{
+	if(t.zorder >= 1000) {
+		return;
+	}
+
 	const ConstLevelObjectPtr& obj = t.object;
 	if(obj->allSolid()) {
-		add_solid_rect(t.x, t.y, t.x + obj->width(), t.y + obj->height(), obj->friction(), obj->traction(), obj->damage(), obj->info());
+		add_solid_rect(solid, t.x, t.y, t.x + obj->width(), t.y + obj->height(), obj->friction(), obj->traction(), obj->damage(), obj->info());
 		return;
 	}
 
@@ -3279,11 +3350,7 @@ void Level::add_tile_solid(const LevelTile& t)
 					xpos = obj->width() - x - 1;
 				}
 				if(obj->isSolid(xpos, y)) {
-					if(obj->isPassthrough()) {
-						add_standable(t.x + x, t.y + y, obj->friction(), obj->traction(), obj->damage(), obj->info());
-					} else {
-						add_solid(t.x + x, t.y + y, obj->friction(), obj->traction(), obj->damage(), obj->info());
-					}
+					setSolid(obj->isPassthrough() ? standable : solid, t.x + x, t.y + y, obj->friction(), obj->traction(), obj->damage(), obj->info());
 				}
 			}
 		}
@@ -3317,8 +3384,7 @@ std::vector<point> Level::get_solid_contiguous_region(int xpos, int ypos) const
 	ypos = round_tile_size(ypos);
 
 	tile_pos base(xpos/TileSize, ypos/TileSize);
-	const TileSolidInfo* info = solid_.find(base);
-	if(info == nullptr || (info->all_solid == false && info->bitmap.any() == false)) {
+	if(!solid_.isRectSolid(rect(base.first*TileSize, base.second*TileSize, TileSize, TileSize))) {
 		return result;
 	}
 
@@ -3342,8 +3408,7 @@ std::vector<point> Level::get_solid_contiguous_region(int xpos, int ypos) const
 				continue;
 			}
 
-			const TileSolidInfo* info = solid_.find(pos);
-			if(info == nullptr || (info->all_solid == false && info->bitmap.any() == false)) {
+			if(!solid_.isRectSolid(rect(pos.first*TileSize, pos.second*TileSize, TileSize, TileSize))) {
 				continue;
 			}
 
@@ -3375,6 +3440,8 @@ void Level::remove_character(EntityPtr e)
 		chars_by_label_.erase(e->label());
 	}
 	chars_.erase(std::remove(chars_.begin(), chars_.end(), e), chars_.end());
+	entity_grid_.erase(e.get());
+	solid_grid_.erase(e.get());
 	solid_chars_.erase(std::remove(solid_chars_.begin(), solid_chars_.end(), e), solid_chars_.end());
 	active_chars_.erase(std::remove(active_chars_.begin(), active_chars_.end(), e), active_chars_.end());
 	new_chars_.erase(std::remove(new_chars_.begin(), new_chars_.end(), e), new_chars_.end());
@@ -3382,17 +3449,19 @@ void Level::remove_character(EntityPtr e)
 
 std::vector<EntityPtr> Level::get_characters_in_rect(const rect& r, int screen_xpos, int screen_ypos) const
 {
+	std::vector<EntityPtr> candidates;
+	entity_grid_.query(r, &candidates);
+
 	std::vector<EntityPtr> res;
-	for(EntityPtr c : chars_) {
+	for(const EntityPtr& c : candidates) {
 		if(object_classification_hidden(*c)) {
 			continue;
 		}
-		CustomObject* obj = dynamic_cast<CustomObject*>(c.get());
 
 		const int xP = c->getMidpoint().x + ((c->parallaxScaleMillisX() - 1000)*screen_xpos)/1000
-			+ (obj->useAbsoluteScreenCoordinates() ? screen_xpos + absolute_object_adjust_x() : 0);
+			+ (c->useAbsoluteScreenCoordinates() ? screen_xpos + absolute_object_adjust_x() : 0);
 		const int yP = c->getMidpoint().y + ((c->parallaxScaleMillisY() - 1000)*screen_ypos)/1000
-			+ (obj->useAbsoluteScreenCoordinates() ? screen_ypos + absolute_object_adjust_y() : 0);
+			+ (c->useAbsoluteScreenCoordinates() ? screen_ypos + absolute_object_adjust_y() : 0);
 		if(pointInRect(point(xP, yP), r)) {
 			res.push_back(c);
 		}
@@ -3403,8 +3472,11 @@ std::vector<EntityPtr> Level::get_characters_in_rect(const rect& r, int screen_x
 
 std::vector<EntityPtr> Level::get_characters_at_point(int x, int y, int screen_xpos, int screen_ypos) const
 {
+	std::vector<EntityPtr> candidates;
+	entity_grid_.query(rect(x, y, 1, 1), &candidates);
+
 	std::vector<EntityPtr> result;
-	for(EntityPtr c : chars_) {
+	for(const EntityPtr& c : candidates) {
 		if(object_classification_hidden(*c)) {
 			continue;
 		}
@@ -3461,12 +3533,17 @@ EntityPtr Level::get_next_character_at_point(int x, int y, int screen_xpos, int
 }
 
 void Level::add_solid_rect(int x1, int y1, int x2, int y2, int friction, int traction, int damage, const std::string& info_str)
+{
+	add_solid_rect(solid_, x1, y1, x2, y2, friction, traction, damage, info_str);
+}
+
+void Level::add_solid_rect(LevelSolidMap& map, int x1, int y1, int x2, int y2, int friction, int traction, int damage, const std::string& info_str)
 {
 	if((x1%TileSize) != 0 || (y1%TileSize) != 0 ||
 	   (x2%TileSize) != 0 || (y2%TileSize) != 0) {
 		for(int y = y1; y < y2; ++y) {
 			for(int x = x1; x < x2; ++x) {
-				add_solid(x, y, friction, traction, damage, info_str);
+				setSolid(map, x, y, friction, traction, damage, info_str);
 			}
 		}
 
@@ -3476,8 +3553,7 @@ void Level::add_solid_rect(int x1, int y1, int x2, int y2, int friction, int tra
 	for(int y = y1; y < y2; y += TileSize) {
 		for(int x = x1; x < x2; x += TileSize) {
 			tile_pos pos(x/TileSize, y/TileSize);
-			TileSolidInfo& s = solid_.insertOrFind(pos);
-			s.all_solid = true;
+			TileSolidInfo& s = map.insertSolidTile(pos);
 			s.info.friction = friction;
 			s.info.traction = traction;
 
@@ -3507,18 +3583,14 @@ void Level::add_standable(int x, int y, int friction, int traction, int damage,
 void Level::setSolid(LevelSolidMap& map, int x, int y, int friction, int traction, int damage, const std::string& info_str, bool solid)
 {
 	tile_pos pos(x/TileSize, y/TileSize);
-	x = x%TileSize;
-	y = y%TileSize;
-	if(x < 0) {
+	if(x%TileSize < 0) {
 		pos.first--;
-		x += TileSize;
 	}
 
-	if(y < 0) {
+	if(y%TileSize < 0) {
 		pos.second--;
-		y += TileSize;
 	}
-	const int index = y*TileSize + x;
+
 	TileSolidInfo& info = map.insertOrFind(pos);
 
 	if(info.info.damage >= 0) {
@@ -3530,14 +3602,11 @@ void Level::setSolid(LevelSolidMap& map, int x, int y, int friction, int tractio
 	if(solid) {
 		info.info.friction = friction;
 		info.info.traction = traction;
-		info.bitmap.set(index);
+		map.setSolidAt(x, y, true);
 	} else {
-		if(info.all_solid) {
-			info.all_solid = false;
-			info.bitmap.set();
-		}
-
-		info.bitmap.reset(index);
+		//all the pixels of an all solid tile are already set.
+		info.all_solid = false;
+		map.setSolidAt(x, y, false);
 	}
 
 	if(info_str.empty() == false) {
@@ -3552,6 +3621,8 @@ void Level::add_multi_player(EntityPtr p)
 	ASSERT_LOG(!g_player_type || g_player_type->match(variant(p.get())), "Player object being added to level does not match required player type. " << p->getDebugDescription() << " is not a " << g_player_type->to_string());
 	players_.push_back(p);
 	chars_.push_back(p);
+	entity_grid_.insert(p.get());
+	solid_grid_.insert(p.get());
 	if(p->label().empty() == false) {
 		chars_by_label_[p->label()] = p;
 	}
@@ -3614,6 +3685,8 @@ void Level::add_player(EntityPtr p)
 	}
 
 	chars_.erase(std::remove(chars_.begin(), chars_.end(), EntityPtr()), chars_.end());
+	entity_grid_.rebuild(chars_);
+	solid_grid_.rebuild(chars_);
 }
 
 void Level::add_character(EntityPtr p)
@@ -3644,6 +3717,8 @@ void Level::add_character(EntityPtr p)
 		add_player(p);
 	} else {
 		chars_.push_back(p);
+		entity_grid_.insert(p.get());
+		solid_grid_.insert(p.get());
 	}
 
 	p->addToLevel();
@@ -4310,6 +4385,51 @@ const std::vector<EntityPtr>& Level::get_solid_chars() const
 	return solid_chars_;
 }
 
+namespace
+{
+	//What is found near a moving object is looked up over an area this
+	//much bigger on each side, so that it can be kept while it moves.
+	const int SolidCharsCacheBorder = 64;
+}
+
+const std::vector<EntityPtr>& Level::get_solid_chars_near(const Entity& mover, const rect& area) const
+{
+	SolidCharsCache& cache = solid_chars_cache_;
+	if(cache.valid && cache.mover == &mover && cache.generation == solid_grid_.generation() &&
+	   area.x() >= cache.area.x() && area.y() >= cache.area.y() &&
+	   area.x2() <= cache.area.x2() && area.y2() <= cache.area.y2()) {
+		return cache.chars;
+	}
+
+	cache.chars.clear();
+	cache.valid = cache.mover == &mover;
+	if(cache.valid) {
+		const int border = SolidCharsCacheBorder;
+		cache.area = rect(area.x() - border, area.y() - border, area.w() + border*2, area.h() + border*2);
+		solid_grid_.query(cache.area, &cache.chars);
+		cache.generation = solid_grid_.generation();
+	} else {
+		solid_grid_.query(area, &cache.chars);
+	}
+
+	return cache.chars;
+}
+
+Level::MoverScope::MoverScope(const Level& lvl, const Entity& mover) : lvl_(lvl), old_mover_(lvl.solid_chars_cache_.mover)
+{
+	lvl_.solid_chars_cache_.mover = &mover;
+	lvl_.solid_chars_cache_.valid = false;
+	lvl_.solid_grid_.setIgnoredMover(&mover);
+}
+
+Level::MoverScope::~MoverScope()
+{
+	lvl_.solid_chars_cache_.mover = old_mover_;
+	lvl_.solid_chars_cache_.valid = false;
+	lvl_.solid_chars_cache_.chars.clear();
+	lvl_.solid_grid_.setIgnoredMover(old_mover_);
+}
+
 bool Level::can_interact(const rect& body) const
 {
 	for(const portal& p : portals_) {
@@ -4339,7 +4459,7 @@ void Level::replay_from_cycle(int ncycle)
 	ASSERT_GE(index, 0);
 
 	const int cycle_to_play_until = cycle_;
-	restore_from_backup(*backups_[index]);
+	restore_from_backup(resolve_backup(index));
 	ASSERT_EQ(cycle_, ncycle);
 	backups_.erase(backups_.begin() + index, backups_.end());
 	while(cycle_ < cycle_to_play_until) {
@@ -4349,6 +4469,14 @@ void Level::replay_from_cycle(int ncycle)
 }
 
 PREF_BOOL(enable_history, true, "Allow editor history features");
+PREF_INT(history_keyframe_interval, 50, "Number of history snapshots from one keyframe to the next");
+
+namespace
+{
+	//History older than this is dropped, a keyframe and the snapshots
+	//depending on it at a time.
+	const size_t MaxBackups = 250;
+}
 
 void Level::backup(bool force)
 {
@@ -4356,24 +4484,17 @@ void Level::backup(bool force)
 		return;
 	}
 
-	std::map<EntityPtr, EntityPtr> entity_map;
-
 	backup_snapshot_ptr snapshot(new backup_snapshot);
 	snapshot->rng_seed = rng::get_seed();
 	snapshot->cycle = cycle_;
-	snapshot->chars.reserve(chars_.size());
+	snapshot->keyframe = backups_.empty() || backed_up_chars_.chars.empty() || backups_since_keyframe_ >= g_history_keyframe_interval;
 
+	std::map<EntityPtr, EntityPtr> entity_map;
+	level_history::copy_entities(chars_, &backed_up_chars_, snapshot.get(), &entity_map);
 
-	for(const EntityPtr& e : chars_) {
-		snapshot->chars.push_back(e->backup());
-		entity_map[e] = snapshot->chars.back();
-
-		if(snapshot->chars.back()->isHuman()) {
-			snapshot->players.push_back(snapshot->chars.back());
-			if(e == player_) {
-				snapshot->player = snapshot->players.back();
-			}
-		}
+	auto player = entity_map.find(player_);
+	if(player != entity_map.end() && player->second->isHuman()) {
+		snapshot->player = player->second;
 	}
 
 	for(entity_group& g : groups_) {
@@ -4387,24 +4508,31 @@ void Level::backup(bool force)
 		}
 	}
 
-	for(const EntityPtr& e : snapshot->chars) {
-		e->mapEntities(entity_map);
-	}
-
 	snapshot->last_touched_player = last_touched_player_;
 
+	backups_since_keyframe_ = snapshot->keyframe ? 1 : backups_since_keyframe_ + 1;
+
 	backups_.push_back(snapshot);
-	if(backups_.size() > 250) {
 
-		for(std::deque<backup_snapshot_ptr>::iterator i = backups_.begin();
-		    i != backups_.begin() + 1; ++i) {
+	for(;;) {
+		size_t group_size = 1;
+		while(group_size < backups_.size() && !backups_[group_size]->keyframe) {
+			++group_size;
+		}
+
+		if(group_size == backups_.size() || backups_.size() - group_size < MaxBackups) {
+			break;
+		}
+
+		//nothing after the next keyframe refers to these copies.
+		for(auto i = backups_.begin(); i != backups_.begin() + group_size; ++i) {
 			for(const EntityPtr& e : (*i)->chars) {
 				//kill off any references this entity holds, to workaround
 				//circular references causing things to stick around.
 				e->cleanup_references();
 			}
 		}
-		backups_.erase(backups_.begin(), backups_.begin() + 1);
+		backups_.erase(backups_.begin(), backups_.begin() + group_size);
 	}
 }
 
@@ -4423,7 +4551,7 @@ void Level::reverse_one_cycle()
 		return;
 	}
 
-	restore_from_backup(*backups_.back());
+	restore_from_backup(resolve_backup(static_cast<int>(backups_.size()) - 1));
 	backups_.pop_back();
 }
 
@@ -4445,14 +4573,63 @@ void Level::reverse_to_cycle(int ncycle)
 	reverse_one_cycle();
 }
 
-void Level::restore_from_backup(backup_snapshot& snapshot)
+Level::resolved_backup Level::resolve_backup(int index) const
 {
+	return level_history::resolve(backups_, index);
+}
+
+void Level::restore_from_backup(const resolved_backup& backup)
+{
+	//The snapshots may share these copies with later ones, so the level
+	//gets copies of its own.
+	std::map<EntityPtr, EntityPtr> restored;
+	std::vector<EntityPtr> chars;
+	chars.reserve(backup.chars.size());
+	for(const EntityPtr& e : backup.chars) {
+		chars.push_back(e->backup());
+		restored[e] = chars.back();
+	}
+
+	std::map<EntityPtr, EntityPtr> entity_map;
+	for(const auto& copy : backup.copies) {
+		auto i = restored.find(copy.second);
+		if(i != restored.end()) {
+			entity_map[copy.first] = i->second;
+		}
+	}
+
+	for(const EntityPtr& e : chars) {
+		e->mapEntities(entity_map);
+	}
+
+	const backup_snapshot& snapshot = *backup.snapshot;
 	rng::set_seed(snapshot.rng_seed);
 	cycle_ = snapshot.cycle;
-	chars_ = snapshot.chars;
-	players_ = snapshot.players;
-	player_ = snapshot.player;
-	groups_ = snapshot.groups;
+	chars_ = chars;
+	entity_grid_.rebuild(chars_);
+	solid_grid_.rebuild(chars_);
+
+	players_.clear();
+	for(const EntityPtr& e : chars_) {
+		if(e->isHuman()) {
+			players_.push_back(e);
+		}
+	}
+
+	auto player = entity_map.find(snapshot.player);
+	player_ = player != entity_map.end() ? player->second : EntityPtr();
+
+	groups_.clear();
+	for(const entity_group& g : snapshot.groups) {
+		groups_.push_back(entity_group());
+		for(const EntityPtr& e : g) {
+			auto i = entity_map.find(e);
+			if(i != entity_map.end()) {
+				groups_.back().push_back(i->second);
+			}
+		}
+	}
+
 	last_touched_player_ = snapshot.last_touched_player;
 	active_chars_.clear();
 
@@ -4465,7 +4642,11 @@ void Level::restore_from_backup(backup_snapshot& snapshot)
 		}
 	}
 
-	for(const EntityPtr& ch : snapshot.chars) {
+	//the next snapshot can't share copies with the ones the level was
+	//restored from.
+	backed_up_chars_.chars.clear();
+
+	for(const EntityPtr& ch : chars_) {
 		ch->handleEvent(OBJECT_EVENT_LOAD);
 	}
 }
@@ -4473,25 +4654,68 @@ void Level::restore_from_backup(backup_snapshot& snapshot)
 std::vector<EntityPtr> Level::trace_past(EntityPtr e, int ncycle)
 {
 	backup();
+
+	const int nbackups = static_cast<int>(backups_.size());
+	int begin = nbackups;
+	while(begin > 0 && backups_[begin-1]->cycle >= ncycle) {
+		--begin;
+	}
+
+	if(begin == nbackups) {
+		return std::vector<EntityPtr>();
+	}
+
+	int first = begin;
+	while(!backups_[first]->keyframe) {
+		--first;
+		ASSERT_LOG(first >= 0, "History snapshot without a keyframe before it");
+	}
+
+	//Walk forward from the keyframe once, keeping the copies current at
+	//each snapshot, rather than resolving every snapshot from its keyframe.
+	std::vector<EntityPtr> ghosts(nbackups - begin);
+	std::map<uint64_t, EntityPtr> latest;
+	const std::vector<uint64_t>* ids = nullptr;
+	for(int index = first; index != nbackups; ++index) {
+		const backup_snapshot& snapshot = *backups_[index];
+		if(snapshot.keyframe) {
+			latest.clear();
+			ids = &snapshot.char_ids;
+		} else if(snapshot.order_changed) {
+			ids = &snapshot.ids;
+		}
+
+		for(size_t i = 0; i != snapshot.chars.size(); ++i) {
+			latest[snapshot.char_ids[i]] = snapshot.chars[i];
+		}
+
+		if(index < begin) {
+			continue;
+		}
+
+		for(uint64_t id : *ids) {
+			auto i = latest.find(id);
+			ASSERT_LOG(i != latest.end(), "History snapshot refers to an entity that was never copied");
+			if(i->second->label() == e->label()) {
+				ghosts[index - begin] = i->second;
+				break;
+			}
+		}
+	}
+
 	int prev_cycle = -1;
 	std::vector<EntityPtr> result;
-	std::deque<backup_snapshot_ptr>::reverse_iterator i = backups_.rbegin();
-	while(i != backups_.rend() && (*i)->cycle >= ncycle) {
-		const backup_snapshot& snapshot = **i;
+	for(int index = nbackups - 1; index >= begin; --index) {
+		const backup_snapshot& snapshot = *backups_[index];
 		if(prev_cycle != -1 && snapshot.cycle == prev_cycle) {
-			++i;
 			continue;
 		}
 
 		prev_cycle = snapshot.cycle;
 
-		for(const EntityPtr& ghost : snapshot.chars) {
-			if(ghost->label() == e->label()) {
-				result.push_back(ghost);
-				break;
-			}
+		if(ghosts[index - begin]) {
+			result.push_back(ghosts[index - begin]);
 		}
-		++i;
 	}
 
 	return result;
@@ -4503,8 +4727,9 @@ std::vector<EntityPtr> Level::predict_future(EntityPtr e, int ncycles)
 	const controls::control_backup_scope ctrl_backup_scope;
 
 	backup();
-	backup_snapshot_ptr snapshot = backups_.back();
+	const resolved_backup snapshot = resolve_backup(static_cast<int>(backups_.size()) - 1);
 	backups_.pop_back();
+	backed_up_chars_.chars.clear();
 
 	const size_t starting_backups = backups_.size();
 
@@ -4534,7 +4759,7 @@ std::vector<EntityPtr> Level::predict_future(EntityPtr e, int ncycles)
 	LOG_INFO("TOOK " << (profile::get_tick_time() - begin_time) << "ms to TRACE PAST OF " << result.size() << " FRAMES");
 
 	backups_.resize(starting_backups);
-	restore_from_backup(*snapshot);
+	restore_from_backup(snapshot);
 
 	return result;
 }
@@ -4542,8 +4767,9 @@ std::vector<EntityPtr> Level::predict_future(EntityPtr e, int ncycles)
 void Level::transfer_state_to(Level& lvl)
 {
 	backup(true);
-	lvl.restore_from_backup(*backups_.back());
+	lvl.restore_from_backup(resolve_backup(static_cast<int>(backups_.size()) - 1));
 	backups_.pop_back();
+	backed_up_chars_.chars.clear();
 }
 
 void Level::get_tile_layers(std::set<int>* all_layers, std::set<int>* hidden_layers)
@@ -5014,6 +5240,9 @@ void Level::surrenderReferences(GarbageCollector* gc)
 	for(EntityPtr& e : solid_chars_) {
 		gc->surrenderPtr(&e, "solid_chars");
 	}
+	for(EntityPtr& e : solid_chars_cache_.chars) {
+		gc->surrenderPtr(&e, "solid_chars_cache");
+	}
 	for(EntityPtr& e : chars_immune_from_time_freeze_) {
 		gc->surrenderPtr(&e, "chars_immune");
 	}
@@ -5080,14 +5309,28 @@ UTILITY(correct_solidity)
 	}
 }
 
+*/
+
 UTILITY(compile_levels)
 {
+	//Levels are compiled to binary files unless asked for text. Either
+	//kind can be loaded; binary files also store the solid maps of their
+	//tiles so loading needn't rebuild them.
+	g_compile_binary_levels = true;
+	for(const std::string& arg : args) {
+		if(arg == "--text") {
+			g_compile_binary_levels = false;
+		} else {
+			ASSERT_LOG(false, "Unrecognized argument to compile_levels: " << arg);
+		}
+	}
+
 	preferences::compiling_tiles = true;
 
 	LOG_INFO("COMPILING LEVELS...");
 
 	std::map<std::string, std::string> file_paths;
-	module::get_unique_filenames_under_dir(preferences::level_path(), &file_paths);
+	module::get_unique_filenames_under_dir("data/level/", &file_paths);
 
 	variant_builder index_node;
 
@@ -5101,7 +5344,9 @@ UTILITY(compile_levels)
 		ffl::IntrusivePtr<Level> lvl(new Level(file));
 		lvl->finishLoading();
 		lvl->record_zorders();
-		module::write_file("data/compiled/level/" + file, lvl->write().write_json(true));
+
+		const variant level_node = lvl->write();
+		module::write_file("data/compiled/level/" + file, g_compile_binary_levels ? variant_binary::write_binary(level_node) : level_node.write_json(true));
 		LOG_INFO("SAVING LEVEL TO MODULE: data/compiled/level/" << file);
 
 		variant_builder level_summary;
@@ -5115,7 +5360,7 @@ UTILITY(compile_levels)
 
 	LevelObject::writeCompiled();
 }
-*/
+
 BENCHMARK(level_solid)
 {
 	//benchmark which tells us how long Level::solid takes.
@@ -5125,6 +5370,65 @@ BENCHMARK(level_solid)
 	}
 }
 
+BENCHMARK_ARG(level_set_active_chars, int nobjects)
+{
+	//objects spread over a level a hundred screens wide, so that only a
+	//few of them are on screen at once.
+	static std::map<int, ffl::IntrusivePtr<Level>> levels;
+	ffl::IntrusivePtr<Level>& lvl = levels[nobjects];
+	if(!lvl) {
+		lvl = ffl::IntrusivePtr<Level>(new Level("test.cfg"));
+		lvl->finishLoading();
+		lvl->setAsCurrentLevel();
+		for(int n = 0; n != nobjects; ++n) {
+			EntityPtr e(new CustomObject("ant_black", rng::generate()%100000, rng::generate()%10000, false));
+			e->setLabel(formatter() << "benchmark_ant_" << n);
+			lvl->add_character(e);
+		}
+	}
+
+	BENCHMARK_LOOP {
+		lvl->set_active_chars();
+		lvl->get_characters_at_point(rng::generate()%100000, rng::generate()%10000, 0, 0);
+	}
+}
+
+BENCHMARK_ARG_CALL(level_set_active_chars, objects_1k, 1000);
+BENCHMARK_ARG_CALL(level_set_active_chars, objects_10k, 10000);
+BENCHMARK_ARG_CALL(level_set_active_chars, objects_50k, 50000);
+
+BENCHMARK_ARG(level_point_standable, int nsolids)
+{
+	//an object walking about among solid objects spread over the level,
+	//checking the ground under its feet as it would while moving.
+	static std::map<int, ffl::IntrusivePtr<Level>> levels;
+	ffl::IntrusivePtr<Level>& lvl = levels[nsolids];
+	if(!lvl) {
+		lvl = ffl::IntrusivePtr<Level>(new Level("test.cfg"));
+		lvl->finishLoading();
+		lvl->setAsCurrentLevel();
+		for(int n = 0; n != nsolids; ++n) {
+			EntityPtr e(new CustomObject("ant_black", rng::generate()%20000, rng::generate()%2000, false));
+			e->setLabel(formatter() << "benchmark_solid_" << n);
+			lvl->add_character(e);
+		}
+	}
+
+	const EntityPtr& mover = lvl->get_chars().front();
+	int x = 0;
+	BENCHMARK_LOOP {
+		const Level::MoverScope mover_scope(*lvl, *mover);
+		x = (x + 97)%20000;
+		for(int step = 0; step != 16; ++step) {
+			point_standable(*lvl, *mover, x + step, 1000);
+		}
+	}
+}
+
+BENCHMARK_ARG_CALL(level_point_standable, solids_100, 100);
+BENCHMARK_ARG_CALL(level_point_standable, solids_1k, 1000);
+BENCHMARK_ARG_CALL(level_point_standable, solids_10k, 10000);
+
 BENCHMARK(load_nene)
 {
 	BENCHMARK_LOOP {
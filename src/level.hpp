@@ -23,6 +23,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <deque>
 #include <map>
 #include <queue>
@@ -38,12 +39,14 @@
 #include "anura_shader.hpp"
 #include "background.hpp"
 #include "entity.hpp"
+#include "entity_grid.hpp"
 #include "formula.hpp"
 #include "formula_callable.hpp"
 #include "formula_callable_definition_fwd.hpp"
 #include "hex_fwd.hpp"
 #include "hex_renderable_fwd.hpp"
 #include "LayerBlitInfo.hpp"
+#include "level_history.hpp"
 #include "level_object.hpp"
 #include "level_solid_map.hpp"
 #include "random.hpp"
@@ -112,13 +115,18 @@ public:
 	void draw_debug_solid(int x, int y, int w, int h) const;
 	void draw_background(int x, int y, int rotation, float xdelta, float ydelta) const;
 	void process();
+
+	//Advances the game by one cycle. Unlike process() this doesn't read
+	//local controls, talk to the network or touch the screen.
+	void do_processing();
+
 	void set_active_chars();
 	void process_draw();
 	bool standable(const rect& r, const SurfaceInfo** info=nullptr) const;
 	bool standable(int x, int y, const SurfaceInfo** info=nullptr) const;
 	bool standable_tile(int x, int y, const SurfaceInfo** info=nullptr) const;
 	bool solid(int x, int y, const SurfaceInfo** info=nullptr) const;
-	bool solid(const Entity& e, const std::vector<point>& points, const SurfaceInfo** info=nullptr) const;
+	bool solid(const Entity& e, const std::vector<SolidSpan>& spans, const SurfaceInfo** info=nullptr) const;
 	bool solid(const rect& r, const SurfaceInfo** info=nullptr) const;
 	bool solid(int xbegin, int ybegin, int w, int h, const SurfaceInfo** info=nullptr) const;
 	bool may_be_solid_in_rect(const rect& r) const;
@@ -290,7 +298,29 @@ public:
 	const std::vector<EntityPtr>& get_active_chars() const { return active_chars_; }
 	const std::vector<EntityPtr>& get_chars() const { return chars_; }
 	const std::vector<EntityPtr>& get_solid_chars() const;
-	void swap_chars(std::vector<EntityPtr>& v) { chars_.swap(v); solid_chars_.clear(); }
+
+	//The solid objects and platforms whose solid or platform rects may
+	//touch area, in the order of get_solid_chars(). The result is only
+	//good until the next call.
+	const std::vector<EntityPtr>& get_solid_chars_near(const Entity& mover, const rect& area) const;
+
+	//While an object is being processed, the objects found near it by
+	//get_solid_chars_near() are kept and reused as it moves about, until
+	//it leaves the area looked up or anything else changes.
+	class MoverScope
+	{
+	public:
+		MoverScope(const Level& lvl, const Entity& mover);
+		~MoverScope();
+	private:
+		MoverScope(const MoverScope&);
+		void operator=(const MoverScope&);
+
+		const Level& lvl_;
+		const Entity* old_mover_;
+	};
+
+	void swap_chars(std::vector<EntityPtr>& v) { chars_.swap(v); solid_chars_.clear(); entity_grid_.rebuild(chars_); solid_grid_.rebuild(chars_); }
 	int num_active_chars() const { return static_cast<int>(active_chars_.size()); }
 
 	//function which, given the rect of the player's body will return true iff
@@ -450,9 +480,9 @@ private:
 	void read_compiled_tiles(variant node, std::vector<LevelTile>::iterator& out);
 
 	void complete_tiles_refresh();
-	void prepare_tiles_for_drawing();
-
-	void do_processing();
+	//builds the vertices used to draw the tiles. If dirty is given, only
+	//the parts of the tile layers which overlap it are rebuilt.
+	void prepare_tiles_for_drawing(const rect* dirty=nullptr);
 
 	void calculateLighting(int x, int y, int w, int h) const;
 
@@ -463,7 +493,9 @@ private:
 
 	void rebuild_tiles_rect(const rect& r);
 	void add_tile_solid(const LevelTile& t);
+	static void add_tile_solid(const LevelTile& t, LevelSolidMap& solid, LevelSolidMap& standable);
 	void add_solid_rect(int x1, int y1, int x2, int y2, int friction, int traction, int damage, const std::string& info);
+	static void add_solid_rect(LevelSolidMap& map, int x1, int y1, int x2, int y2, int friction, int traction, int damage, const std::string& info);
 	void add_solid(int x, int y, int friction, int traction, int damage, const std::string& info);
 	void add_standable(int x, int y, int friction, int traction, int damage, const std::string& info);
 	typedef std::pair<int,int> tile_pos;
@@ -496,9 +528,9 @@ private:
 	LevelSolidMap standable_base_;
 
 	bool isSolid(const LevelSolidMap& map, int x, int y, const SurfaceInfo** surf_info) const;
-	bool isSolid(const LevelSolidMap& map, const Entity& e, const std::vector<point>& points, const SurfaceInfo** surf_info) const;
+	bool isSolid(const LevelSolidMap& map, const Entity& e, const std::vector<SolidSpan>& spans, const SurfaceInfo** surf_info) const;
 
-	void setSolid(LevelSolidMap& map, int x, int y, int friction, int traction, int damage, const std::string& info, bool solid=true);
+	static void setSolid(LevelSolidMap& map, int x, int y, int friction, int traction, int damage, const std::string& info, bool solid=true);
 
 	std::string title_;
 
@@ -544,6 +576,28 @@ private:
 	void erase_char(EntityPtr c);
 	std::vector<EntityPtr> chars_;
 	mutable std::vector<EntityPtr> active_chars_;
+
+	//chars_ filed by position; must be kept in step with chars_.
+	mutable EntityGrid entity_grid_;
+
+	//chars_ filed by their solid and platform rects, and what was last
+	//found near the object being processed.
+	mutable EntityGrid solid_grid_;
+	struct SolidCharsCache
+	{
+		SolidCharsCache() : mover(nullptr), valid(false), generation(0)
+		{}
+		//a copied level has its own grid, so starts with nothing kept.
+		SolidCharsCache(const SolidCharsCache&) : SolidCharsCache()
+		{}
+		SolidCharsCache& operator=(const SolidCharsCache&) { return *this; }
+		const Entity* mover;
+		bool valid;
+		unsigned generation;
+		rect area;
+		std::vector<EntityPtr> chars;
+	};
+	mutable SolidCharsCache solid_chars_cache_;
 	std::vector<EntityPtr> new_chars_;
 	mutable std::vector<EntityPtr> solid_chars_;
 
@@ -627,20 +681,17 @@ private:
 
 	std::shared_ptr<point> lock_screen_;
 
-	struct backup_snapshot {
-		rng::Seed rng_seed;
-		int cycle;
-		std::vector<EntityPtr> chars;
-		std::vector<EntityPtr> players;
-		std::vector<entity_group> groups;
-		EntityPtr player, last_touched_player;
-	};
-
-	void restore_from_backup(backup_snapshot& snapshot);
+	//Snapshots for the history. See level_history.hpp.
+	typedef level_history::snapshot backup_snapshot;
+	typedef level_history::snapshot_ptr backup_snapshot_ptr;
+	typedef level_history::resolved resolved_backup;
 
-	typedef std::shared_ptr<backup_snapshot> backup_snapshot_ptr;
+	resolved_backup resolve_backup(int index) const;
+	void restore_from_backup(const resolved_backup& backup);
 
 	std::deque<backup_snapshot_ptr> backups_;
+	level_history::tracker backed_up_chars_;
+	int backups_since_keyframe_;
 
 	int editor_tile_updates_frozen_;
 	bool editor_dragging_objects_;
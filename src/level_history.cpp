@@ -0,0 +1,290 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <algorithm>
+#include <sstream>
+
+#include "asserts.hpp"
+#include "level_history.hpp"
+#include "unit_test.hpp"
+
+namespace level_history
+{
+	void copy_entities(const std::vector<EntityPtr>& chars, tracker* t, snapshot* s, std::map<EntityPtr, EntityPtr>* entity_map)
+	{
+		//Usually chars is the same as it was at the last snapshot and
+		//entities can be matched up by position.
+		bool same_chars = !s->keyframe && t->chars.size() == chars.size();
+		for(size_t n = 0; same_chars && n != chars.size(); ++n) {
+			same_chars = t->chars[n].source == chars[n];
+		}
+
+		std::map<const Entity*, const tracked_entity*> previous;
+		if(!s->keyframe && !same_chars) {
+			for(const tracked_entity& b : t->chars) {
+				previous[b.source.get()] = &b;
+			}
+
+			s->order_changed = true;
+			s->ids.reserve(chars.size());
+		}
+
+		std::vector<tracked_entity> tracked;
+		tracked.reserve(chars.size());
+
+		for(size_t n = 0; n != chars.size(); ++n) {
+			const EntityPtr& e = chars[n];
+
+			const tracked_entity* prev = nullptr;
+			if(same_chars) {
+				prev = &t->chars[n];
+			} else if(!s->keyframe) {
+				auto i = previous.find(e.get());
+				if(i != previous.end()) {
+					prev = i->second;
+				}
+			}
+
+			tracked_entity entry;
+			entry.source = e;
+			entry.generation = e->stateGeneration();
+			entry.id = prev != nullptr ? prev->id : t->next_id++;
+			if(prev != nullptr && prev->generation == entry.generation) {
+				entry.copy = prev->copy;
+			} else {
+				entry.copy = e->backup();
+				s->chars.push_back(entry.copy);
+				s->char_ids.push_back(entry.id);
+			}
+
+			if(s->order_changed) {
+				s->ids.push_back(entry.id);
+			}
+
+			(*entity_map)[e] = entry.copy;
+			tracked.push_back(entry);
+		}
+
+		for(const EntityPtr& e : s->chars) {
+			e->mapEntities(*entity_map);
+		}
+
+		t->chars.swap(tracked);
+	}
+
+	resolved resolve(const std::deque<snapshot_ptr>& snapshots, int index)
+	{
+		int first = index;
+		while(!snapshots[first]->keyframe) {
+			--first;
+			ASSERT_LOG(first >= 0, "History snapshot without a keyframe before it");
+		}
+
+		std::map<uint64_t, EntityPtr> latest;
+		const std::vector<uint64_t>* ids = nullptr;
+		for(int n = first; n <= index; ++n) {
+			const snapshot& s = *snapshots[n];
+			for(size_t i = 0; i != s.chars.size(); ++i) {
+				latest[s.char_ids[i]] = s.chars[i];
+			}
+
+			if(s.keyframe) {
+				ids = &s.char_ids;
+			} else if(s.order_changed) {
+				ids = &s.ids;
+			}
+		}
+
+		resolved result;
+		result.snapshot = snapshots[index];
+		result.chars.reserve(ids->size());
+		for(uint64_t id : *ids) {
+			auto i = latest.find(id);
+			ASSERT_LOG(i != latest.end(), "History snapshot refers to an entity that was never copied");
+			result.chars.push_back(i->second);
+		}
+
+		for(int n = first; n <= index; ++n) {
+			const snapshot& s = *snapshots[n];
+			for(size_t i = 0; i != s.chars.size(); ++i) {
+				result.copies[s.chars[i]] = latest[s.char_ids[i]];
+			}
+		}
+
+		return result;
+	}
+}
+
+namespace
+{
+	//Just enough of an entity for the history to copy: a value, and a
+	//reference to another entity.
+	class history_test_entity : public Entity
+	{
+	public:
+		explicit history_test_entity(const std::string& label) : Entity(0, 0, true), value(0)
+		{
+			setLabel(label);
+		}
+
+		void setTestValue(int v) { value = v; stateChanged(); }
+		void setTarget(const EntityPtr& e) { target = e; stateChanged(); }
+
+		int value;
+		EntityPtr target;
+
+		EntityPtr backup() const override { return EntityPtr(new history_test_entity(*this)); }
+		void mapEntities(const std::map<EntityPtr, EntityPtr>& m) override {
+			auto i = m.find(target);
+			if(i != m.end()) {
+				target = i->second;
+			}
+		}
+
+		variant getValue(const std::string& key) const override { return variant(); }
+		variant write() const override { return variant(); }
+		void draw(int x, int y) const override {}
+		void drawLater(int x, int y) const override {}
+		void drawGroup() const override {}
+		bool executeCommand(const variant& var) override { return false; }
+		bool destroyed() const override { return false; }
+		bool pointCollides(int x, int y) const override { return false; }
+		bool rectCollides(const rect& r) const override { return false; }
+		const Frame& getIconFrame() const override { ASSERT_LOG(false, "history_test_entity has no frames"); }
+		const Frame& getCurrentFrame() const override { ASSERT_LOG(false, "history_test_entity has no frames"); }
+		rect getDrawRect() const override { return rect(); }
+		int getTimeInFrame() const override { return 0; }
+		EntityPtr standingOn() const override { return EntityPtr(); }
+		void dieWithNoEvent() override {}
+		bool isActive(const rect& screen_area) const override { return false; }
+		void setSoundVolume(float volume, float nseconds) override {}
+		int mass() const override { return 0; }
+		void resolveDelayedEvents() override {}
+		std::string getDebugDescription() const override { return label(); }
+		const std::vector<LightPtr>& lights() const override { return lights_; }
+		void swapLights(std::vector<LightPtr>& lights) override {}
+		bool appearsAtDifficulty(int difficulty) const override { return true; }
+		bool editorForceStanding() const override { return false; }
+		bool getClipArea(rect* clipArea) const override { return false; }
+		game_logic::ConstFormulaCallableDefinitionPtr getDefinition() const override { return game_logic::ConstFormulaCallableDefinitionPtr(); }
+		bool createObject() override { return false; }
+		bool useAbsoluteScreenCoordinates() const override { return false; }
+		void beingAdded() override {}
+		int getValueSlot(const std::string& key) const override { return -1; }
+	protected:
+		ConstSolidInfoPtr calculateSolid() const override { return ConstSolidInfoPtr(); }
+		ConstSolidInfoPtr calculatePlatform() const override { return ConstSolidInfoPtr(); }
+		void control(const Level& lvl) override {}
+	private:
+		std::vector<LightPtr> lights_;
+	};
+
+	//Lists each entity's label and value, and the label of the entity it
+	//refers to, marked with '*' if that is one of chars. Copies are first
+	//mapped through copies, as Level::restore_from_backup() does.
+	std::string describe_entities(const std::vector<EntityPtr>& chars, const std::map<EntityPtr, EntityPtr>& copies=std::map<EntityPtr, EntityPtr>())
+	{
+		std::ostringstream s;
+		for(const EntityPtr& e : chars) {
+			const history_test_entity& entity = static_cast<const history_test_entity&>(*e);
+			s << entity.label() << "=" << entity.value;
+
+			EntityPtr target = entity.target;
+			auto i = copies.find(target);
+			if(i != copies.end()) {
+				target = i->second;
+			}
+
+			if(target) {
+				s << "->" << target->label();
+				if(std::count(chars.begin(), chars.end(), target)) {
+					s << "*";
+				}
+			}
+
+			s << " ";
+		}
+
+		return s.str();
+	}
+
+	history_test_entity& test_entity(const EntityPtr& e)
+	{
+		return static_cast<history_test_entity&>(*e);
+	}
+}
+
+UNIT_TEST(level_history_matches_full_copies)
+{
+	std::vector<EntityPtr> chars;
+	for(const char* label : { "a", "b", "c" }) {
+		chars.push_back(EntityPtr(new history_test_entity(label)));
+	}
+
+	test_entity(chars[0]).setTarget(chars[2]);
+
+	level_history::tracker tracker;
+	std::deque<level_history::snapshot_ptr> snapshots;
+	std::vector<std::string> expected;
+	int since_keyframe = 0;
+	for(int cycle = 0; cycle != 24; ++cycle) {
+		//entities come and go, and change order, both within the
+		//snapshots depending on a keyframe and across keyframes.
+		bool chars_changed = true;
+		if(cycle == 5) {
+			chars.erase(chars.begin() + 1);
+		} else if(cycle == 9) {
+			EntityPtr d(new history_test_entity("d"));
+			test_entity(d).setTarget(chars[0]);
+			chars.push_back(d);
+		} else if(cycle == 14) {
+			std::reverse(chars.begin(), chars.end());
+		} else if(cycle == 17) {
+			chars.insert(chars.begin() + 1, EntityPtr(new history_test_entity("e")));
+		} else {
+			chars_changed = false;
+		}
+
+		//one entity changes each cycle, the rest keep their copies.
+		test_entity(chars[cycle%chars.size()]).setTestValue(cycle);
+
+		level_history::snapshot_ptr s(new level_history::snapshot);
+		s->cycle = cycle;
+		s->keyframe = snapshots.empty() || tracker.chars.empty() || since_keyframe >= 4;
+		std::map<EntityPtr, EntityPtr> entity_map;
+		level_history::copy_entities(chars, &tracker, s.get(), &entity_map);
+		since_keyframe = s->keyframe ? 1 : since_keyframe + 1;
+
+		if(!s->keyframe && !chars_changed) {
+			CHECK_EQ(s->chars.size(), 1);
+		}
+
+		snapshots.push_back(s);
+		expected.push_back(describe_entities(chars));
+	}
+
+	for(int n = 0; n != static_cast<int>(snapshots.size()); ++n) {
+		const level_history::resolved r = level_history::resolve(snapshots, n);
+		CHECK_EQ(describe_entities(r.chars, r.copies), expected[n]);
+	}
+}
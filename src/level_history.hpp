@@ -0,0 +1,106 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "entity.hpp"
+#include "random.hpp"
+
+//The history of a level's entities, which lets the level be reversed to
+//an earlier cycle. Level::backup() takes a snapshot each cycle.
+namespace level_history
+{
+	//A snapshot of the level's entities. Keyframes hold a copy of every
+	//entity. Other snapshots only hold copies of the entities whose
+	//stateGeneration() changed since the snapshot before them, and share
+	//the rest with earlier snapshots back to the keyframe. References
+	//between entities are mapped to the copies current at the snapshot.
+	struct snapshot {
+		snapshot() : cycle(0), keyframe(false), order_changed(false) {}
+		rng::Seed rng_seed;
+		int cycle;
+		bool keyframe;
+
+		//The entities copied in this snapshot, and the backup id of the
+		//live entity each was copied from, which tells which copies are of
+		//the same entity.
+		std::vector<EntityPtr> chars;
+		std::vector<uint64_t> char_ids;
+
+		//The backup ids of the level's entities in chars_ order. Keyframes
+		//use char_ids and other snapshots only set this if chars_ changed.
+		bool order_changed;
+		std::vector<uint64_t> ids;
+
+		std::vector<std::vector<EntityPtr>> groups;
+		EntityPtr player, last_touched_player;
+	};
+
+	typedef std::shared_ptr<snapshot> snapshot_ptr;
+
+	//The entities in the level when the last snapshot was taken, with the
+	//copy of each the snapshots hold and its stateGeneration() at the time.
+	//Cleared whenever the last snapshot is dropped so that the next one is
+	//a keyframe.
+	struct tracked_entity {
+		EntityPtr source, copy;
+		unsigned int generation;
+		uint64_t id;
+	};
+
+	struct tracker {
+		tracker() : next_id(0) {}
+		std::vector<tracked_entity> chars;
+
+		//Backup ids are never reused, unlike the addresses of entities, so
+		//a new entity can't be mistaken for one that has since been
+		//destroyed.
+		uint64_t next_id;
+	};
+
+	//Adds copies of chars to s, which must have keyframe set, sharing the
+	//copies of entities that haven't changed since the last snapshot.
+	//Fills entity_map with the copy of each entity, and maps the references
+	//the new copies hold to the copies.
+	void copy_entities(const std::vector<EntityPtr>& chars, tracker* t, snapshot* s, std::map<EntityPtr, EntityPtr>* entity_map);
+
+	//The state of a snapshot rebuilt from the keyframe before it.
+	struct resolved {
+		snapshot_ptr snapshot;
+
+		//The copies of the level's entities, in chars_ order.
+		std::vector<EntityPtr> chars;
+
+		//Every copy made from the keyframe up to the snapshot, mapped to
+		//the copy of the same entity in chars.
+		std::map<EntityPtr, EntityPtr> copies;
+	};
+
+	resolved resolve(const std::deque<snapshot_ptr>& snapshots, int index);
+}
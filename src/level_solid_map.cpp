@@ -22,11 +22,18 @@
 */
 
 
+#include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <set>
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 #include "level_solid_map.hpp"
 #include "preferences.hpp"
+#include "unit_test.hpp"
 
 namespace
 {
@@ -39,6 +46,119 @@ namespace
 			a.info = b.info;
 		}
 	}
+
+	void put_int(std::string& out, uint32_t value, int nbytes)
+	{
+		for(int n = 0; n != nbytes; ++n) {
+			out.push_back(static_cast<char>(value & 0xFF));
+			value >>= 8;
+		}
+	}
+
+	uint32_t get_int(const char*& p, int nbytes)
+	{
+		uint32_t result = 0;
+		for(int n = 0; n != nbytes; ++n) {
+			result |= static_cast<uint32_t>(static_cast<unsigned char>(p[n])) << (n*8);
+		}
+		p += nbytes;
+		return result;
+	}
+
+	int bitmap_bytes()
+	{
+		return (TileSize*TileSize + 7)/8;
+	}
+
+	//Tile bitmaps are stored in compiled levels as TileSize*TileSize bits,
+	//row by row, packed into bytes starting from the lowest bit.
+	void put_bits(unsigned char* buf, int pos, uint64_t bits, int nbits)
+	{
+		while(nbits > 0) {
+			const int shift = pos&7;
+			const int count = std::min(8 - shift, nbits);
+			buf[pos >> 3] |= static_cast<unsigned char>((bits & ((1U << count) - 1)) << shift);
+			bits >>= count;
+			pos += count;
+			nbits -= count;
+		}
+	}
+
+	uint64_t get_bits(const unsigned char* buf, int pos, int nbits)
+	{
+		uint64_t result = 0;
+		int done = 0;
+		while(done < nbits) {
+			const int shift = pos&7;
+			const int count = std::min(8 - shift, nbits - done);
+			result |= static_cast<uint64_t>((buf[pos >> 3] >> shift) & ((1U << count) - 1)) << done;
+			pos += count;
+			done += count;
+		}
+		return result;
+	}
+
+	//Calls fn(offset, nbits) for each piece of a tile row, split so that no
+	//piece is wider than the 64 bits getBits() and setBits() handle.
+	template<typename Fn>
+	void for_each_row_piece(Fn fn)
+	{
+		for(int offset = 0; offset < TileSize; offset += 64) {
+			fn(offset, std::min(64, TileSize - offset));
+		}
+	}
+
+	uint64_t low_bits(int nbits)
+	{
+		return nbits >= 64 ? ~uint64_t(0) : (uint64_t(1) << nbits) - 1;
+	}
+
+	int count_trailing_zeros(uint64_t mask)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		unsigned long index;
+		_BitScanForward64(&index, mask);
+		return static_cast<int>(index);
+#elif defined(_MSC_VER)
+		unsigned long index;
+		if(_BitScanForward(&index, static_cast<unsigned long>(mask))) {
+			return static_cast<int>(index);
+		}
+		_BitScanForward(&index, static_cast<unsigned long>(mask >> 32));
+		return static_cast<int>(index) + 32;
+#else
+		return __builtin_ctzll(mask);
+#endif
+	}
+
+	//Rounds towards negative infinity, so that e.g. pixel -1 is in tile -1.
+	int divide_down(int n, int size)
+	{
+		return n >= 0 ? n/size : -((-n - 1)/size) - 1;
+	}
+
+	tile_pos tile_at(int x, int y)
+	{
+		return tile_pos(divide_down(x, TileSize), divide_down(y, TileSize));
+	}
+
+	template<typename T>
+	T*& grid_cell(std::vector<T*>& cells, int index)
+	{
+		const unsigned pos = static_cast<unsigned>(index >= 0 ? index : -(index+1));
+		if(cells.size() <= pos) {
+			cells.resize(pos + 1);
+		}
+
+		return cells[pos];
+	}
+
+	template<typename T>
+	T* find_grid_cell(const std::vector<T*>& cells, int index)
+	{
+		const unsigned pos = static_cast<unsigned>(index >= 0 ? index : -(index+1));
+		return pos < cells.size() ? cells[pos] : nullptr;
+	}
 }
 
 const std::string* SurfaceInfo::get_info_str(const std::string& key)
@@ -47,6 +167,72 @@ const std::string* SurfaceInfo::get_info_str(const std::string& key)
 	return &*info_set.insert(key).first;
 }
 
+template<typename T>
+T*& LevelSolidMap::Grid<T>::insert(int x, int y)
+{
+	std::vector<Row>& rows = y >= 0 ? positive_rows_ : negative_rows_;
+	const unsigned index = static_cast<unsigned>(y >= 0 ? y : -(y+1));
+	if(rows.size() <= index) {
+		rows.resize(index + 1);
+	}
+
+	Row& r = rows[index];
+	return grid_cell(x >= 0 ? r.positive_cells : r.negative_cells, x);
+}
+
+template<typename T>
+T* LevelSolidMap::Grid<T>::find(int x, int y) const
+{
+	const std::vector<Row>& rows = y >= 0 ? positive_rows_ : negative_rows_;
+	const unsigned index = static_cast<unsigned>(y >= 0 ? y : -(y+1));
+	if(index >= rows.size()) {
+		return nullptr;
+	}
+
+	const Row& r = rows[index];
+	return find_grid_cell(x >= 0 ? r.positive_cells : r.negative_cells, x);
+}
+
+template<typename T>
+void LevelSolidMap::Grid<T>::clear()
+{
+	forEach([](int x, int y, T* item) { delete item; });
+	positive_rows_.clear();
+	negative_rows_.clear();
+}
+
+template<typename T>
+template<typename Fn>
+void LevelSolidMap::Grid<T>::forEach(Fn fn) const
+{
+	auto visit_row = [&fn](const Row& r, int y) {
+		for(int m = 0; m != r.positive_cells.size(); ++m) {
+			if(r.positive_cells[m]) {
+				fn(m, y, r.positive_cells[m]);
+			}
+		}
+
+		for(int m = 0; m != r.negative_cells.size(); ++m) {
+			if(r.negative_cells[m]) {
+				fn(-m - 1, y, r.negative_cells[m]);
+			}
+		}
+	};
+
+	for(int n = 0; n != positive_rows_.size(); ++n) {
+		visit_row(positive_rows_[n], n);
+	}
+
+	for(int n = 0; n != negative_rows_.size(); ++n) {
+		visit_row(negative_rows_[n], -n - 1);
+	}
+}
+
+LevelSolidMap::Chunk::Chunk()
+{
+	std::fill(rows, rows + ChunkSize, 0);
+}
+
 LevelSolidMap::LevelSolidMap()
 {
 }
@@ -67,179 +253,446 @@ LevelSolidMap::~LevelSolidMap()
 
 TileSolidInfo& LevelSolidMap::insertOrFind(const tile_pos& pos)
 {
-	TileSolidInfo** result = insertRaw(pos);
-	if(!*result) {
-		*result = new TileSolidInfo;
+	TileSolidInfo*& result = tiles_.insert(pos.first, pos.second);
+	if(!result) {
+		result = new TileSolidInfo;
+	}
+
+	return *result;
+}
+
+TileSolidInfo& LevelSolidMap::insertSolidTile(const tile_pos& pos)
+{
+	TileSolidInfo& result = insertOrFind(pos);
+	result.all_solid = true;
+	for(int y = 0; y != TileSize; ++y) {
+		for_each_row_piece([&](int offset, int nbits) {
+			setBits(pos.first*TileSize + offset, pos.second*TileSize + y, nbits, ~uint64_t(0));
+		});
 	}
 
-	return **result;
+	return result;
 }
 
-TileSolidInfo** LevelSolidMap::insertRaw(const tile_pos& pos)
+const TileSolidInfo* LevelSolidMap::find(const tile_pos& pos) const
+{
+	return tiles_.find(pos.first, pos.second);
+}
+
+void LevelSolidMap::erase(const tile_pos& pos)
 {
-	row* r = nullptr;
-	if(pos.second >= 0) {
-		if(positive_rows_.size() <= static_cast<unsigned>(pos.second)) {
-			positive_rows_.resize(pos.second + 1);
+	TileSolidInfo*& info = tiles_.insert(pos.first, pos.second);
+	if(info) {
+		for(int y = 0; y != TileSize; ++y) {
+			for_each_row_piece([&](int offset, int nbits) {
+				clearBits(pos.first*TileSize + offset, pos.second*TileSize + y, nbits);
+			});
 		}
+	}
 
-		r = &positive_rows_[pos.second];
-	} else {
-		const int index = -(pos.second+1);
-		if(negative_rows_.size() <= static_cast<unsigned>(index)) {
-			negative_rows_.resize(index + 1);
+	delete info;
+	info = nullptr;
+}
+
+void LevelSolidMap::clear()
+{
+	tiles_.clear();
+	chunks_.clear();
+}
+
+uint64_t LevelSolidMap::getBits(int x, int y, int nbits) const
+{
+	const int cx = divide_down(x, ChunkSize);
+	const int cy = divide_down(y, ChunkSize);
+	const int shift = x - cx*ChunkSize;
+	const int row = y - cy*ChunkSize;
+
+	uint64_t result = 0;
+	if(const Chunk* c = chunks_.find(cx, cy)) {
+		result = c->rows[row] >> shift;
+	}
+
+	//the pixels carry on into the next chunk.
+	if(shift + nbits > ChunkSize) {
+		if(const Chunk* c = chunks_.find(cx + 1, cy)) {
+			result |= c->rows[row] << (ChunkSize - shift);
 		}
+	}
 
-		r = &negative_rows_[index];
+	return result & low_bits(nbits);
+}
+
+void LevelSolidMap::setBits(int x, int y, int nbits, uint64_t bits)
+{
+	bits &= low_bits(nbits);
+	if(bits == 0) {
+		return;
 	}
 
-	if(pos.first >= 0) {
-		if(r->positive_cells.size() <= static_cast<unsigned>(pos.first)) {
-			r->positive_cells.resize(pos.first + 1);
+	const int cx = divide_down(x, ChunkSize);
+	const int cy = divide_down(y, ChunkSize);
+	const int shift = x - cx*ChunkSize;
+	const int row = y - cy*ChunkSize;
+
+	if(bits << shift) {
+		Chunk*& c = chunks_.insert(cx, cy);
+		if(!c) {
+			c = new Chunk;
 		}
 
-		return &r->positive_cells[pos.first];
-	} else {
-		const int index = -(pos.first+1);
-		if(r->negative_cells.size() <= static_cast<unsigned>(index)) {
-			r->negative_cells.resize(index + 1);
+		c->rows[row] |= bits << shift;
+	}
+
+	if(shift != 0 && (bits >> (ChunkSize - shift))) {
+		Chunk*& c = chunks_.insert(cx + 1, cy);
+		if(!c) {
+			c = new Chunk;
 		}
 
-		return &r->negative_cells[index];
+		c->rows[row] |= bits >> (ChunkSize - shift);
 	}
 }
 
-const TileSolidInfo* LevelSolidMap::find(const tile_pos& pos) const
+void LevelSolidMap::clearBits(int x, int y, int nbits)
 {
-	const row* r = nullptr;
-	if(pos.second >= 0) {
-		if(static_cast<unsigned>(pos.second) < positive_rows_.size()) {
-			r = &positive_rows_[pos.second];
-		} else {
-			return nullptr;
+	const uint64_t bits = low_bits(nbits);
+	const int cx = divide_down(x, ChunkSize);
+	const int cy = divide_down(y, ChunkSize);
+	const int shift = x - cx*ChunkSize;
+	const int row = y - cy*ChunkSize;
+
+	if(Chunk* c = chunks_.find(cx, cy)) {
+		c->rows[row] &= ~(bits << shift);
+	}
+
+	if(shift + nbits > ChunkSize) {
+		if(Chunk* c = chunks_.find(cx + 1, cy)) {
+			c->rows[row] &= ~(bits >> (ChunkSize - shift));
 		}
+	}
+}
+
+bool LevelSolidMap::isSolidAt(int x, int y) const
+{
+	const int cx = divide_down(x, ChunkSize);
+	const int cy = divide_down(y, ChunkSize);
+	const Chunk* c = chunks_.find(cx, cy);
+	return c && (c->rows[y - cy*ChunkSize] >> (x - cx*ChunkSize))&1;
+}
+
+void LevelSolidMap::setSolidAt(int x, int y, bool value)
+{
+	if(value) {
+		setBits(x, y, 1, 1);
 	} else {
-		const int index = -(pos.second+1);
-		if(static_cast<unsigned>(index) < negative_rows_.size()) {
-			r = &negative_rows_[index];
-		} else {
-			return nullptr;
-		}
+		clearBits(x, y, 1);
 	}
+}
 
-	if(pos.first >= 0) {
-		if(static_cast<unsigned>(pos.first) < r->positive_cells.size()) {
-			return r->positive_cells[pos.first];
-		} else {
-			return nullptr;
+bool LevelSolidMap::findSolidInSpan(int x1, int x2, int y, int* xpos) const
+{
+	const int cy = divide_down(y, ChunkSize);
+	const int row = y - cy*ChunkSize;
+
+	int x = x1;
+	while(x < x2) {
+		const int cx = divide_down(x, ChunkSize);
+		const int shift = x - cx*ChunkSize;
+		const int nbits = std::min(ChunkSize - shift, x2 - x);
+		if(const Chunk* c = chunks_.find(cx, cy)) {
+			const uint64_t bits = (c->rows[row] >> shift) & low_bits(nbits);
+			if(bits) {
+				if(xpos) {
+					*xpos = x + count_trailing_zeros(bits);
+				}
+
+				return true;
+			}
 		}
-	} else {
-		const int index = -(pos.first+1);
-		if(static_cast<unsigned>(index) < r->negative_cells.size()) {
-			return r->negative_cells[index];
-		} else {
-			return nullptr;
+
+		x += nbits;
+	}
+
+	return false;
+}
+
+bool LevelSolidMap::isRectSolid(const rect& r) const
+{
+	for(int y = r.y(); y < r.y2(); ++y) {
+		if(findSolidInSpan(r.x(), r.x2(), y)) {
+			return true;
 		}
 	}
+
+	return false;
 }
 
-void LevelSolidMap::erase(const tile_pos& pos)
+const SurfaceInfo* LevelSolidMap::getSurfaceAt(int x, int y) const
 {
-	TileSolidInfo** info = insertRaw(pos);
-	delete *info;
-	*info = nullptr;
+	const tile_pos pos = tile_at(x, y);
+	const TileSolidInfo* info = tiles_.find(pos.first, pos.second);
+	return info ? &info->info : nullptr;
 }
 
-void LevelSolidMap::clear()
+void LevelSolidMap::merge(const LevelSolidMap& map, int xoffset, int yoffset)
 {
-	for(row& r : positive_rows_) {
-		for(TileSolidInfo* info : r.positive_cells) {
-			delete info;
+	map.tiles_.forEach([&](int x, int y, const TileSolidInfo* src) {
+		const tile_pos pos(x + xoffset, y + yoffset);
+		TileSolidInfo& dst = insertOrFind(pos);
+		merge_SurfaceInfo(dst.info, src->info);
+		if(src->all_solid) {
+			insertSolidTile(pos);
+		} else if(!dst.all_solid) {
+			for(int row = 0; row != TileSize; ++row) {
+				for_each_row_piece([&](int offset, int nbits) {
+					setBits(pos.first*TileSize + offset, pos.second*TileSize + row, nbits, map.getBits(x*TileSize + offset, y*TileSize + row, nbits));
+				});
+			}
 		}
+	});
+}
 
-		for(TileSolidInfo* info : r.negative_cells) {
-			delete info;
+void LevelSolidMap::writeBinary(std::string* out) const
+{
+	std::vector<std::pair<tile_pos, const TileSolidInfo*>> cells;
+	tiles_.forEach([&cells](int x, int y, const TileSolidInfo* info) {
+		cells.emplace_back(tile_pos(x, y), info);
+	});
+
+	std::vector<const std::string*> strings;
+	for(const auto& cell : cells) {
+		if(cell.second->info.info && std::find(strings.begin(), strings.end(), cell.second->info.info) == strings.end()) {
+			strings.push_back(cell.second->info.info);
 		}
 	}
 
-	for(row& r : negative_rows_) {
-		for(TileSolidInfo* info : r.positive_cells) {
-			delete info;
-		}
+	put_int(*out, TileSize, 4);
+	put_int(*out, static_cast<uint32_t>(strings.size()), 4);
+	for(const std::string* str : strings) {
+		put_int(*out, static_cast<uint32_t>(str->size()), 2);
+		*out += *str;
+	}
 
-		for(TileSolidInfo* info : r.negative_cells) {
-			delete info;
+	put_int(*out, static_cast<uint32_t>(cells.size()), 4);
+
+	std::vector<unsigned char> bitmap(bitmap_bytes());
+	for(const auto& cell : cells) {
+		const TileSolidInfo& info = *cell.second;
+		put_int(*out, cell.first.first, 4);
+		put_int(*out, cell.first.second, 4);
+		put_int(*out, info.info.friction, 4);
+		put_int(*out, info.info.traction, 4);
+		put_int(*out, info.info.damage, 4);
+		const int string_index = info.info.info ? static_cast<int>(std::find(strings.begin(), strings.end(), info.info.info) - strings.begin()) + 1 : 0;
+		put_int(*out, string_index, 2);
+		out->push_back(info.all_solid ? 1 : 0);
+
+		std::fill(bitmap.begin(), bitmap.end(), 0);
+		for(int y = 0; y != TileSize; ++y) {
+			for_each_row_piece([&](int offset, int nbits) {
+				put_bits(&bitmap[0], y*TileSize + offset, getBits(cell.first.first*TileSize + offset, cell.first.second*TileSize + y, nbits), nbits);
+			});
 		}
-	}
 
-	positive_rows_.clear();
-	negative_rows_.clear();
+		out->append(bitmap.begin(), bitmap.end());
+	}
 }
 
-void LevelSolidMap::merge(const LevelSolidMap& map, int xoffset, int yoffset)
+bool LevelSolidMap::readBinary(const std::string& data)
 {
-	for(int n = 0; n != map.negative_rows_.size(); ++n) {
-		for(int m = 0; m != map.negative_rows_[n].negative_cells.size(); ++m) {
-			const tile_pos pos(-m - 1 + xoffset, -n - 1 + yoffset);
-			TileSolidInfo& dst = insertOrFind(pos);
-			const TileSolidInfo* src = map.negative_rows_[n].negative_cells[m];
-			if(!src) {
-				continue;
-			}
+	const int cell_size = 4*5 + 2 + 1 + bitmap_bytes();
+	const char* p = data.data();
+	const char* end = p + data.size();
+	if(end - p < 8 || static_cast<int>(get_int(p, 4)) != TileSize) {
+		return false;
+	}
 
-			dst.all_solid = dst.all_solid || src->all_solid;
-			merge_SurfaceInfo(dst.info, src->info);
-			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
-			}
+	//each string takes at least its two byte length, so a count larger
+	//than that allows for can't be valid.
+	const uint32_t num_strings = get_int(p, 4);
+	if(static_cast<uint64_t>(num_strings)*2 > static_cast<uint64_t>(end - p)) {
+		return false;
+	}
+
+	std::vector<const std::string*> strings(num_strings);
+	for(const std::string*& str : strings) {
+		if(end - p < 2) {
+			return false;
 		}
 
-		for(int m = 0; m != map.negative_rows_[n].positive_cells.size(); ++m) {
-			const tile_pos pos(m + xoffset, -n - 1 + yoffset);
-			TileSolidInfo& dst = insertOrFind(pos);
-			const TileSolidInfo* src = map.negative_rows_[n].positive_cells[m];
-			if(!src) {
-				continue;
-			}
+		const int len = get_int(p, 2);
+		if(end - p < len) {
+			return false;
+		}
 
-			dst.all_solid = dst.all_solid || src->all_solid;
-			merge_SurfaceInfo(dst.info, src->info);
-			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
-			}
+		str = SurfaceInfo::get_info_str(std::string(p, p + len));
+		p += len;
+	}
+
+	if(end - p < 4) {
+		return false;
+	}
+
+	const uint32_t num_cells = get_int(p, 4);
+	if(static_cast<uint64_t>(end - p) != static_cast<uint64_t>(num_cells)*cell_size) {
+		return false;
+	}
+
+	for(uint32_t n = 0; n != num_cells; ++n) {
+		const int x = static_cast<int32_t>(get_int(p, 4));
+		const int y = static_cast<int32_t>(get_int(p, 4));
+		TileSolidInfo& dst = insertOrFind(tile_pos(x, y));
+		dst.info.friction = static_cast<int32_t>(get_int(p, 4));
+		dst.info.traction = static_cast<int32_t>(get_int(p, 4));
+
+		const int damage = static_cast<int32_t>(get_int(p, 4));
+		dst.info.damage = dst.info.damage >= 0 ? std::min(dst.info.damage, damage) : damage;
+
+		const int string_index = get_int(p, 2);
+		if(string_index > 0 && string_index <= static_cast<int>(strings.size())) {
+			dst.info.info = strings[string_index-1];
 		}
+
+		if(*p++ != 0) {
+			insertSolidTile(tile_pos(x, y));
+		}
+
+		const unsigned char* bitmap = reinterpret_cast<const unsigned char*>(p);
+		for(int row = 0; row != TileSize; ++row) {
+			for_each_row_piece([&](int offset, int nbits) {
+				setBits(x*TileSize + offset, y*TileSize + row, nbits, get_bits(bitmap, row*TileSize + offset, nbits));
+			});
+		}
+		p += bitmap_bytes();
 	}
 
-	for(int n = 0; n != map.positive_rows_.size(); ++n) {
-		for(int m = 0; m != map.positive_rows_[n].negative_cells.size(); ++m) {
-			const tile_pos pos(-m - 1 + xoffset, n + yoffset);
-			TileSolidInfo& dst = insertOrFind(pos);
-			const TileSolidInfo* src = map.positive_rows_[n].negative_cells[m];
-			if(!src) {
-				continue;
-			}
+	return true;
+}
 
-			dst.all_solid = dst.all_solid || src->all_solid;
-			merge_SurfaceInfo(dst.info, src->info);
-			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
-			}
+UNIT_TEST(level_solid_map_binary_round_trip)
+{
+	LevelSolidMap m;
+	TileSolidInfo& a = m.insertOrFind(tile_pos(3, -2));
+	m.setSolidAt(3*TileSize, -2*TileSize, true);
+	m.setSolidAt(4*TileSize - 1, -TileSize - 1, true);
+	a.info.friction = 50;
+	a.info.damage = 2;
+	a.info.info = SurfaceInfo::get_info_str("ice");
+
+	m.insertSolidTile(tile_pos(-1, 4));
+
+	std::string data;
+	m.writeBinary(&data);
+
+	LevelSolidMap res;
+	CHECK_EQ(res.readBinary(data), true);
+	CHECK_EQ(res.readBinary(data.substr(0, data.size()-1)), false);
+
+	std::string bad_count = data;
+	std::fill(bad_count.begin() + 4, bad_count.begin() + 8, '\xff');
+	CHECK_EQ(res.readBinary(bad_count), false);
+
+	const TileSolidInfo* ra = res.find(tile_pos(3, -2));
+	CHECK_EQ(ra != nullptr, true);
+	for(int y = -2*TileSize; y != -TileSize; ++y) {
+		for(int x = 3*TileSize; x != 4*TileSize; ++x) {
+			CHECK_EQ(res.isSolidAt(x, y), m.isSolidAt(x, y));
 		}
+	}
+	CHECK_EQ(ra->info.friction, 50);
+	CHECK_EQ(ra->info.damage, 2);
+	CHECK_EQ(*ra->info.info, "ice");
+
+	const TileSolidInfo* rb = res.find(tile_pos(-1, 4));
+	CHECK_EQ(rb != nullptr && rb->all_solid, true);
+	CHECK_EQ(res.isRectSolid(rect(-TileSize, 4*TileSize, TileSize, TileSize)), true);
+	CHECK_EQ(res.find(tile_pos(0, 0)) == nullptr, true);
+}
 
-		for(int m = 0; m != map.positive_rows_[n].positive_cells.size(); ++m) {
-			const tile_pos pos(m + xoffset, n + yoffset);
-			const TileSolidInfo* src = map.positive_rows_[n].positive_cells[m];
-			if(!src) {
-				continue;
-			}
+namespace
+{
+	struct TileScaleScope {
+		explicit TileScaleScope(int scale) : old_scale(g_tile_scale) { g_tile_scale = scale; }
+		~TileScaleScope() { g_tile_scale = old_scale; }
+		int old_scale;
+	};
+}
+
+UNIT_TEST(level_solid_map_wide_tiles)
+{
+	//tile rows wider than a chunk row are handled in pieces.
+	TileScaleScope scale(5);
+	ASSERT_LOG(TileSize > 64, "Test needs tiles wider than 64 pixels");
+
+	LevelSolidMap m;
+	m.insertSolidTile(tile_pos(-1, 0));
+	m.insertOrFind(tile_pos(1, 0));
+	m.setSolidAt(2*TileSize - 1, 5, true);
+
+	CHECK_EQ(m.isSolidAt(-1, 0), true);
+	CHECK_EQ(m.isSolidAt(-TileSize, TileSize - 1), true);
+	CHECK_EQ(m.isSolidAt(-TileSize + 70, 40), true);
+	CHECK_EQ(m.findSolidInSpan(0, 3*TileSize, 0), false);
+
+	std::string data;
+	m.writeBinary(&data);
+
+	LevelSolidMap res;
+	CHECK_EQ(res.readBinary(data), true);
+	res.merge(m, 2, 0);
+	CHECK_EQ(res.isSolidAt(-TileSize, TileSize - 1), true);
+	CHECK_EQ(res.isSolidAt(-TileSize + 70, 40), true);
+	CHECK_EQ(res.isSolidAt(0, 0), false);
+	CHECK_EQ(res.isSolidAt(TileSize + 70, 40), true);
+	CHECK_EQ(res.isSolidAt(2*TileSize - 1, TileSize - 1), true);
+	CHECK_EQ(res.isSolidAt(4*TileSize - 1, 5), true);
+	CHECK_EQ(res.isSolidAt(4*TileSize - 2, 5), false);
+
+	res.erase(tile_pos(-1, 0));
+	CHECK_EQ(res.findSolidInSpan(-TileSize, 0, TileSize - 1), false);
+}
 
-			TileSolidInfo& dst = insertOrFind(pos);
+UNIT_TEST(level_solid_map_spans)
+{
+	//pixels on either side of chunk boundaries, including negative ones.
+	LevelSolidMap m;
+	const int xs[] = { -65, -64, -1, 0, 63, 64, 130 };
+	for(int x : xs) {
+		m.insertOrFind(tile_pos(x >= 0 ? x/TileSize : -((-x - 1)/TileSize) - 1, -1));
+		m.setSolidAt(x, -1, true);
+	}
 
-			dst.all_solid = dst.all_solid || src->all_solid;
-			merge_SurfaceInfo(dst.info, src->info);
-			if(!dst.all_solid) {
-				dst.bitmap = dst.bitmap | src->bitmap;
+	for(int x1 = -140; x1 < 140; x1 += 7) {
+		for(int x2 = x1; x2 < x1 + 150; x2 += 5) {
+			int expected = x2;
+			for(int x : xs) {
+				if(x >= x1 && x < x2) {
+					expected = std::min(expected, x);
+				}
 			}
+
+			int found = x2;
+			CHECK_EQ(m.findSolidInSpan(x1, x2, -1, &found), expected != x2);
+			CHECK_EQ(found, expected);
+			CHECK_EQ(m.findSolidInSpan(x1, x2, 0), false);
 		}
 	}
+
+	m.erase(tile_pos(0, -1));
+	CHECK_EQ(m.isSolidAt(0, -1), false);
+	CHECK_EQ(m.isSolidAt(-1, -1), true);
+}
+
+BENCHMARK(level_solid_map_rect_query)
+{
+	//a 40x80 object standing on solid ground, as when checking it can be
+	//placed somewhere.
+	LevelSolidMap m;
+	for(int x = -10; x != 10; ++x) {
+		m.insertSolidTile(tile_pos(x, 4));
+	}
+
+	BENCHMARK_LOOP {
+		m.isRectSolid(rect(17, 4*TileSize - 80, 40, 80));
+	}
 }
@@ -23,10 +23,13 @@
 
 #pragma once
 
-#include <boost/dynamic_bitset.hpp>
+#include <cstdint>
 #include <map>
+#include <string>
 #include <vector>
 
+#include "geometry.hpp"
+
 #ifndef MAX_TILE_SIZE
 #define MAX_TILE_SIZE 64
 #endif
@@ -37,7 +40,6 @@ extern int g_tile_size;
 #define TileSize (g_tile_size*g_tile_scale)
 
 typedef std::pair<int,int> tile_pos;
-typedef boost::dynamic_bitset<> tile_bitmap;
 
 struct SurfaceInfo
 {
@@ -50,33 +52,98 @@ struct SurfaceInfo
 
 struct TileSolidInfo
 {
-	TileSolidInfo() : bitmap(TileSize*TileSize), all_solid(false)
+	TileSolidInfo() : all_solid(false)
 	{}
-	tile_bitmap bitmap;
 	SurfaceInfo info;
 	bool all_solid;
 };
 
+//Which pixels of a level are solid, along with the surface of each tile.
+//
+//Pixels are stored apart from the tiles, in chunks of ChunkSize x ChunkSize
+//pixels holding one 64-bit mask per row, so that a run of pixels can be
+//tested a word at a time without regard to tile boundaries. Every pixel of
+//an all_solid tile is set. A pixel is only ever solid inside a tile that
+//has an entry in the map.
 class LevelSolidMap
 {
 public:
+	enum { ChunkSize = 64 };
+
 	LevelSolidMap();
 	LevelSolidMap(const LevelSolidMap& m);
 	LevelSolidMap& operator=(const LevelSolidMap& m);
 	~LevelSolidMap();
 	TileSolidInfo& insertOrFind(const tile_pos& pos);
+
+	//Finds or adds the tile, makes it all_solid and sets all its pixels.
+	TileSolidInfo& insertSolidTile(const tile_pos& pos);
+
 	const TileSolidInfo* find(const tile_pos& pos) const;
 	void erase(const tile_pos& pos);
 	void clear();
 
+	//Pixel access in level coordinates. The tile holding the pixel must
+	//already have been added before making it solid.
+	bool isSolidAt(int x, int y) const;
+	void setSolidAt(int x, int y, bool value);
+
+	//Finds the leftmost solid pixel in row y from x1 up to but not
+	//including x2, storing its position in xpos if given.
+	bool findSolidInSpan(int x1, int x2, int y, int* xpos=nullptr) const;
+	bool isRectSolid(const rect& r) const;
+
+	//The surface of the tile the pixel is in, or null if there is no tile.
+	const SurfaceInfo* getSurfaceAt(int x, int y) const;
+
 	void merge(const LevelSolidMap& m, int xoffset, int yoffset);
-private:
 
-	TileSolidInfo** insertRaw(const tile_pos& pos);
+	//Compact binary form stored in compiled levels. Reading adds the cells
+	//to the map in the same way as setting each solid pixel again would,
+	//and returns false if the data is invalid or was written with a
+	//different tile size, in which case the map is left unchanged.
+	void writeBinary(std::string* out) const;
+	bool readBinary(const std::string& data);
+private:
+	struct Chunk
+	{
+		Chunk();
+		uint64_t rows[ChunkSize];
+	};
 
-	struct row {
-		std::vector<TileSolidInfo*> positive_cells, negative_cells;
+	//Sparse two dimensional array of owned pointers, which grows in each
+	//direction from the origin as needed.
+	template<typename T>
+	class Grid
+	{
+	public:
+		Grid() {}
+		~Grid() { clear(); }
+
+		T*& insert(int x, int y);
+		T* find(int x, int y) const;
+		void clear();
+
+		//Calls fn(x, y, item) for each item present.
+		template<typename Fn>
+		void forEach(Fn fn) const;
+	private:
+		Grid(const Grid&);
+		void operator=(const Grid&);
+
+		struct Row {
+			std::vector<T*> positive_cells, negative_cells;
+		};
+
+		std::vector<Row> positive_rows_, negative_rows_;
 	};
 
-	std::vector<row> positive_rows_, negative_rows_;
+	//Access to up to 64 pixels of row y starting at x, with the leftmost
+	//pixel in the lowest bit.
+	uint64_t getBits(int x, int y, int nbits) const;
+	void setBits(int x, int y, int nbits, uint64_t bits);
+	void clearBits(int x, int y, int nbits);
+
+	Grid<TileSolidInfo> tiles_;
+	Grid<Chunk> chunks_;
 };
@@ -21,247 +21,193 @@
 	   distribution.
 */
 
-//use non-threaded loading unless/until we can fix threaded loading.
-
-#if 0
-#include <assert.h>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 
 #include "asserts.hpp"
+#include "background_task_pool.hpp"
+#include "checksum.hpp"
 #include "concurrent_cache.hpp"
 #include "filesystem.hpp"
-#include "foreach.hpp"
+#include "formula_garbage_collector.hpp"
 #include "json_parser.hpp"
-#include "level.hpp"
 #include "load_level.hpp"
-#include "module.hpp"
-#include "package.hpp"
+#include "logger.hpp"
 #include "preferences.hpp"
-#include "preprocessor.hpp"
-#include "string_utils.hpp"
-#include "texture.hpp"
-#include "thread.hpp"
 #include "variant.hpp"
 
-namespace {
-typedef concurrent_cache<std::string, variant> level_wml_map;
-level_wml_map& wml_cache() {
-	static level_wml_map instance;
-	return instance;
-}
+PREF_BOOL(threaded_level_preload, true, "Parse the WML of adjacent levels on background threads so that moving between levels doesn't stall.");
 
-std::map<std::string, threading::thread*>& wml_threads()
+namespace
 {
-	static std::map<std::string, threading::thread*> instance;
-	return instance;
-}
+	//A level read ahead of time by a background worker. Workers parse
+	//without the preprocessor: a document that needs it (any '@' could be
+	//a directive, since they all start with one) is only read, and is
+	//parsed on the main thread when loaded, because preprocessing runs FFL
+	//and resolves module paths.
+	//
+	//Preloaded levels are handed between threads inside a shared_ptr. The
+	//worker has dropped all of its own references to the variant before
+	//the level is visible in the cache, so from then on only the main
+	//thread touches the variant's (non thread-safe) reference counts.
+	struct PreloadedLevel
+	{
+		PreloadedLevel() : parsed(false) {}
+		std::string path;
+		std::string contents;
+		variant doc;
+		bool parsed;
+	};
 
-class wml_loader {
-	std::string lvl_;
-public:
-	wml_loader(const std::string& lvl) : lvl_(lvl)
-	{}
-	void operator()() {
-		static const std::string global_path = preferences::load_compiled() ? "data/compiled/level/" : preferences::level_path();
+	typedef std::shared_ptr<const PreloadedLevel> LevelDocumentPtr;
 
-		std::string filename;
+	//The cache holds levels which have been preloaded but not loaded yet,
+	//so it only needs to be big enough for a level's neighbours.
+	const size_t MaxPreloadedLevels = 8;
 
-		std::vector<std::string> components = util::split(lvl_, '/');
-		if(components.size() == 1) {
-			filename = global_path + lvl_;
-		} else if(components.size() == 2) {
-			filename = std::string(preferences::user_data_path()) + "/packages/" + components.front() + "/" + components.back();
-		} else {
-			ASSERT_LOG(false, "UNRECOGNIZED LEVEL PATH FORMAT: " << lvl_);
-		}
-
-		try {
-			variant node(json::parse_from_file(filename));
-			wml_cache().put(lvl_, node);
-		} catch(const json::parse_error& e) {
-			ASSERT_LOG(false, "ERROR PARSING LEVEL WML FOR '" << filename << "': " << e.error_message());
-		}catch(...) {
-			std::cerr << "FAILED TO LOAD " << filename << "\n";
-			ASSERT_LOG(false, "FAILED TO LOAD");
-		}
+	size_t count_document(const LevelDocumentPtr&)
+	{
+		return 1;
 	}
-};
-}
-
-void clear_level_wml()
-{
-	wml_cache().clear();
-}
-
-namespace {
-bool is_save_file(const std::string& fname)
-{
-	static const std::string SaveFiles[] = {"save.cfg", "save2.cfg", "save3.cfg", "save4.cfg"};
-	return std::count(SaveFiles, SaveFiles + sizeof(SaveFiles)/sizeof(SaveFiles[0]), fname) != 0;
-}
-}
 
-void preload_level_wml(const std::string& lvl)
-{
-	if(is_save_file(lvl) || lvl == "autosave.cfg") {
-		return;
+	typedef ConcurrentCache<std::string, LevelDocumentPtr> LevelWmlCache;
+	LevelWmlCache& wml_cache()
+	{
+		static LevelWmlCache instance(MaxPreloadedLevels, count_document);
+		return instance;
 	}
 
-	if(wml_cache().count(lvl)) {
-		return;
+	//Preloads which have been submitted to the background task pool and
+	//not yet loaded or cleared. Only accessed from the main thread.
+	std::map<std::string, background_task_pool::task_handle>& wml_tasks()
+	{
+		static std::map<std::string, background_task_pool::task_handle> instance;
+		return instance;
 	}
 
-	wml_cache().put(lvl, variant());
-#if defined(__ANDROID__) && SDL_VERSION_ATLEAST(1, 3, 0)
-	wml_threads()[lvl] = new threading::thread("load-"+lvl, wml_loader(lvl));
-#else
-	wml_threads()[lvl] = new threading::thread(wml_loader(lvl));
-#endif
-}
-
-variant load_level_wml(const std::string& lvl)
-{
-	if(lvl == "tmp_state.cfg") {
-		//special state for debugging.
-		return json::parse_from_file("./tmp_state.cfg");
+	bool is_save_file(const std::string& lvl)
+	{
+		return lvl == "autosave.cfg" || (lvl.size() >= 7 && lvl.substr(0,4) == "save" && lvl.substr(lvl.size()-4) == ".cfg");
 	}
 
-	if(is_save_file(lvl) || lvl == "autosave.cfg") {
-		std::string filename;
-		if(is_save_file(lvl)) {
-			filename = std::string(preferences::user_data_path()) + "/" + lvl;
-		} else {
-			filename = preferences::auto_save_file_path();
+	//Runs on a background worker.
+	std::shared_ptr<PreloadedLevel> read_level_document(const std::string& path)
+	{
+		std::shared_ptr<PreloadedLevel> result(new PreloadedLevel);
+		result->path = path;
+		result->contents = sys::read_file(path);
+		if(result->contents.find('@') == std::string::npos) {
+			//without any directives the document comes out the same as
+			//with the preprocessor. No collectible objects are made.
+			result->doc = json::parse(result->contents, path, json::JSON_PARSE_OPTIONS::NO_PREPROCESSOR);
+			result->parsed = true;
 		}
 
-		return json::parse_from_file(filename);
+		return result;
 	}
+}
 
-	if(wml_cache().count(lvl)) {
-		std::map<std::string, threading::thread*>::iterator t = wml_threads().find(lvl);
-		if(t != wml_threads().end()) {
-			delete t->second;
-			wml_threads().erase(t);
+void clear_level_wml()
+{
+	for(auto& t : wml_tasks()) {
+		if(!t.second.cancel()) {
+			t.second.wait();
 		}
-
-		return wml_cache().get(lvl);
 	}
 
-	wml_loader loader(lvl);
-	loader();
-	return load_level_wml_nowait(lvl);
+	wml_tasks().clear();
+	wml_cache().clear();
 }
 
-variant load_level_wml_nowait(const std::string& lvl)
+void preload_level_wml(const std::string& lvl)
 {
-	return wml_cache().get(lvl);
-}
-
-namespace {
-typedef std::map<std::string, std::pair<threading::thread*, level*> > level_map;
-level_map levels_loading;
+	if(!g_threaded_level_preload || is_save_file(lvl) || wml_tasks().count(lvl) || wml_cache().count(lvl)) {
+		return;
+	}
 
-threading::mutex& levels_loading_mutex() {
-	static threading::mutex m;
-	return m;
-}
+	//level paths are resolved here since the path table is only safe to
+	//use from the main thread.
+	const std::string* level_path = find_level_path(lvl);
+	if(level_path == nullptr) {
+		return;
+	}
 
-class level_loader {
-	std::string lvl_;
-public:
-	level_loader(const std::string& lvl) : lvl_(lvl)
-	{}
-	void operator()() {
-		level* lvl = nullptr;
+	const std::string path = *level_path;
+	wml_tasks()[lvl] = background_task_pool::submit([lvl, path]() {
+		//nothing is cached if this fails, so load_level_wml() loads the
+		//level again on the main thread, where any error gets reported
+		//properly. Nothing may escape, since the pool's workers don't
+		//expect jobs to throw.
 		try {
-			lvl = new level(lvl_);
-		} catch(const graphics::texture::worker_thread_error&) {
-			//we can't load the level in here, we must do it in the main thread.
-			std::cerr << "LOAD LEVEL FAILURE: " << lvl << " MUST LOAD IN "
-			             "MAIN THREAD\n";
+			LevelDocumentPtr doc = read_level_document(path);
+
+			//the garbage collector is only held off while the document is
+			//published, which may evict and free an older one.
+			std::lock_guard<std::mutex> lock(GarbageCollector::getGlobalMutex());
+			wml_cache().put(lvl, doc);
+		} catch(const json::ParseError& e) {
+			LOG_INFO("Failed to preload level " << lvl << ": " << e.errorMessage());
+		} catch(const validation_failure_exception& e) {
+			LOG_INFO("Failed to preload level " << lvl << ": " << e.msg);
+		} catch(const fatal_assert_failure_exception& e) {
+			LOG_INFO("Failed to preload level " << lvl << ": " << e.msg);
+		} catch(const std::exception& e) {
+			LOG_ERROR("Failed to preload level " << lvl << ": " << e.what());
+		} catch(...) {
+			LOG_ERROR("Failed to preload level " << lvl << ": unknown error");
 		}
-		threading::lock lck(levels_loading_mutex());
-		levels_loading[lvl_].second = lvl;
-	}
-};
-
+	}, std::function<void()>(), background_task_pool::PRIORITY::LOW);
 }
 
-load_level_manager::load_level_manager()
-{}
-
-load_level_manager::~load_level_manager()
+variant load_level_wml(const std::string& lvl)
 {
-	for(level_map::iterator i = levels_loading.begin(); i != levels_loading.end(); ++i) {
-		i->second.first->join();
-		delete i->second.first;
-		delete i->second.second;
+	auto task = wml_tasks().find(lvl);
+	if(task == wml_tasks().end()) {
+		return load_level_wml_nowait(lvl);
 	}
 
-	levels_loading.clear();
-}
-
-void preload_level(const std::string& lvl)
-{
-	//--TODO: Currently multi-threaded pre-loading causes weird crashes.
-	//--      need to fix this!!
-	assert(!lvl.empty());
-	threading::lock lck(levels_loading_mutex());
-	if(levels_loading.count(lvl) == 0) {
-#if defined(__ANDROID__) && SDL_VERSION_ATLEAST(1, 3, 0)
-		levels_loading[lvl].first = new threading::thread("load"+lvl,level_loader(lvl));
-#else
-		levels_loading[lvl].first = new threading::thread(level_loader(lvl));
-#endif
+	//If the preload hasn't started yet there's no sense waiting for a
+	//worker to pick it up; parse it here instead.
+	if(!task->second.cancel()) {
+		task->second.wait();
 	}
-}
 
-ffl::IntrusivePtr<level> load_level(const std::string& lvl)
-{
-	std::cerr << "START LOAD LEVEL\n";
-	level_map::iterator itor;
-	{
-		threading::lock lck(levels_loading_mutex());
-		itor = levels_loading.find(lvl);
-		if(itor == levels_loading.end()) {
-			ffl::IntrusivePtr<level> res(new level(lvl));
-			res->finish_loading();
-			fprintf(stderr, "LOADED LEVEL: %p\n", res);
-			return res;
+	wml_tasks().erase(task);
+
+	LevelDocumentPtr doc;
+	if(wml_cache().tryGet(lvl, &doc)) {
+		//documents are only used once; if the level is visited again it is
+		//parsed again so that any edits to it are picked up.
+		wml_cache().erase(lvl);
+		checksum::verify_file(doc->path, doc->contents);
+		if(doc->parsed) {
+			return doc->doc;
 		}
-	}
 
-	itor->second.first->join();
-	delete itor->second.first;
-	ffl::IntrusivePtr<level> res;
-	res.reset(itor->second.second);
-	if(res.get() == nullptr) {
-		res.reset(new level(lvl));
+		try {
+			return json::parse(doc->contents, doc->path);
+		} catch(const json::ParseError& e) {
+			ASSERT_LOG(false, e.errorMessage());
+		}
 	}
-	res->finish_loading();
-	levels_loading.erase(itor);
-	std::cerr << "FINISH LOAD LEVEL\n";
-	return res;
-}
 
-namespace {
-bool hidden_file(const std::string& filename) {
-	return !filename.empty() && filename[0] == '.';
-}
+	return load_level_wml_nowait(lvl);
 }
 
-std::vector<std::string> get_known_levels()
+variant load_level_wml_nowait(const std::string& lvl)
 {
-	std::vector<std::string> files;
-	module::get_files_in_dir(preferences::level_path(), &files);
-	files.erase(std::remove_if(files.begin(), files.end(), hidden_file), files.end());
-
-	foreach(const std::string& pkg, package::all_packages()) {
-		std::vector<std::string> v = package::package_levels(pkg);
-		files.insert(files.end(), v.begin(), v.end());
+	try {
+		if(lvl == "autosave.cfg") {
+			return json::parse_from_file(preferences::auto_save_file_path());
+		} else if(is_save_file(lvl)) {
+			preferences::set_save_slot(lvl);
+			return json::parse_from_file(preferences::save_file_path());
+		}
+		return json::parse_from_file(get_level_path(lvl));
+	} catch(const json::ParseError& e) {
+		ASSERT_LOG(false, e.errorMessage());
 	}
-
-	std::sort(files.begin(), files.end());
-
-	return files;
 }
-#endif
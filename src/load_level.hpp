@@ -37,6 +37,9 @@ void load_level_paths();
 void reload_level_paths();
 const std::string& get_level_path(const std::string& name);
 
+//returns nullptr if there is no level with the given name.
+const std::string* find_level_path(const std::string& name);
+
 void clear_level_wml();
 void preload_level_wml(const std::string& lvl);
 variant load_level_wml(const std::string& lvl);
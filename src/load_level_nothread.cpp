@@ -51,44 +51,23 @@ void load_level_paths()
 	module::get_unique_filenames_under_dir(preferences::load_compiled() ? "data/compiled/level/" : "data/level/", &get_level_paths());
 }
 
-const std::string& get_level_path(const std::string& name)
+const std::string* find_level_path(const std::string& name)
 {
 	if(get_level_paths().empty()) {
 		load_level_paths();
 	}
 	std::map<std::string, std::string>::const_iterator itor = module::find(get_level_paths(), name);
 	if(itor == get_level_paths().end()) {
-		ASSERT_LOG(false, "FILE NOT FOUND: " << name);
+		return nullptr;
 	}
-	return itor->second;
-}
-
-void clear_level_wml()
-{
-}
-
-void preload_level_wml(const std::string& lvl)
-{
+	return &itor->second;
 }
 
-variant load_level_wml(const std::string& lvl)
-{
-	return load_level_wml_nowait(lvl);
-}
-
-variant load_level_wml_nowait(const std::string& lvl)
+const std::string& get_level_path(const std::string& name)
 {
-	try {
-		if(lvl == "autosave.cfg") {
-			return json::parse_from_file(preferences::auto_save_file_path());
-		} else if(lvl.size() >= 7 && lvl.substr(0,4) == "save" && lvl.substr(lvl.size()-4) == ".cfg") {
-			preferences::set_save_slot(lvl);
-			return json::parse_from_file(preferences::save_file_path());
-		}
-		return json::parse_from_file(get_level_path(lvl));
-	} catch(const json::ParseError& e) {
-		ASSERT_LOG(false, e.errorMessage());
-	}
+	const std::string* path = find_level_path(name);
+	ASSERT_LOG(path != nullptr, "FILE NOT FOUND: " << name);
+	return *path;
 }
 
 load_level_manager::load_level_manager()
@@ -97,6 +76,7 @@ load_level_manager::load_level_manager()
 
 load_level_manager::~load_level_manager()
 {
+	clear_level_wml();
 }
 
 void preload_level(const std::string& lvl)
@@ -50,6 +50,7 @@
 #include "draw_scene.hpp"
 #include "editor.hpp"
 #include "difficulty.hpp"
+#include "decoded_image_cache.hpp"
 #include "external_text_editor.hpp"
 #include "filesystem.hpp"
 #include "formula_callable_definition.hpp"
@@ -71,6 +72,7 @@
 #include "md5.hpp"
 #include "message_dialog.hpp"
 #include "module.hpp"
+#include "module_pack.hpp"
 #include "multiplayer.hpp"
 #include "player_info.hpp"
 #include "preferences.hpp"
@@ -134,6 +136,7 @@ namespace
 	PREF_INT(auto_size_ideal_height, 0, "");
 	PREF_BOOL(desktop_fullscreen_force, false, "(Windows) forces desktop fullscreen to actually use fullscreen rather than a borderless window the size of the desktop");
 	PREF_BOOL(msaa, false, "Use msaa");
+	PREF_STRING(renderer, "opengl", "Display device to draw with. 'null' draws nothing and only counts the work given to it, for running headless");
 
 
 #if defined(_MSC_VER)
@@ -983,7 +986,7 @@ int main(int argcount, char* argvec[])
 	WindowManager wm("SDL");
 
 	variant_builder hints;
-	hints.add("renderer", "opengl");
+	hints.add("renderer", g_renderer);
 	hints.add("use_vsync", g_vsync != 0 ? true : false);
 	hints.add("width", preferences::requested_window_width() > 0 ? preferences::requested_window_width() : 800);
 	hints.add("height", preferences::requested_window_height() > 0 ? preferences::requested_window_height() : 600);
@@ -1058,14 +1061,18 @@ int main(int argcount, char* argvec[])
 	graphics::GameScreen::get().setVirtualDimensions(vw, vh);
 	//main_wnd->setWindowIcon(module::map_file("images/window-icon.png"));
 
-	//we prefer late swap tearing so as to minimize frame loss when possible
-	int swap_result = SDL_GL_SetSwapInterval(g_vsync != 0 ? -1 : 0);
-	if(swap_result != 0 && g_vsync != 0) {
-		swap_result = SDL_GL_SetSwapInterval(1);
-	}
+	//we prefer late swap tearing so as to minimize frame loss when possible.
+	//Only OpenGL devices have a GL context to set it on.
+	const auto device_id = DisplayDevice::getCurrent()->ID();
+	if(device_id == DisplayDevice::DISPLAY_DEVICE_OPENGL || device_id == DisplayDevice::DISPLAY_DEVICE_OPENGLES) {
+		int swap_result = SDL_GL_SetSwapInterval(g_vsync != 0 ? -1 : 0);
+		if(swap_result != 0 && g_vsync != 0) {
+			swap_result = SDL_GL_SetSwapInterval(1);
+		}
 
-	if(swap_result != 0) {
-		LOG_ERROR("Could not set swap interval with SDL_GL_SetSwapInterval: " << SDL_GetError());
+		if(swap_result != 0) {
+			LOG_ERROR("Could not set swap interval with SDL_GL_SetSwapInterval: " << SDL_GetError());
+		}
 	}
 
 	try {
@@ -1085,11 +1092,16 @@ int main(int argcount, char* argvec[])
 	// Set the image loading filter function, so that files are found in the correct place.
 	Surface::setFileFilter(FileFilterType::LOAD, [](const std::string& s){ return module::map_file("images/" + s); });
 	Surface::setFileFilter(FileFilterType::SAVE, [](const std::string& s){ return std::string(preferences::user_data_path()) + s; });
+	Surface::setFileReader([](const std::string& fname, std::string* data){ return module_pack::read_file(fname, data); });
 
 	if(g_disable_global_alpha_filter == false) {
 		set_alpha_masks();
 	}
 
+	// The alpha colors change how images are processed, so cached images
+	// made with other colors must not be used.
+	decoded_image_cache::install(g_disable_global_alpha_filter ? "" : sys::read_file(module::map_file("images/alpha-colors.png")));
+
 	//SceneGraphPtr scene = SceneGraph::create("root");
 	//SceneNodePtr root = scene->getRootNode();
 	//root->setNodeName("root_node");
@@ -0,0 +1,103 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mapped_file.hpp"
+
+MappedFile::MappedFile() : data_(nullptr), size_(0)
+#if defined(_WIN32)
+  , file_(INVALID_HANDLE_VALUE), mapping_(nullptr)
+#endif
+{}
+
+MappedFile::~MappedFile()
+{
+#if defined(_WIN32)
+	if(data_) {
+		UnmapViewOfFile(data_);
+	}
+	if(mapping_) {
+		CloseHandle(mapping_);
+	}
+	if(file_ != INVALID_HANDLE_VALUE) {
+		CloseHandle(file_);
+	}
+#else
+	if(data_) {
+		munmap(const_cast<char*>(data_), size_);
+	}
+#endif
+}
+
+bool MappedFile::open(const std::string& fname)
+{
+#if defined(_WIN32)
+	file_ = CreateFileA(fname.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(file_ == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+		return false;
+	}
+
+	mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if(mapping_ == nullptr) {
+		return false;
+	}
+
+	data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+	size_ = static_cast<size_t>(size.QuadPart);
+	return data_ != nullptr;
+#else
+	const int fd = ::open(fname.c_str(), O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+
+	//The mapping keeps the file alive, so the descriptor isn't needed.
+	close(fd);
+	if(p == MAP_FAILED) {
+		return false;
+	}
+
+	data_ = static_cast<const char*>(p);
+	size_ = static_cast<size_t>(st.st_size);
+	return true;
+#endif
+}
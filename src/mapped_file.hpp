@@ -0,0 +1,55 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <string>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+// A read-only view of a whole file mapped into memory. The mapping stays
+// valid for the life of the object.
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	// Returns false if the file doesn't exist, is empty or can't be mapped.
+	bool open(const std::string& fname);
+
+	const char* data() const { return data_; }
+	size_t size() const { return size_; }
+
+private:
+	MappedFile(const MappedFile&);
+	void operator=(const MappedFile&);
+
+	const char* data_;
+	size_t size_;
+#if defined(_WIN32)
+	HANDLE file_, mapping_;
+#endif
+};
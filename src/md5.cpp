@@ -20,6 +20,7 @@
    with Sun's original "cc". */
 
 #include <stdio.h>
+#include <algorithm>
 #include <cstring>		 /* for memcpy() */
 #include "md5.hpp"
 
@@ -33,13 +34,39 @@ namespace md5 {
 
 std::string sum(const std::string& data)
 {
-	std::string result = MD5().calc(data);
-	std::string output;
-	for(std::string::const_iterator i = result.begin(); i != result.end(); ++i) {
-		char buf[64];
-		const unsigned char c = *i;
-		sprintf(buf, "%02x", c);
-		output += buf;
+	hasher h;
+	h.update(data.data(), data.size());
+	return h.hexdigest();
+}
+
+hasher::hasher()
+{
+	MD5Init(&ctx_);
+}
+
+void hasher::update(const char* data, size_t len)
+{
+	//MD5Update takes a 32-bit length.
+	const size_t MaxChunk = 1 << 30;
+	while(len > 0) {
+		const size_t n = std::min(len, MaxChunk);
+		MD5Update(&ctx_, reinterpret_cast<uint8_t*>(const_cast<char*>(data)), static_cast<unsigned>(n));
+		data += n;
+		len -= n;
+	}
+}
+
+std::string hasher::hexdigest()
+{
+	static const char HexDigits[] = "0123456789abcdef";
+
+	uint8_t digest[16];
+	MD5Final(digest, &ctx_);
+
+	std::string output(32, '0');
+	for(int n = 0; n != 16; ++n) {
+		output[n*2] = HexDigits[digest[n] >> 4];
+		output[n*2+1] = HexDigits[digest[n] & 0xF];
 	}
 
 	return output;
@@ -42,6 +42,20 @@ extern void MD5Final(uint8_t digest[16], struct MD5Context *ctx);
 extern void MD5Transform(uint32_t buf[4], uint32_t in[16]);
 
 std::string sum(const std::string& data);
+
+// Computes the md5 of data which arrives in pieces, such as a file being
+// read a block at a time.
+class hasher
+{
+public:
+	hasher();
+	void update(const char* data, size_t len);
+
+	// The digest as 32 hex digits. Only call once.
+	std::string hexdigest();
+private:
+	MD5Context ctx_;
+};
 }
 
 class MD5
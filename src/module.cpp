@@ -37,6 +37,7 @@
 #include "json_parser.hpp"
 #include "md5.hpp"
 #include "module.hpp"
+#include "module_pack.hpp"
 #include "preferences.hpp"
 #include "string_utils.hpp"
 #include "unit_test.hpp"
@@ -363,6 +364,11 @@ namespace module
 		for(int i = 0; i != module_dirs().size(); ++i) {
 			const std::string& path = module_dirs()[i];
 			std::string full_path = path + "/" + name + "/";
+
+			//A packed module is mounted over the module's directory, so
+			//the rest of the engine finds its files at the usual paths.
+			module_pack::mount(path + "/" + name + ".pack", full_path);
+
 			if(sys::file_exists(full_path + "module.cfg")) {
 				variant config = json::parse(sys::read_file(full_path + "module.cfg"));
 				variant version = config["version"];
@@ -641,13 +647,39 @@ namespace module
 	}
 	}
 
-	variant build_package(const std::string& id, bool increment_version, variant version_override, std::string path)
+	namespace
+	{
+		//Unmounts the pack mounted at mount_point, if any, and mounts it
+		//again when done, so anything reading the module's files after
+		//building it sees the pack as it is on disk by then.
+		struct UnmountPackScope {
+			explicit UnmountPackScope(const std::string& mount_point) : mount_point_(mount_point) {
+				module_pack::unmount(mount_point_, &pack_fname_);
+			}
+			~UnmountPackScope() {
+				if(pack_fname_.empty() == false && !module_pack::mount(pack_fname_, mount_point_)) {
+					LOG_ERROR("Could not remount module pack " << pack_fname_ << " at " << mount_point_);
+				}
+			}
+		private:
+			std::string mount_point_, pack_fname_;
+		};
+	}
+
+	//If pack_fname is given the module's files are also written to a module
+	//pack, which can be shipped in place of the module's directory.
+	variant build_package(const std::string& id, bool increment_version, variant version_override, std::string path, const std::string& pack_fname="")
 	{
 		std::vector<std::string> files;
 		if(path == "") {
 			path = "modules/" + id;
 		}
 
+		//The module's own pack may already be mounted over its directory, and
+		//would shadow the loose files we are building from. It's mounted
+		//again afterwards, which picks up the pack if we rebuild it.
+		UnmountPackScope unmount_pack(path + "/");
+
 		ASSERT_LOG(sys::dir_exists(path), "COULD NOT FIND PATH: " << path);
 
 		variant config;
@@ -678,6 +710,7 @@ namespace module
 
 		get_files_in_module(path, files, exclude_paths);
 		std::map<variant, variant> file_attr;
+		std::vector<module_pack::pack_file> pack_files;
 		for(const std::string& file : files) {
 			if(std::find(file.begin(), file.end(), ' ') != file.end()) {
 				LOG_INFO("Ignoring file with invalid path: " << file);
@@ -702,7 +735,18 @@ namespace module
 
 			std::vector<char> data(contents.begin(), contents.end());
 
-			data = base64::b64encode(zip::compress(data));
+			data = zip::compress(data);
+
+			if(pack_fname.empty() == false) {
+				module_pack::pack_file f;
+				f.path = fname;
+				f.contents = contents;
+				f.compressed.assign(data.begin(), data.end());
+				f.flags = attr.count(variant("exe")) ? module_pack::ENTRY_EXECUTABLE : 0;
+				pack_files.push_back(f);
+			}
+
+			data = base64::b64encode(data);
 
 			const std::string data_str(data.begin(), data.end());
 
@@ -712,6 +756,11 @@ namespace module
 			file_attr[variant(fname)] = variant(&attr);
 		}
 
+		if(pack_fname.empty() == false) {
+			LOG_INFO("Writing module pack " << pack_fname << "...");
+			ASSERT_LOG(module_pack::write_pack(pack_fname, pack_files), "Could not write module pack: " << pack_fname);
+		}
+
 		//now save the manifest file.
 		{
 			std::map<variant, variant> attr;
@@ -822,6 +871,28 @@ COMMAND_LINE_UTILITY(generate_manifest)
 	std::cout << manifest.write_json();
 }
 
+COMMAND_LINE_UTILITY(build_module_pack)
+{
+	std::deque<std::string> arguments(args.begin(), args.end());
+	ASSERT_LOG(arguments.size() >= 1 && arguments.size() <= 2, "Expected arguments: module_name [path override]");
+
+	std::string module_id = arguments.front();
+
+	std::string path = "modules/" + module_id;
+	if(arguments.size() > 1) {
+		path = arguments.back();
+	}
+
+	while(path.empty() == false && path[path.size()-1] == '/') {
+		path.resize(path.size()-1);
+	}
+
+	//The pack sits next to the module's directory, where module loading
+	//looks for it.
+	build_package(module_id, false, variant(), path, path + ".pack");
+	std::cout << "Wrote " << path << ".pack\n";
+}
+
 	COMMAND_LINE_UTILITY(replicate_module)
 	{
 		std::string server = g_module_server;
@@ -0,0 +1,629 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+
+#include <boost/filesystem.hpp>
+
+#include "asserts.hpp"
+#include "compress.hpp"
+#include "mapped_file.hpp"
+#include "md5.hpp"
+#include "module_pack.hpp"
+#include "preferences.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+
+PREF_BOOL(module_pack_verify_md5, false, "Check the contents of files read from module packs against the md5 recorded when the pack was built.");
+
+namespace module_pack
+{
+	namespace
+	{
+		const char Magic[4] = { 'F', 'F', 'P', 'K' };
+		const uint32_t Version = 1;
+		const size_t HeaderSize = 32;
+		const size_t Md5Size = 32;
+
+		//Stored files must compress to at most this fraction of their size,
+		//otherwise they're stored uncompressed and can be read straight out
+		//of the mapping.
+		const double MaxCompressionRatio = 0.9;
+
+		struct Entry
+		{
+			std::string path;
+			const char* data;
+			uint32_t stored_size, size;
+			int flags;
+			std::string md5;
+		};
+
+		bool operator<(const Entry& e, const std::string& path) {
+			return e.path < path;
+		}
+
+		struct Pack
+		{
+			std::string fname, mount_point;
+			long long mod_time;
+			MappedFile file;
+
+			//Sorted by path.
+			std::vector<Entry> entries;
+
+			//Every directory that contains an entry, sorted, without a
+			//trailing '/'.
+			std::vector<std::string> dirs;
+
+			//Entries which have been written to disk since the pack was
+			//mounted. Only accessed with the packs mutex held.
+			std::vector<std::string> shadowed;
+		};
+
+		typedef std::shared_ptr<Pack> PackPtr;
+
+		threading::mutex& packs_mutex()
+		{
+			static threading::mutex res;
+			return res;
+		}
+
+		std::vector<PackPtr>& packs()
+		{
+			static std::vector<PackPtr> res;
+			return res;
+		}
+
+		std::atomic<int> g_num_mounted(0);
+
+		uint64_t read_uint(const char* p, int nbytes) {
+			uint64_t result = 0;
+			for(int n = nbytes-1; n >= 0; --n) {
+				result = (result << 8) | static_cast<unsigned char>(p[n]);
+			}
+			return result;
+		}
+
+		void write_uint(std::string& out, uint64_t value, int nbytes) {
+			for(int n = 0; n != nbytes; ++n) {
+				out.push_back(static_cast<char>(value & 0xFF));
+				value >>= 8;
+			}
+		}
+
+		bool starts_with(const std::string& s, const std::string& prefix) {
+			return s.size() >= prefix.size() && s.compare(0, prefix.size(), prefix) == 0;
+		}
+
+		//Collapses "//", "./" and "dir/../" so that a path matches the form
+		//used in the index.
+		std::string normalize(const std::string& fname) {
+			if(fname.find("//") == std::string::npos && fname.find("./") == std::string::npos && fname.find("/.") == std::string::npos) {
+				return fname;
+			}
+
+			std::vector<std::string> parts;
+			std::string::size_type begin = 0;
+			while(begin <= fname.size()) {
+				std::string::size_type end = fname.find('/', begin);
+				if(end == std::string::npos) {
+					end = fname.size();
+				}
+
+				const std::string part(fname, begin, end - begin);
+				if(part == ".." && parts.empty() == false && parts.back() != "..") {
+					parts.pop_back();
+				} else if(part.empty() == false && part != ".") {
+					parts.push_back(part);
+				}
+
+				begin = end + 1;
+			}
+
+			std::string result = fname.empty() == false && fname[0] == '/' ? "/" : "";
+			for(const std::string& part : parts) {
+				result += part;
+				result += "/";
+			}
+
+			if(result.size() > 1 && fname[fname.size()-1] != '/') {
+				result.resize(result.size()-1);
+			}
+
+			return result;
+		}
+
+		//Splits fname into a mounted pack and the path within it. Must be
+		//called with the packs mutex held.
+		PackPtr find_pack_locked(const std::string& fname, std::string* rel) {
+			for(const PackPtr& p : packs()) {
+				if(starts_with(fname, p->mount_point)) {
+					*rel = fname.substr(p->mount_point.size());
+					return p;
+				}
+			}
+
+			return PackPtr();
+		}
+
+		const Entry* find_entry(const std::string& fname, PackPtr* pack) {
+			if(g_num_mounted == 0) {
+				return nullptr;
+			}
+
+			const std::string path = normalize(fname);
+
+			threading::lock l(packs_mutex());
+			std::string rel;
+			PackPtr p = find_pack_locked(path, &rel);
+			if(!p) {
+				return nullptr;
+			}
+
+			auto itor = std::lower_bound(p->entries.begin(), p->entries.end(), rel);
+			if(itor == p->entries.end() || itor->path != rel) {
+				return nullptr;
+			}
+
+			if(p->shadowed.empty() == false && std::count(p->shadowed.begin(), p->shadowed.end(), rel)) {
+				return nullptr;
+			}
+
+			*pack = p;
+			return &*itor;
+		}
+
+		bool load_index(Pack& pack) {
+			const char* data = pack.file.data();
+			const size_t size = pack.file.size();
+			if(size < HeaderSize || memcmp(data, Magic, sizeof(Magic)) != 0) {
+				LOG_ERROR("Not a module pack: " << pack.fname);
+				return false;
+			}
+
+			const uint32_t version = static_cast<uint32_t>(read_uint(data + 4, 4));
+			if(version != Version) {
+				LOG_ERROR("Module pack " << pack.fname << " has unsupported version " << version);
+				return false;
+			}
+
+			const uint32_t num_entries = static_cast<uint32_t>(read_uint(data + 8, 4));
+			const uint64_t index_offset = read_uint(data + 16, 8);
+			const uint64_t index_size = read_uint(data + 24, 8);
+			if(index_offset < HeaderSize || index_offset > size || index_size > size - index_offset) {
+				LOG_ERROR("Module pack " << pack.fname << " is truncated");
+				return false;
+			}
+
+			const char* p = data + index_offset;
+			const char* end = p + index_size;
+
+			pack.entries.reserve(num_entries);
+			for(uint32_t n = 0; n != num_entries; ++n) {
+				if(end - p < 2) {
+					break;
+				}
+
+				const size_t path_len = static_cast<size_t>(read_uint(p, 2));
+				p += 2;
+				if(static_cast<size_t>(end - p) < path_len + 8 + 4 + 4 + 1 + Md5Size) {
+					break;
+				}
+
+				Entry e;
+				e.path.assign(p, path_len);
+				p += path_len;
+				const uint64_t offset = read_uint(p, 8);
+				e.stored_size = static_cast<uint32_t>(read_uint(p + 8, 4));
+				e.size = static_cast<uint32_t>(read_uint(p + 12, 4));
+				e.flags = static_cast<unsigned char>(p[16]);
+				e.md5.assign(p + 17, Md5Size);
+				p += 17 + Md5Size;
+
+				if(offset < HeaderSize || offset > index_offset || e.stored_size > index_offset - offset) {
+					LOG_ERROR("Module pack " << pack.fname << " has a bad entry for " << e.path);
+					return false;
+				}
+
+				e.data = data + offset;
+				pack.entries.push_back(e);
+			}
+
+			if(pack.entries.size() != num_entries) {
+				LOG_ERROR("Module pack " << pack.fname << " has a truncated index");
+				return false;
+			}
+
+			//The writer sorts the index, but don't rely on it.
+			std::sort(pack.entries.begin(), pack.entries.end(), [](const Entry& a, const Entry& b) { return a.path < b.path; });
+
+			for(const Entry& e : pack.entries) {
+				std::string::size_type slash = e.path.rfind('/');
+				while(slash != std::string::npos && slash > 0) {
+					pack.dirs.push_back(e.path.substr(0, slash));
+					slash = e.path.rfind('/', slash-1);
+				}
+			}
+
+			std::sort(pack.dirs.begin(), pack.dirs.end());
+			pack.dirs.erase(std::unique(pack.dirs.begin(), pack.dirs.end()), pack.dirs.end());
+			return true;
+		}
+	}
+
+	bool write_pack(const std::string& fname, std::vector<pack_file> files)
+	{
+		std::sort(files.begin(), files.end(), [](const pack_file& a, const pack_file& b) { return a.path < b.path; });
+
+		// Build the pack beside the old one and rename it into place, so a
+		// mapping of the old pack stays valid for anyone still reading it.
+		const std::string tmp_fname = fname + ".tmp";
+		std::ofstream out(tmp_fname.c_str(), std::ios_base::binary);
+		if(!out) {
+			return false;
+		}
+
+		std::string index;
+		uint64_t offset = HeaderSize;
+
+		out.write(std::string(HeaderSize, '\0').data(), HeaderSize);
+		for(const pack_file& f : files) {
+			ASSERT_LOG(f.path.size() < 0x10000, "Path too long for module pack: " << f.path);
+
+			int flags = f.flags & ~ENTRY_COMPRESSED;
+			const std::string* stored = &f.contents;
+			if(f.compressed.empty() == false && f.compressed.size() <= f.contents.size()*MaxCompressionRatio) {
+				stored = &f.compressed;
+				flags |= ENTRY_COMPRESSED;
+			}
+
+			const std::string md5 = md5::sum(f.contents);
+			ASSERT_LOG(md5.size() == Md5Size, "Unexpected md5 length: " << md5);
+
+			write_uint(index, f.path.size(), 2);
+			index += f.path;
+			write_uint(index, offset, 8);
+			write_uint(index, stored->size(), 4);
+			write_uint(index, f.contents.size(), 4);
+			index.push_back(static_cast<char>(flags));
+			index += md5;
+
+			out.write(stored->data(), stored->size());
+			offset += stored->size();
+		}
+
+		out.write(index.data(), index.size());
+
+		std::string header(Magic, sizeof(Magic));
+		write_uint(header, Version, 4);
+		write_uint(header, files.size(), 4);
+		write_uint(header, 0, 4);
+		write_uint(header, offset, 8);
+		write_uint(header, index.size(), 8);
+
+		out.seekp(0);
+		out.write(header.data(), header.size());
+		out.close();
+
+		boost::system::error_code ec;
+		if(!out) {
+			boost::filesystem::remove(boost::filesystem::path(tmp_fname), ec);
+			return false;
+		}
+
+		boost::filesystem::rename(boost::filesystem::path(tmp_fname), boost::filesystem::path(fname), ec);
+		if(ec) {
+			LOG_ERROR("Could not replace module pack " << fname << ": " << ec.message());
+			boost::filesystem::remove(boost::filesystem::path(tmp_fname), ec);
+			return false;
+		}
+
+		return true;
+	}
+
+	bool mount(const std::string& fname, const std::string& mount_point)
+	{
+		auto pack = std::make_shared<Pack>();
+		pack->fname = fname;
+		pack->mount_point = normalize(mount_point);
+		if(pack->mount_point.empty() == false && pack->mount_point[pack->mount_point.size()-1] != '/') {
+			pack->mount_point += "/";
+		}
+
+		{
+			threading::lock l(packs_mutex());
+			for(const PackPtr& p : packs()) {
+				if(p->fname == fname || p->mount_point == pack->mount_point) {
+					return false;
+				}
+			}
+		}
+
+		boost::system::error_code ec;
+		pack->mod_time = static_cast<long long>(boost::filesystem::last_write_time(boost::filesystem::path(fname), ec));
+		if(ec || !pack->file.open(fname) || !load_index(*pack)) {
+			return false;
+		}
+
+		LOG_INFO("Mounted module pack " << fname << " at " << pack->mount_point << ": " << pack->entries.size() << " files");
+
+		threading::lock l(packs_mutex());
+		packs().push_back(pack);
+		++g_num_mounted;
+		return true;
+	}
+
+	bool unmount(const std::string& mount_point, std::string* fname)
+	{
+		std::string mp = normalize(mount_point);
+		if(mp.empty() == false && mp[mp.size()-1] != '/') {
+			mp += "/";
+		}
+
+		threading::lock l(packs_mutex());
+		for(auto i = packs().begin(); i != packs().end(); ++i) {
+			boost::system::error_code ec;
+			if((*i)->mount_point == mp || boost::filesystem::equivalent(boost::filesystem::path((*i)->mount_point), boost::filesystem::path(mp), ec)) {
+				LOG_INFO("Unmounted module pack " << (*i)->fname);
+				if(fname) {
+					*fname = (*i)->fname;
+				}
+				packs().erase(i);
+				--g_num_mounted;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void unmount_all()
+	{
+		threading::lock l(packs_mutex());
+		packs().clear();
+		g_num_mounted = 0;
+	}
+
+	bool any_mounted()
+	{
+		return g_num_mounted != 0;
+	}
+
+	bool file_exists(const std::string& fname)
+	{
+		PackPtr pack;
+		return find_entry(fname, &pack) != nullptr;
+	}
+
+	bool dir_exists(const std::string& dname)
+	{
+		if(g_num_mounted == 0) {
+			return false;
+		}
+
+		std::string path = normalize(dname);
+		if(path.empty() == false && path[path.size()-1] == '/') {
+			path.resize(path.size()-1);
+		}
+
+		threading::lock l(packs_mutex());
+		std::string rel;
+		PackPtr p = find_pack_locked(path + "/", &rel);
+		if(!p) {
+			return false;
+		}
+
+		if(rel.empty()) {
+			return true;
+		}
+
+		rel.resize(rel.size()-1);
+		return std::binary_search(p->dirs.begin(), p->dirs.end(), rel);
+	}
+
+	bool read_file(const std::string& fname, std::string* contents)
+	{
+		PackPtr pack;
+		const Entry* e = find_entry(fname, &pack);
+		if(e == nullptr) {
+			return false;
+		}
+
+		if(e->flags & ENTRY_COMPRESSED) {
+			const std::vector<char> data = zip::decompress_known_size(std::vector<char>(e->data, e->data + e->stored_size), e->size);
+			contents->assign(data.begin(), data.end());
+		} else {
+			contents->assign(e->data, e->stored_size);
+		}
+
+		if(g_module_pack_verify_md5) {
+			ASSERT_LOG(md5::sum(*contents) == e->md5, "Contents of " << fname << " in module pack " << pack->fname << " don't match its md5");
+		}
+
+		return true;
+	}
+
+	long long file_mod_time(const std::string& fname)
+	{
+		PackPtr pack;
+		return find_entry(fname, &pack) ? pack->mod_time : 0;
+	}
+
+	long long file_size(const std::string& fname)
+	{
+		PackPtr pack;
+		const Entry* e = find_entry(fname, &pack);
+		return e ? static_cast<long long>(e->size) : -1;
+	}
+
+	std::string file_md5(const std::string& fname)
+	{
+		PackPtr pack;
+		const Entry* e = find_entry(fname, &pack);
+		return e ? e->md5 : std::string();
+	}
+
+	void get_files_in_dir(const std::string& dir, std::vector<std::string>* files, std::vector<std::string>* dirs)
+	{
+		if(g_num_mounted == 0) {
+			return;
+		}
+
+		std::string path = normalize(dir);
+		if(path.empty() == false && path[path.size()-1] != '/') {
+			path += "/";
+		}
+
+		threading::lock l(packs_mutex());
+		std::string prefix;
+		PackPtr p = find_pack_locked(path, &prefix);
+		if(!p) {
+			return;
+		}
+
+		std::string last_dir;
+		for(auto itor = std::lower_bound(p->entries.begin(), p->entries.end(), prefix); itor != p->entries.end() && starts_with(itor->path, prefix); ++itor) {
+			const std::string::size_type slash = itor->path.find('/', prefix.size());
+			if(slash == std::string::npos) {
+				if(files) {
+					files->push_back(itor->path.substr(prefix.size()));
+				}
+			} else if(dirs) {
+				std::string subdir(itor->path, prefix.size(), slash - prefix.size());
+				if(subdir != last_dir) {
+					dirs->push_back(subdir);
+					last_dir = subdir;
+				}
+			}
+		}
+	}
+
+	void get_files_under_dir(const std::string& dir, std::vector<std::string>* files)
+	{
+		if(g_num_mounted == 0) {
+			return;
+		}
+
+		std::string path = normalize(dir);
+		if(path.empty() == false && path[path.size()-1] != '/') {
+			path += "/";
+		}
+
+		threading::lock l(packs_mutex());
+		std::string prefix;
+		PackPtr p = find_pack_locked(path, &prefix);
+		if(!p) {
+			return;
+		}
+
+		for(auto itor = std::lower_bound(p->entries.begin(), p->entries.end(), prefix); itor != p->entries.end() && starts_with(itor->path, prefix); ++itor) {
+			files->push_back(p->mount_point + itor->path);
+		}
+	}
+
+	void shadow_file(const std::string& fname)
+	{
+		if(g_num_mounted == 0) {
+			return;
+		}
+
+		threading::lock l(packs_mutex());
+		std::string rel;
+		PackPtr p = find_pack_locked(normalize(fname), &rel);
+		if(p && std::count(p->shadowed.begin(), p->shadowed.end(), rel) == 0) {
+			p->shadowed.push_back(rel);
+		}
+	}
+}
+
+UNIT_TEST(module_pack_round_trip)
+{
+	const std::string fname = "module_pack_test.pack";
+
+	std::vector<module_pack::pack_file> files;
+	module_pack::pack_file f;
+	f.path = "data/objects/frog.cfg";
+	f.contents = std::string(4000, 'a');
+	f.compressed = zip::compress(f.contents);
+	files.push_back(f);
+
+	f.path = "images/frog.png";
+	f.contents = "\x89PNG not really";
+	f.compressed = "";
+	files.push_back(f);
+
+	f.path = "module.cfg";
+	f.contents = "{id: \"frog\"}";
+	files.push_back(f);
+
+	CHECK_EQ(module_pack::write_pack(fname, files), true);
+	CHECK_EQ(module_pack::mount(fname, "test_pack_mount/frog/"), true);
+
+	std::string contents;
+	CHECK_EQ(module_pack::read_file("test_pack_mount/frog/data/objects/frog.cfg", &contents), true);
+	CHECK_EQ(contents, std::string(4000, 'a'));
+	CHECK_EQ(module_pack::read_file("test_pack_mount/frog/./images//frog.png", &contents), true);
+	CHECK_EQ(contents, "\x89PNG not really");
+	CHECK_EQ(module_pack::file_size("test_pack_mount/frog/module.cfg"), 12);
+	CHECK_EQ(module_pack::file_md5("test_pack_mount/frog/module.cfg"), md5::sum("{id: \"frog\"}"));
+	CHECK_EQ(module_pack::file_exists("test_pack_mount/frog/images"), false);
+	CHECK_EQ(module_pack::dir_exists("test_pack_mount/frog/data/objects"), true);
+	CHECK_EQ(module_pack::dir_exists("test_pack_mount/frog/"), true);
+	CHECK_EQ(module_pack::dir_exists("test_pack_mount/frog/sounds"), false);
+
+	std::vector<std::string> dir_files, dirs;
+	module_pack::get_files_in_dir("test_pack_mount/frog", &dir_files, &dirs);
+	CHECK_EQ(dir_files.size(), 1);
+	CHECK_EQ(dirs.size(), 2);
+
+	dir_files.clear();
+	module_pack::get_files_under_dir("test_pack_mount/frog/data", &dir_files);
+	CHECK_EQ(dir_files.size(), 1);
+	CHECK_EQ(dir_files.front(), "test_pack_mount/frog/data/objects/frog.cfg");
+
+	module_pack::shadow_file("test_pack_mount/frog/module.cfg");
+	CHECK_EQ(module_pack::file_exists("test_pack_mount/frog/module.cfg"), false);
+
+	//Rewriting a mounted pack replaces the file rather than truncating it,
+	//so the mounted copy can still be read.
+	files.pop_back();
+	CHECK_EQ(module_pack::write_pack(fname, files), true);
+	CHECK_EQ(module_pack::read_file("test_pack_mount/frog/data/objects/frog.cfg", &contents), true);
+	CHECK_EQ(contents, std::string(4000, 'a'));
+	CHECK_EQ(boost::filesystem::exists(boost::filesystem::path(fname + ".tmp")), false);
+
+	std::string unmounted;
+	CHECK_EQ(module_pack::unmount("./test_pack_mount/frog", &unmounted), true);
+	CHECK_EQ(unmounted, fname);
+	CHECK_EQ(module_pack::file_exists("test_pack_mount/frog/data/objects/frog.cfg"), false);
+	CHECK_EQ(module_pack::unmount("test_pack_mount/frog/"), false);
+
+	module_pack::unmount_all();
+	boost::filesystem::remove(boost::filesystem::path(fname));
+}
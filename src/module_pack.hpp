@@ -0,0 +1,107 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Module packs: a whole module directory stored in one indexed archive.
+//
+// A pack named <module>.pack found next to a module's directory is memory
+// mapped when the module is located, and its files then appear at the
+// module's path to the functions in sys::, as though they were loose files.
+// Files in a pack shadow files on disk, until something writes the file
+// on disk.
+//
+// Layout (all integers little-endian):
+//   header:  "FFPK", u32 version, u32 num_entries, u32 reserved,
+//            u64 index_offset, u64 index_size
+//   data:    the contents of each entry, back to back
+//   index:   for each entry, sorted by path:
+//            u16 path_len, path, u64 offset, u32 stored_size, u32 size,
+//            u8 flags, char md5[32]
+namespace module_pack
+{
+	enum ENTRY_FLAGS {
+		// The stored data is zlib compressed.
+		ENTRY_COMPRESSED = 1,
+		ENTRY_EXECUTABLE = 2,
+	};
+
+	struct pack_file
+	{
+		pack_file() : flags(0) {}
+
+		// Path relative to the root of the pack, using '/' separators.
+		std::string path;
+		std::string contents;
+
+		// As produced by zip::compress(), or empty to store the file
+		// uncompressed.
+		std::string compressed;
+		int flags;
+	};
+
+	// Writes a pack. Returns false if the file couldn't be written.
+	bool write_pack(const std::string& fname, std::vector<pack_file> files);
+
+	// Maps the pack fname so that its files appear under mount_point, which
+	// should end in a '/'. Returns false if the pack is missing, invalid or
+	// already mounted.
+	bool mount(const std::string& fname, const std::string& mount_point);
+
+	// Unmounts the pack at mount_point, so the files on disk there are seen
+	// again. Anyone still reading from the pack keeps its mapping alive.
+	// Returns false if nothing was mounted there. If fname is given it is
+	// set to the file the pack was mounted from, so it can be mounted again.
+	bool unmount(const std::string& mount_point, std::string* fname=nullptr);
+	void unmount_all();
+
+	// True if any packs are mounted. Cheap, and safe to call from any
+	// thread, so callers can skip pack lookups entirely when it's false.
+	bool any_mounted();
+
+	// These mirror their sys:: equivalents for paths inside mounted packs,
+	// and are safe to call from any thread.
+	bool file_exists(const std::string& fname);
+	bool dir_exists(const std::string& dname);
+	bool read_file(const std::string& fname, std::string* contents);
+	long long file_mod_time(const std::string& fname);
+	long long file_size(const std::string& fname);
+
+	// The md5 recorded for the file when the pack was built. Empty if the
+	// file isn't in a pack.
+	std::string file_md5(const std::string& fname);
+
+	// Adds the names of files and directories immediately inside dir.
+	void get_files_in_dir(const std::string& dir, std::vector<std::string>* files, std::vector<std::string>* dirs);
+
+	// Adds the full path of every file under dir, at any depth.
+	void get_files_under_dir(const std::string& dir, std::vector<std::string>* files);
+
+	// Called when fname is written to disk; the file on disk is used from
+	// then on.
+	void shadow_file(const std::string& fname);
+}
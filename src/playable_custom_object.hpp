@@ -53,6 +53,7 @@ public:
 	virtual int verticalLook() const override { return vertical_look_; }
 
 	virtual bool isActive(const rect& screen_area) const override;
+	virtual bool getActivationBounds(rect* bounds) const override { return false; }
 
 	bool canInteract() const { return can_interact_ != 0; }
 
@@ -80,6 +80,7 @@ void SolidMap::createObjectSolidMaps(variant node, std::vector<ConstSolidMapPtr>
 		if(legs_height == 0) {
 			body_map->calculateSide(0, 1, body_map->bottom_);
 		}
+		body_map->calculateSpans();
 		v.push_back(body_map);
 	} else {
 		legs_height = area.h();
@@ -105,6 +106,7 @@ void SolidMap::createObjectSolidMaps(variant node, std::vector<ConstSolidMapPtr>
 		legs_map->calculateSide(-1, 0, legs_map->left_);
 		legs_map->calculateSide(1, 0, legs_map->right_);
 		legs_map->calculateSide(-10000, 0, legs_map->all_);
+		legs_map->calculateSpans();
 		v.push_back(legs_map);
 	}
 }
@@ -126,6 +128,7 @@ void SolidMap::createObjectPlatformMaps(const rect& area_ref, std::vector<ConstS
 	platform->calculateSide(-1, 0, platform->left_);
 	platform->calculateSide(1, 0, platform->right_);
 	platform->calculateSide(-100000, 0, platform->all_);
+	platform->calculateSpans();
 	v.push_back(platform);
 }
 SolidMapPtr SolidMap::createFromTexture(const KRE::TexturePtr& t, const rect& area_rect)
@@ -287,6 +290,22 @@ void SolidMap::calculateSide(int xdir, int ydir, std::vector<point>& points) con
 	}
 }
 
+void SolidMap::calculateSpans()
+{
+	for(int d = 0; d <= static_cast<int>(MOVE_DIRECTION::NONE); ++d) {
+		std::vector<SolidSpan>& spans = spans_[d];
+		spans.clear();
+		for(const point& p : dir(static_cast<MOVE_DIRECTION>(d))) {
+			if(!spans.empty() && spans.back().y == p.y && spans.back().x2 + 1 == p.x) {
+				spans.back().x2 = p.x;
+			} else {
+				SolidSpan span = { p.y, p.x, p.x };
+				spans.push_back(span);
+			}
+		}
+	}
+}
+
 ConstSolidInfoPtr SolidInfo::createFromSolidMaps(const std::vector<ConstSolidMapPtr>& solid)
 {
 	if(solid.empty()) {
@@ -33,6 +33,12 @@
 
 enum class MOVE_DIRECTION { LEFT, RIGHT, UP, DOWN, NONE };
 
+//A horizontal run of solid points from x1 to x2 inclusive.
+struct SolidSpan
+{
+	int y, x1, x2;
+};
+
 class SolidMap
 {
 public:
@@ -51,6 +57,9 @@ public:
 	const std::vector<point>& top() const { return top_; }
 	const std::vector<point>& bottom() const { return bottom_; }
 	const std::vector<point>& all() const { return all_; }
+
+	//The points of dir(d) merged into horizontal runs, in the same order.
+	const std::vector<SolidSpan>& spans(MOVE_DIRECTION d) const { return spans_[static_cast<int>(d)]; }
 private:
 	static ConstSolidMapPtr createObjectSolidMapFromSolidNode(variant node);
 
@@ -59,6 +68,7 @@ private:
 	void setSolid(int x, int y, bool value=true);
 
 	void calculateSide(int xdir, int ydir, std::vector<point>& points) const;
+	void calculateSpans();
 
 	void applyOffsets(const std::vector<int>& offsets);
 
@@ -69,6 +79,7 @@ private:
 
 	//all the solid points that are on the different sides of the solid area.
 	std::vector<point> left_, right_, top_, bottom_, all_;
+	std::vector<SolidSpan> spans_[static_cast<int>(MOVE_DIRECTION::NONE) + 1];
 };
 
 class SolidInfo
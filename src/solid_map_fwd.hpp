@@ -31,3 +31,5 @@ typedef std::shared_ptr<const SolidMap> ConstSolidMapPtr;
 
 class SolidInfo;
 typedef std::shared_ptr<const SolidInfo> ConstSolidInfoPtr;
+
+struct SolidSpan;
@@ -34,6 +34,7 @@
 #include <vorbis/vorbisfile.h>
 
 #include "asserts.hpp"
+#include "async_io.hpp"
 #include "filesystem.hpp"
 #include "formatter.hpp"
 #include "formula_callable.hpp"
@@ -753,7 +754,14 @@ namespace sound
 			buf = reinterpret_cast<Uint8*>(&ogg_buf[0]);
 			len = ogg_buf.size();
 		} else {
-			res_spec = SDL_LoadWAV(fname.c_str(), &in_spec, &buf, &len);
+			//Read through the file cache so that sounds prefetched along
+			//with a level don't touch the disk again.
+			async_io::file_data data = async_io::read_file(fname);
+			if(data->empty()) {
+				res_spec = nullptr;
+			} else {
+				res_spec = SDL_LoadWAV_RW(SDL_RWFromConstMem(data->data(), static_cast<int>(data->size())), 1, &in_spec, &buf, &len);
+			}
 		}
 
 		if(res_spec == nullptr) {
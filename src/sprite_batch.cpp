@@ -0,0 +1,148 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include "Blittable.hpp"
+#include "WindowManager.hpp"
+
+#include "frame.hpp"
+#include "sprite_batch.hpp"
+
+namespace
+{
+	// All batches draw through one renderable, so that its attribute
+	// buffers are made once rather than for every batch.
+	KRE::Blittable& get_batch_target()
+	{
+		static KRE::Blittable* target = new KRE::Blittable;
+		return *target;
+	}
+
+	SpriteBatch::Stats& get_stats()
+	{
+		static SpriteBatch::Stats stats;
+		return stats;
+	}
+}
+
+SpriteBatch::SpriteBatch()
+	: frame_(nullptr),
+	  color_(KRE::Color::colorWhite())
+{
+}
+
+SpriteBatch::~SpriteBatch()
+{
+	flush();
+}
+
+bool SpriteBatch::canJoin(const Frame& frame, const KRE::Color& color) const
+{
+	if(frame_ == &frame) {
+		return color_ == color;
+	}
+
+	const KRE::Blittable& a = frame_->getBlitTarget();
+	const KRE::Blittable& b = frame.getBlitTarget();
+	return a.getTexture() == b.getTexture()
+	    && a.getShader() == b.getShader()
+	    && a.isBlendModeSet() == b.isBlendModeSet()
+	    && (!a.isBlendModeSet() || a.getBlendMode() == b.getBlendMode())
+	    && a.isBlendEquationSet() == b.isBlendEquationSet()
+	    && (!a.isBlendEquationSet() || a.getBlendEquation() == b.getBlendEquation())
+	    && a.isBlendStateSet() == b.isBlendStateSet()
+	    && a.isBlendEnabled() == b.isBlendEnabled()
+	    && color_ == color;
+}
+
+void SpriteBatch::add(const Frame& frame, const KRE::Color& color, int x, int y, bool face_right, bool upside_down, int time, float rotate, float scale)
+{
+	//a color set on the frame itself wins over the one it is drawn with.
+	const KRE::Color& c = frame.getBlitTarget().isColorSet() ? frame.getBlitTarget().getColor() : color;
+
+	if(!queue_.empty() && !canJoin(frame, c)) {
+		flush();
+	}
+
+	if(queue_.empty()) {
+		frame_ = &frame;
+		color_ = c;
+	}
+
+	frame.appendQuad(&queue_, x, y, face_right, upside_down, time, rotate, scale);
+	++get_stats().sprites;
+}
+
+void SpriteBatch::flush()
+{
+	if(queue_.empty()) {
+		return;
+	}
+
+	const KRE::Blittable& src = frame_->getBlitTarget();
+	KRE::Blittable& target = get_batch_target();
+
+	target.setTexture(src.getTexture());
+	if(target.getShader() != src.getShader()) {
+		target.setShader(src.getShader());
+	}
+
+	if(src.isBlendModeSet()) {
+		target.setBlendMode(src.getBlendMode());
+	} else {
+		target.clearBlendMode();
+	}
+
+	if(src.isBlendEquationSet()) {
+		target.setBlendEquation(src.getBlendEquation());
+	} else {
+		target.clearBlendEquation();
+	}
+
+	if(src.isBlendStateSet()) {
+		target.setBlendState(src.isBlendEnabled());
+	} else {
+		target.clearBlendState();
+	}
+
+	target.setColor(color_);
+
+	//update() swaps the vertices into the target, leaving us its old
+	//buffer to fill next time.
+	target.update(&queue_);
+	queue_.clear();
+
+	KRE::WindowManager::getMainWindow()->render(&target);
+	++get_stats().draw_calls;
+
+	frame_ = nullptr;
+}
+
+const SpriteBatch::Stats& SpriteBatch::getStats()
+{
+	return get_stats();
+}
+
+void SpriteBatch::resetStats()
+{
+	get_stats() = Stats();
+}
@@ -0,0 +1,75 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Color.hpp"
+#include "SceneUtil.hpp"
+
+class Frame;
+
+// Draws runs of plain sprites with as few render calls as possible.
+//
+// Sprites are queued as quads in a single vertex buffer for as long as
+// they use the same texture, shader, blend state and color. Adding a
+// sprite which differs, or calling flush(), draws the queued run with one
+// call, so sprites always reach the screen in the order they were added.
+// Anything else that draws must flush the batch first.
+class SpriteBatch
+{
+public:
+	SpriteBatch();
+	~SpriteBatch();
+
+	// Queues the frame as draw() would draw it at (x, y).
+	void add(const Frame& frame, const KRE::Color& color, int x, int y, bool face_right, bool upside_down, int time, float rotate, float scale);
+
+	void flush();
+
+	bool empty() const { return queue_.empty(); }
+
+	// Sprites added to any batch, and render calls used to draw them.
+	struct Stats
+	{
+		Stats() : sprites(0), draw_calls(0)
+		{}
+		int64_t sprites, draw_calls;
+	};
+
+	// Totals since resetStats() was last called.
+	static const Stats& getStats();
+	static void resetStats();
+private:
+	SpriteBatch(const SpriteBatch&);
+	void operator=(const SpriteBatch&);
+
+	bool canJoin(const Frame& frame, const KRE::Color& color) const;
+
+	// The frame whose render state the queued sprites are drawn with.
+	const Frame* frame_;
+	KRE::Color color_;
+	std::vector<KRE::vertex_texcoord> queue_;
+};
@@ -28,6 +28,9 @@
 #include "module.hpp"
 #include "preferences.hpp"
 #include "surface_cache.hpp"
+#include "unit_test.hpp"
+
+PREF_INT(surface_cache_max_mb, 512, "Memory budget for cached image surfaces in megabytes. The least recently used surfaces are dropped when it is exceeded. 0 means unlimited.");
 
 namespace graphics
 {
@@ -40,10 +43,19 @@ namespace graphics
 			int64_t mod_time;
 		};
 
+		size_t surface_bytes(const CacheEntry& entry)
+		{
+			if(entry.surf == nullptr) {
+				return 0;
+			}
+
+			return static_cast<size_t>(entry.surf->rowPitch()) * entry.surf->height();
+		}
+
 		typedef ConcurrentCache<std::string,CacheEntry> SurfaceMap;
 		SurfaceMap& cache()
 		{
-			static SurfaceMap res;
+			static SurfaceMap res(static_cast<size_t>(g_surface_cache_max_mb) * 1024 * 1024, surface_bytes);
 			return res;
 		}
 
@@ -58,16 +70,12 @@ namespace graphics
 	KRE::SurfacePtr SurfaceCache::get(const std::string& key, bool cache_surface, std::string* full_filename)
 	{
 		if(cache_surface) {
-			KRE::SurfacePtr surf = cache().get(key).surf;
-			if(surf == nullptr) {
+			return cache().getOrCompute(key, [&key]() {
 				CacheEntry entry;
-				surf = entry.surf = get(key, false);
-				if(entry.fname.empty() == false) {
-					entry.mod_time = get_file_mod_time(entry.fname);
-				}
-				cache().put(key, entry);
-			}
-			return surf;
+				entry.surf = get(key, false, &entry.fname);
+				entry.mod_time = entry.fname.empty() ? 0 : get_file_mod_time(entry.fname);
+				return entry;
+			}).surf;
 		}
 
 		std::string fname = image_path + key;
@@ -102,7 +110,11 @@ namespace graphics
 	void SurfaceCache::invalidateModified(std::vector<std::string>* keys_modified)
 	{
 		for(const auto& k : cache().getKeys()) {
-			CacheEntry entry = cache().get(k);
+			CacheEntry entry;
+			if(!cache().tryGet(k, &entry)) {
+				continue;
+			}
+
 			const int64_t mod_time = get_file_mod_time(entry.fname);
 			if(mod_time != entry.mod_time) {
 				cache().erase(k);
@@ -119,3 +131,24 @@ namespace graphics
 	}
 
 }
+
+UNIT_TEST(concurrent_cache_lru)
+{
+	ConcurrentCache<int, int> cache(10, [](const int& v) { return static_cast<size_t>(v); }, 1);
+	cache.put(1, 4);
+	cache.put(2, 4);
+	CHECK_EQ(cache.get(1), 4);
+
+	//2 is now the least recently used entry, so it's the one evicted.
+	cache.put(3, 4);
+	CHECK_EQ(cache.count(1), 1);
+	CHECK_EQ(cache.count(2), 0);
+	CHECK_EQ(cache.count(3), 1);
+	CHECK_EQ(cache.getStats().evictions, 1);
+	CHECK_EQ(cache.getStats().bytes, 8);
+
+	int computed = 0;
+	CHECK_EQ(cache.getOrCompute(4, [&computed]() { ++computed; return 2; }), 2);
+	CHECK_EQ(cache.getOrCompute(4, [&computed]() { ++computed; return 3; }), 2);
+	CHECK_EQ(computed, 1);
+}
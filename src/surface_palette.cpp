@@ -21,15 +21,23 @@
 	   distribution.
 */
 
+#include <atomic>
 #include <map>
 #include <vector>
 
 #include <boost/bimap.hpp>
 
 #include "asserts.hpp"
+#include "concurrent_cache.hpp"
 #include "json_parser.hpp"
 #include "module.hpp"
+#include "preferences.hpp"
+#include "profile_timer.hpp"
 #include "surface_palette.hpp"
+#include "thread.hpp"
+#include "unit_test.hpp"
+
+PREF_INT(palette_cache_max_kb, 32768, "Memory budget for sprite sheets recolored with a palette, in kilobytes. The least recently used sheets are dropped when it is exceeded. 0 means unlimited.");
 
 namespace graphics
 {
@@ -68,6 +76,144 @@ namespace graphics
 			return res;
 		}
 
+		// Maps the colors a palette replaces to their replacements. The source
+		// colors live in an open-addressed hash table at most a quarter full,
+		// so a lookup is a multiply and almost always a single probe, and
+		// each slot holds an index into the compact list of mapped colors.
+		class PaletteLookup
+		{
+		public:
+			PaletteLookup(const std::vector<uint32_t>& from, const std::vector<uint32_t>& to) : shift_(32)
+			{
+				ASSERT_LOG(from.size() == to.size(), "Palette color lists differ in size: " << from.size() << " vs " << to.size());
+				ASSERT_LOG(from.size() < EmptySlot, "Too many colors in palette: " << from.size());
+
+				size_t nslots = 4;
+				shift_ = 30;
+				while(nslots < from.size()*4) {
+					nslots *= 2;
+					--shift_;
+				}
+
+				keys_.resize(nslots);
+				slots_.resize(nslots, EmptySlot);
+				for(size_t n = 0; n != from.size(); ++n) {
+					size_t slot = findSlot(from[n]);
+					if(slots_[slot] == EmptySlot) {
+						keys_[slot] = from[n];
+						slots_[slot] = static_cast<uint16_t>(mapped_.size());
+						mapped_.push_back(to[n]);
+					} else {
+						// Later entries in a palette image win, as they always have.
+						mapped_[slots_[slot]] = to[n];
+					}
+				}
+			}
+
+			uint32_t map(uint32_t color) const {
+				const uint16_t index = slots_[findSlot(color)];
+				return index == EmptySlot ? color : mapped_[index];
+			}
+
+			// Maps a row of RGBA bytes, writing the result bpp bytes apart.
+			void mapRow(const uint8_t* rgba, int w, uint8_t* out, int bpp) const {
+				// Neighbouring pixels tend to be the same color, so remember
+				// the last lookup.
+				uint32_t last_color = 0, last_mapped = map(0);
+				for(int x = 0; x != w; ++x, rgba += 4, out += bpp) {
+					const uint32_t color = (static_cast<uint32_t>(rgba[0]) << 24)
+						| (static_cast<uint32_t>(rgba[1]) << 16)
+						| (static_cast<uint32_t>(rgba[2]) << 8)
+						| (static_cast<uint32_t>(rgba[3]));
+
+					if(color != last_color) {
+						last_color = color;
+						last_mapped = map(color);
+					}
+
+					out[0] = (last_mapped >> 24) & 0xff;
+					out[1] = (last_mapped >> 16) & 0xff;
+					out[2] = (last_mapped >>  8) & 0xff;
+					out[3] = (last_mapped >>  0) & 0xff;
+				}
+			}
+
+			size_t numColors() const { return mapped_.size(); }
+		private:
+			enum { EmptySlot = 0xffff };
+
+			size_t findSlot(uint32_t color) const {
+				const size_t mask = slots_.size() - 1;
+				size_t slot = (color * 0x9e3779b1u) >> shift_;
+				while(slots_[slot] != EmptySlot && keys_[slot] != color) {
+					slot = (slot + 1) & mask;
+				}
+				return slot;
+			}
+
+			std::vector<uint32_t> keys_;
+			std::vector<uint16_t> slots_;
+			std::vector<uint32_t> mapped_;
+			int shift_;
+		};
+
+		typedef std::shared_ptr<const PaletteLookup> PaletteLookupPtr;
+
+		std::atomic<long long> g_tables_built(0), g_pixels_mapped(0);
+		std::atomic<long long> g_map_us(0);
+
+		// Palette images are turned into lookup tables once. The id of the
+		// palette surface is kept so that a palette reloaded from disk gets
+		// a new table.
+		PaletteLookupPtr get_palette_lookup(int palette, const KRE::SurfacePtr& psurf)
+		{
+			static threading::mutex mutex;
+			static std::map<int, std::pair<unsigned, PaletteLookupPtr>> tables;
+
+			{
+				threading::lock lck(mutex);
+				auto it = tables.find(palette);
+				if(it != tables.end() && it->second.first == psurf->id()) {
+					return it->second.second;
+				}
+			}
+
+			std::vector<uint32_t> from, to;
+			if(psurf->width() > psurf->height()) {
+				for(int x = 0; x != psurf->width(); ++x) {
+					from.emplace_back(psurf->getColorAt(x, 0).asRGBA());
+					to.emplace_back(psurf->getColorAt(x, 1).asRGBA());
+				}
+			} else {
+				for(int y = 0; y != psurf->height(); ++y) {
+					from.emplace_back(psurf->getColorAt(0, y).asRGBA());
+					to.emplace_back(psurf->getColorAt(1, y).asRGBA());
+				}
+			}
+
+			auto table = std::make_shared<const PaletteLookup>(from, to);
+			++g_tables_built;
+
+			threading::lock lck(mutex);
+			tables[palette] = std::make_pair(psurf->id(), table);
+			return table;
+		}
+
+		size_t surface_bytes(const KRE::SurfacePtr& surf)
+		{
+			return surf ? static_cast<size_t>(surf->rowPitch()) * surf->height() : 0;
+		}
+
+		// Recolored sheets, keyed by the ids of the source surface and of the
+		// palette surface. Surface ids are never reused, so a sheet or palette
+		// reloaded from disk simply misses and its old entries age out.
+		typedef ConcurrentCache<uint64_t, KRE::SurfacePtr> MappedSurfaceCache;
+		MappedSurfaceCache& mapped_surface_cache()
+		{
+			static MappedSurfaceCache res(static_cast<size_t>(g_palette_cache_max_kb) * 1024, surface_bytes);
+			return res;
+		}
+
 		typedef std::map<std::string, std::weak_ptr<KRE::Texture>> palette_texture_cache;
 		palette_texture_cache& get_palette_texture_cache()
 		{
@@ -120,50 +266,46 @@ namespace graphics
 			return surface;
 		}
 
-		// generate a map of the palette.
-		std::map<uint32_t, uint32_t> color_map;
-		if(psurf->width() > psurf->height()) {
-			for(int x = 0; x != psurf->width(); ++x) {
-				Color normal_color = psurf->getColorAt(x, 0);
-				Color mapped_color = psurf->getColorAt(x, 1);
-				color_map[normal_color.asRGBA()] = mapped_color.asRGBA();
-			}
-		} else {
-			for(int y = 0; y != psurf->height(); ++y) {
-				Color normal_color = psurf->getColorAt(0, y);
-				Color mapped_color = psurf->getColorAt(1, y);
-				color_map[normal_color.asRGBA()] = mapped_color.asRGBA();
-			}
-		}
+		const uint64_t key = (static_cast<uint64_t>(surface->id()) << 32) | psurf->id();
+		return mapped_surface_cache().getOrCompute(key, [&surface, &psurf, palette]() {
+			profile::timer timer;
+			auto table = get_palette_lookup(palette, psurf);
 
-		int rp = surface->rowPitch();
-		int bpp = surface->bytesPerPixel();
-		std::vector<uint8_t> new_pixels;
-		new_pixels.resize(rp * surface->height());
-
-		surface->iterateOverSurface([&color_map, &new_pixels, rp, bpp](int x, int y, int r, int g, int b, int a) {
-			uint32_t color = (static_cast<uint32_t>(r) << 24)
-				| (static_cast<uint32_t>(g) << 16)
-				| (static_cast<uint32_t>(b) << 8)
-				| (static_cast<uint32_t>(a));
-			const int index = x * bpp + y * rp;
-
-			auto it = color_map.find(color);
-			if(it == color_map.end()) {
-				new_pixels[index + 0] = r;
-				new_pixels[index + 1] = g;
-				new_pixels[index + 2] = b;
-				new_pixels[index + 3] = a;
-			} else {
-				new_pixels[index + 0] = (it->second >> 24) & 0xff;
-				new_pixels[index + 1] = (it->second >> 16) & 0xff;
-				new_pixels[index + 2] = (it->second >>  8) & 0xff;
-				new_pixels[index + 3] = (it->second >>  0) & 0xff;
-			}
+			int rp = surface->rowPitch();
+			int bpp = surface->bytesPerPixel();
+			std::vector<uint8_t> new_pixels;
+			new_pixels.resize(rp * surface->height());
+
+			surface->iterateOverRows([&table, &new_pixels, rp, bpp](int y, const uint8_t* rgba, int w) {
+				table->mapRow(rgba, w, &new_pixels[y * rp], bpp);
+			});
+			auto new_surf = Surface::create(surface->width(), surface->height(), PixelFormat::PF::PIXELFORMAT_RGBA8888);
+			new_surf->writePixels(&new_pixels[0], static_cast<int>(new_pixels.size()));
+
+			g_pixels_mapped += static_cast<long long>(surface->width()) * surface->height();
+			g_map_us += static_cast<long long>(timer.get_time());
+			return new_surf;
 		});
-		auto new_surf = Surface::create(surface->width(), surface->height(), PixelFormat::PF::PIXELFORMAT_RGBA8888);
-		new_surf->writePixels(&new_pixels[0], static_cast<int>(new_pixels.size()));
-		return new_surf;
+	}
+
+	void clear_palette_cache()
+	{
+		mapped_surface_cache().clear();
+	}
+
+	palette_cache_stats get_palette_cache_stats()
+	{
+		const MappedSurfaceCache::Stats stats = mapped_surface_cache().getStats();
+		palette_cache_stats result;
+		result.hits = stats.hits;
+		result.misses = stats.misses;
+		result.evictions = stats.evictions;
+		result.entries = stats.entries;
+		result.bytes = stats.bytes;
+		result.tables_built = g_tables_built;
+		result.pixels_mapped = g_pixels_mapped;
+		result.map_us = g_map_us;
+		return result;
 	}
 
 	KRE::TexturePtr get_palette_texture(const std::string& name, const variant& node, int palette)
@@ -207,3 +349,60 @@ namespace graphics
 		return tex;
 	}
 }
+
+UNIT_TEST(palette_lookup_maps_colors)
+{
+	std::vector<uint32_t> from, to;
+	for(uint32_t n = 0; n != 40; ++n) {
+		from.push_back(0xff0000ffu + (n << 8));
+		to.push_back(0x00ff00ffu + (n << 16));
+	}
+	from.push_back(from.front());
+	to.push_back(0x12345678u);
+
+	graphics::PaletteLookup table(from, to);
+	CHECK_EQ(table.numColors(), 40U);
+	CHECK_EQ(table.map(from.front()), 0x12345678u);
+	CHECK_EQ(table.map(from[7]), to[7]);
+	CHECK_EQ(table.map(0xabcdef01u), 0xabcdef01u);
+	CHECK_EQ(table.map(0), 0u);
+
+	const uint8_t row[] = { 0xff, 0x00, 0x07, 0xff,  0xff, 0x00, 0x07, 0xff,  0x01, 0x02, 0x03, 0x04 };
+	uint8_t out[12];
+	table.mapRow(row, 3, out, 4);
+	CHECK_EQ(out[0], 0x01);
+	CHECK_EQ(out[1], 0x06);
+	CHECK_EQ(out[3], 0xff);
+	CHECK_EQ(out[4], 0x01);
+	CHECK_EQ(out[5], 0x06);
+	CHECK_EQ(out[8], 0x01);
+	CHECK_EQ(out[11], 0x04);
+}
+
+BENCHMARK(palette_lookup_map_rows)
+{
+	std::vector<uint32_t> from, to;
+	for(uint32_t n = 0; n != 64; ++n) {
+		from.push_back(0x80000000u + n * 0x010203ffu);
+		to.push_back(n * 0x03020100u + 0xff);
+	}
+	graphics::PaletteLookup table(from, to);
+
+	// A sprite sheet's worth of pixels: runs of palette colors, other
+	// colors and transparency.
+	const int w = 2048;
+	std::vector<uint8_t> row(w * 4), out(w * 4);
+	for(int x = 0; x != w; ++x) {
+		const uint32_t color = (x/3)%4 == 0 ? 0 : (x/3)%4 == 1 ? from[(x*7)%64] : 0x10203040u + x;
+		row[x*4+0] = color >> 24;
+		row[x*4+1] = color >> 16;
+		row[x*4+2] = color >> 8;
+		row[x*4+3] = color;
+	}
+
+	BENCHMARK_LOOP {
+		for(int y = 0; y != 256; ++y) {
+			table.mapRow(&row[0], w, &out[0], 4);
+		}
+	}
+}
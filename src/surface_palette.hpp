@@ -35,8 +35,27 @@ namespace graphics
 
 	KRE::SurfacePtr get_palette_surface(int palette);
 
+	// Returns a copy of surface with the colors of the palette replaced.
+	// Results are cached by (surface, palette), within the memory budget
+	// set by the palette_cache_max_kb preference.
 	KRE::SurfacePtr map_palette(KRE::SurfacePtr surface, int palette);
 
+	void clear_palette_cache();
+
+	struct palette_cache_stats
+	{
+		palette_cache_stats() : hits(0), misses(0), evictions(0), entries(0), bytes(0), tables_built(0), pixels_mapped(0), map_us(0)
+		{}
+		long long hits, misses, evictions;
+		size_t entries, bytes;
+
+		// Palettes turned into lookup tables, pixels recolored and the
+		// total time spent recoloring, in microseconds.
+		long long tables_built, pixels_mapped, map_us;
+	};
+
+	palette_cache_stats get_palette_cache_stats();
+
 	KRE::TexturePtr get_palette_texture(const std::string& name, const variant& node, int palette);
 	KRE::TexturePtr get_palette_texture(const std::string& name, const variant& node, const std::vector<int>& palette);
 }
@@ -26,15 +26,21 @@
 #include <sys/wait.h>
 #endif
 
+#include <chrono>
+#include <cstring>
 #include <deque>
+#include <functional>
 #include <map>
 #include <vector>
 #include <sstream>
 
 #include <boost/filesystem.hpp>
 
+#include "kre/Simd.hpp"
+#include "kre/SurfaceBlur.hpp"
 #include "kre/SurfaceSDL.hpp"
 #include "kre/SurfaceScale.hpp"
+#include "kre/Util.hpp"
 
 #include <SDL2/SDL_image.h>
 
@@ -2174,3 +2180,100 @@ COMMAND_LINE_UTILITY(generate_tilesheet)
 	surf->savePng("sheet.png"); //module::get_module_path() + fname.str());
 
 }
+
+namespace
+{
+	KRE::SurfacePtr make_filter_benchmark_surface(int size, const std::vector<uint32_t>& pixels)
+	{
+		using namespace KRE;
+		auto surf = Surface::create(size, size, 32, size * 4, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, &pixels[0]);
+		ASSERT_LOG(surf->getPixelFormat()->getFormat() == PixelFormat::PF::PIXELFORMAT_ARGB8888, "Benchmark surface isn't ARGB8888");
+		return surf;
+	}
+
+	bool same_pixels(const KRE::SurfacePtr& a, const KRE::SurfacePtr& b)
+	{
+		if(a->width() != b->width() || a->height() != b->height() || a->rowPitch() != b->rowPitch()) {
+			return false;
+		}
+		return memcmp(a->pixels(), b->pixels(), a->rowPitch() * a->height()) == 0;
+	}
+}
+
+// Times the CPU blur and scale filters on a large surface, first with the
+// scalar code on one thread and then with vector code on every thread, and
+// checks that both give the same pixels.
+//
+// usage: benchmark_surface_filters [--size=N] [--iterations=N]
+COMMAND_LINE_UTILITY(benchmark_surface_filters)
+{
+	using namespace KRE;
+
+	int size = 2048;
+	int iterations = 5;
+	for(const std::string& arg : args) {
+		if(arg.compare(0, 7, "--size=") == 0) {
+			size = atoi(arg.c_str() + 7);
+		} else if(arg.compare(0, 13, "--iterations=") == 0) {
+			iterations = atoi(arg.c_str() + 13);
+		} else {
+			ASSERT_LOG(false, "Unrecognized argument: " << arg);
+		}
+	}
+
+	ASSERT_LOG(size > 1 && iterations > 0, "Bad size or iteration count");
+
+	// Random colors, with runs of transparent and opaque pixels so the blur
+	// has edges to work on.
+	std::vector<uint32_t> pixels(size * size);
+	uint32_t seed = 1;
+	for(int n = 0; n != size * size; ++n) {
+		seed = seed * 1664525 + 1013904223;
+		const uint32_t alpha = (n / 37) % 3 == 0 ? 0 : 0xff000000;
+		pixels[n] = alpha | (seed >> 8);
+	}
+
+	struct Filter {
+		const char* name;
+		std::function<SurfacePtr(const SurfacePtr&)> fn;
+	};
+
+	const Filter filters[] = {
+		{ "alpha_blur", [](const SurfacePtr& s) { surface_alpha_blur(s, 8.0f); return s; } },
+		{ "nearest_neighbour", [](const SurfacePtr& s) { return scale::nearest_neighbour(s, 150); } },
+		{ "bilinear", [](const SurfacePtr& s) { return scale::bilinear(s, 150); } },
+		{ "bicubic", [](const SurfacePtr& s) { return scale::bicubic(s, 150); } },
+		{ "epx", [](const SurfacePtr& s) { return scale::epx(s); } },
+	};
+
+	const double mpix = size * static_cast<double>(size) / 1000000.0;
+	std::cout << "Filtering " << size << "x" << size << " surfaces, " << Util::get_max_parallel_threads() << " threads\n";
+
+	for(const Filter& f : filters) {
+		SurfacePtr results[2];
+		double ms[2];
+		for(int mode = 0; mode != 2; ++mode) {
+			const bool fast = mode == 1;
+			simd::set_enabled(fast);
+			Util::set_max_parallel_threads(fast ? 0 : 1);
+
+			double total = 0;
+			for(int n = 0; n != iterations; ++n) {
+				// The blur works in place, so every run gets a fresh copy.
+				auto input = make_filter_benchmark_surface(size, pixels);
+				const auto start = std::chrono::steady_clock::now();
+				results[mode] = f.fn(input);
+				total += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			}
+
+			ms[mode] = total / iterations;
+		}
+		simd::set_enabled(true);
+		Util::set_max_parallel_threads(0);
+
+		std::cout << f.name << ": scalar " << ms[0] << "ms (" << mpix / (ms[0] / 1000.0) << " Mpix/s), "
+			<< "vector+threads " << ms[1] << "ms (" << mpix / (ms[1] / 1000.0) << " Mpix/s), "
+			<< "speedup " << ms[0] / ms[1] << "x, "
+			<< (same_pixels(results[0], results[1]) ? "identical" : "OUTPUT DIFFERS") << "\n";
+	}
+}
@@ -0,0 +1,431 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#ifdef _MSC_VER
+#include <winsock2.h>
+#else
+#include <netinet/in.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "asserts.hpp"
+#include "controls.hpp"
+#include "DisplayDeviceNull.hpp"
+#include "draw_scene.hpp"
+#include "filesystem.hpp"
+#include "level.hpp"
+#include "profile_timer.hpp"
+#include "random.hpp"
+#include "sprite_batch.hpp"
+#include "unit_test.hpp"
+#include "WindowManager.hpp"
+
+namespace
+{
+	//The most players the controls module keeps input for.
+	const int MaxPlayers = 8;
+
+	//A control packet in the format of controls::write_control_packet().
+	//It holds a player's controls for every cycle from first_cycle up to
+	//cycle.
+	struct ControlPacket
+	{
+		int slot, first_cycle, cycle;
+		std::vector<char> data;
+	};
+
+	bool compare_packet_cycle(const ControlPacket& a, const ControlPacket& b)
+	{
+		return a.first_cycle < b.first_cycle;
+	}
+
+	void write_int32(std::vector<char>& v, int32_t value)
+	{
+		value = htonl(value);
+		v.resize(v.size() + 4);
+		memcpy(&v[v.size()-4], &value, 4);
+	}
+
+	int32_t read_int32(const char* buf)
+	{
+		int32_t value;
+		memcpy(&value, buf, 4);
+		return ntohl(value);
+	}
+
+	//Reads a recorded controls stream: control packets, each preceded by
+	//its length as a 32-bit big-endian integer. Packets are returned in
+	//the order of the first cycle they hold controls for.
+	std::vector<ControlPacket> read_control_stream(const std::string& fname)
+	{
+		const std::string contents = sys::read_file(fname);
+
+		std::vector<ControlPacket> result;
+		size_t pos = 0;
+		while(pos < contents.size()) {
+			ASSERT_LOG(pos + 4 <= contents.size(), "Truncated control packet in " << fname << " at byte " << pos);
+			const size_t len = static_cast<uint32_t>(read_int32(&contents[pos]));
+			pos += 4;
+
+			ASSERT_LOG(len >= 17 && pos + len <= contents.size(), "Bad control packet in " << fname << " at byte " << pos);
+
+			ControlPacket packet;
+			packet.data.assign(contents.begin() + pos, contents.begin() + pos + len);
+			packet.slot = static_cast<unsigned char>(packet.data[0]);
+			packet.cycle = read_int32(&packet.data[1]);
+			packet.first_cycle = 1 + packet.cycle - read_int32(&packet.data[13]);
+			ASSERT_LOG(packet.slot < MaxPlayers, "Control packet for player " << packet.slot << " in " << fname);
+			result.push_back(packet);
+
+			pos += len;
+		}
+
+		std::stable_sort(result.begin(), result.end(), compare_packet_cycle);
+		return result;
+	}
+
+	//A packet holding no input for the given player on every cycle up to
+	//last_cycle.
+	ControlPacket make_idle_packet(int slot, int first_cycle, int last_cycle)
+	{
+		ControlPacket packet;
+		packet.slot = slot;
+		packet.first_cycle = first_cycle;
+		packet.cycle = last_cycle;
+		packet.data.push_back(static_cast<char>(slot));
+		write_int32(packet.data, last_cycle);
+		write_int32(packet.data, 0); //no checksum to compare against
+		write_int32(packet.data, 0);
+		write_int32(packet.data, 1 + last_cycle - first_cycle);
+		for(int cycle = first_cycle; cycle <= last_cycle; ++cycle) {
+			packet.data.push_back(0); //keys
+			packet.data.push_back(0); //empty user string
+		}
+
+		return packet;
+	}
+
+	//Gives the controls module every packet holding controls that the
+	//given cycle reads. Processing a cycle reads the controls for the cycle
+	//before it, so a packet is needed once the cycle after its first one
+	//is reached.
+	void feed_control_packets(const std::vector<ControlPacket>& packets, std::vector<ControlPacket>::const_iterator& next_packet, int cycle)
+	{
+		while(next_packet != packets.end() && next_packet->first_cycle < cycle) {
+			controls::read_control_packet(&next_packet->data[0], next_packet->data.size());
+			++next_packet;
+		}
+	}
+
+	class StateChecksum
+	{
+	public:
+		StateChecksum() : hash_(2166136261u)
+		{}
+
+		void add(const std::string& s) {
+			add(s.data(), s.size());
+		}
+
+		void add(int32_t value) {
+			for(int n = 0; n != 4; ++n) {
+				addByte(static_cast<uint8_t>(value >> (n*8)));
+			}
+		}
+
+		uint32_t get() const { return hash_; }
+	private:
+		void add(const char* data, size_t len) {
+			add(static_cast<int32_t>(len));
+			for(size_t n = 0; n != len; ++n) {
+				addByte(static_cast<uint8_t>(data[n]));
+			}
+		}
+
+		void addByte(uint8_t c) {
+			hash_ = (hash_ ^ c) * 16777619u;
+		}
+
+		uint32_t hash_;
+	};
+
+	//Hashes the state of the level's objects and the random number
+	//generator. Two runs of a level with the same controls should give
+	//the same checksum on every cycle.
+	uint32_t level_state_checksum(const Level& lvl)
+	{
+		StateChecksum sum;
+		sum.add(lvl.cycle());
+
+		std::ostringstream seed;
+		seed << rng::get_seed();
+		sum.add(seed.str());
+
+		for(const EntityPtr& e : lvl.get_chars()) {
+			sum.add(e->label());
+			sum.add(e->getCurrentFrame().id());
+			sum.add(e->centiX());
+			sum.add(e->centiY());
+			sum.add(e->velocityX());
+			sum.add(e->velocityY());
+			sum.add(e->isFacingRight());
+			sum.add(e->isUpsideDown());
+			sum.add(e->getHitpoints());
+		}
+
+		return sum.get();
+	}
+
+	double percentile(const std::vector<double>& sorted, double p)
+	{
+		const size_t index = std::min(sorted.size() - 1, static_cast<size_t>(p*sorted.size()));
+		return sorted[index];
+	}
+}
+
+//Runs a level for a number of cycles without drawing it, feeding players
+//the controls from a recorded stream, and prints how long each cycle took
+//along with a checksum of the game state after it. With --draw each cycle
+//is also drawn, along with how many sprites were batched into how many
+//draw calls, and when run with --renderer=null the work each frame gave
+//the display device is printed too.
+//
+//Levels need the game window and display device, so this runs once they
+//are set up. To run without a display, e.g. on a build server, use the
+//null display device and SDL's dummy video driver:
+//  SDL_VIDEODRIVER=dummy anura --renderer=null --utility=simulate_level <level>
+UTILITY(simulate_level)
+{
+	std::string level_file, controls_file;
+	int max_cycles = -1;
+	bool draw = false;
+	for(const std::string& arg : args) {
+		if(arg == "--draw") {
+			draw = true;
+		} else if(arg.substr(0, 9) == "--cycles=") {
+			max_cycles = atoi(arg.c_str() + 9);
+		} else if(arg.substr(0, 11) == "--controls=") {
+			controls_file = arg.substr(11);
+		} else if(level_file.empty()) {
+			level_file = arg;
+		} else {
+			level_file.clear();
+			break;
+		}
+	}
+
+	if(level_file.empty()) {
+		std::cerr << "simulate_level usage: <level> [--cycles=N] [--controls=FILE] [--draw]\n"
+		             "  FILE holds control packets, each preceded by its length as a\n"
+		             "  32-bit big-endian integer. Without it players press nothing.\n"
+		             "  --draw also draws every cycle. Run with --renderer=null to get\n"
+		             "  counts of draw calls, vertices, texture and shader switches and\n"
+		             "  uploaded bytes for each frame.\n"
+		             "  To run without a display, set SDL_VIDEODRIVER=dummy and use\n"
+		             "  --renderer=null, since the game window is still created.\n";
+		return;
+	}
+
+	ffl::IntrusivePtr<Level> lvl(new Level(level_file));
+	lvl->finishLoading();
+	lvl->setAsCurrentLevel();
+
+	const int starting_cycle = lvl->cycle();
+
+	std::vector<ControlPacket> packets;
+	if(controls_file.empty() == false) {
+		packets = read_control_stream(controls_file);
+	}
+
+	int nplayers = std::max<int>(1, static_cast<int>(lvl->players().size()));
+	for(const ControlPacket& packet : packets) {
+		nplayers = std::max(nplayers, packet.slot + 1);
+	}
+
+	//Every player's controls come from packets, so there is no local player.
+	controls::new_level(starting_cycle, nplayers, nplayers);
+
+	//Controls for a cycle are read on the cycle after it, so every player's
+	//controls need to be known up to one cycle before the last one run.
+	int last_cycle = -1;
+	if(packets.empty()) {
+		last_cycle = starting_cycle + (max_cycles >= 0 ? max_cycles : 1000);
+		for(int slot = 0; slot != nplayers; ++slot) {
+			packets.push_back(make_idle_packet(slot, starting_cycle, last_cycle - 1));
+		}
+	} else {
+		for(int slot = 0; slot != nplayers; ++slot) {
+			int slot_end = -1;
+			for(const ControlPacket& packet : packets) {
+				if(packet.slot == slot) {
+					slot_end = std::max(slot_end, packet.cycle + 1);
+				}
+			}
+
+			ASSERT_LOG(slot_end != -1, "No controls recorded for player " << slot);
+			if(last_cycle == -1 || slot_end < last_cycle) {
+				last_cycle = slot_end;
+			}
+		}
+
+		if(max_cycles >= 0) {
+			last_cycle = std::min(last_cycle, starting_cycle + max_cycles);
+		}
+	}
+
+	auto wnd = KRE::WindowManager::getMainWindow();
+	const bool count_draws = draw && KRE::DisplayDevice::getCurrent()->ID() == KRE::DisplayDevice::DISPLAY_DEVICE_NULL;
+
+	std::vector<double> cycle_us, draw_us;
+	KRE::RenderStats draw_totals;
+	SpriteBatch::Stats batch_totals;
+	std::vector<ControlPacket>::const_iterator next_packet = packets.begin();
+	while(lvl->cycle() < last_cycle) {
+		feed_control_packets(packets, next_packet, lvl->cycle() + 1);
+
+		profile::timer timer;
+		lvl->do_processing();
+		cycle_us.push_back(timer.get_time());
+
+		std::cout << "cycle " << lvl->cycle() << " " << std::fixed << std::setprecision(1) << cycle_us.back() << "us checksum " << std::hex << std::setw(8) << std::setfill('0') << level_state_checksum(*lvl) << std::dec << std::setfill(' ');
+
+		if(draw) {
+			KRE::DisplayDeviceNull::resetStats();
+			SpriteBatch::resetStats();
+
+			profile::timer draw_timer;
+			wnd->clear(KRE::ClearFlags::ALL);
+			draw_scene(*lvl, last_draw_position());
+			wnd->swap();
+			draw_us.push_back(draw_timer.get_time());
+
+			const SpriteBatch::Stats& batch_stats = SpriteBatch::getStats();
+			std::cout << " draw " << draw_us.back() << "us"
+			          << " batched " << batch_stats.sprites << " sprites in " << batch_stats.draw_calls << " calls";
+			batch_totals.sprites += batch_stats.sprites;
+			batch_totals.draw_calls += batch_stats.draw_calls;
+			if(count_draws) {
+				const KRE::RenderStats& stats = KRE::DisplayDeviceNull::getStats();
+				std::cout << " calls " << stats.draw_calls
+				          << " vertices " << stats.vertices
+				          << " textures " << stats.texture_switches
+				          << " shaders " << stats.shader_switches
+				          << " uploaded " << stats.uploaded_bytes;
+
+				draw_totals.draw_calls += stats.draw_calls;
+				draw_totals.vertices += stats.vertices;
+				draw_totals.texture_switches += stats.texture_switches;
+				draw_totals.shader_switches += stats.shader_switches;
+				draw_totals.uploaded_bytes += stats.uploaded_bytes;
+				draw_totals.frames += stats.frames;
+			}
+		}
+
+		std::cout << "\n";
+	}
+
+	if(cycle_us.empty()) {
+		std::cout << "no cycles run\n";
+		return;
+	}
+
+	std::vector<double> sorted = cycle_us;
+	std::sort(sorted.begin(), sorted.end());
+
+	double total = 0.0;
+	for(double t : sorted) {
+		total += t;
+	}
+
+	std::cout << "cycles: " << sorted.size()
+	          << " mean: " << (total/sorted.size()) << "us"
+	          << " p50: " << percentile(sorted, 0.5) << "us"
+	          << " p90: " << percentile(sorted, 0.9) << "us"
+	          << " p99: " << percentile(sorted, 0.99) << "us"
+	          << " max: " << sorted.back() << "us\n";
+	if(draw_us.empty() == false) {
+		std::sort(draw_us.begin(), draw_us.end());
+		total = 0.0;
+		for(double t : draw_us) {
+			total += t;
+		}
+
+		std::cout << "draw mean: " << (total/draw_us.size()) << "us"
+		          << " p50: " << percentile(draw_us, 0.5) << "us"
+		          << " p90: " << percentile(draw_us, 0.9) << "us"
+		          << " p99: " << percentile(draw_us, 0.99) << "us"
+		          << " max: " << draw_us.back() << "us\n";
+		std::cout << "batched sprites: " << batch_totals.sprites
+		          << " in draw calls: " << batch_totals.draw_calls << "\n";
+	}
+
+	if(draw_totals.frames > 0) {
+		std::cout << "per frame: calls " << (draw_totals.draw_calls/draw_totals.frames)
+		          << " vertices " << (draw_totals.vertices/draw_totals.frames)
+		          << " textures " << (draw_totals.texture_switches/draw_totals.frames)
+		          << " shaders " << (draw_totals.shader_switches/draw_totals.frames)
+		          << " uploaded " << (draw_totals.uploaded_bytes/draw_totals.frames) << "\n";
+	}
+
+	std::cout << "checksum mismatches: " << controls::num_checksum_mismatches() << "\n";
+}
+
+UNIT_TEST(simulate_level_idle_controls)
+{
+	//With no controls file every player gets one idle packet covering the
+	//whole run, which has to be fed before the first cycle reads it.
+	const int starting_cycle = 10, last_cycle = 20, nplayers = 2;
+	controls::new_level(starting_cycle, nplayers, nplayers);
+
+	std::vector<ControlPacket> packets;
+	for(int slot = 0; slot != nplayers; ++slot) {
+		packets.push_back(make_idle_packet(slot, starting_cycle, last_cycle - 1));
+	}
+
+	std::vector<ControlPacket>::const_iterator next_packet = packets.begin();
+	for(int cycle = starting_cycle + 1; cycle <= last_cycle; ++cycle) {
+		feed_control_packets(packets, next_packet, cycle);
+		for(int slot = 0; slot != nplayers; ++slot) {
+			bool output[controls::NUM_CONTROLS];
+			const std::string* user = nullptr;
+			controls::get_controlStatus(cycle, slot, output, &user);
+			for(bool pressed : output) {
+				CHECK_EQ(pressed, false);
+			}
+
+			CHECK(user != nullptr && user->empty(), "no user string for cycle " << cycle);
+		}
+	}
+
+	CHECK(next_packet == packets.end(), "idle packets left unfed");
+	controls::new_level(0, 1, 0);
+}
@@ -1846,6 +1846,15 @@ const std::string& variant::as_string() const
 	return string_->str;
 }
 
+const std::string* variant::translated_from() const
+{
+	if(type_ != VARIANT_TYPE_STRING || string_->translated_from.empty()) {
+		return nullptr;
+	}
+
+	return &string_->translated_from;
+}
+
 boost::uuids::uuid variant::as_callable_loading() const
 {
 	must_be(VARIANT_TYPE_CALLABLE_LOADING);
@@ -2871,130 +2880,242 @@ std::string variant::to_debug_string(std::vector<const game_logic::FormulaCallab
 	return s.str();
 }
 
-std::string variant::write_json(bool pretty, unsigned int flags) const
+namespace
 {
-	std::ostringstream s;
+	void append_int(std::string& out, int64_t n)
+	{
+		char buf[24];
+		char* p = buf + sizeof(buf);
+		uint64_t u = n < 0 ? 0 - static_cast<uint64_t>(n) : static_cast<uint64_t>(n);
+		do {
+			*--p = static_cast<char>('0' + u%10);
+			u /= 10;
+		} while(u);
+
+		if(n < 0) {
+			*--p = '-';
+		}
+
+		out.append(p, buf + sizeof(buf));
+	}
+
+	//Same format as operator<<(std::ostream&, decimal): at least one
+	//fractional digit, with trailing zeros removed.
+	void append_decimal(std::string& out, int64_t value)
+	{
+		if(value < 0) {
+			out.push_back('-');
+		}
+
+		const uint64_t abs_value = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+		append_int(out, static_cast<int64_t>(abs_value/VARIANT_DECIMAL_PRECISION));
+		out.push_back('.');
+
+		char frac[DECIMAL_PLACES];
+		uint64_t f = abs_value%VARIANT_DECIMAL_PRECISION;
+		for(int n = DECIMAL_PLACES-1; n >= 0; --n) {
+			frac[n] = static_cast<char>('0' + f%10);
+			f /= 10;
+		}
+
+		int len = DECIMAL_PLACES;
+		while(len > 1 && frac[len-1] == '0') {
+			--len;
+		}
+
+		out.append(frac, frac + len);
+	}
+
+	//Tables of which characters need a backslash in front of them, for
+	//each kind of string delimiter and with or without JSON_COMPLIANT.
+	struct EscapeTable
+	{
+		EscapeTable(char delim, bool compliant) {
+			memset(needs_escape, 0, sizeof(needs_escape));
+			needs_escape[static_cast<unsigned char>('\\')] = true;
+			needs_escape[static_cast<unsigned char>(delim)] = true;
+			if(compliant) {
+				needs_escape[static_cast<unsigned char>('\n')] = true;
+			}
+		}
+
+		bool needs_escape[256];
+	};
+
+	void append_escaped(std::string& out, const std::string& str, char delim, bool compliant)
+	{
+		static const EscapeTable tables[2][2] = {
+			{ EscapeTable('"', false), EscapeTable('"', true) },
+			{ EscapeTable('~', false), EscapeTable('~', true) },
+		};
+
+		const EscapeTable& table = tables[delim == '~' ? 1 : 0][compliant ? 1 : 0];
+
+		out.push_back(delim);
+
+		//Most strings need no escaping, so copy the longest run that
+		//doesn't need it in one go.
+		const char* i = str.data();
+		const char* end = i + str.size();
+		while(i != end) {
+			const char* run_end = i;
+			while(run_end != end && !table.needs_escape[static_cast<unsigned char>(*run_end)]) {
+				++run_end;
+			}
+
+			out.append(i, run_end);
+			if(run_end == end) {
+				break;
+			}
+
+			if(*run_end == '\n') {
+				out += "\\n";
+			} else {
+				out.push_back('\\');
+				out.push_back(*run_end);
+			}
+
+			i = run_end + 1;
+		}
+
+		out.push_back(delim);
+	}
+
+	void append_key_formula(std::string& out, const std::string& str)
+	{
+		if(str.size() >= 7 && std::equal(str.begin(), str.begin() + 7, "\"@eval ")) {
+			out += str;
+		} else {
+			out += "\"@eval ";
+			for(char c : str) {
+				if(c == '"' || c == '\\') {
+					out.push_back('\\');
+				}
+				out.push_back(c);
+			}
+			out.push_back('"');
+		}
+	}
+}
+
+std::string variant::write_json(bool pretty, unsigned int flags, size_t size_hint) const
+{
+	std::string result;
+	append_json(result, pretty, flags, size_hint);
+	return result;
+}
+
+void variant::write_json(std::ostream& s, unsigned int flags) const
+{
+	std::string str;
+	append_json_compact(str, flags);
+	s.write(str.data(), str.size());
+}
+
+void variant::append_json(std::string& out, bool pretty, unsigned int flags, size_t size_hint) const
+{
+	if(size_hint) {
+		out.reserve(out.size() + size_hint);
+	}
+
 	if(pretty) {
-		write_json_pretty(s, "", flags);
+		std::string indent;
+		append_json_pretty(out, indent, flags);
 	} else {
-		write_json(s, flags);
+		append_json_compact(out, flags);
 	}
-	return s.str();
 }
 
-void variant::write_json(std::ostream& s, unsigned int flags) const
+void variant::append_map_key_json(std::string& out, bool pretty, unsigned int flags) const
+{
+	if(is_string()) {
+		append_escaped(out, string_->str, '"', false);
+	} else {
+		std::string str;
+		append_json(str, pretty, flags);
+		append_key_formula(out, str);
+	}
+}
+
+void variant::append_json_compact(std::string& out, unsigned int flags) const
 {
 	switch(type_) {
-	case VARIANT_TYPE_NULL: {
-		s << "null";
+	case VARIANT_TYPE_NULL:
+		out += "null";
 		return;
-	}
 	case VARIANT_TYPE_BOOL:
-		s << (bool_value_ ? "true" : "false");
-		break;
-	case VARIANT_TYPE_INT: {
-		s << as_int();
+		out += bool_value_ ? "true" : "false";
 		return;
-	}
-	case VARIANT_TYPE_ENUM: {
-		s << "\"@eval enum " << g_enum_vector[int_value_] << "\"";
+	case VARIANT_TYPE_INT:
+		append_int(out, int_value_);
 		return;
-	}
-	case VARIANT_TYPE_DECIMAL: {
-		s << decimal::from_raw_value(decimal_value_);
+	case VARIANT_TYPE_ENUM:
+		out += "\"@eval enum ";
+		out += g_enum_vector[int_value_];
+		out.push_back('"');
+		return;
+	case VARIANT_TYPE_DECIMAL:
+		append_decimal(out, decimal_value_);
 		return;
-	}
 	case VARIANT_TYPE_MAP: {
-		s << "{";
+		out.push_back('{');
 		for(std::map<variant,variant>::const_iterator i = map_->elements.begin(); i != map_->elements.end(); ++i) {
 			if(i != map_->elements.begin()) {
-				s << ',';
+				out.push_back(',');
 			}
 
-			if(i->first.is_string()) {
-				std::string str = i->first.string_cast();
-				boost::replace_all(str, "\"", "\\\"");
-				boost::replace_all(str, "\\", "\\\\");
-				s << '"' << str << "\":";
-			} else {
-				std::string str = i->first.write_json(true, flags);
-
-				if (str.size() >= 7 && std::equal(str.begin(), str.begin() + 7, "\"@eval ")) {
-					s << str << ":";
-				}
-				else {
-					boost::replace_all(str, "\"", "\\\"");
-					s << "\"@eval " << str << "\":";
-				}
-			}
-
-			i->second.write_json(s, flags);
+			i->first.append_map_key_json(out, true, flags);
+			out.push_back(':');
+			i->second.append_json_compact(out, flags);
 		}
 
-		s << "}";
+		out.push_back('}');
 		return;
 	}
 	case VARIANT_TYPE_LIST: {
-		s << "[";
+		out.push_back('[');
 
 		if(list_ != nullptr) {
 			for(std::vector<variant>::const_iterator i = list_->begin;
 			    i != list_->end; ++i) {
 				if(i != list_->begin) {
-					s << ',';
+					out.push_back(',');
 				}
 
-				i->write_json(s, flags);
+				i->append_json_compact(out, flags);
 			}
 		}
 
-		s << "]";
+		out.push_back(']');
 		return;
 	}
 	case VARIANT_TYPE_STRING: {
-		const std::string& str = string_->translated_from.empty() ? string_->str : string_->translated_from;
-		const char delim = string_->translated_from.empty() ? '"' : '~';
-		if(std::count(str.begin(), str.end(), '\\')
-			|| std::count(str.begin(), str.end(), delim)
-			|| ((flags&JSON_COMPLIANT) && std::count(str.begin(), str.end(), '\n'))) {
-			//escape the string
-			s << delim;
-			for(std::string::const_iterator i = str.begin(); i != str.end(); ++i) {
-				if(*i == '\\' || *i == delim) {
-					s << '\\';
-				}
-
-				if((flags&JSON_COMPLIANT) && *i == '\n') {
-					s << "\\n";
-				} else {
-					s << *i;
-				}
-			}
-			s << delim;
-		} else {
-			s << delim << string_->str << delim;
-		}
+		const bool translated = !string_->translated_from.empty();
+		append_escaped(out, translated ? string_->translated_from : string_->str, translated ? '~' : '"', (flags&JSON_COMPLIANT) != 0);
 		return;
 	}
 	case VARIANT_TYPE_CALLABLE: {
-		std::string str;
-		serializeToString(str);
-		s << "\"@eval " << str << "\"";
+		out += "\"@eval ";
+		serializeToString(out);
+		out.push_back('"');
 		return;
 	}
 	case VARIANT_TYPE_FUNCTION: {
+		std::ostringstream s;
 		s << "\"@eval ";
 		write_function(s);
 		s << "\"";
+		out += s.str();
 		return;
 	}
 	case VARIANT_TYPE_GENERIC_FUNCTION: {
 		//TODO: implement serialization of generic functions
-		s << "generic_function_serialization_not_implemented";
+		out += "generic_function_serialization_not_implemented";
 		return;
 	}
 
 	case VARIANT_TYPE_MULTI_FUNCTION: {
+		std::ostringstream s;
 		s << "\"@eval overload(";
 		for(int n = 0; n != multi_fn_->functions.size(); ++n) {
 			const variant& v = multi_fn_->functions[n];
@@ -3005,11 +3126,12 @@ void variant::write_json(std::ostream& s, unsigned int flags) const
 		}
 
 		s << ")\"";
+		out += s.str();
 		return;
 	}
 	default:
 		LOG_ERROR("Illegal type to serialize: " << to_debug_string());
-		s << "q(ILLEGAL TYPE TO SERIALIZE: " << to_debug_string() << ")";
+		out += "q(ILLEGAL TYPE TO SERIALIZE: " + to_debug_string() + ")";
 		return;
 	}
 }
@@ -3052,41 +3174,35 @@ void variant::write_function(std::ostream& s) const
 }
 
 void variant::write_json_pretty(std::ostream& s, std::string indent, unsigned int flags) const
+{
+	std::string str;
+	append_json_pretty(str, indent, flags);
+	s.write(str.data(), str.size());
+}
+
+void variant::append_json_pretty(std::string& out, std::string& indent, unsigned int flags) const
 {
 	switch(type_) {
 	case VARIANT_TYPE_MAP: {
-		s << "{";
+		out.push_back('{');
 		indent += "\t";
 		for(std::map<variant,variant>::const_iterator i = map_->elements.begin(); i != map_->elements.end(); ++i) {
 			if(i != map_->elements.begin()) {
-				s << ',';
+				out.push_back(',');
 			}
 
-			s << "\n" << indent;
-			if(i->first.is_string()) {
-				std::string str = i->first.string_cast();
-				boost::replace_all(str, "\"", "\\\"");
-				boost::replace_all(str, "\\", "\\\\");
-				s << '"' << str << "\": ";
-			}
-			else {
-				std::string str = i->first.write_json(true, flags);
-
-				if (str.size() >= 7 && std::equal(str.begin(), str.begin() + 7, "\"@eval ")) {
-					s << str << ": ";
-				}
-				else {
-					boost::replace_all(str, "\"", "\\\"");
-					boost::replace_all(str, "\\", "\\\\");
-					s << "\"@eval " << str << "\": ";
-				}
-			}
+			out.push_back('\n');
+			out += indent;
+			i->first.append_map_key_json(out, true, flags);
+			out += ": ";
 
-			i->second.write_json_pretty(s, indent, flags);
+			i->second.append_json_pretty(out, indent, flags);
 		}
 		indent.resize(indent.size()-1);
 
-		s << "\n" << indent << "}";
+		out.push_back('\n');
+		out += indent;
+		out.push_back('}');
 		return;
 	}
 	case VARIANT_TYPE_LIST: {
@@ -3103,40 +3219,40 @@ void variant::write_json_pretty(std::ostream& s, std::string indent, unsigned in
 
 		const bool expanded = list_ && list_->begin != list_->end && (flags&EXPANDED_LISTS);
 		if(!found_non_scalar && !expanded) {
-			write_json(s, flags);
+			append_json_compact(out, flags);
 			return;
 		}
 
-
-		s << "[";
+		out.push_back('[');
 
 		indent += "\t";
 		if(list_ != nullptr) {
 			for(std::vector<variant>::const_iterator i = list_->begin;
 			    i != list_->end; ++i) {
 				if(i != list_->begin) {
-					s << ',';
+					out.push_back(',');
 				}
 
-				s << "\n" << indent;
+				out.push_back('\n');
+				out += indent;
 
-				i->write_json_pretty(s, indent, flags);
+				i->append_json_pretty(out, indent, flags);
 			}
 		}
 
 		indent.resize(indent.size()-1);
 
 		if(list_ && list_->size() > 0) {
-			s << "\n" << indent << "]";
-		} else {
-			s << "]";
+			out.push_back('\n');
+			out += indent;
 		}
 
+		out.push_back(']');
 		return;
 	}
 
 	default:
-		write_json(s, flags);
+		append_json_compact(out, flags);
 		break;
 	}
 }
@@ -3218,6 +3334,89 @@ BENCHMARK(variant_assign)
 	}
 }
 
+UNIT_TEST(variant_write_json)
+{
+	const int64_t decimals[] = { 0, 1, -1, 500000, -500000, 9876000, -12345678, 1000000 };
+	for(int64_t value : decimals) {
+		std::ostringstream s;
+		s << decimal::from_raw_value(value);
+		CHECK_EQ(variant(value, variant::DECIMAL_VARIANT).write_json(false), s.str());
+	}
+
+	CHECK_EQ(variant(-2147483647 - 1).write_json(false), "-2147483648");
+
+	std::map<variant,variant> m;
+	m[variant("a\"b")] = variant("x\\y\nz");
+	m[variant(5)] = variant::create_translated_string("hello", "bonjour");
+	std::vector<variant> items;
+	items.push_back(variant(&m));
+	items.push_back(variant(0));
+	const variant v(&items);
+
+	CHECK_EQ(v.write_json(false), "[{\"@eval 5\":~hello~,\"a\\\"b\":\"x\\\\y\nz\"},0]");
+	CHECK_EQ(v.write_json(false, variant::JSON_COMPLIANT), "[{\"@eval 5\":~hello~,\"a\\\"b\":\"x\\\\y\\nz\"},0]");
+	CHECK_EQ(v.write_json(true), "[\n\t{\n\t\t\"@eval 5\": ~hello~,\n\t\t\"a\\\"b\": \"x\\\\y\nz\"\n\t},\n\t0\n]");
+
+	std::string buf = "prefix ";
+	variant(4).append_json(buf);
+	CHECK_EQ(buf, "prefix 4");
+}
+
+namespace
+{
+	//Something shaped like the state of a large tbs game.
+	variant make_json_benchmark_doc()
+	{
+		std::vector<variant> units;
+		for(int n = 0; n != 2000; ++n) {
+			std::map<variant,variant> unit;
+			unit[variant("id")] = variant(n);
+			unit[variant("type")] = variant("spearman");
+			unit[variant("name")] = variant(formatter() << "Unit number " << n);
+			unit[variant("x")] = variant(n%64);
+			unit[variant("y")] = variant(n/64);
+			unit[variant("hitpoints")] = variant(int64_t(n*12345), variant::DECIMAL_VARIANT);
+			std::vector<variant> abilities;
+			abilities.push_back(variant("charge"));
+			abilities.push_back(variant("first_strike"));
+			unit[variant("abilities")] = variant(&abilities);
+			units.push_back(variant(&unit));
+		}
+
+		std::map<variant,variant> doc;
+		doc[variant("units")] = variant(&units);
+		doc[variant("turn")] = variant(42);
+		return variant(&doc);
+	}
+}
+
+BENCHMARK(variant_write_json_ostream)
+{
+	const variant doc = make_json_benchmark_doc();
+	BENCHMARK_LOOP {
+		std::ostringstream s;
+		doc.write_json(s);
+	}
+}
+
+BENCHMARK(variant_write_json_string)
+{
+	const variant doc = make_json_benchmark_doc();
+	BENCHMARK_LOOP {
+		doc.write_json(false);
+	}
+}
+
+BENCHMARK(variant_append_json_reused_buffer)
+{
+	const variant doc = make_json_benchmark_doc();
+	std::string buf;
+	BENCHMARK_LOOP {
+		buf.clear();
+		doc.append_json(buf);
+	}
+}
+
 /**  Log (debug) unit test variable name and value. */
 #define LOG_DEBUG_UT_VAR(test_name, variable_suffix, variable_name)         \
 	LOG_DEBUG(                                                          \
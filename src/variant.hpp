@@ -384,6 +384,10 @@ public:
 	std::string as_string_default(const char* default_value=nullptr) const;
 	const std::string& as_string() const;
 
+	//if this is a string created by create_translated_string(), gives the
+	//untranslated original, otherwise gives nullptr.
+	const std::string* translated_from() const;
+
 	bool is_callable() const { return type_ == VARIANT_TYPE_CALLABLE; }
 	const game_logic::FormulaCallable* as_callable() const {
 		must_be(VARIANT_TYPE_CALLABLE); return callable_; }
@@ -445,10 +449,15 @@ public:
 		JSON_COMPLIANT = 1,
 		EXPANDED_LISTS = 2,
 	};
-	std::string write_json(bool pretty=true, unsigned int flags=FSON_MODE) const;
+	std::string write_json(bool pretty=true, unsigned int flags=FSON_MODE, size_t size_hint=0) const;
 	void write_json(std::ostream& s, unsigned int flags=FSON_MODE) const;
 	void write_json_pretty(std::ostream& s, std::string indent, unsigned int flags=FSON_MODE) const;
 
+	//Appends the JSON for this variant to out, keeping what is already
+	//there, so that code writing many documents can reuse one buffer.
+	//size_hint is the expected size of the output, if known.
+	void append_json(std::string& out, bool pretty=false, unsigned int flags=FSON_MODE, size_t size_hint=0) const;
+
 	enum TYPE { VARIANT_TYPE_NULL, VARIANT_TYPE_BOOL, VARIANT_TYPE_INT, VARIANT_TYPE_DECIMAL, VARIANT_TYPE_CALLABLE, VARIANT_TYPE_CALLABLE_LOADING, VARIANT_TYPE_LIST, VARIANT_TYPE_STRING, VARIANT_TYPE_MAP, VARIANT_TYPE_FUNCTION, VARIANT_TYPE_GENERIC_FUNCTION, VARIANT_TYPE_MULTI_FUNCTION, VARIANT_TYPE_DELAYED, VARIANT_TYPE_WEAK, VARIANT_TYPE_ENUM, VARIANT_TYPE_INVALID };
 	TYPE type() const { return type_; }
 
@@ -515,6 +524,10 @@ private:
 
 	void increment_refcount();
 	void release();
+
+	void append_json_compact(std::string& out, unsigned int flags) const;
+	void append_json_pretty(std::string& out, std::string& indent, unsigned int flags) const;
+	void append_map_key_json(std::string& out, bool pretty, unsigned int flags) const;
 };
 
 std::ostream& operator<<(std::ostream& os, const variant& v);
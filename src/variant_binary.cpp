@@ -0,0 +1,620 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#include "asserts.hpp"
+#include "filesystem.hpp"
+#include "formatter.hpp"
+#include "formula.hpp"
+#include "unit_test.hpp"
+#include "variant_binary.hpp"
+#include "wml_formula_callable.hpp"
+
+namespace variant_binary
+{
+	namespace
+	{
+		const char Magic[] = { 'F', 'F', 'L', 'B' };
+		const size_t HeaderSize = sizeof(Magic) + 1;
+
+		//Lists and maps record the size of their contents in a fixed width
+		//field so that it can be filled in once the contents are written.
+		const size_t ContainerSizeBytes = 4;
+
+		const size_t UuidBytes = 16;
+
+		void put_varint(std::string& out, uint64_t n)
+		{
+			while(n >= 0x80) {
+				out.push_back(static_cast<char>((n & 0x7f) | 0x80));
+				n >>= 7;
+			}
+
+			out.push_back(static_cast<char>(n));
+		}
+
+		uint64_t zigzag_encode(int64_t n)
+		{
+			return (static_cast<uint64_t>(n) << 1) ^ static_cast<uint64_t>(n >> 63);
+		}
+
+		int64_t zigzag_decode(uint64_t n)
+		{
+			return static_cast<int64_t>(n >> 1) ^ -static_cast<int64_t>(n & 1);
+		}
+
+		void check_available(const char* pos, const char* end, size_t nbytes)
+		{
+			if(pos > end || static_cast<size_t>(end - pos) < nbytes) {
+				throw json::ParseError("Unexpected end of binary document");
+			}
+		}
+
+		uint64_t read_varint(const char*& pos, const char* end)
+		{
+			uint64_t result = 0;
+			for(int shift = 0; shift < 64; shift += 7) {
+				check_available(pos, end, 1);
+				const uint8_t c = static_cast<uint8_t>(*pos++);
+				result |= static_cast<uint64_t>(c & 0x7f) << shift;
+				if((c & 0x80) == 0) {
+					return result;
+				}
+			}
+
+			throw json::ParseError("Malformed integer in binary document");
+		}
+
+		uint32_t read_uint32(const char*& pos, const char* end)
+		{
+			check_available(pos, end, ContainerSizeBytes);
+			uint32_t result = 0;
+			for(size_t n = 0; n != ContainerSizeBytes; ++n) {
+				result |= static_cast<uint32_t>(static_cast<uint8_t>(pos[n])) << (n*8);
+			}
+
+			pos += ContainerSizeBytes;
+			return result;
+		}
+
+		TAG read_tag(const char*& pos, const char* end)
+		{
+			check_available(pos, end, 1);
+			const uint8_t tag = static_cast<uint8_t>(*pos++);
+			if(tag >= static_cast<uint8_t>(TAG::NUM_TAGS)) {
+				throw json::ParseError(formatter() << "Unknown value tag in binary document: " << static_cast<int>(tag));
+			}
+
+			return static_cast<TAG>(tag);
+		}
+
+		class Writer
+		{
+		public:
+			void write(const variant& v) {
+				switch(v.type()) {
+				case variant::VARIANT_TYPE_NULL:
+					putTag(TAG::NUL);
+					break;
+				case variant::VARIANT_TYPE_BOOL:
+					putTag(v.as_bool() ? TAG::TRUE_VALUE : TAG::FALSE_VALUE);
+					break;
+				case variant::VARIANT_TYPE_INT:
+					putTag(TAG::INT);
+					put_varint(body_, zigzag_encode(v.as_int()));
+					break;
+				case variant::VARIANT_TYPE_DECIMAL:
+					putTag(TAG::DECIMAL);
+					put_varint(body_, zigzag_encode(v.as_decimal().value()));
+					break;
+				case variant::VARIANT_TYPE_STRING: {
+					const std::string* original = v.translated_from();
+					if(original) {
+						putTag(TAG::TRANSLATED_STRING);
+						putString(*original);
+					} else {
+						putTag(TAG::STRING);
+						putString(v.as_string());
+					}
+					break;
+				}
+				case variant::VARIANT_TYPE_ENUM:
+					putTag(TAG::ENUM);
+					putString(v.as_enum());
+					break;
+				case variant::VARIANT_TYPE_LIST: {
+					const int count = v.num_elements();
+					const size_t size_pos = beginContainer(TAG::LIST, count);
+					for(int n = 0; n != count; ++n) {
+						write(v[n]);
+					}
+					endContainer(size_pos);
+					break;
+				}
+				case variant::VARIANT_TYPE_MAP: {
+					const std::map<variant,variant>& m = v.as_map();
+					const size_t size_pos = beginContainer(TAG::MAP, static_cast<int>(m.size()));
+					for(const auto& p : m) {
+						write(p.first);
+						write(p.second);
+					}
+					endContainer(size_pos);
+					break;
+				}
+				case variant::VARIANT_TYPE_CALLABLE: {
+					const game_logic::WmlSerializableFormulaCallable* obj = v.try_convert<game_logic::WmlSerializableFormulaCallable>();
+					if(obj) {
+						putUuid(obj->uuid());
+					} else {
+						std::string str;
+						v.serializeToString(str);
+						putTag(TAG::FORMULA);
+						putString(str);
+					}
+					break;
+				}
+				case variant::VARIANT_TYPE_CALLABLE_LOADING:
+					putUuid(v.as_callable_loading());
+					break;
+				default: {
+					//Functions and anything else FSON can only express as a
+					//formula to be evaluated.
+					const std::string json = v.write_json(false);
+					const std::string prefix = "\"@eval ";
+					ASSERT_LOG(json.size() > prefix.size() && std::equal(prefix.begin(), prefix.end(), json.begin()) && json[json.size()-1] == '"',
+					           "Cannot write value of type " << variant::variant_type_to_string(v.type()) << " to a binary document");
+					putTag(TAG::FORMULA);
+					putString(std::string(json.begin() + prefix.size(), json.end() - 1));
+					break;
+				}
+				}
+			}
+
+			void finish(std::string* out) const {
+				out->append(Magic, Magic + sizeof(Magic));
+				out->push_back(static_cast<char>(FORMAT_VERSION));
+				put_varint(*out, strings_.size());
+				for(const std::string* s : strings_) {
+					put_varint(*out, s->size());
+					out->append(*s);
+				}
+
+				out->append(body_);
+			}
+
+		private:
+			void putTag(TAG tag) {
+				body_.push_back(static_cast<char>(tag));
+			}
+
+			void putString(const std::string& s) {
+				auto itor = string_index_.find(s);
+				if(itor == string_index_.end()) {
+					itor = string_index_.insert(std::make_pair(s, static_cast<uint64_t>(strings_.size()))).first;
+					strings_.push_back(&itor->first);
+				}
+
+				put_varint(body_, itor->second);
+			}
+
+			void putUuid(const boost::uuids::uuid& id) {
+				putTag(TAG::OBJECT_REF);
+				body_.append(reinterpret_cast<const char*>(id.data), UuidBytes);
+			}
+
+			size_t beginContainer(TAG tag, int count) {
+				putTag(tag);
+				put_varint(body_, count);
+				const size_t size_pos = body_.size();
+				body_.append(ContainerSizeBytes, '\0');
+				return size_pos;
+			}
+
+			void endContainer(size_t size_pos) {
+				const size_t nbytes = body_.size() - size_pos - ContainerSizeBytes;
+				ASSERT_LOG(nbytes <= 0xffffffffu, "List or map too large for a binary document");
+				for(size_t n = 0; n != ContainerSizeBytes; ++n) {
+					body_[size_pos + n] = static_cast<char>((nbytes >> (n*8)) & 0xff);
+				}
+			}
+
+			std::string body_;
+
+			//Distinct strings in order of first use. Points at the keys of
+			//string_index_, which never move.
+			std::vector<const std::string*> strings_;
+			std::unordered_map<std::string, uint64_t> string_index_;
+		};
+	}
+
+	bool is_binary(const char* begin, const char* end)
+	{
+		return static_cast<size_t>(end - begin) >= HeaderSize && std::equal(Magic, Magic + sizeof(Magic), begin);
+	}
+
+	bool is_binary(const std::string& data)
+	{
+		return is_binary(data.data(), data.data() + data.size());
+	}
+
+	void write_binary(const variant& v, std::string* out)
+	{
+		Writer writer;
+		writer.write(v);
+		writer.finish(out);
+	}
+
+	std::string write_binary(const variant& v)
+	{
+		std::string result;
+		write_binary(v, &result);
+		return result;
+	}
+
+	variant parse_binary(const char* begin, const char* end, json::JSON_PARSE_OPTIONS options)
+	{
+		const Document doc(begin, end);
+		return doc.root().to_variant(options);
+	}
+
+	variant parse_binary(const std::string& data, json::JSON_PARSE_OPTIONS options)
+	{
+		return parse_binary(data.data(), data.data() + data.size(), options);
+	}
+
+	Document::Document(const char* begin, const char* end)
+	  : begin_(begin), end_(end), root_(nullptr)
+	{
+		if(!is_binary(begin, end)) {
+			throw json::ParseError("Not a binary document");
+		}
+
+		const int version = static_cast<uint8_t>(begin[sizeof(Magic)]);
+		if(version > FORMAT_VERSION) {
+			throw json::ParseError(formatter() << "Binary document has format version " << version << ", newer than the supported version " << static_cast<int>(FORMAT_VERSION));
+		}
+
+		const char* pos = begin + HeaderSize;
+		const uint64_t num_strings = read_varint(pos, end);
+		if(num_strings > static_cast<uint64_t>(end - pos)) {
+			throw json::ParseError("Corrupt string table in binary document");
+		}
+
+		strings_.reserve(static_cast<size_t>(num_strings));
+		for(uint64_t n = 0; n != num_strings; ++n) {
+			const uint64_t len = read_varint(pos, end);
+			check_available(pos, end, static_cast<size_t>(len));
+			strings_.push_back(StringRef(pos, static_cast<size_t>(len)));
+			pos += len;
+		}
+
+		root_ = pos;
+		if(skip(root_) != end_) {
+			throw json::ParseError("Trailing data after binary document");
+		}
+	}
+
+	int Document::readCount(const char*& pos) const
+	{
+		const uint64_t count = read_varint(pos, end_);
+
+		//Every element takes at least one byte.
+		if(count > static_cast<uint64_t>(end_ - pos)) {
+			throw json::ParseError("Corrupt element count in binary document");
+		}
+
+		read_uint32(pos, end_);
+		return static_cast<int>(count);
+	}
+
+	StringRef Document::getString(uint64_t index) const
+	{
+		if(index >= strings_.size()) {
+			throw json::ParseError("String index out of range in binary document");
+		}
+
+		return strings_[static_cast<size_t>(index)];
+	}
+
+	const char* Document::skip(const char* pos) const
+	{
+		switch(read_tag(pos, end_)) {
+		case TAG::NUL:
+		case TAG::FALSE_VALUE:
+		case TAG::TRUE_VALUE:
+			return pos;
+		case TAG::INT:
+		case TAG::DECIMAL:
+		case TAG::STRING:
+		case TAG::TRANSLATED_STRING:
+		case TAG::ENUM:
+		case TAG::FORMULA:
+			read_varint(pos, end_);
+			return pos;
+		case TAG::OBJECT_REF:
+			check_available(pos, end_, UuidBytes);
+			return pos + UuidBytes;
+		case TAG::LIST:
+		case TAG::MAP: {
+			read_varint(pos, end_);
+			const uint32_t nbytes = read_uint32(pos, end_);
+			check_available(pos, end_, nbytes);
+			return pos + nbytes;
+		}
+		default:
+			throw json::ParseError("Unknown value tag in binary document");
+		}
+	}
+
+	variant Document::decode(const char*& pos, json::JSON_PARSE_OPTIONS options, std::vector<variant>& string_cache) const
+	{
+		const TAG tag = read_tag(pos, end_);
+		switch(tag) {
+		case TAG::NUL:
+			return variant();
+		case TAG::FALSE_VALUE:
+			return variant::from_bool(false);
+		case TAG::TRUE_VALUE:
+			return variant::from_bool(true);
+		case TAG::INT:
+			return variant(static_cast<int>(zigzag_decode(read_varint(pos, end_))));
+		case TAG::DECIMAL:
+			return variant(zigzag_decode(read_varint(pos, end_)), variant::DECIMAL_VARIANT);
+		case TAG::STRING: {
+			//Repeated strings, such as map keys, share a single copy.
+			const uint64_t index = read_varint(pos, end_);
+			const StringRef s = getString(index);
+			variant& cached = string_cache[static_cast<size_t>(index)];
+			if(cached.is_null()) {
+				cached = variant(s.str());
+			}
+			return cached;
+		}
+		case TAG::TRANSLATED_STRING:
+			return variant::create_translated_string(getString(read_varint(pos, end_)).str());
+		case TAG::ENUM:
+			return variant::create_enum(getString(read_varint(pos, end_)).str());
+		case TAG::FORMULA: {
+			const std::string formula = getString(read_varint(pos, end_)).str();
+			if(options == json::JSON_PARSE_OPTIONS::USE_PREPROCESSOR) {
+				return game_logic::Formula(variant(formula)).execute();
+			}
+			return variant("@eval " + formula);
+		}
+		case TAG::OBJECT_REF: {
+			check_available(pos, end_, UuidBytes);
+			boost::uuids::uuid id;
+			std::copy(pos, pos + UuidBytes, id.data);
+			pos += UuidBytes;
+			return variant::create_variant_under_construction(id);
+		}
+		case TAG::LIST: {
+			const int count = readCount(pos);
+			std::vector<variant> items;
+			items.reserve(count);
+			for(int n = 0; n != count; ++n) {
+				items.push_back(decode(pos, options, string_cache));
+			}
+			return variant(&items);
+		}
+		case TAG::MAP: {
+			const int count = readCount(pos);
+			std::map<variant,variant> items;
+			for(int n = 0; n != count; ++n) {
+				variant key = decode(pos, options, string_cache);
+				variant value = decode(pos, options, string_cache);
+
+				//Keys were written in map order, so each one goes at the end.
+				items.insert(items.end(), std::make_pair(key, value));
+			}
+
+			variant result(&items);
+			if(options == json::JSON_PARSE_OPTIONS::USE_PREPROCESSOR) {
+				game_logic::WmlSerializableFormulaCallable::deserializeObj(result, &result);
+			}
+			return result;
+		}
+		default:
+			throw json::ParseError("Unknown value tag in binary document");
+		}
+	}
+
+	TAG Node::tag() const
+	{
+		ASSERT_LOG(doc_ != nullptr, "Using an invalid binary document node");
+		return static_cast<TAG>(*pos_);
+	}
+
+	bool Node::as_bool() const
+	{
+		ASSERT_LOG(is_bool(), "Binary document value is not a bool");
+		return tag() == TAG::TRUE_VALUE;
+	}
+
+	int Node::as_int() const
+	{
+		ASSERT_LOG(is_int(), "Binary document value is not an int");
+		const char* pos = pos_ + 1;
+		return static_cast<int>(zigzag_decode(read_varint(pos, doc_->end_)));
+	}
+
+	int64_t Node::as_decimal_raw() const
+	{
+		if(is_int()) {
+			return static_cast<int64_t>(as_int())*VARIANT_DECIMAL_PRECISION;
+		}
+
+		ASSERT_LOG(is_decimal(), "Binary document value is not a decimal");
+		const char* pos = pos_ + 1;
+		return zigzag_decode(read_varint(pos, doc_->end_));
+	}
+
+	StringRef Node::as_string() const
+	{
+		ASSERT_LOG(is_string() || tag() == TAG::ENUM || tag() == TAG::FORMULA, "Binary document value is not a string");
+		const char* pos = pos_ + 1;
+		return doc_->getString(read_varint(pos, doc_->end_));
+	}
+
+	boost::uuids::uuid Node::as_uuid() const
+	{
+		ASSERT_LOG(tag() == TAG::OBJECT_REF, "Binary document value is not an object reference");
+		boost::uuids::uuid id;
+		std::copy(pos_ + 1, pos_ + 1 + UuidBytes, id.data);
+		return id;
+	}
+
+	const char* Node::contents(int* count) const
+	{
+		ASSERT_LOG(is_list() || is_map(), "Binary document value is not a list or map");
+		const char* pos = pos_ + 1;
+		*count = static_cast<int>(read_varint(pos, doc_->end_));
+		read_uint32(pos, doc_->end_);
+		return pos;
+	}
+
+	int Node::num_elements() const
+	{
+		int count = 0;
+		contents(&count);
+		return count;
+	}
+
+	Node Node::operator[](int n) const
+	{
+		int count = 0;
+		const char* pos = contents(&count);
+		ASSERT_LOG(n >= 0 && n < count, "Index " << n << " out of range in binary document list of " << count << " elements");
+
+		const int skip_count = is_map() ? n*2 + 1 : n;
+		for(int i = 0; i != skip_count; ++i) {
+			pos = doc_->skip(pos);
+		}
+
+		return Node(doc_, pos);
+	}
+
+	Node Node::key(int n) const
+	{
+		ASSERT_LOG(is_map(), "Binary document value is not a map");
+		int count = 0;
+		const char* pos = contents(&count);
+		ASSERT_LOG(n >= 0 && n < count, "Index " << n << " out of range in binary document map of " << count << " elements");
+
+		for(int i = 0; i != n*2; ++i) {
+			pos = doc_->skip(pos);
+		}
+
+		return Node(doc_, pos);
+	}
+
+	Node Node::operator[](const std::string& key) const
+	{
+		ASSERT_LOG(is_map(), "Binary document value is not a map");
+		int count = 0;
+		const char* pos = contents(&count);
+		for(int n = 0; n != count; ++n) {
+			const Node k(doc_, pos);
+			pos = doc_->skip(pos);
+			if(k.tag() == TAG::STRING && k.as_string() == key) {
+				return Node(doc_, pos);
+			}
+			pos = doc_->skip(pos);
+		}
+
+		return Node();
+	}
+
+	variant Node::to_variant(json::JSON_PARSE_OPTIONS options) const
+	{
+		ASSERT_LOG(doc_ != nullptr, "Using an invalid binary document node");
+		std::vector<variant> string_cache(doc_->strings_.size());
+		const char* pos = pos_;
+		return doc_->decode(pos, options, string_cache);
+	}
+}
+
+COMMAND_LINE_UTILITY(convert_document)
+{
+	std::string in_file, out_file;
+	bool to_binary = true;
+
+	for(auto it = args.begin(); it != args.end(); ++it) {
+		if(*it == "--to-json") {
+			to_binary = false;
+		} else if(*it == "--to-binary") {
+			to_binary = true;
+		} else if(in_file.empty()) {
+			in_file = *it;
+		} else {
+			out_file = *it;
+		}
+	}
+
+	ASSERT_LOG(!in_file.empty() && !out_file.empty(), "Usage: convert_document [--to-binary|--to-json] <input> <output>");
+
+	const std::string data = sys::read_file(in_file);
+	variant doc;
+	if(variant_binary::is_binary(data)) {
+		doc = variant_binary::parse_binary(data, json::JSON_PARSE_OPTIONS::NO_PREPROCESSOR);
+	} else {
+		doc = json::parse(data, json::JSON_PARSE_OPTIONS::NO_PREPROCESSOR);
+	}
+
+	const std::string output = to_binary ? variant_binary::write_binary(doc) : doc.write_json();
+	sys::write_file(out_file, output);
+	LOG_INFO("Converted " << in_file << " (" << data.size() << " bytes) to " << out_file << " (" << output.size() << " bytes)");
+}
+
+UNIT_TEST(variant_binary_round_trip)
+{
+	const variant doc = json::parse("{\"a\": 1, \"b\": -70000, \"c\": 2.5, \"name\": \"hello\", \"list\": [\"hello\", null, true, false, {\"a\": \"x\"}, -0.125]}", json::JSON_PARSE_OPTIONS::NO_PREPROCESSOR);
+
+	const std::string data = variant_binary::write_binary(doc);
+	CHECK_EQ(variant_binary::is_binary(data), true);
+	CHECK_EQ(variant_binary::parse_binary(data) == doc, true);
+
+	//Each distinct string is only stored once.
+	const variant_binary::Document view(data.data(), data.data() + data.size());
+	CHECK_EQ(view.num_strings(), 7);
+
+	const variant_binary::Node root = view.root();
+	CHECK_EQ(root.num_elements(), 5);
+	CHECK_EQ(root["b"].as_int(), -70000);
+	CHECK_EQ(root["c"].as_decimal_raw(), 2*VARIANT_DECIMAL_PRECISION + VARIANT_DECIMAL_PRECISION/2);
+	CHECK_EQ(root["name"].as_string().str(), "hello");
+	CHECK_EQ(root["list"].num_elements(), 6);
+	CHECK_EQ(root["list"][4]["a"].as_string().str(), "x");
+	CHECK_EQ(root["missing"].valid(), false);
+
+	bool threw = false;
+	try {
+		variant_binary::parse_binary(data.substr(0, data.size() - 1));
+	} catch(const json::ParseError&) {
+		threw = true;
+	}
+	CHECK_EQ(threw, true);
+}
@@ -0,0 +1,164 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "json_parser.hpp"
+#include "uuid.hpp"
+#include "variant.hpp"
+
+// A compact binary encoding of variant documents.
+//
+// Layout: a header holding a magic number and the format version, then a
+// table of every distinct string in the document, then the root value.
+// Values are a tag byte followed by their payload. Integers are stored as
+// variable length zig-zag numbers, strings as indexes into the string table,
+// and lists and maps as an element count and the byte length of their
+// contents, so that a reader can skip over them without decoding them.
+//
+// Errors in an encoded document are reported by throwing json::ParseError,
+// so documents in either format can be handled the same way.
+namespace variant_binary
+{
+	enum { FORMAT_VERSION = 1 };
+
+	// True if the data starts with the header of an encoded document.
+	bool is_binary(const char* begin, const char* end);
+	bool is_binary(const std::string& data);
+
+	void write_binary(const variant& v, std::string* out);
+	std::string write_binary(const variant& v);
+
+	// With USE_PREPROCESSOR, maps which describe serializable objects are
+	// turned into those objects and formulas are evaluated, as happens when
+	// FSON is parsed. Otherwise formulas are returned as "@eval" strings.
+	variant parse_binary(const char* begin, const char* end, json::JSON_PARSE_OPTIONS options=json::JSON_PARSE_OPTIONS::USE_PREPROCESSOR);
+	variant parse_binary(const std::string& data, json::JSON_PARSE_OPTIONS options=json::JSON_PARSE_OPTIONS::USE_PREPROCESSOR);
+
+	enum class TAG : uint8_t {
+		NUL, FALSE_VALUE, TRUE_VALUE, INT, DECIMAL, STRING, TRANSLATED_STRING,
+		LIST, MAP, ENUM, OBJECT_REF, FORMULA, NUM_TAGS
+	};
+
+	// A string inside an encoded document. Points into the document's buffer.
+	struct StringRef
+	{
+		StringRef() : data(nullptr), size(0) {}
+		StringRef(const char* d, size_t n) : data(d), size(n) {}
+		std::string str() const { return std::string(data, data + size); }
+		bool operator==(const std::string& s) const { return s.size() == size && std::equal(data, data + size, s.begin()); }
+		bool operator!=(const std::string& s) const { return !(*this == s); }
+
+		const char* data;
+		size_t size;
+	};
+
+	class Document;
+
+	// A value inside a Document. Nothing is decoded until it is asked for,
+	// and strings are handed out as references into the document's buffer.
+	class Node
+	{
+	public:
+		Node() : doc_(nullptr), pos_(nullptr) {}
+
+		bool valid() const { return doc_ != nullptr; }
+		TAG tag() const;
+
+		bool is_null() const { return tag() == TAG::NUL; }
+		bool is_bool() const { return tag() == TAG::FALSE_VALUE || tag() == TAG::TRUE_VALUE; }
+		bool is_int() const { return tag() == TAG::INT; }
+		bool is_decimal() const { return tag() == TAG::DECIMAL; }
+		bool is_string() const { return tag() == TAG::STRING || tag() == TAG::TRANSLATED_STRING; }
+		bool is_list() const { return tag() == TAG::LIST; }
+		bool is_map() const { return tag() == TAG::MAP; }
+
+		bool as_bool() const;
+		int as_int() const;
+		int64_t as_decimal_raw() const;
+
+		// For strings, enums and formulas. Translated strings give the
+		// untranslated text.
+		StringRef as_string() const;
+		boost::uuids::uuid as_uuid() const;
+
+		// For lists and maps.
+		int num_elements() const;
+
+		// List elements, or the values of a map in key order.
+		Node operator[](int n) const;
+		Node key(int n) const;
+
+		// Looks up a string key in a map. Returns an invalid node if the key
+		// isn't present.
+		Node operator[](const std::string& key) const;
+
+		// Decodes this value and everything beneath it.
+		variant to_variant(json::JSON_PARSE_OPTIONS options=json::JSON_PARSE_OPTIONS::USE_PREPROCESSOR) const;
+
+	private:
+		friend class Document;
+		Node(const Document* doc, const char* pos) : doc_(doc), pos_(pos) {}
+
+		// Start of the contents of a list or map, and its element count.
+		const char* contents(int* count) const;
+
+		const Document* doc_;
+		const char* pos_;
+	};
+
+	// A read-only view over an encoded document, such as a memory mapped
+	// file. Only the string table is indexed up front. The buffer must
+	// outlive the document and any nodes taken from it.
+	class Document
+	{
+	public:
+		Document(const char* begin, const char* end);
+
+		Node root() const { return Node(this, root_); }
+		int num_strings() const { return static_cast<int>(strings_.size()); }
+
+	private:
+		friend class Node;
+		StringRef getString(uint64_t index) const;
+
+		// Reads the element count and content size of a list or map.
+		int readCount(const char*& pos) const;
+
+		// Returns the position following the value at pos.
+		const char* skip(const char* pos) const;
+
+		// Decodes the value at pos and advances pos past it.
+		variant decode(const char*& pos, json::JSON_PARSE_OPTIONS options, std::vector<variant>& string_cache) const;
+
+		const char* begin_;
+		const char* end_;
+		const char* root_;
+		std::vector<StringRef> strings_;
+	};
+}
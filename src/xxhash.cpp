@@ -0,0 +1,221 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#include <algorithm>
+#include <cstring>
+
+#include "unit_test.hpp"
+#include "xxhash.hpp"
+
+namespace xxhash
+{
+	namespace
+	{
+		const uint64_t Prime1 = 11400714785074694791ULL;
+		const uint64_t Prime2 = 14029467366897019727ULL;
+		const uint64_t Prime3 = 1609587929392839161ULL;
+		const uint64_t Prime4 = 9650029242287828579ULL;
+		const uint64_t Prime5 = 2870177450012600261ULL;
+
+		inline uint64_t rotl(uint64_t x, int r)
+		{
+			return (x << r) | (x >> (64 - r));
+		}
+
+		inline uint64_t read64(const unsigned char* p)
+		{
+			uint64_t result = 0;
+			for(int n = 7; n >= 0; --n) {
+				result = (result << 8) | p[n];
+			}
+			return result;
+		}
+
+		inline uint32_t read32(const unsigned char* p)
+		{
+			return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+		}
+
+		inline uint64_t round(uint64_t acc, uint64_t input)
+		{
+			acc += input*Prime2;
+			acc = rotl(acc, 31);
+			return acc*Prime1;
+		}
+
+		inline uint64_t merge_round(uint64_t acc, uint64_t val)
+		{
+			acc ^= round(0, val);
+			return acc*Prime1 + Prime4;
+		}
+
+		//Consumes as many whole 32-byte stripes of p as there are,
+		//returning the number of bytes used.
+		size_t consume_stripes(uint64_t* v, const unsigned char* p, size_t len)
+		{
+			const unsigned char* begin = p;
+			const unsigned char* end = p + (len & ~static_cast<size_t>(31));
+			uint64_t v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+			for(; p != end; p += 32) {
+				v1 = round(v1, read64(p));
+				v2 = round(v2, read64(p + 8));
+				v3 = round(v3, read64(p + 16));
+				v4 = round(v4, read64(p + 24));
+			}
+
+			v[0] = v1;
+			v[1] = v2;
+			v[2] = v3;
+			v[3] = v4;
+			return p - begin;
+		}
+	}
+
+	hasher::hasher(uint64_t seed)
+	  : seed_(seed), total_len_(0), buf_size_(0)
+	{
+		v_[0] = seed + Prime1 + Prime2;
+		v_[1] = seed + Prime2;
+		v_[2] = seed;
+		v_[3] = seed - Prime1;
+	}
+
+	void hasher::update(const void* data, size_t len)
+	{
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		total_len_ += len;
+
+		if(buf_size_ > 0) {
+			const size_t n = std::min(len, sizeof(buf_) - buf_size_);
+			memcpy(buf_ + buf_size_, p, n);
+			buf_size_ += n;
+			p += n;
+			len -= n;
+			if(buf_size_ < sizeof(buf_)) {
+				return;
+			}
+
+			consume_stripes(v_, buf_, sizeof(buf_));
+			buf_size_ = 0;
+		}
+
+		const size_t used = consume_stripes(v_, p, len);
+		memcpy(buf_, p + used, len - used);
+		buf_size_ = len - used;
+	}
+
+	uint64_t hasher::digest() const
+	{
+		uint64_t h;
+		if(total_len_ >= 32) {
+			h = rotl(v_[0], 1) + rotl(v_[1], 7) + rotl(v_[2], 12) + rotl(v_[3], 18);
+			for(int n = 0; n != 4; ++n) {
+				h = merge_round(h, v_[n]);
+			}
+		} else {
+			h = seed_ + Prime5;
+		}
+
+		h += total_len_;
+
+		const unsigned char* p = buf_;
+		const unsigned char* end = buf_ + buf_size_;
+		for(; end - p >= 8; p += 8) {
+			h ^= round(0, read64(p));
+			h = rotl(h, 27)*Prime1 + Prime4;
+		}
+
+		if(end - p >= 4) {
+			h ^= static_cast<uint64_t>(read32(p))*Prime1;
+			h = rotl(h, 23)*Prime2 + Prime3;
+			p += 4;
+		}
+
+		for(; p != end; ++p) {
+			h ^= (*p)*Prime5;
+			h = rotl(h, 11)*Prime1;
+		}
+
+		h ^= h >> 33;
+		h *= Prime2;
+		h ^= h >> 29;
+		h *= Prime3;
+		h ^= h >> 32;
+		return h;
+	}
+
+	std::string hasher::hexdigest() const
+	{
+		static const char HexDigits[] = "0123456789abcdef";
+
+		const uint64_t h = digest();
+		std::string result(16, '0');
+		for(int n = 0; n != 16; ++n) {
+			result[n] = HexDigits[(h >> (60 - n*4)) & 0xF];
+		}
+
+		return result;
+	}
+
+	uint64_t hash64(const void* data, size_t len, uint64_t seed)
+	{
+		hasher h(seed);
+		h.update(data, len);
+		return h.digest();
+	}
+
+	std::string sum(const std::string& data)
+	{
+		hasher h;
+		h.update(data.data(), data.size());
+		return h.hexdigest();
+	}
+}
+
+UNIT_TEST(xxhash_known_values)
+{
+	CHECK_EQ(xxhash::sum(""), "ef46db3751d8e999");
+	CHECK_EQ(xxhash::sum("abc"), "44bc2cf5ad770999");
+	CHECK_EQ(xxhash::sum("Nobody inspects the spammish repetition"), "fbcea83c8a378bf1");
+
+	//feeding the data in pieces gives the same result.
+	std::string data;
+	for(int n = 0; n != 1000; ++n) {
+		data.push_back(static_cast<char>(n*7));
+	}
+
+	xxhash::hasher h;
+	for(size_t pos = 0; pos < data.size(); pos += 13) {
+		h.update(data.data() + pos, std::min<size_t>(13, data.size() - pos));
+	}
+
+	CHECK_EQ(h.hexdigest(), xxhash::sum(data));
+}
+
+BENCHMARK(xxhash_1mb)
+{
+	const std::string data(1024*1024, 'x');
+	BENCHMARK_LOOP {
+		xxhash::sum(data);
+	}
+}
@@ -0,0 +1,57 @@
+/*
+	Copyright (C) 2003-2014 by David White <davewx7@gmail.com>
+
+	This software is provided 'as-is', without any express or implied
+	warranty. In no event will the authors be held liable for any damages
+	arising from the use of this software.
+
+	Permission is granted to anyone to use this software for any purpose,
+	including commercial applications, and to alter it and redistribute it
+	freely, subject to the following restrictions:
+
+	   1. The origin of this software must not be misrepresented; you must not
+	   claim that you wrote the original software. If you use this software
+	   in a product, an acknowledgement in the product documentation would be
+	   appreciated but is not required.
+
+	   2. Altered source versions must be plainly marked as such, and must not be
+	   misrepresented as being the original software.
+
+	   3. This notice may not be removed or altered from any source
+	   distribution.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// The 64-bit xxHash. It isn't cryptographic, but detects accidental or
+// casual changes to data and runs several times faster than md5.
+namespace xxhash
+{
+	// Computes the hash of data which arrives in pieces, such as a file
+	// being read a block at a time.
+	class hasher
+	{
+	public:
+		explicit hasher(uint64_t seed=0);
+		void update(const void* data, size_t len);
+
+		uint64_t digest() const;
+
+		// The digest as 16 hex digits.
+		std::string hexdigest() const;
+	private:
+		uint64_t v_[4];
+		uint64_t seed_, total_len_;
+		unsigned char buf_[32];
+		size_t buf_size_;
+	};
+
+	uint64_t hash64(const void* data, size_t len, uint64_t seed=0);
+
+	// The hash of data as 16 hex digits.
+	std::string sum(const std::string& data);
+}